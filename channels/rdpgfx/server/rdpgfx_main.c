@@ -606,7 +606,8 @@ static UINT rdpgfx_write_surface_command(wStream* s, RDPGFX_SURFACE_COMMAND* cmd
 			havc444 = (RDPGFX_AVC444_BITMAP_STREAM*)cmd->extra;
 			havc420 = &(havc444->bitstream[0]);
 			/* avc420EncodedBitstreamInfo (4 bytes) */
-			Stream_Write_UINT32(s, havc420->length | (havc444->LC << 30UL));
+			Stream_Write_UINT32(s, rdpgfx_estimate_h264_avc420(havc420)
+							   | (havc444->LC << 30UL));
 			/* avc420EncodedBitstream1 */
 			error = rdpgfx_write_h264_avc420(s, havc420);
 
@@ -619,7 +620,7 @@ static UINT rdpgfx_write_surface_command(wStream* s, RDPGFX_SURFACE_COMMAND* cmd
 			/* avc420EncodedBitstream2 */
 			if (havc444->LC == 0)
 			{
-				havc420 = &(havc444->bitstream[0]);
+				havc420 = &(havc444->bitstream[1]);
 				error = rdpgfx_write_h264_avc420(s, havc420);
 
 				if (error != CHANNEL_RC_OK)
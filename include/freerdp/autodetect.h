@@ -23,6 +23,22 @@
 
 typedef struct rdp_autodetect rdpAutoDetect;
 
+/**
+ * Network characteristics measured by a server during the session,
+ * times are in ms and rates in kbit/s, 0 until measured.
+ */
+struct _AUTODETECT_NETWORK_CHARACTERISTICS
+{
+	UINT32 baseRTT; /* lowest round trip time */
+	UINT32 smoothedRTT; /* EWMA of the round trip time (gain 1/8) */
+	UINT32 jitter; /* EWMA of the round trip time deviation (gain 1/4) */
+	UINT32 bandwidth; /* last bandwidth measurement */
+	UINT32 goodput; /* EWMA of the bandwidth measurements (gain 1/4) */
+	UINT32 rttSamples;
+	UINT32 bandwidthSamples;
+};
+typedef struct _AUTODETECT_NETWORK_CHARACTERISTICS AUTODETECT_NETWORK_CHARACTERISTICS;
+
 typedef BOOL (*pRTTMeasureRequest)(rdpContext* context, UINT16 sequenceNumber);
 typedef BOOL (*pRTTMeasureResponse)(rdpContext* context, UINT16 sequenceNumber);
 typedef BOOL (*pBandwidthMeasureStart)(rdpContext* context, UINT16 sequenceNumber);
@@ -30,6 +46,8 @@ typedef BOOL (*pBandwidthMeasureStop)(rdpContext* context, UINT16 sequenceNumber
 typedef BOOL (*pBandwidthMeasureResults)(rdpContext* context, UINT16 sequenceNumber);
 typedef BOOL (*pNetworkCharacteristicsResult)(rdpContext* context, UINT16 sequenceNumber);
 typedef BOOL (*pClientBandwidthMeasureResult)(rdpContext* context, rdpAutoDetect* data);
+typedef BOOL (*pNetworkCharacteristicsUpdate)(rdpContext* context,
+		const AUTODETECT_NETWORK_CHARACTERISTICS* characteristics);
 
 struct rdp_autodetect
 {
@@ -45,7 +63,13 @@ struct rdp_autodetect
 	ALIGN64 UINT32 netCharBaseRTT; /* 6 */
 	ALIGN64 UINT32 netCharAverageRTT; /* 7 */
 	ALIGN64 BOOL bandwidthMeasureStarted; /* 8 */
-	UINT64 paddingA[16 - 9]; /* 9 */
+	/* Continuous measurement estimates (server side) */
+	ALIGN64 UINT32 netCharSmoothedRTT; /* 9 */
+	ALIGN64 UINT32 netCharJitter; /* 10 */
+	ALIGN64 UINT32 netCharGoodput; /* 11 */
+	ALIGN64 UINT32 rttSampleCount; /* 12 */
+	ALIGN64 UINT32 bandwidthSampleCount; /* 13 */
+	UINT64 paddingA[16 - 14]; /* 14 */
 
 	ALIGN64 pRTTMeasureRequest RTTMeasureRequest; /* 16 */
 	ALIGN64 pRTTMeasureResponse RTTMeasureResponse; /* 17 */
@@ -54,8 +78,34 @@ struct rdp_autodetect
 	ALIGN64 pBandwidthMeasureResults BandwidthMeasureResults; /* 20 */
 	ALIGN64 pNetworkCharacteristicsResult NetworkCharacteristicsResult; /* 21 */
 	ALIGN64 pClientBandwidthMeasureResult ClientBandwidthMeasureResult; /* 22 */
-	UINT64 paddingB[32 - 23]; /* 23 */
+	ALIGN64 pNetworkCharacteristicsUpdate NetworkCharacteristicsUpdate; /* 23 */
+	UINT64 paddingB[32 - 24]; /* 24 */
+
+	/* Continuous measurement scheduling (server side), intervals in ms, 0 disables */
+	ALIGN64 UINT32 continuousRTTInterval; /* 32 */
+	ALIGN64 UINT32 continuousBandwidthInterval; /* 33 */
+	ALIGN64 UINT32 continuousBandwidthWindow; /* 34 */
+	ALIGN64 UINT64 nextRTTRequestTime; /* 35 */
+	ALIGN64 UINT64 nextBandwidthRequestTime; /* 36 */
+	ALIGN64 UINT64 bandwidthStopTime; /* 37 */
+	ALIGN64 UINT64 rttRequestTime; /* 38 */
+	ALIGN64 UINT16 continuousSequenceNumber; /* 39 */
+	UINT64 paddingC[48 - 40]; /* 40 */
 };
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+FREERDP_API void freerdp_autodetect_set_continuous_intervals(rdpAutoDetect* autodetect,
+		UINT32 rttInterval, UINT32 bandwidthInterval, UINT32 bandwidthWindow);
+FREERDP_API BOOL freerdp_autodetect_check_continuous(rdpAutoDetect* autodetect);
+FREERDP_API BOOL freerdp_autodetect_get_network_characteristics(rdpAutoDetect* autodetect,
+		AUTODETECT_NETWORK_CHARACTERISTICS* characteristics);
+
+#ifdef __cplusplus
+}
+#endif
+
 
 #endif /* FREERDP_AUTODETECT_H */
@@ -25,6 +25,8 @@ typedef struct _CLEAR_CONTEXT CLEAR_CONTEXT;
 #include <freerdp/api.h>
 #include <freerdp/types.h>
 
+#include <winpr/stream.h>
+
 #include <freerdp/codec/nsc.h>
 #include <freerdp/codec/color.h>
 
@@ -37,6 +39,9 @@ struct _CLEAR_GLYPH_ENTRY
 	UINT32 size;
 	UINT32 count;
 	UINT32* pixels;
+	UINT32 hash;
+	UINT16 width;
+	UINT16 height;
 };
 typedef struct _CLEAR_GLYPH_ENTRY CLEAR_GLYPH_ENTRY;
 
@@ -45,6 +50,7 @@ struct _CLEAR_VBAR_ENTRY
 	UINT32 size;
 	UINT32 count;
 	UINT32* pixels;
+	UINT32 hash;
 };
 typedef struct _CLEAR_VBAR_ENTRY CLEAR_VBAR_ENTRY;
 
@@ -60,13 +66,31 @@ struct _CLEAR_CONTEXT
 	CLEAR_VBAR_ENTRY VBarStorage[32768];
 	UINT32 ShortVBarStorageCursor;
 	CLEAR_VBAR_ENTRY ShortVBarStorage[16384];
+
+	/* encoder state */
+	BOOL CacheReset;
+	UINT32 GlyphCursor;
+	UINT16 GlyphHashTable[4096];
+	UINT16 VBarHashTable[65536];
+	UINT16 ShortVBarHashTable[32768];
+	wStream* ResidualStream;
+	wStream* BandsStream;
+	wStream* SubcodecStream;
+	wStream* TempStream;
+
+	/* per-layer byte counts of the last clear_compress() call */
+	UINT32 ResidualByteCount;
+	UINT32 BandsByteCount;
+	UINT32 SubcodecByteCount;
+	BOOL GlyphHit;
 };
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-FREERDP_API int clear_compress(CLEAR_CONTEXT* clear, BYTE* pSrcData, UINT32 SrcSize, BYTE** ppDstData, UINT32* pDstSize);
+FREERDP_API int clear_compress(CLEAR_CONTEXT* clear, BYTE* pSrcData, DWORD SrcFormat, int nSrcStep,
+		int nWidth, int nHeight, BYTE** ppDstData, UINT32* pDstSize);
 
 FREERDP_API int clear_decompress(CLEAR_CONTEXT* clear, BYTE* pSrcData, UINT32 SrcSize,
 		BYTE** ppDstData, DWORD DstFormat, int nDstStep, int nXDst, int nYDst, int nWidth, int nHeight);
@@ -67,10 +67,38 @@ struct _H264_CONTEXT
 	UINT32 iStride[2][3];
 	BYTE* pYUVData[2][3];
 
+	/**
+	 * AVC420 encoder input planes, two sets when DoubleBuffering is set.
+	 * prepareIndex counts the frames converted, encodeIndex the frames
+	 * whose encode has completed.
+	 */
+	BOOL DoubleBuffering;
+	UINT32 numYUVBuffers;
+	UINT32 iYUVBufferStride[3];
+	UINT32 iYUVBufferSize[3];
+	BYTE* pYUVBuffers[2][3];
+	BOOL YUVBufferValid[2];
+	LONG volatile prepareIndex;
+	LONG volatile encodeIndex;
+	UINT32 numLastRects;
+	RECTANGLE_16* pLastRects;
+
 	UINT32 iYUV444Size[3];
 	UINT32 iYUV444Stride[3];
 	BYTE* pYUV444Data[3];
 
+	/**
+	 * AVC444 encoder: main and auxiliary views of the current frame and of
+	 * the last frame sent, the two sets are swapped after each frame.
+	 */
+	UINT32 iNewYUVStride[2][3];
+	UINT32 iNewYUVSize[2][3];
+	BYTE* pNewYUVData[2][3];
+	UINT32 iOldYUVStride[2][3];
+	UINT32 iOldYUVSize[2][3];
+	BYTE* pOldYUVData[2][3];
+	BOOL OldYUVValid;
+
 	UINT32 numSystemData;
 	void* pSystemData;
 	H264_CONTEXT_SUBSYSTEM* subsystem;
@@ -83,7 +111,17 @@ extern "C" {
 FREERDP_API INT32 avc420_compress(H264_CONTEXT* h264, BYTE* pSrcData,
 				  DWORD SrcFormat, UINT32 nSrcStep,
 				  UINT32 nSrcWidth, UINT32 nSrcHeight,
-				  BYTE** ppDstData, UINT32* pDstSize);
+				  const RECTANGLE_16* regionRects, UINT32 numRegionRects,
+				  BYTE** ppDstData, UINT32* pDstSize,
+				  RDPGFX_H264_METABLOCK* meta);
+
+FREERDP_API INT32 avc420_prepare(H264_CONTEXT* h264, BYTE* pSrcData,
+				 DWORD SrcFormat, UINT32 nSrcStep,
+				 UINT32 nSrcWidth, UINT32 nSrcHeight,
+				 const RECTANGLE_16* regionRects, UINT32 numRegionRects,
+				 RDPGFX_H264_METABLOCK* meta);
+
+FREERDP_API INT32 avc420_encode(H264_CONTEXT* h264, BYTE** ppDstData, UINT32* pDstSize);
 
 FREERDP_API INT32 avc420_decompress(H264_CONTEXT* h264, BYTE* pSrcData,
 				    UINT32 SrcSize, BYTE* pDstData,
@@ -105,6 +143,8 @@ FREERDP_API INT32 avc444_decompress(H264_CONTEXT* h264, BYTE op,
 				  BYTE* pDstData, DWORD DstFormat,
 				  UINT32 nDstStep, UINT32 nDstWidth, UINT32 nDstHeight);
 
+FREERDP_API void h264_metablock_free(RDPGFX_H264_METABLOCK* meta);
+
 FREERDP_API BOOL h264_context_reset(H264_CONTEXT* h264, UINT32 width, UINT32 height);
 
 FREERDP_API H264_CONTEXT* h264_context_new(BOOL Compressor);
@@ -26,6 +26,7 @@ typedef struct _PROGRESSIVE_CONTEXT PROGRESSIVE_CONTEXT;
 #include <freerdp/types.h>
 
 #include <winpr/wlog.h>
+#include <winpr/pool.h>
 #include <winpr/collections.h>
 
 #include <freerdp/codec/rfx.h>
@@ -228,13 +229,27 @@ struct _PROGRESSIVE_CONTEXT
 	RFX_PROGRESSIVE_CODEC_QUANT quantProgValFull;
 
 	wHashTable* SurfaceContexts;
+
+	BOOL syncSent;
+	UINT32 frameIndex;
+
+	void (*idwt_x)(INT16* pLowBand, int nLowStep, INT16* pHighBand, int nHighStep,
+			INT16* pDstBand, int nDstStep, int nLowCount, int nHighCount, int nDstCount);
+	void (*idwt_y)(INT16* pLowBand, int nLowStep, INT16* pHighBand, int nHighStep,
+			INT16* pDstBand, int nDstStep, int nLowCount, int nHighCount, int nDstCount);
+
+	BOOL UseThreads;
+	UINT32 ThreadCount;
+	PTP_POOL ThreadPool;
+	TP_CALLBACK_ENVIRON ThreadPoolEnv;
 };
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-FREERDP_API int progressive_compress(PROGRESSIVE_CONTEXT* progressive, BYTE* pSrcData, UINT32 SrcSize, BYTE** ppDstData, UINT32* pDstSize);
+FREERDP_API int progressive_compress(PROGRESSIVE_CONTEXT* progressive, BYTE* pSrcData, DWORD SrcFormat, int nSrcStep,
+		int nWidth, int nHeight, UINT16 surfaceId, BYTE** ppDstData, UINT32* pDstSize);
 
 FREERDP_API int progressive_decompress(PROGRESSIVE_CONTEXT* progressive, BYTE* pSrcData, UINT32 SrcSize,
 		BYTE** ppDstData, DWORD DstFormat, int nDstStep, int nXDst, int nYDst, int nWidth, int nHeight, UINT16 surfaceId);
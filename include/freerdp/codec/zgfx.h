@@ -32,6 +32,12 @@
 
 #define ZGFX_SEGMENTED_MAXSIZE			65535
 
+#define ZGFX_COMPRESSION_LEVEL_NONE		0
+#define ZGFX_COMPRESSION_LEVEL_DEFAULT		6
+#define ZGFX_COMPRESSION_LEVEL_MAX		9
+
+#define ZGFX_HASH_BITS				16
+
 struct _ZGFX_CONTEXT
 {
 	BOOL Compressor;
@@ -50,6 +56,15 @@ struct _ZGFX_CONTEXT
 	BYTE HistoryBuffer[2500000];
 	UINT32 HistoryIndex;
 	UINT32 HistoryBufferSize;
+
+	BYTE* pbOutputCurrent;
+
+	UINT32 CompressionLevel;
+	UINT32 HistoryPosition;
+	UINT32 HashPosition;
+	UINT32* HashHead;
+	UINT32* HashChain;
+	BYTE LiteralTokens[256];
 };
 typedef struct _ZGFX_CONTEXT ZGFX_CONTEXT;
 
@@ -62,6 +77,7 @@ FREERDP_API int zgfx_compress(ZGFX_CONTEXT* zgfx, const BYTE* pSrcData, UINT32 S
 FREERDP_API int zgfx_compress_to_stream(ZGFX_CONTEXT* zgfx, wStream* sDst, const BYTE* pUncompressed, UINT32 uncompressedSize, UINT32* pFlags);
 
 FREERDP_API void zgfx_context_reset(ZGFX_CONTEXT* zgfx, BOOL flush);
+FREERDP_API void zgfx_context_set_compression_level(ZGFX_CONTEXT* zgfx, UINT32 level);
 
 FREERDP_API ZGFX_CONTEXT* zgfx_context_new(BOOL Compressor);
 FREERDP_API void zgfx_context_free(ZGFX_CONTEXT* zgfx);
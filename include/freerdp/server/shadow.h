@@ -50,6 +50,7 @@ typedef struct rdp_shadow_encoder rdpShadowEncoder;
 typedef struct rdp_shadow_capture rdpShadowCapture;
 typedef struct rdp_shadow_subsystem rdpShadowSubsystem;
 typedef struct rdp_shadow_multiclient_event rdpShadowMultiClientEvent;
+typedef struct rdp_shadow_encode_cache rdpShadowEncodeCache;
 
 typedef struct _RDP_SHADOW_ENTRY_POINTS RDP_SHADOW_ENTRY_POINTS;
 typedef int (*pfnShadowSubsystemEntry)(RDP_SHADOW_ENTRY_POINTS* pEntryPoints);
@@ -119,6 +120,7 @@ struct rdp_shadow_server
 	rdpShadowSurface* lobby;
 	rdpShadowCapture* capture;
 	rdpShadowSubsystem* subsystem;
+	rdpShadowEncodeCache* encodeCache;
 
 	DWORD port;
 	BOOL mayView;
@@ -299,6 +301,7 @@ FREERDP_API void shadow_server_free(rdpShadowServer* server);
 
 FREERDP_API int shadow_capture_align_clip_rect(RECTANGLE_16* rect, RECTANGLE_16* clip);
 FREERDP_API int shadow_capture_compare(BYTE* pData1, int nStep1, int nWidth, int nHeight, BYTE* pData2, int nStep2, RECTANGLE_16* rect);
+FREERDP_API int shadow_capture_compare_region(BYTE* pData1, int nStep1, int nWidth, int nHeight, BYTE* pData2, int nStep2, REGION16* region);
 
 FREERDP_API void shadow_subsystem_frame_update(rdpShadowSubsystem* subsystem);
 
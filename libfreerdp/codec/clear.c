@@ -27,6 +27,9 @@
 
 #include <freerdp/codec/color.h>
 #include <freerdp/codec/clear.h>
+#include <freerdp/log.h>
+
+#define TAG FREERDP_TAG("codec.clear")
 
 static UINT32 CLEAR_LOG2_FLOOR[256] =
 {
@@ -825,8 +828,904 @@ int clear_decompress(CLEAR_CONTEXT* clear, BYTE* pSrcData, UINT32 SrcSize,
 	return 1;
 }
 
-int clear_compress(CLEAR_CONTEXT* clear, BYTE* pSrcData, UINT32 SrcSize, BYTE** ppDstData, UINT32* pDstSize)
+#define CLEAR_CELL_WIDTH		64
+#define CLEAR_CELL_HEIGHT		52
+
+#define CLEAR_CELL_RESIDUAL		0
+#define CLEAR_CELL_BAND			1
+#define CLEAR_CELL_SUBCODEC		2
+
+#define CLEAR_PALETTE_SIZE		128
+#define CLEAR_PALETTE_SLOTS		256
+
+struct _CLEAR_PALETTE
+{
+	UINT32 count;
+	BOOL overflow;
+	UINT32 colors[CLEAR_PALETTE_SIZE];
+	UINT32 hits[CLEAR_PALETTE_SIZE];
+	BYTE slots[CLEAR_PALETTE_SLOTS];
+};
+typedef struct _CLEAR_PALETTE CLEAR_PALETTE;
+
+static UINT32 clear_hash_pixels(const UINT32* pixels, UINT32 count, UINT32 seed)
+{
+	UINT32 i;
+	UINT32 hash = 2166136261U ^ seed;
+
+	for (i = 0; i < count; i++)
+	{
+		hash ^= pixels[i];
+		hash *= 16777619U;
+	}
+
+	hash ^= (hash >> 15);
+	hash *= 0x2C1B3C6DU;
+	hash ^= (hash >> 12);
+
+	return hash;
+}
+
+/**
+ * Returns the palette index of the given color, adding it if needed.
+ * Returns -1 once more than 127 distinct colors have been seen.
+ */
+
+static int clear_palette_lookup(CLEAR_PALETTE* palette, UINT32 color)
+{
+	UINT32 slot;
+	UINT32 index;
+
+	slot = ((color * 0x9E3779B1U) >> 24) & (CLEAR_PALETTE_SLOTS - 1);
+
+	while (palette->slots[slot])
+	{
+		index = palette->slots[slot] - 1;
+
+		if (palette->colors[index] == color)
+			return (int) index;
+
+		slot = (slot + 1) & (CLEAR_PALETTE_SLOTS - 1);
+	}
+
+	if (palette->count >= (CLEAR_PALETTE_SIZE - 1))
+	{
+		palette->overflow = TRUE;
+		return -1;
+	}
+
+	index = palette->count++;
+	palette->colors[index] = color;
+	palette->hits[index] = 0;
+	palette->slots[slot] = (BYTE) (index + 1);
+
+	return (int) index;
+}
+
+static void clear_palette_build(CLEAR_PALETTE* palette, const UINT32* pixels, int nStep,
+		int nWidth, int nHeight)
+{
+	int x, y;
+	int index = -1;
+	UINT32 color = 0;
+	const UINT32* pSrcPixel;
+
+	ZeroMemory(palette, sizeof(CLEAR_PALETTE));
+
+	for (y = 0; y < nHeight; y++)
+	{
+		pSrcPixel = &pixels[y * nStep];
+
+		for (x = 0; x < nWidth; x++)
+		{
+			if ((index < 0) || (pSrcPixel[x] != color))
+			{
+				color = pSrcPixel[x];
+				index = clear_palette_lookup(palette, color);
+
+				if (index < 0)
+					return;
+			}
+
+			palette->hits[index]++;
+		}
+	}
+}
+
+static UINT32 clear_palette_background(CLEAR_PALETTE* palette)
+{
+	UINT32 i;
+	UINT32 index = 0;
+
+	for (i = 1; i < palette->count; i++)
+	{
+		if (palette->hits[i] > palette->hits[index])
+			index = i;
+	}
+
+	return palette->colors[index];
+}
+
+static void clear_write_color(wStream* s, UINT32 color)
+{
+	Stream_Write_UINT8(s, color & 0xFF); /* blue */
+	Stream_Write_UINT8(s, (color >> 8) & 0xFF); /* green */
+	Stream_Write_UINT8(s, (color >> 16) & 0xFF); /* red */
+}
+
+static void clear_write_run_length(wStream* s, UINT32 runLength)
+{
+	if (runLength < 0xFF)
+	{
+		Stream_Write_UINT8(s, runLength);
+	}
+	else if (runLength < 0xFFFF)
+	{
+		Stream_Write_UINT8(s, 0xFF);
+		Stream_Write_UINT16(s, runLength);
+	}
+	else
+	{
+		Stream_Write_UINT8(s, 0xFF);
+		Stream_Write_UINT16(s, 0xFFFF);
+		Stream_Write_UINT32(s, runLength);
+	}
+}
+
+static int clear_vbar_lookup(CLEAR_CONTEXT* clear, const UINT32* vBar, UINT32 count, UINT32 hash)
+{
+	UINT32 index;
+	CLEAR_VBAR_ENTRY* vBarEntry;
+
+	index = clear->VBarHashTable[hash & 0xFFFF];
+
+	if (!index--)
+		return -1;
+
+	vBarEntry = &(clear->VBarStorage[index]);
+
+	if ((vBarEntry->hash != hash) || (vBarEntry->count != count))
+		return -1;
+
+	if (memcmp(vBarEntry->pixels, vBar, count * 4) != 0)
+		return -1;
+
+	return (int) index;
+}
+
+static int clear_short_vbar_lookup(CLEAR_CONTEXT* clear, const UINT32* vBar, UINT32 count, UINT32 hash)
+{
+	UINT32 index;
+	CLEAR_VBAR_ENTRY* vBarEntry;
+
+	index = clear->ShortVBarHashTable[hash & 0x7FFF];
+
+	if (!index--)
+		return -1;
+
+	vBarEntry = &(clear->ShortVBarStorage[index]);
+
+	if ((vBarEntry->hash != hash) || (vBarEntry->count != count))
+		return -1;
+
+	if (memcmp(vBarEntry->pixels, vBar, count * 4) != 0)
+		return -1;
+
+	return (int) index;
+}
+
+static BOOL clear_vbar_store(CLEAR_VBAR_ENTRY* vBarEntry, const UINT32* vBar, UINT32 count, UINT32 hash)
+{
+	if (count > vBarEntry->size)
+	{
+		UINT32* tmp;
+
+		tmp = (UINT32*) realloc(vBarEntry->pixels, count * 4);
+
+		if (!tmp)
+			return FALSE;
+
+		vBarEntry->pixels = tmp;
+		vBarEntry->size = count;
+	}
+
+	if (count)
+		CopyMemory(vBarEntry->pixels, vBar, count * 4);
+
+	vBarEntry->count = count;
+	vBarEntry->hash = hash;
+
+	return TRUE;
+}
+
+static void clear_vbar_trim(const UINT32* vBar, UINT32 count, UINT32 colorBkg, UINT32* pYOn, UINT32* pYOff)
 {
+	UINT32 yOn = 0;
+	UINT32 yOff = count;
+
+	while ((yOn < count) && (vBar[yOn] == colorBkg))
+		yOn++;
+
+	while ((yOff > yOn) && (vBar[yOff - 1] == colorBkg))
+		yOff--;
+
+	if (yOn == yOff)
+		yOn = yOff = 0;
+
+	*pYOn = yOn;
+	*pYOff = yOff;
+}
+
+/**
+ * Estimates the bands layer cost of a cell without touching the caches.
+ */
+
+static UINT32 clear_estimate_band_cost(CLEAR_CONTEXT* clear, const UINT32* pixels, int nStep,
+		int nWidth, int nHeight, UINT32 colorBkg)
+{
+	int x, y;
+	int seenCount = 0;
+	UINT32 cost = 11;
+	UINT32 hash;
+	UINT32 yOn, yOff;
+	UINT32 shortHash;
+	UINT32 vBar[CLEAR_CELL_HEIGHT];
+	UINT32 seen[CLEAR_CELL_WIDTH];
+	BOOL hit;
+	int i;
+
+	for (x = 0; x < nWidth; x++)
+	{
+		for (y = 0; y < nHeight; y++)
+			vBar[y] = pixels[(y * nStep) + x];
+
+		hash = clear_hash_pixels(vBar, nHeight, nHeight);
+		hit = (clear_vbar_lookup(clear, vBar, nHeight, hash) >= 0) ? TRUE : FALSE;
+
+		for (i = 0; (i < seenCount) && !hit; i++)
+		{
+			if (seen[i] == hash)
+				hit = TRUE;
+		}
+
+		if (hit)
+		{
+			cost += 2;
+			continue;
+		}
+
+		seen[seenCount++] = hash;
+
+		clear_vbar_trim(vBar, nHeight, colorBkg, &yOn, &yOff);
+
+		if (yOff == yOn)
+		{
+			cost += 2;
+			continue;
+		}
+
+		shortHash = clear_hash_pixels(&vBar[yOn], yOff - yOn, yOff - yOn);
+
+		if (clear_short_vbar_lookup(clear, &vBar[yOn], yOff - yOn, shortHash) >= 0)
+			cost += 3;
+		else
+			cost += 2 + ((yOff - yOn) * 3);
+	}
+
+	return cost;
+}
+
+static BOOL clear_encode_vbar(CLEAR_CONTEXT* clear, wStream* s, const UINT32* vBar, UINT32 count, UINT32 colorBkg)
+{
+	int index;
+	UINT32 y;
+	UINT32 hash;
+	UINT32 yOn, yOff;
+	UINT32 shortHash;
+	UINT32 shortCount;
+	CLEAR_VBAR_ENTRY* vBarEntry;
+
+	if (!Stream_EnsureRemainingCapacity(s, 2 + (count * 3)))
+		return FALSE;
+
+	hash = clear_hash_pixels(vBar, count, count);
+	index = clear_vbar_lookup(clear, vBar, count, hash);
+
+	if (index >= 0)
+	{
+		Stream_Write_UINT16(s, 0x8000 | index); /* VBAR_CACHE_HIT */
+		return TRUE;
+	}
+
+	clear_vbar_trim(vBar, count, colorBkg, &yOn, &yOff);
+	shortCount = yOff - yOn;
+	shortHash = clear_hash_pixels(&vBar[yOn], shortCount, shortCount);
+	index = shortCount ? clear_short_vbar_lookup(clear, &vBar[yOn], shortCount, shortHash) : -1;
+
+	if (index >= 0)
+	{
+		Stream_Write_UINT16(s, 0x4000 | index); /* SHORT_VBAR_CACHE_HIT */
+		Stream_Write_UINT8(s, yOn);
+	}
+	else
+	{
+		Stream_Write_UINT16(s, (yOff << 8) | yOn); /* SHORT_VBAR_CACHE_MISS */
+
+		for (y = yOn; y < yOff; y++)
+			clear_write_color(s, vBar[y]);
+
+		vBarEntry = &(clear->ShortVBarStorage[clear->ShortVBarStorageCursor]);
+
+		if (!clear_vbar_store(vBarEntry, &vBar[yOn], shortCount, shortHash))
+			return FALSE;
+
+		clear->ShortVBarHashTable[shortHash & 0x7FFF] = (UINT16) (clear->ShortVBarStorageCursor + 1);
+		clear->ShortVBarStorageCursor = (clear->ShortVBarStorageCursor + 1) % 16384;
+	}
+
+	/* the decoder builds a new full vbar for every short vbar */
+
+	vBarEntry = &(clear->VBarStorage[clear->VBarStorageCursor]);
+
+	if (!clear_vbar_store(vBarEntry, vBar, count, hash))
+		return FALSE;
+
+	clear->VBarHashTable[hash & 0xFFFF] = (UINT16) (clear->VBarStorageCursor + 1);
+	clear->VBarStorageCursor = (clear->VBarStorageCursor + 1) % 32768;
+
+	return TRUE;
+}
+
+static BOOL clear_encode_band_cell(CLEAR_CONTEXT* clear, wStream* s, const UINT32* pixels, int nStep,
+		int nWidth, int nHeight, UINT32 colorBkg)
+{
+	int x, y;
+	UINT32 vBar[CLEAR_CELL_HEIGHT];
+
+	for (x = 0; x < nWidth; x++)
+	{
+		for (y = 0; y < nHeight; y++)
+			vBar[y] = pixels[(y * nStep) + x];
+
+		if (!clear_encode_vbar(clear, s, vBar, nHeight, colorBkg))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+static BOOL clear_encode_rlex(CLEAR_PALETTE* palette, wStream* s, const UINT32* pixels, int nStep,
+		int nWidth, int nHeight)
+{
+	UINT32 i;
+	UINT32 numBits;
+	UINT32 maxDepth;
+	UINT32 index;
+	UINT32 next;
+	UINT32 suiteDepth;
+	UINT32 runLength;
+	UINT32 pixelIndex;
+	UINT32 pixelCount;
+	BYTE indices[CLEAR_CELL_WIDTH * CLEAR_CELL_HEIGHT];
+
+	pixelCount = nWidth * nHeight;
+	numBits = CLEAR_LOG2_FLOOR[palette->count - 1] + 1;
+	maxDepth = CLEAR_8BIT_MASKS[8 - numBits];
+
+	if (!Stream_EnsureRemainingCapacity(s, 1 + (palette->count * 3) + (pixelCount * 2)))
+		return FALSE;
+
+	for (i = 0; i < pixelCount; i++)
+		indices[i] = (BYTE) clear_palette_lookup(palette, pixels[((i / nWidth) * nStep) + (i % nWidth)]);
+
+	Stream_Write_UINT8(s, palette->count);
+
+	for (i = 0; i < palette->count; i++)
+		clear_write_color(s, palette->colors[i]);
+
+	pixelIndex = 0;
+
+	while (pixelIndex < pixelCount)
+	{
+		index = indices[pixelIndex];
+		runLength = 0;
+
+		while (((pixelIndex + runLength + 1) < pixelCount) && (indices[pixelIndex + runLength + 1] == index))
+			runLength++;
+
+		pixelIndex += runLength + 1;
+		suiteDepth = 0;
+
+		while ((pixelIndex < pixelCount) && (suiteDepth < maxDepth))
+		{
+			next = indices[pixelIndex];
+
+			if ((next != (index + suiteDepth + 1)) || (next >= palette->count))
+				break;
+
+			suiteDepth++;
+			pixelIndex++;
+		}
+
+		Stream_Write_UINT8(s, ((index + suiteDepth) & CLEAR_8BIT_MASKS[numBits]) | (suiteDepth << numBits));
+		clear_write_run_length(s, runLength);
+	}
+
+	return TRUE;
+}
+
+static BOOL clear_encode_nsc(CLEAR_CONTEXT* clear, wStream* s, const UINT32* pixels, int nStep,
+		int nWidth, int nHeight)
+{
+	/* the NSCodec encoder expects bottom-up input, feed it a negative stride */
+
+	nsc_compose_message(clear->nsc, s, (BYTE*) &pixels[(nHeight - 1) * nStep],
+			nWidth, nHeight, -(nStep * 4));
+
+	return TRUE;
+}
+
+static BOOL clear_write_subcodec(CLEAR_CONTEXT* clear, int xStart, int yStart, int nWidth, int nHeight,
+		BYTE subcodecId, BYTE* pData, UINT32 DataSize)
+{
+	wStream* s = clear->SubcodecStream;
+
+	if (!Stream_EnsureRemainingCapacity(s, 13 + DataSize))
+		return FALSE;
+
+	Stream_Write_UINT16(s, xStart); /* xStart (2 bytes) */
+	Stream_Write_UINT16(s, yStart); /* yStart (2 bytes) */
+	Stream_Write_UINT16(s, nWidth); /* width (2 bytes) */
+	Stream_Write_UINT16(s, nHeight); /* height (2 bytes) */
+	Stream_Write_UINT32(s, DataSize); /* bitmapDataByteCount (4 bytes) */
+	Stream_Write_UINT8(s, subcodecId); /* subcodecId (1 byte) */
+	Stream_Write(s, pData, DataSize);
+
+	return TRUE;
+}
+
+static UINT32 clear_count_runs(const UINT32* pixels, int nStep, int nXSrc, int nWidth, int nHeight)
+{
+	int x, y;
+	UINT32 runs = 0;
+	const UINT32* pSrcPixel;
+
+	for (y = 0; y < nHeight; y++)
+	{
+		pSrcPixel = &pixels[y * nStep];
+
+		if ((nXSrc == 0) || (pSrcPixel[-1] != pSrcPixel[0]))
+			runs++;
+
+		for (x = 1; x < nWidth; x++)
+		{
+			if (pSrcPixel[x] != pSrcPixel[x - 1])
+				runs++;
+		}
+	}
+
+	return runs;
+}
+
+static BOOL clear_encode_residual(CLEAR_CONTEXT* clear, const UINT32* pixels, int nWidth, int nHeight,
+		const BYTE* cells, int cellsX)
+{
+	int x, y;
+	int cx;
+	int xEnd;
+	UINT32 color;
+	UINT32 runLength = 0;
+	const BYTE* pCell;
+	const UINT32* pSrcPixel;
+	wStream* s = clear->ResidualStream;
+
+	color = pixels[0];
+
+	for (y = 0; y < nHeight; y++)
+	{
+		pSrcPixel = &pixels[y * nWidth];
+		pCell = &cells[(y / CLEAR_CELL_HEIGHT) * cellsX];
+
+		for (cx = 0; cx < cellsX; cx++)
+		{
+			x = cx * CLEAR_CELL_WIDTH;
+			xEnd = MIN(x + CLEAR_CELL_WIDTH, nWidth);
+
+			if (pCell[cx] != CLEAR_CELL_RESIDUAL)
+			{
+				/* covered by another layer, extend the current run */
+				runLength += (xEnd - x);
+				continue;
+			}
+
+			for (; x < xEnd; x++)
+			{
+				if (pSrcPixel[x] != color)
+				{
+					if (runLength)
+					{
+						if (!Stream_EnsureRemainingCapacity(s, 10))
+							return FALSE;
+
+						clear_write_color(s, color);
+						clear_write_run_length(s, runLength);
+					}
+
+					color = pSrcPixel[x];
+					runLength = 0;
+				}
+
+				runLength++;
+			}
+		}
+	}
+
+	if (!Stream_EnsureRemainingCapacity(s, 10))
+		return FALSE;
+
+	clear_write_color(s, color);
+	clear_write_run_length(s, runLength);
+
+	return TRUE;
+}
+
+static BOOL clear_encode_layers(CLEAR_CONTEXT* clear, const UINT32* pixels, int nWidth, int nHeight,
+		BOOL allowLossy)
+{
+	int cx, cy;
+	int cellsX;
+	int cellsY;
+	int xCell, yCell;
+	int cellWidth;
+	int cellHeight;
+	BYTE* cells;
+	BYTE decision;
+	BYTE subcodecId = 0;
+	BOOL bandOpen;
+	BOOL useResidual = FALSE;
+	UINT32 bandBkg = 0;
+	size_t bandPos = 0;
+	UINT32 colorBkg;
+	UINT32 residualCost;
+	UINT32 bandCost;
+	UINT32 subcodecCost;
+	UINT32 minCost;
+	const UINT32* pCellPixels;
+	CLEAR_PALETTE palette;
+	wStream* sBands = clear->BandsStream;
+	wStream* sTemp = clear->TempStream;
+
+	cellsX = (nWidth + CLEAR_CELL_WIDTH - 1) / CLEAR_CELL_WIDTH;
+	cellsY = (nHeight + CLEAR_CELL_HEIGHT - 1) / CLEAR_CELL_HEIGHT;
+
+	cells = (BYTE*) calloc(cellsX * cellsY, 1);
+
+	if (!cells)
+		return FALSE;
+
+	for (cy = 0; cy < cellsY; cy++)
+	{
+		yCell = cy * CLEAR_CELL_HEIGHT;
+		cellHeight = MIN(CLEAR_CELL_HEIGHT, nHeight - yCell);
+		bandOpen = FALSE;
+
+		for (cx = 0; cx < cellsX; cx++)
+		{
+			xCell = cx * CLEAR_CELL_WIDTH;
+			cellWidth = MIN(CLEAR_CELL_WIDTH, nWidth - xCell);
+			pCellPixels = &pixels[(yCell * nWidth) + xCell];
+
+			clear_palette_build(&palette, pCellPixels, nWidth, cellWidth, cellHeight);
+			colorBkg = clear_palette_background(&palette);
+
+			residualCost = clear_count_runs(pCellPixels, nWidth, xCell, cellWidth, cellHeight) * 4;
+			bandCost = clear_estimate_band_cost(clear, pCellPixels, nWidth, cellWidth, cellHeight, colorBkg);
+
+			if (bandOpen && (bandBkg == colorBkg))
+				bandCost -= 11;
+
+			minCost = MIN(residualCost, bandCost);
+			subcodecCost = 0xFFFFFFFF;
+			Stream_SetPosition(sTemp, 0);
+
+			if (!palette.overflow)
+			{
+				/* RLEX cannot beat this lower bound, don't bother trying */
+
+				if (minCost > (13 + 1 + (palette.count * 3) + 2))
+				{
+					if (!clear_encode_rlex(&palette, sTemp, pCellPixels, nWidth, cellWidth, cellHeight))
+						goto fail;
+
+					subcodecId = 2; /* CLEARCODEC_SUBCODEC_RLEX */
+					subcodecCost = 13 + Stream_GetPosition(sTemp);
+				}
+			}
+			else if (minCost > (UINT32) (cellWidth * cellHeight))
+			{
+				/* natural image content */
+
+				if (allowLossy)
+				{
+					if (!clear_encode_nsc(clear, sTemp, pCellPixels, nWidth, cellWidth, cellHeight))
+						goto fail;
+
+					subcodecId = 1; /* NSCodec */
+				}
+				else
+				{
+					int x, y;
+
+					if (!Stream_EnsureRemainingCapacity(sTemp, cellWidth * cellHeight * 3))
+						goto fail;
+
+					for (y = 0; y < cellHeight; y++)
+					{
+						for (x = 0; x < cellWidth; x++)
+							clear_write_color(sTemp, pCellPixels[(y * nWidth) + x]);
+					}
+
+					subcodecId = 0; /* Uncompressed */
+				}
+
+				subcodecCost = 13 + Stream_GetPosition(sTemp);
+			}
+
+			if (subcodecCost < minCost)
+				decision = CLEAR_CELL_SUBCODEC;
+			else if (bandCost < residualCost)
+				decision = CLEAR_CELL_BAND;
+			else
+				decision = CLEAR_CELL_RESIDUAL;
+
+			cells[(cy * cellsX) + cx] = decision;
+
+			if (bandOpen && ((decision != CLEAR_CELL_BAND) || (bandBkg != colorBkg)))
+			{
+				/* close the current band by filling in its xEnd */
+				size_t pos = Stream_GetPosition(sBands);
+				Stream_SetPosition(sBands, bandPos + 2);
+				Stream_Write_UINT16(sBands, xCell - 1);
+				Stream_SetPosition(sBands, pos);
+				bandOpen = FALSE;
+			}
+
+			if (decision == CLEAR_CELL_SUBCODEC)
+			{
+				if (!clear_write_subcodec(clear, xCell, yCell, cellWidth, cellHeight, subcodecId,
+						Stream_Buffer(sTemp), Stream_GetPosition(sTemp)))
+					goto fail;
+			}
+			else if (decision == CLEAR_CELL_BAND)
+			{
+				if (!bandOpen)
+				{
+					if (!Stream_EnsureRemainingCapacity(sBands, 11))
+						goto fail;
+
+					bandPos = Stream_GetPosition(sBands);
+					bandBkg = colorBkg;
+					bandOpen = TRUE;
+
+					Stream_Write_UINT16(sBands, xCell); /* xStart (2 bytes) */
+					Stream_Write_UINT16(sBands, xCell + cellWidth - 1); /* xEnd (2 bytes) */
+					Stream_Write_UINT16(sBands, yCell); /* yStart (2 bytes) */
+					Stream_Write_UINT16(sBands, yCell + cellHeight - 1); /* yEnd (2 bytes) */
+					clear_write_color(sBands, colorBkg); /* colorBkg (3 bytes) */
+				}
+
+				if (!clear_encode_band_cell(clear, sBands, pCellPixels, nWidth, cellWidth, cellHeight, colorBkg))
+					goto fail;
+			}
+			else
+			{
+				useResidual = TRUE;
+			}
+		}
+
+		if (bandOpen)
+		{
+			size_t pos = Stream_GetPosition(sBands);
+			Stream_SetPosition(sBands, bandPos + 2);
+			Stream_Write_UINT16(sBands, nWidth - 1);
+			Stream_SetPosition(sBands, pos);
+		}
+	}
+
+	if (useResidual)
+	{
+		if (!clear_encode_residual(clear, pixels, nWidth, nHeight, cells, cellsX))
+			goto fail;
+	}
+
+	free(cells);
+	return TRUE;
+
+fail:
+	free(cells);
+	return FALSE;
+}
+
+int clear_compress(CLEAR_CONTEXT* clear, BYTE* pSrcData, DWORD SrcFormat, int nSrcStep,
+		int nWidth, int nHeight, BYTE** ppDstData, UINT32* pDstSize)
+{
+	int x, y;
+	wStream* s;
+	BOOL invert;
+	UINT32 hash = 0;
+	UINT32 index;
+	UINT32 pixelCount;
+	BYTE glyphFlags = 0;
+	UINT16 glyphIndex = 0;
+	UINT32* pixels;
+	UINT32* pDstPixel;
+	UINT32* pSrcPixel;
+	CLEAR_GLYPH_ENTRY* glyphEntry = NULL;
+
+	if (!clear || !clear->Compressor || !pSrcData || !ppDstData || !pDstSize)
+		return -1;
+
+	if ((nWidth < 1) || (nHeight < 1) || (nWidth > 0xFFFF) || (nHeight > 0xFFFF))
+		return -1;
+
+	if (FREERDP_PIXEL_FORMAT_BPP(SrcFormat) != 32)
+		return -1;
+
+	invert = FREERDP_PIXEL_FORMAT_IS_ABGR(SrcFormat) ? TRUE : FALSE;
+	pixelCount = nWidth * nHeight;
+
+	/* normalize the source to 0x00RRGGBB, padded for the NSCodec SIMD encoder */
+
+	if (((pixelCount * 4) + 16) > clear->TempSize)
+	{
+		BYTE* tmp;
+
+		tmp = (BYTE*) realloc(clear->TempBuffer, (pixelCount * 4) + 16);
+
+		if (!tmp)
+			return -1;
+
+		clear->TempBuffer = tmp;
+		clear->TempSize = (pixelCount * 4) + 16;
+	}
+
+	pixels = (UINT32*) clear->TempBuffer;
+	pDstPixel = pixels;
+
+	for (y = 0; y < nHeight; y++)
+	{
+		pSrcPixel = (UINT32*) &pSrcData[y * nSrcStep];
+
+		if (!invert)
+		{
+			for (x = 0; x < nWidth; x++)
+				*pDstPixel++ = pSrcPixel[x] & 0x00FFFFFF;
+		}
+		else
+		{
+			for (x = 0; x < nWidth; x++)
+			{
+				*pDstPixel++ = ((pSrcPixel[x] & 0x0000FF) << 16) | (pSrcPixel[x] & 0x00FF00) |
+						((pSrcPixel[x] & 0xFF0000) >> 16);
+			}
+		}
+	}
+
+	clear->ResidualByteCount = 0;
+	clear->BandsByteCount = 0;
+	clear->SubcodecByteCount = 0;
+	clear->GlyphHit = FALSE;
+
+	if (clear->CacheReset)
+	{
+		glyphFlags |= CLEARCODEC_FLAG_CACHE_RESET;
+		clear->VBarStorageCursor = 0;
+		clear->ShortVBarStorageCursor = 0;
+		clear->CacheReset = FALSE;
+	}
+
+	if (pixelCount <= 1024)
+	{
+		hash = clear_hash_pixels(pixels, pixelCount, (nWidth << 16) | nHeight);
+		index = clear->GlyphHashTable[hash & 0xFFF];
+
+		if (index--)
+		{
+			glyphEntry = &(clear->GlyphCache[index]);
+
+			if ((glyphEntry->hash == hash) && (glyphEntry->width == nWidth) &&
+					(glyphEntry->height == nHeight) &&
+					(memcmp(glyphEntry->pixels, pixels, pixelCount * 4) == 0))
+			{
+				glyphFlags |= CLEARCODEC_FLAG_GLYPH_INDEX | CLEARCODEC_FLAG_GLYPH_HIT;
+				glyphIndex = (UINT16) index;
+				clear->GlyphHit = TRUE;
+			}
+		}
+
+		if (!clear->GlyphHit)
+		{
+			glyphFlags |= CLEARCODEC_FLAG_GLYPH_INDEX;
+			glyphIndex = clear->GlyphCursor;
+			clear->GlyphCursor = (clear->GlyphCursor + 1) % 4000;
+		}
+	}
+
+	if (!clear->GlyphHit)
+	{
+		Stream_SetPosition(clear->ResidualStream, 0);
+		Stream_SetPosition(clear->BandsStream, 0);
+		Stream_SetPosition(clear->SubcodecStream, 0);
+
+		/* glyph cache entries must match the source exactly, keep them lossless */
+
+		if (!clear_encode_layers(clear, pixels, nWidth, nHeight,
+				(glyphFlags & CLEARCODEC_FLAG_GLYPH_INDEX) ? FALSE : TRUE))
+			return -1;
+
+		clear->ResidualByteCount = Stream_GetPosition(clear->ResidualStream);
+		clear->BandsByteCount = Stream_GetPosition(clear->BandsStream);
+		clear->SubcodecByteCount = Stream_GetPosition(clear->SubcodecStream);
+	}
+
+	s = Stream_New(NULL, 4 + 12 + clear->ResidualByteCount + clear->BandsByteCount + clear->SubcodecByteCount);
+
+	if (!s)
+		return -1;
+
+	Stream_Write_UINT8(s, glyphFlags); /* glyphFlags (1 byte) */
+	Stream_Write_UINT8(s, clear->seqNumber); /* seqNumber (1 byte) */
+	clear->seqNumber = (clear->seqNumber + 1) % 256;
+
+	if (glyphFlags & CLEARCODEC_FLAG_GLYPH_INDEX)
+		Stream_Write_UINT16(s, glyphIndex); /* glyphIndex (2 bytes) */
+
+	if (!clear->GlyphHit)
+	{
+		Stream_Write_UINT32(s, clear->ResidualByteCount); /* residualByteCount (4 bytes) */
+		Stream_Write_UINT32(s, clear->BandsByteCount); /* bandsByteCount (4 bytes) */
+		Stream_Write_UINT32(s, clear->SubcodecByteCount); /* subcodecByteCount (4 bytes) */
+
+		Stream_Write(s, Stream_Buffer(clear->ResidualStream), clear->ResidualByteCount);
+		Stream_Write(s, Stream_Buffer(clear->BandsStream), clear->BandsByteCount);
+		Stream_Write(s, Stream_Buffer(clear->SubcodecStream), clear->SubcodecByteCount);
+	}
+
+	if ((glyphFlags & CLEARCODEC_FLAG_GLYPH_INDEX) && !clear->GlyphHit)
+	{
+		glyphEntry = &(clear->GlyphCache[glyphIndex]);
+
+		if (pixelCount > glyphEntry->size)
+		{
+			UINT32* tmp;
+
+			tmp = (UINT32*) realloc(glyphEntry->pixels, pixelCount * 4);
+
+			if (!tmp)
+			{
+				Stream_Free(s, TRUE);
+				return -1;
+			}
+
+			glyphEntry->pixels = tmp;
+			glyphEntry->size = pixelCount;
+		}
+
+		CopyMemory(glyphEntry->pixels, pixels, pixelCount * 4);
+		glyphEntry->count = pixelCount;
+		glyphEntry->hash = hash;
+		glyphEntry->width = nWidth;
+		glyphEntry->height = nHeight;
+		clear->GlyphHashTable[hash & 0xFFF] = glyphIndex + 1;
+	}
+
+	WLog_DBG(TAG, "residualByteCount: %d bandsByteCount: %d subcodecByteCount: %d glyphHit: %d",
+			clear->ResidualByteCount, clear->BandsByteCount, clear->SubcodecByteCount, clear->GlyphHit);
+
+	*ppDstData = Stream_Buffer(s);
+	*pDstSize = Stream_GetPosition(s);
+	Stream_Free(s, FALSE);
+
 	return 1;
 }
 
@@ -839,6 +1738,15 @@ BOOL clear_context_reset(CLEAR_CONTEXT* clear)
 	clear->VBarStorageCursor = 0;
 	clear->ShortVBarStorageCursor = 0;
 
+	if (clear->Compressor)
+	{
+		clear->CacheReset = TRUE;
+		clear->GlyphCursor = 0;
+		ZeroMemory(clear->GlyphHashTable, sizeof(clear->GlyphHashTable));
+		ZeroMemory(clear->VBarHashTable, sizeof(clear->VBarHashTable));
+		ZeroMemory(clear->ShortVBarHashTable, sizeof(clear->ShortVBarHashTable));
+	}
+
 	return TRUE;
 }
 
@@ -857,17 +1765,35 @@ CLEAR_CONTEXT* clear_context_new(BOOL Compressor)
 	if (!clear->nsc)
 		goto error_nsc;
 
-	nsc_context_set_pixel_format(clear->nsc, RDP_PIXEL_FORMAT_R8G8B8);
+	nsc_context_set_pixel_format(clear->nsc, Compressor ? RDP_PIXEL_FORMAT_B8G8R8A8 : RDP_PIXEL_FORMAT_R8G8B8);
 
 	clear->TempSize = 512 * 512 * 4;
 	clear->TempBuffer = (BYTE*) malloc(clear->TempSize);
 	if (!clear->TempBuffer)
 		goto error_temp_buffer;
 
+	if (Compressor)
+	{
+		clear->ResidualStream = Stream_New(NULL, 4096);
+		clear->BandsStream = Stream_New(NULL, 4096);
+		clear->SubcodecStream = Stream_New(NULL, 4096);
+		clear->TempStream = Stream_New(NULL, 4096);
+
+		if (!clear->ResidualStream || !clear->BandsStream ||
+				!clear->SubcodecStream || !clear->TempStream)
+			goto error_streams;
+	}
+
 	clear_context_reset(clear);
 
 	return clear;
 
+error_streams:
+	Stream_Free(clear->ResidualStream, TRUE);
+	Stream_Free(clear->BandsStream, TRUE);
+	Stream_Free(clear->SubcodecStream, TRUE);
+	Stream_Free(clear->TempStream, TRUE);
+	free(clear->TempBuffer);
 error_temp_buffer:
 	nsc_context_free(clear->nsc);
 error_nsc:
@@ -886,6 +1812,11 @@ void clear_context_free(CLEAR_CONTEXT* clear)
 
 	free(clear->TempBuffer);
 
+	Stream_Free(clear->ResidualStream, TRUE);
+	Stream_Free(clear->BandsStream, TRUE);
+	Stream_Free(clear->SubcodecStream, TRUE);
+	Stream_Free(clear->TempStream, TRUE);
+
 	for (i = 0; i < 4000; i++)
 		free(clear->GlyphCache[i].pixels);
 
@@ -24,6 +24,7 @@
 #include <winpr/crt.h>
 #include <winpr/print.h>
 #include <winpr/library.h>
+#include <winpr/interlocked.h>
 #include <winpr/bitstream.h>
 
 #include <freerdp/primitives.h>
@@ -920,7 +921,10 @@ static int openh264_compress(H264_CONTEXT* h264, BYTE** ppDstData, UINT32* pDstS
 	BYTE** pYUVData = h264->pYUVData[plane];
 	UINT32* iStride = h264->iStride[plane];
 
-	sys = &((H264_CONTEXT_OPENH264*) h264->pSystemData)[0];
+	if (plane >= h264->numSystemData)
+		return -1;
+
+	sys = &((H264_CONTEXT_OPENH264*) h264->pSystemData)[plane];
 
 	if (!sys->pEncoder)
 		return -1;
@@ -1120,7 +1124,8 @@ static BOOL openh264_init(H264_CONTEXT* h264)
 #endif
 	static WelsTraceCallback traceCallback = (WelsTraceCallback) openh264_trace_callback;
 
-	h264->numSystemData = 1;
+	/* AVC444 encodes the main and auxiliary views as two separate streams */
+	h264->numSystemData = h264->Compressor ? 2 : 1;
 
 	sysContexts = (H264_CONTEXT_OPENH264*) calloc(h264->numSystemData,
 						      sizeof(H264_CONTEXT_OPENH264));
@@ -1528,56 +1533,456 @@ INT32 avc420_decompress(H264_CONTEXT* h264, BYTE* pSrcData, UINT32 SrcSize,
 	return 1;
 }
 
-INT32 avc420_compress(H264_CONTEXT* h264, BYTE* pSrcData, DWORD SrcFormat,
-		      UINT32 nSrcStep, UINT32 nSrcWidth, UINT32 nSrcHeight,
-		      BYTE** ppDstData, UINT32* pDstSize)
+/**
+ * Number of frames converted by avc420_prepare whose encode has not
+ * completed yet, their planes must not be touched.
+ */
+static UINT32 avc420_pending_frames(H264_CONTEXT* h264)
+{
+	LONG prepared = InterlockedCompareExchange(&h264->prepareIndex, 0, 0);
+	LONG encoded = InterlockedCompareExchange(&h264->encodeIndex, 0, 0);
+
+	return (UINT32) (prepared - encoded);
+}
+
+static void avc420_free_buffers(H264_CONTEXT* h264)
+{
+	UINT32 x, y;
+
+	for (y=0; y<2; y++)
+	{
+		for (x=0; x<3; x++)
+		{
+			_aligned_free(h264->pYUVBuffers[y][x]);
+			h264->pYUVBuffers[y][x] = NULL;
+		}
+
+		h264->YUVBufferValid[y] = FALSE;
+	}
+
+	h264->numYUVBuffers = 0;
+	h264->prepareIndex = 0;
+	h264->encodeIndex = 0;
+
+	free(h264->pLastRects);
+	h264->pLastRects = NULL;
+	h264->numLastRects = 0;
+}
+
+/**
+ * Allocate the input planes of the encoder, with 16 byte aligned rows
+ * and chroma planes of a quarter of the luma size.
+ */
+static BOOL avc420_alloc_buffers(H264_CONTEXT* h264, UINT32 width, UINT32 height)
+{
+	UINT32 x, y;
+	UINT32 nWidth, nHeight;
+
+	avc420_free_buffers(h264);
+
+	nWidth = (width + 1) & ~1;
+	nHeight = (height + 1) & ~1;
+
+	h264->iYUVBufferStride[0] = (nWidth + 15) & ~15;
+	h264->iYUVBufferStride[1] = ((nWidth / 2) + 15) & ~15;
+	h264->iYUVBufferStride[2] = h264->iYUVBufferStride[1];
+
+	h264->iYUVBufferSize[0] = h264->iYUVBufferStride[0] * nHeight;
+	h264->iYUVBufferSize[1] = h264->iYUVBufferStride[1] * (nHeight / 2);
+	h264->iYUVBufferSize[2] = h264->iYUVBufferStride[2] * (nHeight / 2);
+
+	h264->numYUVBuffers = h264->DoubleBuffering ? 2 : 1;
+
+	for (y=0; y<h264->numYUVBuffers; y++)
+	{
+		for (x=0; x<3; x++)
+		{
+			if (!(h264->pYUVBuffers[y][x] = (BYTE*) _aligned_malloc(h264->iYUVBufferSize[x], 16)))
+			{
+				avc420_free_buffers(h264);
+				return FALSE;
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+static BOOL avc420_save_rects(H264_CONTEXT* h264, const RECTANGLE_16* rects, UINT32 numRects)
+{
+	RECTANGLE_16* pLastRects;
+
+	if (h264->numYUVBuffers < 2)
+		return TRUE;
+
+	if (!(pLastRects = (RECTANGLE_16*) realloc(h264->pLastRects, (numRects + 1) * sizeof(RECTANGLE_16))))
+		return FALSE;
+
+	CopyMemory(pLastRects, rects, numRects * sizeof(RECTANGLE_16));
+
+	h264->pLastRects = pLastRects;
+	h264->numLastRects = numRects;
+
+	return TRUE;
+}
+
+static BOOL avc420_convert_rect(H264_CONTEXT* h264, BYTE* pYUVData[3],
+				BYTE* pSrcData, UINT32 nSrcStep, const RECTANGLE_16* rect)
 {
-	int status = -1;
 	prim_size_t roi;
-	int nWidth, nHeight;
+	BYTE* pYUVRect[3];
+	const UINT32* iStride = h264->iYUVBufferStride;
 	primitives_t* prims = primitives_get();
-	UINT32* iStride;
+
+	roi.width = rect->right - rect->left;
+	roi.height = rect->bottom - rect->top;
+
+	pYUVRect[0] = &pYUVData[0][(rect->top * iStride[0]) + rect->left];
+	pYUVRect[1] = &pYUVData[1][((rect->top / 2) * iStride[1]) + (rect->left / 2)];
+	pYUVRect[2] = &pYUVData[2][((rect->top / 2) * iStride[2]) + (rect->left / 2)];
+
+	return (prims->RGBToYUV420_8u_P3AC4R(&pSrcData[(rect->top * nSrcStep) + (rect->left * 4)],
+					     nSrcStep, pYUVRect, (UINT32*) iStride, &roi) == PRIMITIVES_SUCCESS);
+}
+
+void h264_metablock_free(RDPGFX_H264_METABLOCK* meta)
+{
+	if (!meta)
+		return;
+
+	free(meta->regionRects);
+	free(meta->quantQualityVals);
+
+	meta->numRegionRects = 0;
+	meta->regionRects = NULL;
+	meta->quantQualityVals = NULL;
+}
+
+static BOOL avc420_alloc_metablock(H264_CONTEXT* h264, RDPGFX_H264_METABLOCK* meta,
+				   UINT32 numRegionRects)
+{
+	UINT32 x;
+
+	meta->numRegionRects = 0;
+
+	meta->regionRects = (RECTANGLE_16*) calloc(numRegionRects, sizeof(RECTANGLE_16));
+	meta->quantQualityVals = (RDPGFX_H264_QUANT_QUALITY*) calloc(numRegionRects,
+				 sizeof(RDPGFX_H264_QUANT_QUALITY));
+
+	if (!meta->regionRects || !meta->quantQualityVals)
+	{
+		h264_metablock_free(meta);
+		return FALSE;
+	}
+
+	for (x=0; x<numRegionRects; x++)
+	{
+		meta->quantQualityVals[x].qp = h264->QP;
+		meta->quantQualityVals[x].r = 0;
+		meta->quantQualityVals[x].p = 0;
+		meta->quantQualityVals[x].qualityVal = 100 - h264->QP;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Convert the next frame into the encoder input planes. Only regionRects
+ * are converted, the rest of the planes still hold the previous frame, so
+ * the encoder sees unchanged macroblocks bit for bit identical to its
+ * reference and skips them. meta receives the rectangles the client has
+ * to update, release it with h264_metablock_free. Without regionRects the
+ * whole frame is updated.
+ *
+ * With DoubleBuffering set, avc420_prepare for frame N + 1 may run while
+ * avc420_encode encodes frame N on another thread. A frame size change
+ * frees the planes, it fails until all prepared frames are encoded.
+ */
+INT32 avc420_prepare(H264_CONTEXT* h264, BYTE* pSrcData, DWORD SrcFormat,
+		     UINT32 nSrcStep, UINT32 nSrcWidth, UINT32 nSrcHeight,
+		     const RECTANGLE_16* regionRects, UINT32 numRegionRects,
+		     RDPGFX_H264_METABLOCK* meta)
+{
+	UINT32 x, count;
+	UINT32 buffer;
 	BYTE** pYUVData;
+	RECTANGLE_16 rect;
 
-	if (!h264)
+	if (!h264 || !meta || !h264->Compressor)
 		return -1;
 
-	if (!h264->subsystem->Compress)
+	if (!h264->numYUVBuffers || (h264->width != nSrcWidth) || (h264->height != nSrcHeight))
+	{
+		if (!h264_context_reset(h264, nSrcWidth, nSrcHeight))
+			return -1;
+	}
+
+	if (avc420_pending_frames(h264) >= h264->numYUVBuffers)
+	{
+		WLog_ERR(TAG, "all %u input buffers wait for avc420_encode",
+			 h264->numYUVBuffers);
 		return -1;
+	}
 
-	iStride =  h264->iStride[0];
-	pYUVData = h264->pYUVData[0];
+	buffer = ((UINT32) h264->prepareIndex) % h264->numYUVBuffers;
+	pYUVData = h264->pYUVBuffers[buffer];
 
-	nWidth = (nSrcWidth + 1) & ~1;
-	nHeight = (nSrcHeight + 1) & ~1;
+	if (!h264->YUVBufferValid[buffer] || !regionRects || (numRegionRects < 1))
+	{
+		regionRects = NULL;
+		numRegionRects = 1;
+	}
 
-	if (!(pYUVData[0] = (BYTE*) malloc(nWidth * nHeight)))
+	if (!avc420_alloc_metablock(h264, meta, numRegionRects))
 		return -1;
-	iStride[0] = nWidth;
 
-	if (!(pYUVData[1] = (BYTE*) malloc(nWidth * nHeight)))
-		goto error_1;
-	iStride[1] = nWidth / 2;
+	count = 0;
 
-	if (!(pYUVData[2] = (BYTE*) malloc(nWidth * nHeight)))
-		goto error_2;
-	iStride[2] = nWidth / 2;
+	for (x=0; x<numRegionRects; x++)
+	{
+		if (regionRects)
+		{
+			/* 4:2:0 subsampling works on 2x2 blocks */
+			rect.left = regionRects[x].left & ~1;
+			rect.top = regionRects[x].top & ~1;
+			rect.right = MIN((regionRects[x].right + 1) & ~1, nSrcWidth);
+			rect.bottom = MIN((regionRects[x].bottom + 1) & ~1, nSrcHeight);
+		}
+		else
+		{
+			rect.left = 0;
+			rect.top = 0;
+			rect.right = nSrcWidth;
+			rect.bottom = nSrcHeight;
+		}
 
-	roi.width = nSrcWidth;
-	roi.height = nSrcHeight;
+		if ((rect.right <= rect.left) || (rect.bottom <= rect.top))
+			continue;
+
+		if (!avc420_convert_rect(h264, pYUVData, pSrcData, nSrcStep, &rect))
+			goto fail;
+
+		meta->regionRects[count++] = rect;
+	}
+
+	meta->numRegionRects = count;
+
+	/* The other buffer of a pair misses the damage of the previous frame */
+	if (regionRects && (h264->numYUVBuffers > 1))
+	{
+		for (x=0; x<h264->numLastRects; x++)
+		{
+			if (!avc420_convert_rect(h264, pYUVData, pSrcData, nSrcStep, &(h264->pLastRects[x])))
+				goto fail;
+		}
+	}
+
+	if (!avc420_save_rects(h264, meta->regionRects, meta->numRegionRects))
+		goto fail;
+
+	h264->YUVBufferValid[buffer] = TRUE;
+	InterlockedIncrement(&h264->prepareIndex);
+
+	return 1;
+
+fail:
+	/* Convert everything again on the next frames */
+	for (x=0; x<h264->numYUVBuffers; x++)
+		h264->YUVBufferValid[x] = FALSE;
+
+	h264_metablock_free(meta);
 
-	prims->RGBToYUV420_8u_P3AC4R(pSrcData, nSrcStep, pYUVData, iStride, &roi);
+	return -1;
+}
+
+/**
+ * Encode the oldest frame converted by avc420_prepare.
+ */
+INT32 avc420_encode(H264_CONTEXT* h264, BYTE** ppDstData, UINT32* pDstSize)
+{
+	INT32 status;
+	UINT32 x, buffer;
+
+	if (!h264 || !h264->numYUVBuffers)
+		return -1;
+
+	if (!h264->subsystem->Compress)
+		return -1;
+
+	if (avc420_pending_frames(h264) < 1)
+		return -1;
+
+	buffer = ((UINT32) h264->encodeIndex) % h264->numYUVBuffers;
+
+	for (x=0; x<3; x++)
+	{
+		h264->pYUVData[0][x] = h264->pYUVBuffers[buffer][x];
+		h264->iStride[0][x] = h264->iYUVBufferStride[x];
+	}
 
 	status = h264->subsystem->Compress(h264, ppDstData, pDstSize, 0);
 
-	free(pYUVData[2]);
-	pYUVData[2] = NULL;
-error_2:
-	free(pYUVData[1]);
-	pYUVData[1] = NULL;
-error_1:
-	free(pYUVData[0]);
-	pYUVData[0] = NULL;
+	/* The planes belong to the buffers, not to the view */
+	for (x=0; x<3; x++)
+		h264->pYUVData[0][x] = NULL;
+
+	/* The buffer is free for avc420_prepare again, even if the encode failed */
+	InterlockedIncrement(&h264->encodeIndex);
+
+	return status;
+}
+
+INT32 avc420_compress(H264_CONTEXT* h264, BYTE* pSrcData, DWORD SrcFormat,
+		      UINT32 nSrcStep, UINT32 nSrcWidth, UINT32 nSrcHeight,
+		      const RECTANGLE_16* regionRects, UINT32 numRegionRects,
+		      BYTE** ppDstData, UINT32* pDstSize, RDPGFX_H264_METABLOCK* meta)
+{
+	INT32 status;
+
+	status = avc420_prepare(h264, pSrcData, SrcFormat, nSrcStep, nSrcWidth, nSrcHeight,
+				regionRects, numRegionRects, meta);
+
+	if (status < 0)
+		return status;
+
+	status = avc420_encode(h264, ppDstData, pDstSize);
+
+	if (status < 0)
+		h264_metablock_free(meta);
+
+	return status;
+}
+
+static void avc444_free_view(BYTE* pYUVData[3], UINT32 iStride[3], UINT32 iSize[3])
+{
+	UINT32 x;
+
+	for (x=0; x<3; x++)
+	{
+		free(pYUVData[x]);
+		pYUVData[x] = NULL;
+		iStride[x] = 0;
+		iSize[x] = 0;
+	}
+}
+
+static void avc444_free_views(H264_CONTEXT* h264)
+{
+	UINT32 view;
+
+	for (view=0; view<2; view++)
+	{
+		avc444_free_view(h264->pNewYUVData[view], h264->iNewYUVStride[view],
+				 h264->iNewYUVSize[view]);
+		avc444_free_view(h264->pOldYUVData[view], h264->iOldYUVStride[view],
+				 h264->iOldYUVSize[view]);
+	}
+
+	h264->OldYUVValid = FALSE;
+}
+
+/**
+ * The view buffers are kept from frame to frame and only allocated again
+ * when the frame size changes.
+ */
+static BOOL avc444_ensure_view(BYTE* pYUVData[3], UINT32 iStride[3],
+			       UINT32 iSize[3], UINT32 nWidth,
+			       UINT32 nLumaHeight, UINT32 nChromaHeight)
+{
+	UINT32 x;
+	UINT32 stride, size;
+
+	for (x=0; x<3; x++)
+	{
+		stride = (x == 0) ? nWidth : nWidth / 2;
+		size = stride * ((x == 0) ? nLumaHeight : nChromaHeight);
+
+		if (pYUVData[x] && (iStride[x] == stride) && (iSize[x] == size))
+			continue;
+
+		free(pYUVData[x]);
+		iStride[x] = stride;
+		iSize[x] = size;
+
+		/* Zeroed, the split does not touch the padding of the auxiliary view */
+		if (!(pYUVData[x] = (BYTE*) calloc(1, size)))
+		{
+			avc444_free_view(pYUVData, iStride, iSize);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static BOOL avc444_ensure_yuv444(H264_CONTEXT* h264, UINT32 nWidth, UINT32 nHeight)
+{
+	UINT32 x;
+	UINT32* piSize = h264->iYUV444Size;
+	UINT32* piStride = h264->iYUV444Stride;
+	BYTE** ppYUVData = h264->pYUV444Data;
+
+	for (x=0; x<3; x++)
+	{
+		BYTE* pYUVTmpData;
+
+		if (ppYUVData[x] && (piStride[x] == nWidth) &&
+		    (piSize[x] == nWidth * nHeight))
+			continue;
+
+		piStride[x] = nWidth;
+		piSize[x] = nWidth * nHeight;
+
+		if (!(pYUVTmpData = (BYTE*) realloc(ppYUVData[x], piSize[x])))
+			return FALSE;
+
+		ppYUVData[x] = pYUVTmpData;
+		memset(ppYUVData[x], 0, piSize[x]);
+	}
+
+	return TRUE;
+}
+
+static BOOL avc444_view_changed(H264_CONTEXT* h264, UINT32 view)
+{
+	UINT32 x;
+
+	if (!h264->OldYUVValid)
+		return TRUE;
+
+	for (x=0; x<3; x++)
+	{
+		if (h264->iOldYUVSize[view][x] != h264->iNewYUVSize[view][x])
+			return TRUE;
+
+		if (memcmp(h264->pOldYUVData[view][x], h264->pNewYUVData[view][x],
+			   h264->iNewYUVSize[view][x]) != 0)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/**
+ * The planes handed to the subsystem belong to the views, they are only
+ * set for the duration of the call.
+ */
+static INT32 avc444_encode_view(H264_CONTEXT* h264, UINT32 view,
+				BYTE** ppDstData, UINT32* pDstSize)
+{
+	INT32 status;
+	UINT32 x;
+
+	for (x=0; x<3; x++)
+	{
+		h264->pYUVData[view][x] = h264->pNewYUVData[view][x];
+		h264->iStride[view][x] = h264->iNewYUVStride[view][x];
+	}
+
+	status = h264->subsystem->Compress(h264, ppDstData, pDstSize, view);
+
+	for (x=0; x<3; x++)
+		h264->pYUVData[view][x] = NULL;
 
 	return status;
 }
@@ -1587,7 +1992,121 @@ INT32 avc444_compress(H264_CONTEXT* h264, BYTE* pSrcData, DWORD SrcFormat,
 		      BYTE* op, BYTE** ppDstData, UINT32* pDstSize,
 		      BYTE** ppAuxDstData, UINT32* pAuxDstSize)
 {
-	return -1;
+	INT32 status = -1;
+	UINT32 x, view;
+	prim_size_t roi;
+	UINT32 nWidth, nHeight, padHeight;
+	BOOL mainChanged, auxChanged;
+	primitives_t* prims = primitives_get();
+
+	if (!h264 || !op)
+		return -1;
+
+	if (!ppDstData || !pDstSize || !ppAuxDstData || !pAuxDstSize)
+		return -1;
+
+	if (!h264->subsystem->Compress)
+		return -1;
+
+	nWidth = (nSrcWidth + 1) & ~1;
+	nHeight = (nSrcHeight + 1) & ~1;
+
+	/* The auxiliary view is padded to multiples of 16 lines (B4 and B5) */
+	padHeight = (nHeight + 15) & ~15;
+
+	if (!avc444_ensure_yuv444(h264, nWidth, nHeight))
+		return -1;
+
+	if (!avc444_ensure_view(h264->pNewYUVData[0], h264->iNewYUVStride[0],
+				h264->iNewYUVSize[0], nWidth, nHeight, nHeight / 2))
+		goto fail;
+
+	if (!avc444_ensure_view(h264->pNewYUVData[1], h264->iNewYUVStride[1],
+				h264->iNewYUVSize[1], nWidth, padHeight, nHeight / 2))
+		goto fail;
+
+	roi.width = nSrcWidth;
+	roi.height = nSrcHeight;
+
+	if (prims->RGBToYUV444_8u_P3AC4R(pSrcData, nSrcStep, h264->pYUV444Data,
+					 h264->iYUV444Stride, &roi) != PRIMITIVES_SUCCESS)
+		goto fail;
+
+	roi.width = nWidth;
+	roi.height = nHeight;
+
+	if (prims->YUV444SplitToYUV420((const BYTE**) h264->pYUV444Data,
+				       h264->iYUV444Stride,
+				       h264->pNewYUVData[0], h264->iNewYUVStride[0],
+				       h264->pNewYUVData[1], h264->iNewYUVStride[1],
+				       &roi) != PRIMITIVES_SUCCESS)
+		goto fail;
+
+	/**
+	 * Pick the cheapest op mode for this frame: a stream whose view did
+	 * not change since the last frame does not have to be sent, the client
+	 * combines it with what it already has.
+	 */
+	mainChanged = avc444_view_changed(h264, 0);
+	auxChanged = avc444_view_changed(h264, 1);
+
+	if (mainChanged && auxChanged)
+		*op = 0; /* YUV420 in stream 1, Chroma420 in stream 2 */
+	else if (auxChanged)
+		*op = 2; /* Chroma420 in stream 1 */
+	else
+		*op = 1; /* YUV420 in stream 1 */
+
+	*ppAuxDstData = NULL;
+	*pAuxDstSize = 0;
+
+	switch (*op)
+	{
+	case 0:
+		status = avc444_encode_view(h264, 0, ppDstData, pDstSize);
+		if (status >= 0)
+			status = avc444_encode_view(h264, 1, ppAuxDstData, pAuxDstSize);
+		break;
+	case 1:
+		status = avc444_encode_view(h264, 0, ppDstData, pDstSize);
+		break;
+	case 2:
+		status = avc444_encode_view(h264, 1, ppDstData, pDstSize);
+		break;
+	default:
+		break;
+	}
+
+	if (status < 0)
+		goto fail;
+
+	/* The views just sent are the reference for the next change detection */
+	for (view=0; view<2; view++)
+	{
+		for (x=0; x<3; x++)
+		{
+			BYTE* pYUVData = h264->pOldYUVData[view][x];
+			UINT32 iStride = h264->iOldYUVStride[view][x];
+			UINT32 iSize = h264->iOldYUVSize[view][x];
+
+			h264->pOldYUVData[view][x] = h264->pNewYUVData[view][x];
+			h264->iOldYUVStride[view][x] = h264->iNewYUVStride[view][x];
+			h264->iOldYUVSize[view][x] = h264->iNewYUVSize[view][x];
+			h264->pNewYUVData[view][x] = pYUVData;
+			h264->iNewYUVStride[view][x] = iStride;
+			h264->iNewYUVSize[view][x] = iSize;
+		}
+	}
+
+	h264->OldYUVValid = TRUE;
+
+	return status;
+
+fail:
+	/* Force both streams on the next frame */
+	h264->OldYUVValid = FALSE;
+
+	return status;
 }
 
 static BOOL avc444_process_rect(H264_CONTEXT* h264,
@@ -1885,9 +2404,21 @@ BOOL h264_context_reset(H264_CONTEXT* h264, UINT32 width, UINT32 height)
 	if (!h264)
 		return FALSE;
 
+	if (h264->Compressor && h264->numYUVBuffers && avc420_pending_frames(h264))
+	{
+		WLog_ERR(TAG, "cannot reset while %u frames wait for avc420_encode",
+			 avc420_pending_frames(h264));
+		return FALSE;
+	}
+
 	h264->width = width;
 	h264->height = height;
 
+	avc444_free_views(h264);
+
+	if (h264->Compressor)
+		return avc420_alloc_buffers(h264, width, height);
+
 	return TRUE;
 }
 
@@ -1929,6 +2460,12 @@ void h264_context_free(H264_CONTEXT* h264)
 		free (h264->pYUV444Data[0]);
 		free (h264->pYUV444Data[1]);
 		free (h264->pYUV444Data[2]);
+
+		if (h264->Compressor)
+			avc420_free_buffers(h264);
+
+		avc444_free_views(h264);
+
 		free(h264);
 	}
 }
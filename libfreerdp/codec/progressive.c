@@ -22,7 +22,9 @@
 #endif
 
 #include <winpr/crt.h>
+#include <winpr/pool.h>
 #include <winpr/print.h>
+#include <winpr/sysinfo.h>
 #include <winpr/bitstream.h>
 
 #include <freerdp/primitives.h>
@@ -30,11 +32,19 @@
 #include <freerdp/codec/progressive.h>
 #include <freerdp/log.h>
 
+#include "rfx_rlgr.h"
+#include "rfx_bitstream.h"
 #include "rfx_differential.h"
 #include "rfx_quantization.h"
+#include "progressive_sse2.h"
+#include "progressive_neon.h"
 
 #define TAG FREERDP_TAG("codec.progressive")
 
+#ifndef PROGRESSIVE_INIT_SIMD
+#define PROGRESSIVE_INIT_SIMD(_progressive) do { } while (0)
+#endif
+
 const char* progressive_get_block_type_string(UINT16 blockType)
 {
 	switch (blockType)
@@ -358,7 +368,7 @@ int progressive_delete_surface_context(PROGRESSIVE_CONTEXT* progressive, UINT16
  * LL3		4015		9x9		81
  */
 
-static void progressive_rfx_idwt_x(INT16* pLowBand, int nLowStep, INT16* pHighBand, int nHighStep,
+void progressive_rfx_idwt_x(INT16* pLowBand, int nLowStep, INT16* pHighBand, int nHighStep,
 		INT16* pDstBand, int nDstStep, int nLowCount, int nHighCount, int nDstCount)
 {
 	int i, j;
@@ -443,7 +453,7 @@ static void progressive_rfx_idwt_x(INT16* pLowBand, int nLowStep, INT16* pHighBa
 	}
 }
 
-static void progressive_rfx_idwt_y(INT16* pLowBand, int nLowStep, INT16* pHighBand, int nHighStep,
+void progressive_rfx_idwt_y(INT16* pLowBand, int nLowStep, INT16* pHighBand, int nHighStep,
 		INT16* pDstBand, int nDstStep, int nLowCount, int nHighCount, int nDstCount)
 {
 	int i, j;
@@ -557,7 +567,8 @@ static int progressive_rfx_get_band_h_count(int level)
 		return (64 + (1 << (level - 1))) >> level;
 }
 
-static void progressive_rfx_dwt_2d_decode_block(INT16* buffer, INT16* temp, int level)
+static void progressive_rfx_dwt_2d_decode_block(PROGRESSIVE_CONTEXT* progressive,
+		INT16* buffer, INT16* temp, int level)
 {
 	int offset;
 	int nBandL;
@@ -619,7 +630,7 @@ static void progressive_rfx_dwt_2d_decode_block(INT16* buffer, INT16* temp, int
 	nHighCount[0] = nBandH;
 	nDstCount[0] = nBandL;
 
-	progressive_rfx_idwt_x(pLowBand[0], nLowStep[0], pHighBand[0], nHighStep[0], pDstBand[0], nDstStep[0], nLowCount[0], nHighCount[0], nDstCount[0]);
+	progressive->idwt_x(pLowBand[0], nLowStep[0], pHighBand[0], nHighStep[0], pDstBand[0], nDstStep[0], nLowCount[0], nHighCount[0], nDstCount[0]);
 
 	/* horizontal (LH + HH -> H) */
 
@@ -633,7 +644,7 @@ static void progressive_rfx_dwt_2d_decode_block(INT16* buffer, INT16* temp, int
 	nHighCount[1] = nBandH;
 	nDstCount[1] = nBandH;
 
-	progressive_rfx_idwt_x(pLowBand[1], nLowStep[1], pHighBand[1], nHighStep[1], pDstBand[1], nDstStep[1], nLowCount[1], nHighCount[1], nDstCount[1]);
+	progressive->idwt_x(pLowBand[1], nLowStep[1], pHighBand[1], nHighStep[1], pDstBand[1], nDstStep[1], nLowCount[1], nHighCount[1], nDstCount[1]);
 
 	/* vertical (L + H -> LL) */
 
@@ -647,10 +658,11 @@ static void progressive_rfx_dwt_2d_decode_block(INT16* buffer, INT16* temp, int
 	nHighCount[2] = nBandH;
 	nDstCount[2] = nBandL + nBandH;
 
-	progressive_rfx_idwt_y(pLowBand[2], nLowStep[2], pHighBand[2], nHighStep[2], pDstBand[2], nDstStep[2], nLowCount[2], nHighCount[2], nDstCount[2]);
+	progressive->idwt_y(pLowBand[2], nLowStep[2], pHighBand[2], nHighStep[2], pDstBand[2], nDstStep[2], nLowCount[2], nHighCount[2], nDstCount[2]);
 }
 
-void progressive_rfx_dwt_2d_decode(INT16* buffer, INT16* temp, INT16* current, INT16* sign, BOOL diff)
+void progressive_rfx_dwt_2d_decode(PROGRESSIVE_CONTEXT* progressive, INT16* buffer, INT16* temp,
+		INT16* current, INT16* sign, BOOL diff)
 {
 	const primitives_t* prims = primitives_get();
 
@@ -659,9 +671,9 @@ void progressive_rfx_dwt_2d_decode(INT16* buffer, INT16* temp, INT16* current, I
 
 	CopyMemory(current, buffer, 4096 * 2);
 
-	progressive_rfx_dwt_2d_decode_block(&buffer[3807], temp, 3);
-	progressive_rfx_dwt_2d_decode_block(&buffer[3007], temp, 2);
-	progressive_rfx_dwt_2d_decode_block(&buffer[0], temp, 1);
+	progressive_rfx_dwt_2d_decode_block(progressive, &buffer[3807], temp, 3);
+	progressive_rfx_dwt_2d_decode_block(progressive, &buffer[3007], temp, 2);
+	progressive_rfx_dwt_2d_decode_block(progressive, &buffer[0], temp, 1);
 }
 
 void progressive_rfx_decode_block(const primitives_t* prims, INT16* buffer, int length, UINT32 shift)
@@ -673,10 +685,9 @@ void progressive_rfx_decode_block(const primitives_t* prims, INT16* buffer, int
 }
 
 int progressive_rfx_decode_component(PROGRESSIVE_CONTEXT* progressive, RFX_COMPONENT_CODEC_QUANT* shift,
-		const BYTE* data, int length, INT16* buffer, INT16* current, INT16* sign, BOOL diff)
+		const BYTE* data, int length, INT16* buffer, INT16* current, INT16* sign, INT16* temp, BOOL diff)
 {
 	int status;
-	INT16* temp;
 	const primitives_t* prims = primitives_get();
 
 	status = rfx_rlgr_decode(data, length, buffer, 4096, 1);
@@ -699,19 +710,21 @@ int progressive_rfx_decode_component(PROGRESSIVE_CONTEXT* progressive, RFX_COMPO
 	progressive_rfx_decode_block(prims, &buffer[3951], 64, shift->HH3); /* HH3 */
 	progressive_rfx_decode_block(prims, &buffer[4015], 81, shift->LL3); /* LL3 */
 
-	temp = (INT16*) BufferPool_Take(progressive->bufferPool, -1); /* DWT buffer */
-
-	progressive_rfx_dwt_2d_decode(buffer, temp, current, sign, diff);
-
-	BufferPool_Return(progressive->bufferPool, temp);
+	progressive_rfx_dwt_2d_decode(progressive, buffer, temp, current, sign, diff);
 
 	return 1;
 }
 
-int progressive_decompress_tile_first(PROGRESSIVE_CONTEXT* progressive, RFX_PROGRESSIVE_TILE* tile)
+/**
+ * pBuffer and temp are scratch buffers taken from the buffer pool by the
+ * caller, one pair per decoding thread.
+ */
+
+int progressive_decompress_tile_first(PROGRESSIVE_CONTEXT* progressive, RFX_PROGRESSIVE_TILE* tile,
+		BYTE* pBuffer, INT16* temp)
 {
 	BOOL diff;
-	BYTE* pBuffer;
+	BYTE* pTileBuffer;
 	INT16* pSign[3];
 	INT16* pSrcDst[3];
 	INT16* pCurrent[3];
@@ -804,32 +817,29 @@ int progressive_decompress_tile_first(PROGRESSIVE_CONTEXT* progressive, RFX_PROG
 		tile->current = (BYTE*) _aligned_malloc((8192 + 32) * 3, 16);
 	}
 
-	pBuffer = tile->sign;
-	pSign[0] = (INT16*)((BYTE*)(&pBuffer[((8192 + 32) * 0) + 16])); /* Y/R buffer */
-	pSign[1] = (INT16*)((BYTE*)(&pBuffer[((8192 + 32) * 1) + 16])); /* Cb/G buffer */
-	pSign[2] = (INT16*)((BYTE*)(&pBuffer[((8192 + 32) * 2) + 16])); /* Cr/B buffer */
+	pTileBuffer = tile->sign;
+	pSign[0] = (INT16*)((BYTE*)(&pTileBuffer[((8192 + 32) * 0) + 16])); /* Y/R buffer */
+	pSign[1] = (INT16*)((BYTE*)(&pTileBuffer[((8192 + 32) * 1) + 16])); /* Cb/G buffer */
+	pSign[2] = (INT16*)((BYTE*)(&pTileBuffer[((8192 + 32) * 2) + 16])); /* Cr/B buffer */
 
-	pBuffer = tile->current;
-	pCurrent[0] = (INT16*)((BYTE*)(&pBuffer[((8192 + 32) * 0) + 16])); /* Y/R buffer */
-	pCurrent[1] = (INT16*)((BYTE*)(&pBuffer[((8192 + 32) * 1) + 16])); /* Cb/G buffer */
-	pCurrent[2] = (INT16*)((BYTE*)(&pBuffer[((8192 + 32) * 2) + 16])); /* Cr/B buffer */
+	pTileBuffer = tile->current;
+	pCurrent[0] = (INT16*)((BYTE*)(&pTileBuffer[((8192 + 32) * 0) + 16])); /* Y/R buffer */
+	pCurrent[1] = (INT16*)((BYTE*)(&pTileBuffer[((8192 + 32) * 1) + 16])); /* Cb/G buffer */
+	pCurrent[2] = (INT16*)((BYTE*)(&pTileBuffer[((8192 + 32) * 2) + 16])); /* Cr/B buffer */
 
-	pBuffer = (BYTE*) BufferPool_Take(progressive->bufferPool, -1);
 	pSrcDst[0] = (INT16*)((BYTE*)(&pBuffer[((8192 + 32) * 0) + 16])); /* Y/R buffer */
 	pSrcDst[1] = (INT16*)((BYTE*)(&pBuffer[((8192 + 32) * 1) + 16])); /* Cb/G buffer */
 	pSrcDst[2] = (INT16*)((BYTE*)(&pBuffer[((8192 + 32) * 2) + 16])); /* Cr/B buffer */
 
-	progressive_rfx_decode_component(progressive, &shiftY, tile->yData, tile->yLen, pSrcDst[0], pCurrent[0], pSign[0], diff); /* Y */
-	progressive_rfx_decode_component(progressive, &shiftCb, tile->cbData, tile->cbLen, pSrcDst[1], pCurrent[1], pSign[1], diff); /* Cb */
-	progressive_rfx_decode_component(progressive, &shiftCr, tile->crData, tile->crLen, pSrcDst[2], pCurrent[2], pSign[2], diff); /* Cr */
+	progressive_rfx_decode_component(progressive, &shiftY, tile->yData, tile->yLen, pSrcDst[0], pCurrent[0], pSign[0], temp, diff); /* Y */
+	progressive_rfx_decode_component(progressive, &shiftCb, tile->cbData, tile->cbLen, pSrcDst[1], pCurrent[1], pSign[1], temp, diff); /* Cb */
+	progressive_rfx_decode_component(progressive, &shiftCr, tile->crData, tile->crLen, pSrcDst[2], pCurrent[2], pSign[2], temp, diff); /* Cr */
 
 	if (!progressive->invert)
 		prims->yCbCrToRGB_16s8u_P3AC4R((const INT16**) pSrcDst, 64 * 2, tile->data, 64 * 4, &roi_64x64);
 	else
 		prims->yCbCrToBGR_16s8u_P3AC4R((const INT16**) pSrcDst, 64 * 2, tile->data, 64 * 4, &roi_64x64);
 
-	BufferPool_Return(progressive->bufferPool, pBuffer);
-
 	return 1;
 }
 
@@ -1033,9 +1043,8 @@ int progressive_rfx_upgrade_block(RFX_PROGRESSIVE_UPGRADE_STATE* state, INT16* b
 
 int progressive_rfx_upgrade_component(PROGRESSIVE_CONTEXT* progressive, RFX_COMPONENT_CODEC_QUANT* shift,
 		RFX_COMPONENT_CODEC_QUANT* bitPos, RFX_COMPONENT_CODEC_QUANT* numBits, INT16* buffer,
-		INT16* current, INT16* sign, const BYTE* srlData, int srlLen, const BYTE* rawData, int rawLen)
+		INT16* current, INT16* sign, INT16* temp, const BYTE* srlData, int srlLen, const BYTE* rawData, int rawLen)
 {
-	INT16* temp;
 	int aRawLen;
 	int aSrlLen;
 	wBitStream s_srl;
@@ -1095,23 +1104,20 @@ int progressive_rfx_upgrade_component(PROGRESSIVE_CONTEXT* progressive, RFX_COMP
 		return -1;
 	}
 
-	temp = (INT16*) BufferPool_Take(progressive->bufferPool, -1); /* DWT buffer */
-
 	CopyMemory(buffer, current, 4096 * 2);
 
-	progressive_rfx_dwt_2d_decode_block(&buffer[3807], temp, 3);
-	progressive_rfx_dwt_2d_decode_block(&buffer[3007], temp, 2);
-	progressive_rfx_dwt_2d_decode_block(&buffer[0], temp, 1);
-
-	BufferPool_Return(progressive->bufferPool, temp);
+	progressive_rfx_dwt_2d_decode_block(progressive, &buffer[3807], temp, 3);
+	progressive_rfx_dwt_2d_decode_block(progressive, &buffer[3007], temp, 2);
+	progressive_rfx_dwt_2d_decode_block(progressive, &buffer[0], temp, 1);
 
 	return 1;
 }
 
-int progressive_decompress_tile_upgrade(PROGRESSIVE_CONTEXT* progressive, RFX_PROGRESSIVE_TILE* tile)
+int progressive_decompress_tile_upgrade(PROGRESSIVE_CONTEXT* progressive, RFX_PROGRESSIVE_TILE* tile,
+		BYTE* pBuffer, INT16* temp)
 {
 	int status;
-	BYTE* pBuffer;
+	BYTE* pTileBuffer;
 	INT16* pSign[3];
 	INT16* pSrcDst[3];
 	INT16* pCurrent[3];
@@ -1207,35 +1213,34 @@ int progressive_decompress_tile_upgrade(PROGRESSIVE_CONTEXT* progressive, RFX_PR
 	CopyMemory(&(tile->cbProgQuant), quantProgCb, sizeof(RFX_COMPONENT_CODEC_QUANT));
 	CopyMemory(&(tile->crProgQuant), quantProgCr, sizeof(RFX_COMPONENT_CODEC_QUANT));
 
-	pBuffer = tile->sign;
-	pSign[0] = (INT16*)((BYTE*)(&pBuffer[((8192 + 32) * 0) + 16])); /* Y/R buffer */
-	pSign[1] = (INT16*)((BYTE*)(&pBuffer[((8192 + 32) * 1) + 16])); /* Cb/G buffer */
-	pSign[2] = (INT16*)((BYTE*)(&pBuffer[((8192 + 32) * 2) + 16])); /* Cr/B buffer */
+	pTileBuffer = tile->sign;
+	pSign[0] = (INT16*)((BYTE*)(&pTileBuffer[((8192 + 32) * 0) + 16])); /* Y/R buffer */
+	pSign[1] = (INT16*)((BYTE*)(&pTileBuffer[((8192 + 32) * 1) + 16])); /* Cb/G buffer */
+	pSign[2] = (INT16*)((BYTE*)(&pTileBuffer[((8192 + 32) * 2) + 16])); /* Cr/B buffer */
 
-	pBuffer = tile->current;
-	pCurrent[0] = (INT16*)((BYTE*)(&pBuffer[((8192 + 32) * 0) + 16])); /* Y/R buffer */
-	pCurrent[1] = (INT16*)((BYTE*)(&pBuffer[((8192 + 32) * 1) + 16])); /* Cb/G buffer */
-	pCurrent[2] = (INT16*)((BYTE*)(&pBuffer[((8192 + 32) * 2) + 16])); /* Cr/B buffer */
+	pTileBuffer = tile->current;
+	pCurrent[0] = (INT16*)((BYTE*)(&pTileBuffer[((8192 + 32) * 0) + 16])); /* Y/R buffer */
+	pCurrent[1] = (INT16*)((BYTE*)(&pTileBuffer[((8192 + 32) * 1) + 16])); /* Cb/G buffer */
+	pCurrent[2] = (INT16*)((BYTE*)(&pTileBuffer[((8192 + 32) * 2) + 16])); /* Cr/B buffer */
 
-	pBuffer = (BYTE*) BufferPool_Take(progressive->bufferPool, -1);
 	pSrcDst[0] = (INT16*)((BYTE*)(&pBuffer[((8192 + 32) * 0) + 16])); /* Y/R buffer */
 	pSrcDst[1] = (INT16*)((BYTE*)(&pBuffer[((8192 + 32) * 1) + 16])); /* Cb/G buffer */
 	pSrcDst[2] = (INT16*)((BYTE*)(&pBuffer[((8192 + 32) * 2) + 16])); /* Cr/B buffer */
 
 	status = progressive_rfx_upgrade_component(progressive, &shiftY, quantProgY, &yNumBits,
-			pSrcDst[0], pCurrent[0], pSign[0], tile->ySrlData, tile->ySrlLen, tile->yRawData, tile->yRawLen); /* Y */
+			pSrcDst[0], pCurrent[0], pSign[0], temp, tile->ySrlData, tile->ySrlLen, tile->yRawData, tile->yRawLen); /* Y */
 
 	if (status < 0)
 		return -1;
 
 	status = progressive_rfx_upgrade_component(progressive, &shiftCb, quantProgCb, &cbNumBits,
-			pSrcDst[1], pCurrent[1], pSign[1], tile->cbSrlData, tile->cbSrlLen, tile->cbRawData, tile->cbRawLen); /* Cb */
+			pSrcDst[1], pCurrent[1], pSign[1], temp, tile->cbSrlData, tile->cbSrlLen, tile->cbRawData, tile->cbRawLen); /* Cb */
 
 	if (status < 0)
 		return -1;
 
 	status = progressive_rfx_upgrade_component(progressive, &shiftCr, quantProgCr, &crNumBits,
-			pSrcDst[2], pCurrent[2], pSign[2], tile->crSrlData, tile->crSrlLen, tile->crRawData, tile->crRawLen); /* Cr */
+			pSrcDst[2], pCurrent[2], pSign[2], temp, tile->crSrlData, tile->crSrlLen, tile->crRawData, tile->crRawLen); /* Cr */
 
 	if (status < 0)
 		return -1;
@@ -1245,19 +1250,169 @@ int progressive_decompress_tile_upgrade(PROGRESSIVE_CONTEXT* progressive, RFX_PR
 	else
 		prims->yCbCrToBGR_16s8u_P3AC4R((const INT16**) pSrcDst, 64 * 2, tile->data, 64 * 4, &roi_64x64);
 
-	BufferPool_Return(progressive->bufferPool, pBuffer);
-
 	return 1;
 }
 
+struct _PROGRESSIVE_TILE_WORK_PARAM
+{
+	PROGRESSIVE_CONTEXT* progressive;
+	PROGRESSIVE_SURFACE_CONTEXT* surface;
+	RFX_PROGRESSIVE_TILE** tiles;
+	UINT32 numTiles;
+	UINT32 worker;
+	UINT32 numWorkers;
+	int status;
+};
+typedef struct _PROGRESSIVE_TILE_WORK_PARAM PROGRESSIVE_TILE_WORK_PARAM;
+
+/**
+ * Decodes the tiles of the list falling on the given worker, tiles are
+ * dealt out by their index in the surface grid so a tile listed twice is
+ * always decoded by the same worker, in list order.
+ */
+
+static int progressive_decompress_tile_range(PROGRESSIVE_TILE_WORK_PARAM* param)
+{
+	int status = 1;
+	UINT32 index;
+	BYTE* pBuffer;
+	INT16* temp;
+	RFX_PROGRESSIVE_TILE* tile;
+	PROGRESSIVE_CONTEXT* progressive = param->progressive;
+
+	pBuffer = (BYTE*) BufferPool_Take(progressive->bufferPool, -1);
+	temp = (INT16*) BufferPool_Take(progressive->bufferPool, -1); /* DWT buffer */
+
+	if (!pBuffer || !temp)
+	{
+		status = -1;
+		goto out;
+	}
+
+	for (index = 0; index < param->numTiles; index++)
+	{
+		tile = param->tiles[index];
+
+		if (((UINT32) (tile - param->surface->tiles) % param->numWorkers) != param->worker)
+			continue;
+
+		switch (tile->blockType)
+		{
+			case PROGRESSIVE_WBT_TILE_SIMPLE:
+			case PROGRESSIVE_WBT_TILE_FIRST:
+				status = progressive_decompress_tile_first(progressive, tile, pBuffer, temp);
+				break;
+
+			case PROGRESSIVE_WBT_TILE_UPGRADE:
+				status = progressive_decompress_tile_upgrade(progressive, tile, pBuffer, temp);
+				break;
+		}
+
+		if (status < 0)
+			break;
+	}
+
+out:
+	if (pBuffer)
+		BufferPool_Return(progressive->bufferPool, pBuffer);
+
+	if (temp)
+		BufferPool_Return(progressive->bufferPool, temp);
+
+	param->status = status;
+	return status;
+}
+
+static void CALLBACK progressive_process_tiles_work_callback(PTP_CALLBACK_INSTANCE instance, void* context, PTP_WORK work)
+{
+	progressive_decompress_tile_range((PROGRESSIVE_TILE_WORK_PARAM*) context);
+}
+
+/**
+ * Tiles only write their own data buffer, the surface is updated from
+ * those buffers in tile order once all of them have been decoded.
+ */
+
+static int progressive_decompress_tiles(PROGRESSIVE_CONTEXT* progressive, PROGRESSIVE_SURFACE_CONTEXT* surface,
+		RFX_PROGRESSIVE_TILE** tiles, UINT32 numTiles)
+{
+	UINT32 index;
+	UINT32 numWorkers;
+	UINT32 closeCount = 0;
+	int status = 1;
+	PTP_WORK* workObjects = NULL;
+	PROGRESSIVE_TILE_WORK_PARAM* params = NULL;
+	PROGRESSIVE_TILE_WORK_PARAM param;
+
+	numWorkers = progressive->UseThreads ? progressive->ThreadCount : 1;
+
+	if (numWorkers > numTiles)
+		numWorkers = numTiles;
+
+	if (numWorkers < 2)
+	{
+		param.progressive = progressive;
+		param.surface = surface;
+		param.tiles = tiles;
+		param.numTiles = numTiles;
+		param.worker = 0;
+		param.numWorkers = 1;
+
+		return progressive_decompress_tile_range(&param);
+	}
+
+	workObjects = (PTP_WORK*) calloc(numWorkers, sizeof(PTP_WORK));
+	params = (PROGRESSIVE_TILE_WORK_PARAM*) calloc(numWorkers, sizeof(PROGRESSIVE_TILE_WORK_PARAM));
+
+	if (!workObjects || !params)
+	{
+		free(workObjects);
+		free(params);
+		return -1;
+	}
+
+	for (index = 0; index < numWorkers; index++)
+	{
+		params[index].progressive = progressive;
+		params[index].surface = surface;
+		params[index].tiles = tiles;
+		params[index].numTiles = numTiles;
+		params[index].worker = index;
+		params[index].numWorkers = numWorkers;
+
+		if (!(workObjects[index] = CreateThreadpoolWork((PTP_WORK_CALLBACK) progressive_process_tiles_work_callback,
+				(void*) &params[index], &progressive->ThreadPoolEnv)))
+		{
+			WLog_ERR(TAG, "CreateThreadpoolWork failed.");
+			status = -1;
+			break;
+		}
+
+		SubmitThreadpoolWork(workObjects[index]);
+		closeCount = index + 1;
+	}
+
+	for (index = 0; index < closeCount; index++)
+	{
+		WaitForThreadpoolWorkCallbacks(workObjects[index], FALSE);
+		CloseThreadpoolWork(workObjects[index]);
+
+		if (params[index].status < 0)
+			status = -1;
+	}
+
+	free(workObjects);
+	free(params);
+
+	return status;
+}
+
 int progressive_process_tiles(PROGRESSIVE_CONTEXT* progressive, BYTE* blocks, UINT32 blocksLen, PROGRESSIVE_SURFACE_CONTEXT* surface)
 {
-	int status = -1;
 	BYTE* block;
 	UINT16 xIdx;
 	UINT16 yIdx;
 	UINT16 zIdx;
-	UINT16 index;
 	UINT32 boffset;
 	UINT16 blockType;
 	UINT32 blockLen;
@@ -1511,25 +1666,11 @@ int progressive_process_tiles(PROGRESSIVE_CONTEXT* progressive, BYTE* blocks, UI
 		WLog_WARN(TAG, "numTiles inconsistency: actual: %d, expected: %d\n", count, region->numTiles);
 	}
 
-	for (index = 0; index < region->numTiles; index++)
-	{
-		tile = tiles[index];
-
-		switch (tile->blockType)
-		{
-			case PROGRESSIVE_WBT_TILE_SIMPLE:
-			case PROGRESSIVE_WBT_TILE_FIRST:
-				status = progressive_decompress_tile_first(progressive, tile);
-				break;
-
-			case PROGRESSIVE_WBT_TILE_UPGRADE:
-				status = progressive_decompress_tile_upgrade(progressive, tile);
-				break;
-		}
+	if (count > region->numTiles)
+		count = region->numTiles;
 
-		if (status < 0)
-			return -1;
-	}
+	if (progressive_decompress_tiles(progressive, surface, tiles, count) < 0)
+		return -1;
 
 	return (int) offset;
 }
@@ -1875,83 +2016,990 @@ int progressive_decompress(PROGRESSIVE_CONTEXT* progressive, BYTE* pSrcData, UIN
 	return 1;
 }
 
-int progressive_compress(PROGRESSIVE_CONTEXT* progressive, BYTE* pSrcData, UINT32 SrcSize, BYTE** ppDstData, UINT32* pDstSize)
+/**
+ * Progressive encoder
+ *
+ * The first pass of a tile is sent with a coarse progressive quantization,
+ * each following call on an unchanged tile sends a TILE_UPGRADE block which
+ * refines the coefficients (SRL/RAW) until the tile reaches full quality.
+ */
+
+static const RFX_COMPONENT_CODEC_QUANT progressive_default_quant =
 {
-	return 1;
-}
+	6, 6, 6, 6, 7, 7, 8, 8, 8, 9 /* LL3, HL3, LH3, HH3, HL2, LH2, HH2, HL1, LH1, HH1 */
+};
 
-BOOL progressive_context_reset(PROGRESSIVE_CONTEXT* progressive)
+static const RFX_PROGRESSIVE_CODEC_QUANT progressive_default_prog_quant[] =
 {
-	if (!progressive)
-		return FALSE;
+	{
+		25,
+		{ 2, 3, 3, 3, 4, 4, 4, 5, 5, 5 }, /* Y */
+		{ 3, 4, 4, 4, 5, 5, 5, 6, 6, 6 }, /* Cb */
+		{ 3, 4, 4, 4, 5, 5, 5, 6, 6, 6 } /* Cr */
+	},
+	{
+		60,
+		{ 1, 1, 1, 1, 2, 2, 2, 2, 2, 2 }, /* Y */
+		{ 1, 2, 2, 2, 2, 2, 2, 3, 3, 3 }, /* Cb */
+		{ 1, 2, 2, 2, 2, 2, 2, 3, 3, 3 } /* Cr */
+	}
+};
 
-	return TRUE;
+#define PROGRESSIVE_PROG_QUANT_COUNT	2
+
+static void progressive_component_codec_quant_write(BYTE* block, const RFX_COMPONENT_CODEC_QUANT* quantVal)
+{
+	block[0] = (quantVal->LL3 & 0x0F) | (quantVal->HL3 << 4);
+	block[1] = (quantVal->LH3 & 0x0F) | (quantVal->HH3 << 4);
+	block[2] = (quantVal->HL2 & 0x0F) | (quantVal->LH2 << 4);
+	block[3] = (quantVal->HH2 & 0x0F) | (quantVal->HL1 << 4);
+	block[4] = (quantVal->LH1 & 0x0F) | (quantVal->HH1 << 4);
 }
 
-PROGRESSIVE_CONTEXT* progressive_context_new(BOOL Compressor)
+/**
+ * Forward reduce-extrapolate DWT, the exact counterpart of progressive_rfx_idwt_x/y:
+ * the low band has either nHighCount + 1 or nHighCount + 2 coefficients.
+ */
+
+static void progressive_rfx_dwt_1d(const INT16* pSrc, int nSrcStep, INT16* pLow, int nLowStep,
+		INT16* pHigh, int nHighStep, int nLowCount, int nHighCount)
 {
-	PROGRESSIVE_CONTEXT* progressive;
+	int i;
+	int X0, X1, X2;
+	int H0, H1;
 
-	progressive = (PROGRESSIVE_CONTEXT*) calloc(1, sizeof(PROGRESSIVE_CONTEXT));
+	for (i = 0; i < nHighCount; i++)
+	{
+		X0 = pSrc[(2 * i) * nSrcStep];
+		X1 = pSrc[(2 * i + 1) * nSrcStep];
+		X2 = pSrc[(2 * i + 2) * nSrcStep];
 
-	if (progressive)
+		pHigh[i * nHighStep] = (INT16) ((X1 - ((X0 + X2) / 2)) / 2);
+	}
+
+	H0 = pHigh[0];
+
+	for (i = 0; i < nHighCount; i++)
 	{
-		progressive->Compressor = Compressor;
+		H1 = pHigh[i * nHighStep];
+		X0 = pSrc[(2 * i) * nSrcStep];
 
-		progressive->bufferPool = BufferPool_New(TRUE, (8192 + 32) * 3, 16);
+		pLow[i * nLowStep] = (INT16) (X0 + ((H0 + H1) / 2));
 
-		progressive->cRects = 64;
-		progressive->rects = (RFX_RECT*) malloc(progressive->cRects * sizeof(RFX_RECT));
+		H0 = H1;
+	}
 
-		if (!progressive->rects)
-			goto cleanup;
+	X0 = pSrc[(2 * i) * nSrcStep];
 
-		progressive->cTiles = 64;
-		progressive->tiles = (RFX_PROGRESSIVE_TILE**) malloc(progressive->cTiles * sizeof(RFX_PROGRESSIVE_TILE*));
+	if (nLowCount == (nHighCount + 1))
+	{
+		pLow[i * nLowStep] = (INT16) (X0 + H0);
+	}
+	else
+	{
+		X1 = pSrc[(2 * i + 1) * nSrcStep];
 
-		if (!progressive->tiles)
-			goto cleanup;
+		pLow[i * nLowStep] = (INT16) (X0 + (H0 / 2));
+		pLow[(i + 1) * nLowStep] = (INT16) ((2 * X1) - X0);
+	}
+}
 
-		progressive->cQuant = 8;
-		progressive->quantVals = (RFX_COMPONENT_CODEC_QUANT*) malloc(progressive->cQuant * sizeof(RFX_COMPONENT_CODEC_QUANT));
+static void progressive_rfx_dwt_2d_encode_block(INT16* buffer, INT16* temp, int level)
+{
+	int i;
+	int nBandL;
+	int nBandH;
+	int nSize;
+	INT16 *HL, *LH;
+	INT16 *HH, *LL;
+	INT16 *L, *H;
 
-		if (!progressive->quantVals)
-			goto cleanup;
+	nBandL = progressive_rfx_get_band_l_count(level);
+	nBandH = progressive_rfx_get_band_h_count(level);
+	nSize = nBandL + nBandH;
 
-		progressive->cProgQuant = 8;
-		progressive->quantProgVals = (RFX_PROGRESSIVE_CODEC_QUANT*) malloc(progressive->cProgQuant * sizeof(RFX_PROGRESSIVE_CODEC_QUANT));
+	HL = &buffer[0];
+	LH = &HL[nBandL * nBandH];
+	HH = &LH[nBandH * nBandL];
+	LL = &HH[nBandH * nBandH];
 
-		if (!progressive->quantProgVals)
-			goto cleanup;
+	L = &temp[0];
+	H = &temp[nBandL * nSize];
 
-		ZeroMemory(&(progressive->quantProgValFull), sizeof(RFX_PROGRESSIVE_CODEC_QUANT));
-		progressive->quantProgValFull.quality = 100;
+	/* vertical (LLx -> L + H) */
 
-		progressive->SurfaceContexts = HashTable_New(TRUE);
+	for (i = 0; i < nSize; i++)
+		progressive_rfx_dwt_1d(&buffer[i], nSize, &L[i], nSize, &H[i], nSize, nBandL, nBandH);
 
-		progressive_context_reset(progressive);
-	}
+	/* horizontal (L -> LL + HL, H -> LH + HH) */
 
-	return progressive;
+	for (i = 0; i < nBandL; i++)
+		progressive_rfx_dwt_1d(&L[i * nSize], 1, &LL[i * nBandL], 1, &HL[i * nBandH], 1, nBandL, nBandH);
 
-cleanup:
-	free(progressive->rects);
-	free(progressive->tiles);
-	free(progressive->quantVals);
-	free(progressive->quantProgVals);
-	free(progressive);
-	return NULL;
+	for (i = 0; i < nBandH; i++)
+		progressive_rfx_dwt_1d(&H[i * nSize], 1, &LH[i * nBandL], 1, &HH[i * nBandH], 1, nBandL, nBandH);
 }
 
-void progressive_context_free(PROGRESSIVE_CONTEXT* progressive)
+static void progressive_rfx_dwt_2d_encode(INT16* buffer, INT16* temp)
+{
+	progressive_rfx_dwt_2d_encode_block(&buffer[0], temp, 1);
+	progressive_rfx_dwt_2d_encode_block(&buffer[3007], temp, 2);
+	progressive_rfx_dwt_2d_encode_block(&buffer[3807], temp, 3);
+}
+
+/**
+ * Quantization has to truncate the magnitude of the non-LL coefficients (and floor LL3)
+ * so that the bits sent by later upgrade passes line up with what the decoder already has.
+ */
+
+static void progressive_rfx_encode_block(const INT16* src, INT16* dst, int length, UINT32 shift, BOOL nonLL)
 {
-	int count;
 	int index;
-	ULONG_PTR* pKeys = NULL;
-	PROGRESSIVE_SURFACE_CONTEXT* surface;
 
-	if (!progressive)
+	if (!nonLL)
+	{
+		for (index = 0; index < length; index++)
+			dst[index] = src[index] >> shift;
+
 		return;
+	}
+
+	for (index = 0; index < length; index++)
+	{
+		if (src[index] < 0)
+			dst[index] = -((-src[index]) >> shift);
+		else
+			dst[index] = src[index] >> shift;
+	}
+}
+
+static int progressive_rfx_encode_component(PROGRESSIVE_CONTEXT* progressive, RFX_COMPONENT_CODEC_QUANT* shift,
+		const INT16* coeffs, INT16* buffer, BYTE* pDstData, int DstSize)
+{
+	int length;
+
+	progressive_rfx_encode_block(&coeffs[0], &buffer[0], 1023, shift->HL1, TRUE); /* HL1 */
+	progressive_rfx_encode_block(&coeffs[1023], &buffer[1023], 1023, shift->LH1, TRUE); /* LH1 */
+	progressive_rfx_encode_block(&coeffs[2046], &buffer[2046], 961, shift->HH1, TRUE); /* HH1 */
+	progressive_rfx_encode_block(&coeffs[3007], &buffer[3007], 272, shift->HL2, TRUE); /* HL2 */
+	progressive_rfx_encode_block(&coeffs[3279], &buffer[3279], 272, shift->LH2, TRUE); /* LH2 */
+	progressive_rfx_encode_block(&coeffs[3551], &buffer[3551], 256, shift->HH2, TRUE); /* HH2 */
+	progressive_rfx_encode_block(&coeffs[3807], &buffer[3807], 72, shift->HL3, TRUE); /* HL3 */
+	progressive_rfx_encode_block(&coeffs[3879], &buffer[3879], 72, shift->LH3, TRUE); /* LH3 */
+	progressive_rfx_encode_block(&coeffs[3951], &buffer[3951], 64, shift->HH3, TRUE); /* HH3 */
+	progressive_rfx_encode_block(&coeffs[4015], &buffer[4015], 81, shift->LL3, FALSE); /* LL3 */
+
+	rfx_differential_encode(&buffer[4015], 81); /* LL3 */
+
+	ZeroMemory(pDstData, DstSize);
+
+	length = rfx_rlgr_encode(RLGR1, buffer, 4096, pDstData, DstSize);
+
+	if ((length < 0) || (length >= DstSize) || (length > 0xFFFF))
+		return -1;
+
+	return length;
+}
+
+struct _RFX_PROGRESSIVE_UPGRADE_ENCODE_STATE
+{
+	BOOL nonLL;
+	RFX_BITSTREAM* srl;
+	RFX_BITSTREAM* raw;
+
+	/* SRL state */
+
+	int kp;
+	int nz;
+};
+typedef struct _RFX_PROGRESSIVE_UPGRADE_ENCODE_STATE RFX_PROGRESSIVE_UPGRADE_ENCODE_STATE;
+
+/**
+ * Mirror of progressive_rfx_srl_read(): zero runs of (1 << k) are sent as a '0' bit,
+ * shorter runs as a '1' bit, the run length on k bits and the nonzero value
+ * (sign bit and unary magnitude) which terminates them.
+ */
+
+static void progressive_rfx_srl_write(RFX_PROGRESSIVE_UPGRADE_ENCODE_STATE* state, int value, UINT32 numBits)
+{
+	int k;
+	UINT32 index;
+	UINT32 mag;
+	UINT32 max;
+	RFX_BITSTREAM* bs = state->srl;
+
+	k = state->kp / 8;
+
+	if (!value)
+	{
+		state->nz++;
+
+		if (state->nz == (1 << k))
+		{
+			rfx_bitstream_put_bits(bs, 0, 1);
+
+			state->nz = 0;
+			state->kp += 4;
+
+			if (state->kp > 80)
+				state->kp = 80;
+		}
+
+		return;
+	}
+
+	rfx_bitstream_put_bits(bs, 1, 1);
+
+	if (k)
+		rfx_bitstream_put_bits(bs, state->nz, k);
+
+	state->nz = 0;
+
+	rfx_bitstream_put_bits(bs, (value < 0) ? 1 : 0, 1);
+
+	state->kp -= 6;
+
+	if (state->kp < 0)
+		state->kp = 0;
+
+	if (numBits == 1)
+		return;
+
+	mag = (value < 0) ? -value : value;
+	max = (1 << numBits) - 1;
+
+	/* unary magnitude: (mag - 1) zero bits, terminated by a '1' bit unless mag == max */
+
+	for (index = 1; index < mag; index++)
+		rfx_bitstream_put_bits(bs, 0, 1);
+
+	if (mag < max)
+		rfx_bitstream_put_bits(bs, 1, 1);
+}
+
+static void progressive_rfx_upgrade_encode_block(RFX_PROGRESSIVE_UPGRADE_ENCODE_STATE* state,
+		const INT16* coeffs, int length, UINT32 shift, UINT32 numBits)
+{
+	int index;
+	int value;
+	UINT32 mask;
+	UINT32 prevShift;
+
+	if (!numBits)
+		return;
+
+	mask = (1 << numBits) - 1;
+	prevShift = shift + numBits;
+
+	if (!state->nonLL)
+	{
+		for (index = 0; index < length; index++)
+		{
+			value = coeffs[index] >> shift;
+			rfx_bitstream_put_bits(state->raw, value & mask, numBits);
+		}
+
+		return;
+	}
+
+	for (index = 0; index < length; index++)
+	{
+		value = coeffs[index];
+
+		if (value < 0)
+			value = -value;
+
+		if (value >> prevShift)
+		{
+			/* already significant, send the next bits of the magnitude as RAW */
+			rfx_bitstream_put_bits(state->raw, (value >> shift) & mask, numBits);
+		}
+		else
+		{
+			value >>= shift;
+			progressive_rfx_srl_write(state, (coeffs[index] < 0) ? -value : value, numBits);
+		}
+	}
+}
+
+static int progressive_rfx_upgrade_encode_component(PROGRESSIVE_CONTEXT* progressive, RFX_COMPONENT_CODEC_QUANT* shift,
+		RFX_COMPONENT_CODEC_QUANT* numBits, const INT16* coeffs, BYTE* srlData, int srlSize, int* srlLen,
+		BYTE* rawData, int rawSize, int* rawLen)
+{
+	RFX_BITSTREAM s_srl;
+	RFX_BITSTREAM s_raw;
+	RFX_PROGRESSIVE_UPGRADE_ENCODE_STATE state;
+
+	ZeroMemory(&state, sizeof(RFX_PROGRESSIVE_UPGRADE_ENCODE_STATE));
+
+	ZeroMemory(srlData, srlSize);
+	ZeroMemory(rawData, rawSize);
+
+	state.kp = 8;
+	state.srl = &s_srl;
+	state.raw = &s_raw;
+
+	rfx_bitstream_attach(state.srl, srlData, srlSize);
+	rfx_bitstream_attach(state.raw, rawData, rawSize);
+
+	state.nonLL = TRUE;
+	progressive_rfx_upgrade_encode_block(&state, &coeffs[0], 1023, shift->HL1, numBits->HL1); /* HL1 */
+	progressive_rfx_upgrade_encode_block(&state, &coeffs[1023], 1023, shift->LH1, numBits->LH1); /* LH1 */
+	progressive_rfx_upgrade_encode_block(&state, &coeffs[2046], 961, shift->HH1, numBits->HH1); /* HH1 */
+	progressive_rfx_upgrade_encode_block(&state, &coeffs[3007], 272, shift->HL2, numBits->HL2); /* HL2 */
+	progressive_rfx_upgrade_encode_block(&state, &coeffs[3279], 272, shift->LH2, numBits->LH2); /* LH2 */
+	progressive_rfx_upgrade_encode_block(&state, &coeffs[3551], 256, shift->HH2, numBits->HH2); /* HH2 */
+	progressive_rfx_upgrade_encode_block(&state, &coeffs[3807], 72, shift->HL3, numBits->HL3); /* HL3 */
+	progressive_rfx_upgrade_encode_block(&state, &coeffs[3879], 72, shift->LH3, numBits->LH3); /* LH3 */
+	progressive_rfx_upgrade_encode_block(&state, &coeffs[3951], 64, shift->HH3, numBits->HH3); /* HH3 */
+
+	state.nonLL = FALSE;
+	progressive_rfx_upgrade_encode_block(&state, &coeffs[4015], 81, shift->LL3, numBits->LL3); /* LL3 */
+
+	/* a pending zero run is closed with a '0' bit, the decoder stops before consuming it entirely */
+
+	if (state.nz)
+		rfx_bitstream_put_bits(state.srl, 0, 1);
+
+	if (rfx_bitstream_eos(state.srl) || rfx_bitstream_eos(state.raw))
+		return -1;
+
+	*srlLen = rfx_bitstream_get_processed_bytes(state.srl);
+	*rawLen = rfx_bitstream_get_processed_bytes(state.raw);
+
+	return 1;
+}
+
+static void progressive_tile_read_pixels(BYTE* pSrcData, BOOL invert, int nSrcStep, int nXSrc, int nYSrc,
+		int nWidth, int nHeight, UINT32* pDstData)
+{
+	int x, y;
+	UINT32 pixel;
+	UINT32* pSrcPixel;
+	UINT32* pDstPixel;
+
+	/* the area outside of the surface repeats the last column/row to keep the high bands quiet */
+
+	for (y = 0; y < 64; y++)
+	{
+		pSrcPixel = (UINT32*) &pSrcData[((nYSrc + ((y < nHeight) ? y : (nHeight - 1))) * nSrcStep) + (nXSrc * 4)];
+		pDstPixel = &pDstData[y * 64];
+
+		for (x = 0; x < 64; x++)
+		{
+			pixel = pSrcPixel[(x < nWidth) ? x : (nWidth - 1)];
+
+			if (invert)
+				pixel = (pixel & 0xFF00) | ((pixel >> 16) & 0xFF) | ((pixel & 0xFF) << 16);
+
+			pDstPixel[x] = pixel & 0x00FFFFFF;
+		}
+	}
+}
+
+static int progressive_compress_tile_first(PROGRESSIVE_CONTEXT* progressive, RFX_PROGRESSIVE_TILE* tile, wStream* s)
+{
+	int x, y;
+	int index;
+	int status;
+	int lengths[3];
+	UINT32 pixel;
+	UINT32* pSrcPixel;
+	BYTE* pBuffer;
+	BYTE* pData;
+	INT16* temp;
+	INT16* pSrcDst[3];
+	INT16* pCurrent[3];
+	BYTE* pDstData[3];
+	RFX_COMPONENT_CODEC_QUANT shift[3];
+	const RFX_PROGRESSIVE_CODEC_QUANT* quantProgVal;
+	static const prim_size_t roi_64x64 = { 64, 64 };
+	const primitives_t* prims = primitives_get();
+
+	quantProgVal = &progressive_default_prog_quant[0];
+
+	tile->blockType = PROGRESSIVE_WBT_TILE_FIRST;
+	tile->quantIdxY = tile->quantIdxCb = tile->quantIdxCr = 0;
+	tile->flags = 0;
+	tile->quality = 0;
+	tile->pass = 1;
+
+	CopyMemory(&(tile->yQuant), &progressive_default_quant, sizeof(RFX_COMPONENT_CODEC_QUANT));
+	CopyMemory(&(tile->cbQuant), &progressive_default_quant, sizeof(RFX_COMPONENT_CODEC_QUANT));
+	CopyMemory(&(tile->crQuant), &progressive_default_quant, sizeof(RFX_COMPONENT_CODEC_QUANT));
+
+	CopyMemory(&(tile->yProgQuant), &(quantProgVal->yQuantValues), sizeof(RFX_COMPONENT_CODEC_QUANT));
+	CopyMemory(&(tile->cbProgQuant), &(quantProgVal->cbQuantValues), sizeof(RFX_COMPONENT_CODEC_QUANT));
+	CopyMemory(&(tile->crProgQuant), &(quantProgVal->crQuantValues), sizeof(RFX_COMPONENT_CODEC_QUANT));
+
+	progressive_rfx_quant_add(&(tile->yQuant), &(tile->yProgQuant), &(tile->yBitPos));
+	progressive_rfx_quant_add(&(tile->cbQuant), &(tile->cbProgQuant), &(tile->cbBitPos));
+	progressive_rfx_quant_add(&(tile->crQuant), &(tile->crProgQuant), &(tile->crBitPos));
+
+	CopyMemory(&shift[0], &(tile->yBitPos), sizeof(RFX_COMPONENT_CODEC_QUANT));
+	progressive_rfx_quant_lsub(&shift[0], 1); /* -6 + 5 = -1 */
+	CopyMemory(&shift[1], &(tile->cbBitPos), sizeof(RFX_COMPONENT_CODEC_QUANT));
+	progressive_rfx_quant_lsub(&shift[1], 1); /* -6 + 5 = -1 */
+	CopyMemory(&shift[2], &(tile->crBitPos), sizeof(RFX_COMPONENT_CODEC_QUANT));
+	progressive_rfx_quant_lsub(&shift[2], 1); /* -6 + 5 = -1 */
+
+	pBuffer = tile->current;
+	pCurrent[0] = (INT16*)((BYTE*)(&pBuffer[((8192 + 32) * 0) + 16])); /* Y/R buffer */
+	pCurrent[1] = (INT16*)((BYTE*)(&pBuffer[((8192 + 32) * 1) + 16])); /* Cb/G buffer */
+	pCurrent[2] = (INT16*)((BYTE*)(&pBuffer[((8192 + 32) * 2) + 16])); /* Cr/B buffer */
+
+	pSrcPixel = (UINT32*) tile->data;
+
+	for (y = 0; y < 64; y++)
+	{
+		for (x = 0; x < 64; x++)
+		{
+			pixel = *pSrcPixel++;
+			index = (y * 64) + x;
+
+			pCurrent[0][index] = (INT16) ((pixel >> 16) & 0xFF);
+			pCurrent[1][index] = (INT16) ((pixel >> 8) & 0xFF);
+			pCurrent[2][index] = (INT16) (pixel & 0xFF);
+		}
+	}
+
+	prims->RGBToYCbCr_16s16s_P3P3((const INT16**) pCurrent, 64 * sizeof(INT16),
+			pCurrent, 64 * sizeof(INT16), &roi_64x64);
+
+	temp = (INT16*) BufferPool_Take(progressive->bufferPool, -1); /* DWT buffer */
+	pBuffer = (BYTE*) BufferPool_Take(progressive->bufferPool, -1);
+	pData = (BYTE*) BufferPool_Take(progressive->bufferPool, -1);
+
+	if (!temp || !pBuffer || !pData)
+	{
+		if (temp)
+			BufferPool_Return(progressive->bufferPool, temp);
+
+		if (pBuffer)
+			BufferPool_Return(progressive->bufferPool, pBuffer);
+
+		if (pData)
+			BufferPool_Return(progressive->bufferPool, pData);
+
+		return -1;
+	}
+
+	pSrcDst[0] = (INT16*)((BYTE*)(&pBuffer[((8192 + 32) * 0) + 16])); /* Y/R buffer */
+	pSrcDst[1] = (INT16*)((BYTE*)(&pBuffer[((8192 + 32) * 1) + 16])); /* Cb/G buffer */
+	pSrcDst[2] = (INT16*)((BYTE*)(&pBuffer[((8192 + 32) * 2) + 16])); /* Cr/B buffer */
+
+	pDstData[0] = &pData[(8192 + 32) * 0];
+	pDstData[1] = &pData[(8192 + 32) * 1];
+	pDstData[2] = &pData[(8192 + 32) * 2];
+
+	status = 1;
+
+	for (index = 0; index < 3; index++)
+	{
+		progressive_rfx_dwt_2d_encode(pCurrent[index], temp);
+
+		lengths[index] = progressive_rfx_encode_component(progressive, &shift[index],
+				pCurrent[index], pSrcDst[index], pDstData[index], 8192 + 32);
+
+		if (lengths[index] < 0)
+			status = -1;
+	}
+
+	if ((status > 0) && !Stream_EnsureRemainingCapacity(s, 23 + lengths[0] + lengths[1] + lengths[2]))
+		status = -1;
+
+	if (status > 0)
+	{
+		tile->yLen = (UINT16) lengths[0];
+		tile->cbLen = (UINT16) lengths[1];
+		tile->crLen = (UINT16) lengths[2];
+		tile->tailLen = 0;
+		tile->blockLen = 23 + tile->yLen + tile->cbLen + tile->crLen;
+
+		Stream_Write_UINT16(s, tile->blockType); /* blockType (2 bytes) */
+		Stream_Write_UINT32(s, tile->blockLen); /* blockLen (4 bytes) */
+		Stream_Write_UINT8(s, tile->quantIdxY); /* quantIdxY (1 byte) */
+		Stream_Write_UINT8(s, tile->quantIdxCb); /* quantIdxCb (1 byte) */
+		Stream_Write_UINT8(s, tile->quantIdxCr); /* quantIdxCr (1 byte) */
+		Stream_Write_UINT16(s, tile->xIdx); /* xIdx (2 bytes) */
+		Stream_Write_UINT16(s, tile->yIdx); /* yIdx (2 bytes) */
+		Stream_Write_UINT8(s, tile->flags); /* flags (1 byte) */
+		Stream_Write_UINT8(s, tile->quality); /* quality (1 byte) */
+		Stream_Write_UINT16(s, tile->yLen); /* yLen (2 bytes) */
+		Stream_Write_UINT16(s, tile->cbLen); /* cbLen (2 bytes) */
+		Stream_Write_UINT16(s, tile->crLen); /* crLen (2 bytes) */
+		Stream_Write_UINT16(s, tile->tailLen); /* tailLen (2 bytes) */
+		Stream_Write(s, pDstData[0], tile->yLen); /* yData */
+		Stream_Write(s, pDstData[1], tile->cbLen); /* cbData */
+		Stream_Write(s, pDstData[2], tile->crLen); /* crData */
+	}
+
+	BufferPool_Return(progressive->bufferPool, temp);
+	BufferPool_Return(progressive->bufferPool, pBuffer);
+	BufferPool_Return(progressive->bufferPool, pData);
+
+	return status;
+}
+
+static int progressive_compress_tile_upgrade(PROGRESSIVE_CONTEXT* progressive, RFX_PROGRESSIVE_TILE* tile, wStream* s)
+{
+	int index;
+	int status;
+	int srlLen[3];
+	int rawLen[3];
+	BYTE* pBuffer;
+	BYTE* pSrlData;
+	BYTE* pRawData;
+	INT16* pCurrent[3];
+	RFX_COMPONENT_CODEC_QUANT* quant[3];
+	RFX_COMPONENT_CODEC_QUANT* bitPos[3];
+	RFX_COMPONENT_CODEC_QUANT* progQuant[3];
+	RFX_COMPONENT_CODEC_QUANT newBitPos[3];
+	RFX_COMPONENT_CODEC_QUANT numBits[3];
+	RFX_COMPONENT_CODEC_QUANT shift[3];
+	const RFX_PROGRESSIVE_CODEC_QUANT* quantProgVal;
+
+	if (tile->pass < PROGRESSIVE_PROG_QUANT_COUNT)
+	{
+		tile->quality = tile->pass;
+		quantProgVal = &progressive_default_prog_quant[tile->quality];
+	}
+	else
+	{
+		tile->quality = 0xFF;
+		quantProgVal = &(progressive->quantProgValFull);
+	}
+
+	tile->blockType = PROGRESSIVE_WBT_TILE_UPGRADE;
+	tile->pass++;
+
+	CopyMemory(&(tile->yProgQuant), &(quantProgVal->yQuantValues), sizeof(RFX_COMPONENT_CODEC_QUANT));
+	CopyMemory(&(tile->cbProgQuant), &(quantProgVal->cbQuantValues), sizeof(RFX_COMPONENT_CODEC_QUANT));
+	CopyMemory(&(tile->crProgQuant), &(quantProgVal->crQuantValues), sizeof(RFX_COMPONENT_CODEC_QUANT));
+
+	quant[0] = &(tile->yQuant);
+	quant[1] = &(tile->cbQuant);
+	quant[2] = &(tile->crQuant);
+
+	bitPos[0] = &(tile->yBitPos);
+	bitPos[1] = &(tile->cbBitPos);
+	bitPos[2] = &(tile->crBitPos);
+
+	progQuant[0] = &(tile->yProgQuant);
+	progQuant[1] = &(tile->cbProgQuant);
+	progQuant[2] = &(tile->crProgQuant);
+
+	pBuffer = tile->current;
+	pCurrent[0] = (INT16*)((BYTE*)(&pBuffer[((8192 + 32) * 0) + 16])); /* Y/R buffer */
+	pCurrent[1] = (INT16*)((BYTE*)(&pBuffer[((8192 + 32) * 1) + 16])); /* Cb/G buffer */
+	pCurrent[2] = (INT16*)((BYTE*)(&pBuffer[((8192 + 32) * 2) + 16])); /* Cr/B buffer */
+
+	pSrlData = (BYTE*) BufferPool_Take(progressive->bufferPool, -1);
+	pRawData = (BYTE*) BufferPool_Take(progressive->bufferPool, -1);
+
+	if (!pSrlData || !pRawData)
+	{
+		if (pSrlData)
+			BufferPool_Return(progressive->bufferPool, pSrlData);
+
+		if (pRawData)
+			BufferPool_Return(progressive->bufferPool, pRawData);
+
+		return -1;
+	}
+
+	status = 1;
+
+	for (index = 0; index < 3; index++)
+	{
+		progressive_rfx_quant_add(quant[index], progQuant[index], &newBitPos[index]);
+		progressive_rfx_quant_sub(bitPos[index], &newBitPos[index], &numBits[index]);
+
+		CopyMemory(&shift[index], &newBitPos[index], sizeof(RFX_COMPONENT_CODEC_QUANT));
+		progressive_rfx_quant_lsub(&shift[index], 1); /* -6 + 5 = -1 */
+
+		CopyMemory(bitPos[index], &newBitPos[index], sizeof(RFX_COMPONENT_CODEC_QUANT));
+
+		if (progressive_rfx_upgrade_encode_component(progressive, &shift[index], &numBits[index], pCurrent[index],
+				&pSrlData[(8192 + 32) * index], 8192 + 32, &srlLen[index],
+				&pRawData[(8192 + 32) * index], 8192 + 32, &rawLen[index]) < 0)
+		{
+			status = -1;
+		}
+	}
+
+	if ((status > 0) && !Stream_EnsureRemainingCapacity(s, 26 + srlLen[0] + rawLen[0] +
+			srlLen[1] + rawLen[1] + srlLen[2] + rawLen[2]))
+		status = -1;
+
+	if (status > 0)
+	{
+		tile->ySrlLen = (UINT16) srlLen[0];
+		tile->yRawLen = (UINT16) rawLen[0];
+		tile->cbSrlLen = (UINT16) srlLen[1];
+		tile->cbRawLen = (UINT16) rawLen[1];
+		tile->crSrlLen = (UINT16) srlLen[2];
+		tile->crRawLen = (UINT16) rawLen[2];
+		tile->blockLen = 26 + tile->ySrlLen + tile->yRawLen + tile->cbSrlLen +
+				tile->cbRawLen + tile->crSrlLen + tile->crRawLen;
+
+		Stream_Write_UINT16(s, tile->blockType); /* blockType (2 bytes) */
+		Stream_Write_UINT32(s, tile->blockLen); /* blockLen (4 bytes) */
+		Stream_Write_UINT8(s, tile->quantIdxY); /* quantIdxY (1 byte) */
+		Stream_Write_UINT8(s, tile->quantIdxCb); /* quantIdxCb (1 byte) */
+		Stream_Write_UINT8(s, tile->quantIdxCr); /* quantIdxCr (1 byte) */
+		Stream_Write_UINT16(s, tile->xIdx); /* xIdx (2 bytes) */
+		Stream_Write_UINT16(s, tile->yIdx); /* yIdx (2 bytes) */
+		Stream_Write_UINT8(s, tile->quality); /* quality (1 byte) */
+		Stream_Write_UINT16(s, tile->ySrlLen); /* ySrlLen (2 bytes) */
+		Stream_Write_UINT16(s, tile->yRawLen); /* yRawLen (2 bytes) */
+		Stream_Write_UINT16(s, tile->cbSrlLen); /* cbSrlLen (2 bytes) */
+		Stream_Write_UINT16(s, tile->cbRawLen); /* cbRawLen (2 bytes) */
+		Stream_Write_UINT16(s, tile->crSrlLen); /* crSrlLen (2 bytes) */
+		Stream_Write_UINT16(s, tile->crRawLen); /* crRawLen (2 bytes) */
+		Stream_Write(s, &pSrlData[(8192 + 32) * 0], tile->ySrlLen); /* ySrlData */
+		Stream_Write(s, &pRawData[(8192 + 32) * 0], tile->yRawLen); /* yRawData */
+		Stream_Write(s, &pSrlData[(8192 + 32) * 1], tile->cbSrlLen); /* cbSrlData */
+		Stream_Write(s, &pRawData[(8192 + 32) * 1], tile->cbRawLen); /* cbRawData */
+		Stream_Write(s, &pSrlData[(8192 + 32) * 2], tile->crSrlLen); /* crSrlData */
+		Stream_Write(s, &pRawData[(8192 + 32) * 2], tile->crRawLen); /* crRawData */
+	}
+
+	BufferPool_Return(progressive->bufferPool, pSrlData);
+	BufferPool_Return(progressive->bufferPool, pRawData);
+
+	return status;
+}
+
+/**
+ * Encodes the surface content found at pSrcData (nWidth x nHeight pixels, clipped to the surface).
+ * Tiles that changed since the previous call are sent as a coarse first pass, tiles that did not
+ * change are upgraded one quality level per call until they reach full quality.
+ *
+ * Returns 1 when *ppDstData holds a message, 0 when there is nothing left to send and -1 on error.
+ */
+
+int progressive_compress(PROGRESSIVE_CONTEXT* progressive, BYTE* pSrcData, DWORD SrcFormat, int nSrcStep,
+		int nWidth, int nHeight, UINT16 surfaceId, BYTE** ppDstData, UINT32* pDstSize)
+{
+	int status;
+	BOOL invert;
+	UINT32 index;
+	UINT32 xIdx, yIdx;
+	UINT32 gridWidth;
+	UINT32 gridHeight;
+	UINT32 numTiles = 0;
+	UINT32 numRects = 0;
+	UINT32 tileDataSize;
+	UINT32 regionLen;
+	UINT32* pixels;
+	wStream* s;
+	wStream* sTiles;
+	wStream* sRects;
+	RFX_PROGRESSIVE_TILE* tile;
+	PROGRESSIVE_SURFACE_CONTEXT* surface;
+
+	if (!progressive || !progressive->Compressor || !pSrcData || !ppDstData || !pDstSize)
+		return -1;
+
+	*ppDstData = NULL;
+	*pDstSize = 0;
+
+	if (FREERDP_PIXEL_FORMAT_BPP(SrcFormat) != 32)
+		return -1;
+
+	surface = (PROGRESSIVE_SURFACE_CONTEXT*) progressive_get_surface_data(progressive, surfaceId);
+
+	if (!surface)
+		return -1;
+
+	if (nWidth > (int) surface->width)
+		nWidth = surface->width;
+
+	if (nHeight > (int) surface->height)
+		nHeight = surface->height;
+
+	if ((nWidth < 1) || (nHeight < 1))
+		return -1;
+
+	invert = FREERDP_PIXEL_FORMAT_IS_ABGR(SrcFormat) ? TRUE : FALSE;
+
+	gridWidth = (nWidth + 63) / 64;
+	gridHeight = (nHeight + 63) / 64;
+
+	pixels = (UINT32*) BufferPool_Take(progressive->bufferPool, -1);
+	sTiles = Stream_New(NULL, 4096);
+	sRects = Stream_New(NULL, 256);
+
+	if (!pixels || !sTiles || !sRects)
+	{
+		status = -1;
+		goto out;
+	}
+
+	status = 1;
+
+	for (yIdx = 0; yIdx < gridHeight; yIdx++)
+	{
+		for (xIdx = 0; xIdx < gridWidth; xIdx++)
+		{
+			tile = &(surface->tiles[(yIdx * surface->gridWidth) + xIdx]);
+
+			tile->xIdx = xIdx;
+			tile->yIdx = yIdx;
+			tile->x = xIdx * 64;
+			tile->y = yIdx * 64;
+			tile->width = ((nWidth - tile->x) < 64) ? (nWidth - tile->x) : 64;
+			tile->height = ((nHeight - tile->y) < 64) ? (nHeight - tile->y) : 64;
+
+			progressive_tile_read_pixels(pSrcData, invert, nSrcStep, tile->x, tile->y,
+					tile->width, tile->height, pixels);
+
+			if (!tile->data)
+				tile->data = (BYTE*) _aligned_malloc(64 * 64 * 4, 16);
+
+			if (!tile->current)
+				tile->current = (BYTE*) _aligned_malloc((8192 + 32) * 3, 16);
+
+			if (!tile->data || !tile->current)
+			{
+				status = -1;
+				goto out;
+			}
+
+			if (tile->pass && (memcmp(tile->data, pixels, 64 * 64 * 4) == 0))
+			{
+				if (tile->quality == 0xFF)
+					continue; /* static tile at full quality */
+
+				status = progressive_compress_tile_upgrade(progressive, tile, sTiles);
+			}
+			else
+			{
+				CopyMemory(tile->data, pixels, 64 * 64 * 4);
+				status = progressive_compress_tile_first(progressive, tile, sTiles);
+			}
+
+			if (status < 0)
+				goto out;
+
+			if (!Stream_EnsureRemainingCapacity(sRects, 8))
+			{
+				status = -1;
+				goto out;
+			}
+
+			Stream_Write_UINT16(sRects, tile->x); /* x (2 bytes) */
+			Stream_Write_UINT16(sRects, tile->y); /* y (2 bytes) */
+			Stream_Write_UINT16(sRects, tile->width); /* width (2 bytes) */
+			Stream_Write_UINT16(sRects, tile->height); /* height (2 bytes) */
+
+			numRects++;
+			numTiles++;
+		}
+	}
+
+	if (!numTiles)
+	{
+		status = 0;
+		goto out;
+	}
+
+	if ((numTiles > 0xFFFF) || (numRects > 0xFFFF))
+	{
+		status = -1;
+		goto out;
+	}
+
+	tileDataSize = Stream_GetPosition(sTiles);
+	regionLen = 18 + (numRects * 8) + 5 + (PROGRESSIVE_PROG_QUANT_COUNT * 16) + tileDataSize;
+
+	s = Stream_New(NULL, 12 + 10 + 12 + regionLen + 6);
+
+	if (!s)
+	{
+		status = -1;
+		goto out;
+	}
+
+	if (!progressive->syncSent)
+	{
+		Stream_Write_UINT16(s, PROGRESSIVE_WBT_SYNC); /* blockType (2 bytes) */
+		Stream_Write_UINT32(s, 12); /* blockLen (4 bytes) */
+		Stream_Write_UINT32(s, 0xCACCACCA); /* magic (4 bytes) */
+		Stream_Write_UINT16(s, 0x0100); /* version (2 bytes) */
+
+		Stream_Write_UINT16(s, PROGRESSIVE_WBT_CONTEXT); /* blockType (2 bytes) */
+		Stream_Write_UINT32(s, 10); /* blockLen (4 bytes) */
+		Stream_Write_UINT8(s, 0); /* ctxId (1 byte) */
+		Stream_Write_UINT16(s, 64); /* tileSize (2 bytes) */
+		Stream_Write_UINT8(s, RFX_SUBBAND_DIFFING); /* flags (1 byte) */
+
+		progressive->syncSent = TRUE;
+	}
+
+	Stream_Write_UINT16(s, PROGRESSIVE_WBT_FRAME_BEGIN); /* blockType (2 bytes) */
+	Stream_Write_UINT32(s, 12); /* blockLen (4 bytes) */
+	Stream_Write_UINT32(s, progressive->frameIndex++); /* frameIndex (4 bytes) */
+	Stream_Write_UINT16(s, 1); /* regionCount (2 bytes) */
+
+	Stream_Write_UINT16(s, PROGRESSIVE_WBT_REGION); /* blockType (2 bytes) */
+	Stream_Write_UINT32(s, regionLen); /* blockLen (4 bytes) */
+	Stream_Write_UINT8(s, 64); /* tileSize (1 byte) */
+	Stream_Write_UINT16(s, numRects); /* numRects (2 bytes) */
+	Stream_Write_UINT8(s, 1); /* numQuant (1 byte) */
+	Stream_Write_UINT8(s, PROGRESSIVE_PROG_QUANT_COUNT); /* numProgQuant (1 byte) */
+	Stream_Write_UINT8(s, RFX_DWT_REDUCE_EXTRAPOLATE); /* flags (1 byte) */
+	Stream_Write_UINT16(s, numTiles); /* numTiles (2 bytes) */
+	Stream_Write_UINT32(s, tileDataSize); /* tileDataSize (4 bytes) */
+
+	Stream_Write(s, Stream_Buffer(sRects), numRects * 8); /* rects */
+
+	progressive_component_codec_quant_write(Stream_Pointer(s), &progressive_default_quant); /* quantVals */
+	Stream_Seek(s, 5);
+
+	for (index = 0; index < PROGRESSIVE_PROG_QUANT_COUNT; index++)
+	{
+		const RFX_PROGRESSIVE_CODEC_QUANT* quantProgVal = &progressive_default_prog_quant[index];
+
+		Stream_Write_UINT8(s, quantProgVal->quality); /* quality (1 byte) */
+		progressive_component_codec_quant_write(Stream_Pointer(s), &(quantProgVal->yQuantValues));
+		progressive_component_codec_quant_write(Stream_Pointer(s) + 5, &(quantProgVal->cbQuantValues));
+		progressive_component_codec_quant_write(Stream_Pointer(s) + 10, &(quantProgVal->crQuantValues));
+		Stream_Seek(s, 15);
+	}
+
+	Stream_Write(s, Stream_Buffer(sTiles), tileDataSize); /* tiles */
+
+	Stream_Write_UINT16(s, PROGRESSIVE_WBT_FRAME_END); /* blockType (2 bytes) */
+	Stream_Write_UINT32(s, 6); /* blockLen (4 bytes) */
+
+	*ppDstData = Stream_Buffer(s);
+	*pDstSize = Stream_GetPosition(s);
+	Stream_Free(s, FALSE);
+
+out:
+	if (pixels)
+		BufferPool_Return(progressive->bufferPool, pixels);
+
+	Stream_Free(sTiles, TRUE);
+	Stream_Free(sRects, TRUE);
+	return status;
+}
+
+BOOL progressive_context_reset(PROGRESSIVE_CONTEXT* progressive)
+{
+	if (!progressive)
+		return FALSE;
+
+	progressive->syncSent = FALSE;
+	progressive->frameIndex = 0;
+
+	return TRUE;
+}
+
+PROGRESSIVE_CONTEXT* progressive_context_new(BOOL Compressor)
+{
+	PROGRESSIVE_CONTEXT* progressive;
+
+	progressive = (PROGRESSIVE_CONTEXT*) calloc(1, sizeof(PROGRESSIVE_CONTEXT));
+
+	if (progressive)
+	{
+		progressive->Compressor = Compressor;
+
+		progressive->bufferPool = BufferPool_New(TRUE, (8192 + 32) * 3, 16);
+
+		progressive->cRects = 64;
+		progressive->rects = (RFX_RECT*) malloc(progressive->cRects * sizeof(RFX_RECT));
+
+		if (!progressive->rects)
+			goto cleanup;
+
+		progressive->cTiles = 64;
+		progressive->tiles = (RFX_PROGRESSIVE_TILE**) malloc(progressive->cTiles * sizeof(RFX_PROGRESSIVE_TILE*));
+
+		if (!progressive->tiles)
+			goto cleanup;
+
+		progressive->cQuant = 8;
+		progressive->quantVals = (RFX_COMPONENT_CODEC_QUANT*) malloc(progressive->cQuant * sizeof(RFX_COMPONENT_CODEC_QUANT));
+
+		if (!progressive->quantVals)
+			goto cleanup;
+
+		progressive->cProgQuant = 8;
+		progressive->quantProgVals = (RFX_PROGRESSIVE_CODEC_QUANT*) malloc(progressive->cProgQuant * sizeof(RFX_PROGRESSIVE_CODEC_QUANT));
+
+		if (!progressive->quantProgVals)
+			goto cleanup;
+
+		ZeroMemory(&(progressive->quantProgValFull), sizeof(RFX_PROGRESSIVE_CODEC_QUANT));
+		progressive->quantProgValFull.quality = 100;
+
+		progressive->SurfaceContexts = HashTable_New(TRUE);
+
+		progressive->idwt_x = progressive_rfx_idwt_x;
+		progressive->idwt_y = progressive_rfx_idwt_y;
+
+		PROGRESSIVE_INIT_SIMD(progressive);
+
+		if (!Compressor)
+		{
+			SYSTEM_INFO sysinfo;
+
+			GetNativeSystemInfo(&sysinfo);
+
+			progressive->ThreadCount = sysinfo.dwNumberOfProcessors;
+			progressive->UseThreads = (progressive->ThreadCount > 1) ? TRUE : FALSE;
+		}
+
+		if (progressive->UseThreads)
+		{
+			/* initialize the primitives before any decoding thread uses them */
+			primitives_get();
+
+			progressive->ThreadPool = CreateThreadpool(NULL);
+
+			if (!progressive->ThreadPool)
+				goto cleanup;
+
+			InitializeThreadpoolEnvironment(&progressive->ThreadPoolEnv);
+			SetThreadpoolCallbackPool(&progressive->ThreadPoolEnv, progressive->ThreadPool);
+			SetThreadpoolThreadMaximum(progressive->ThreadPool, progressive->ThreadCount);
+		}
+
+		progressive_context_reset(progressive);
+	}
+
+	return progressive;
+
+cleanup:
+	BufferPool_Free(progressive->bufferPool);
+	HashTable_Free(progressive->SurfaceContexts);
+	free(progressive->rects);
+	free(progressive->tiles);
+	free(progressive->quantVals);
+	free(progressive->quantProgVals);
+	free(progressive);
+	return NULL;
+}
+
+void progressive_context_free(PROGRESSIVE_CONTEXT* progressive)
+{
+	int count;
+	int index;
+	ULONG_PTR* pKeys = NULL;
+	PROGRESSIVE_SURFACE_CONTEXT* surface;
+
+	if (!progressive)
+		return;
+
+	if (progressive->UseThreads)
+	{
+		CloseThreadpool(progressive->ThreadPool);
+		DestroyThreadpoolEnvironment(&progressive->ThreadPoolEnv);
+	}
 
 	BufferPool_Free(progressive->bufferPool);
 
@@ -0,0 +1,288 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * Progressive Codec Bitmap Compression - NEON Optimizations
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#if defined(__ARM_NEON__)
+
+#include <arm_neon.h>
+#include <winpr/sysinfo.h>
+
+#include "progressive_neon.h"
+
+/**
+ * Same arithmetic as the SSE2 kernels: the scalar code rounds (a + b) / 2
+ * towards zero, the halving add gives the floor of the full sum which is
+ * corrected by one for negative odd sums.
+ */
+
+static __inline int16x8_t __attribute__((__gnu_inline__, __always_inline__, __artificial__))
+vavg_trunc_s16(int16x8_t a, int16x8_t b)
+{
+	int16x8_t avg = vhaddq_s16(a, b);
+	int16x8_t odd = vandq_s16(veorq_s16(a, b), vdupq_n_s16(1));
+	int16x8_t sign = vreinterpretq_s16_u16(vshrq_n_u16(vreinterpretq_u16_s16(avg), 15));
+
+	return vaddq_s16(avg, vandq_s16(odd, sign));
+}
+
+static __inline int16x8_t __attribute__((__gnu_inline__, __always_inline__, __artificial__))
+vhalf_trunc_s16(int16x8_t a)
+{
+	int16x8_t sign = vreinterpretq_s16_u16(vshrq_n_u16(vreinterpretq_u16_s16(a), 15));
+
+	return vshrq_n_s16(vaddq_s16(a, sign), 1);
+}
+
+/**
+ * Eight output pairs of a row at once from shifted loads of the bands, see
+ * progressive_rfx_idwt_x_sse2. The pairs are stored interleaved by vst2q.
+ */
+
+static void progressive_rfx_idwt_x_neon(INT16* pLowBand, int nLowStep, INT16* pHighBand, int nHighStep,
+		INT16* pDstBand, int nDstStep, int nLowCount, int nHighCount, int nDstCount)
+{
+	int i, j;
+	INT16 L0;
+	INT16 H0, H1;
+	INT16 X0, X1, X2;
+	INT16 *pL, *pH, *pX;
+	int16x8_t l0, l1;
+	int16x8_t hm, h0, h1;
+	int16x8x2_t x;
+
+	for (i = 0; i < nDstCount; i++)
+	{
+		pL = pLowBand;
+		pH = pHighBand;
+		pX = pDstBand;
+
+		H0 = pH[0];
+		L0 = pL[0];
+
+		X0 = L0 - H0;
+		X2 = L0 - H0;
+
+		for (j = 0; j < (nHighCount - 1); j++)
+		{
+			if ((j > 0) && ((j + 8) <= (nHighCount - 1)))
+			{
+				hm = vld1q_s16(&pH[j - 1]);
+				h0 = vld1q_s16(&pH[j]);
+				h1 = vld1q_s16(&pH[j + 1]);
+				l0 = vld1q_s16(&pL[j]);
+				l1 = vld1q_s16(&pL[j + 1]);
+
+				x.val[0] = vsubq_s16(l0, vavg_trunc_s16(hm, h0));
+				x.val[1] = vsubq_s16(l1, vavg_trunc_s16(h0, h1));
+				x.val[1] = vaddq_s16(vavg_trunc_s16(x.val[0], x.val[1]), vshlq_n_s16(h0, 1));
+
+				vst2q_s16(&pX[2 * j], x);
+
+				/* resume the scalar recurrence at pair j + 8 */
+				j += 8;
+
+				H0 = pH[j];
+				X0 = pL[j] - ((pH[j - 1] + H0) / 2);
+				X2 = X0;
+
+				j--;
+				continue;
+			}
+
+			H1 = pH[j + 1];
+			L0 = pL[j + 1];
+
+			X2 = L0 - ((H0 + H1) / 2);
+			X1 = ((X0 + X2) / 2) + (2 * H0);
+
+			pX[2 * j] = X0;
+			pX[2 * j + 1] = X1;
+
+			X0 = X2;
+			H0 = H1;
+		}
+
+		/* the end of the row needs E(nHighCount - 1) and the last high band value */
+		if (nHighCount > 1)
+		{
+			H0 = pH[nHighCount - 1];
+			X2 = pL[nHighCount - 1] - ((pH[nHighCount - 2] + H0) / 2);
+		}
+
+		pL += nHighCount;
+		pX += 2 * (nHighCount - 1);
+
+		if (nLowCount <= (nHighCount + 1))
+		{
+			if (nLowCount <= nHighCount)
+			{
+				pX[0] = X2;
+				pX[1] = X2 + (2 * H0);
+			}
+			else
+			{
+				L0 = *pL;
+
+				X0 = L0 - H0;
+
+				pX[0] = X2;
+				pX[1] = ((X0 + X2) / 2) + (2 * H0);
+				pX[2] = X0;
+			}
+		}
+		else
+		{
+			L0 = *pL;
+			pL++;
+
+			X0 = L0 - (H0 / 2);
+
+			pX[0] = X2;
+			pX[1] = ((X0 + X2) / 2) + (2 * H0);
+			pX[2] = X0;
+
+			L0 = *pL;
+
+			pX[3] = (X0 + L0) / 2;
+		}
+
+		pLowBand += nLowStep;
+		pHighBand += nHighStep;
+		pDstBand += nDstStep;
+	}
+}
+
+/**
+ * Eight columns at once with the scalar recurrence, the remaining ones are
+ * left to the scalar code.
+ */
+
+static void progressive_rfx_idwt_y_neon(INT16* pLowBand, int nLowStep, INT16* pHighBand, int nHighStep,
+		INT16* pDstBand, int nDstStep, int nLowCount, int nHighCount, int nDstCount)
+{
+	int i, j;
+	INT16 *pL, *pH, *pX;
+	int16x8_t L0;
+	int16x8_t H0, H1;
+	int16x8_t X0, X1, X2;
+
+	for (i = 0; (i + 8) <= nDstCount; i += 8)
+	{
+		pL = pLowBand;
+		pH = pHighBand;
+		pX = pDstBand;
+
+		H0 = vld1q_s16(pH);
+		pH += nHighStep;
+
+		L0 = vld1q_s16(pL);
+		pL += nLowStep;
+
+		X0 = vsubq_s16(L0, H0);
+		X2 = X0;
+
+		for (j = 0; j < (nHighCount - 1); j++)
+		{
+			H1 = vld1q_s16(pH);
+			pH += nHighStep;
+
+			L0 = vld1q_s16(pL);
+			pL += nLowStep;
+
+			X2 = vsubq_s16(L0, vavg_trunc_s16(H0, H1));
+			X1 = vaddq_s16(vavg_trunc_s16(X0, X2), vshlq_n_s16(H0, 1));
+
+			vst1q_s16(pX, X0);
+			pX += nDstStep;
+
+			vst1q_s16(pX, X1);
+			pX += nDstStep;
+
+			X0 = X2;
+			H0 = H1;
+		}
+
+		if (nLowCount <= (nHighCount + 1))
+		{
+			if (nLowCount <= nHighCount)
+			{
+				vst1q_s16(pX, X2);
+				pX += nDstStep;
+
+				vst1q_s16(pX, vaddq_s16(X2, vshlq_n_s16(H0, 1)));
+			}
+			else
+			{
+				L0 = vld1q_s16(pL);
+
+				X0 = vsubq_s16(L0, H0);
+
+				vst1q_s16(pX, X2);
+				pX += nDstStep;
+
+				vst1q_s16(pX, vaddq_s16(vavg_trunc_s16(X0, X2), vshlq_n_s16(H0, 1)));
+				pX += nDstStep;
+
+				vst1q_s16(pX, X0);
+			}
+		}
+		else
+		{
+			L0 = vld1q_s16(pL);
+			pL += nLowStep;
+
+			X0 = vsubq_s16(L0, vhalf_trunc_s16(H0));
+
+			vst1q_s16(pX, X2);
+			pX += nDstStep;
+
+			vst1q_s16(pX, vaddq_s16(vavg_trunc_s16(X0, X2), vshlq_n_s16(H0, 1)));
+			pX += nDstStep;
+
+			vst1q_s16(pX, X0);
+			pX += nDstStep;
+
+			L0 = vld1q_s16(pL);
+
+			vst1q_s16(pX, vavg_trunc_s16(X0, L0));
+		}
+
+		pLowBand += 8;
+		pHighBand += 8;
+		pDstBand += 8;
+	}
+
+	if (i < nDstCount)
+	{
+		progressive_rfx_idwt_y(pLowBand, nLowStep, pHighBand, nHighStep,
+				pDstBand, nDstStep, nLowCount, nHighCount, nDstCount - i);
+	}
+}
+
+void progressive_init_neon(PROGRESSIVE_CONTEXT* progressive)
+{
+	if (!IsProcessorFeaturePresent(PF_ARM_NEON_INSTRUCTIONS_AVAILABLE))
+		return;
+
+	progressive->idwt_x = progressive_rfx_idwt_x_neon;
+	progressive->idwt_y = progressive_rfx_idwt_y_neon;
+}
+
+#endif /* __ARM_NEON__ */
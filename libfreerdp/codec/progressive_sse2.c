@@ -0,0 +1,306 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * Progressive Codec Bitmap Compression - SSE2 Optimizations
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <winpr/sysinfo.h>
+
+#include <xmmintrin.h>
+#include <emmintrin.h>
+
+#include "progressive_sse2.h"
+
+#ifdef _MSC_VER
+#define	__attribute__(...)
+#endif
+
+#ifndef __clang__
+#define ATTRIBUTES  __gnu_inline__, __always_inline__, __artificial__
+#else
+#define ATTRIBUTES __gnu_inline__, __always_inline__
+#endif
+
+/**
+ * The scalar reduce-extrapolate IDWT computes (a + b) / 2 on int, which
+ * rounds towards zero, and stores the results as INT16. Both are
+ * reproduced exactly on 16 bit lanes: the floor average is built from the
+ * halves so it does not overflow, then corrected by one for negative odd
+ * sums. Sums and differences simply wrap like the INT16 stores.
+ */
+
+static __inline __m128i __attribute__((ATTRIBUTES))
+_mm_avg_trunc_epi16(__m128i a, __m128i b)
+{
+	__m128i avg;
+	__m128i odd;
+	const __m128i one = _mm_set1_epi16(1);
+
+	avg = _mm_add_epi16(_mm_srai_epi16(a, 1), _mm_srai_epi16(b, 1));
+	avg = _mm_add_epi16(avg, _mm_and_si128(_mm_and_si128(a, b), one));
+	odd = _mm_and_si128(_mm_xor_si128(a, b), one);
+
+	return _mm_add_epi16(avg, _mm_and_si128(odd, _mm_srli_epi16(avg, 15)));
+}
+
+static __inline __m128i __attribute__((ATTRIBUTES))
+_mm_half_trunc_epi16(__m128i a)
+{
+	return _mm_srai_epi16(_mm_add_epi16(a, _mm_srli_epi16(a, 15)), 1);
+}
+
+/**
+ * Along a row each output pair only depends on the bands:
+ *
+ * X[2j]     = E(j) = L(j) - (H(j - 1) + H(j)) / 2, E(0) = L(0) - H(0)
+ * X[2j + 1] = (E(j) + E(j + 1)) / 2 + 2 * H(j)
+ *
+ * so eight pairs are computed at once from shifted loads of the bands,
+ * the first pair and the end of the row are left to the scalar code.
+ */
+
+static void progressive_rfx_idwt_x_sse2(INT16* pLowBand, int nLowStep, INT16* pHighBand, int nHighStep,
+		INT16* pDstBand, int nDstStep, int nLowCount, int nHighCount, int nDstCount)
+{
+	int i, j;
+	INT16 L0;
+	INT16 H0, H1;
+	INT16 X0, X1, X2;
+	INT16 *pL, *pH, *pX;
+	__m128i l0, l1;
+	__m128i hm, h0, h1;
+	__m128i e0, e1, o0;
+
+	for (i = 0; i < nDstCount; i++)
+	{
+		pL = pLowBand;
+		pH = pHighBand;
+		pX = pDstBand;
+
+		H0 = pH[0];
+		L0 = pL[0];
+
+		X0 = L0 - H0;
+		X2 = L0 - H0;
+
+		for (j = 0; j < (nHighCount - 1); j++)
+		{
+			if ((j > 0) && ((j + 8) <= (nHighCount - 1)))
+			{
+				hm = _mm_loadu_si128((__m128i*) &pH[j - 1]);
+				h0 = _mm_loadu_si128((__m128i*) &pH[j]);
+				h1 = _mm_loadu_si128((__m128i*) &pH[j + 1]);
+				l0 = _mm_loadu_si128((__m128i*) &pL[j]);
+				l1 = _mm_loadu_si128((__m128i*) &pL[j + 1]);
+
+				e0 = _mm_sub_epi16(l0, _mm_avg_trunc_epi16(hm, h0));
+				e1 = _mm_sub_epi16(l1, _mm_avg_trunc_epi16(h0, h1));
+				o0 = _mm_add_epi16(_mm_avg_trunc_epi16(e0, e1), _mm_slli_epi16(h0, 1));
+
+				_mm_storeu_si128((__m128i*) &pX[2 * j], _mm_unpacklo_epi16(e0, o0));
+				_mm_storeu_si128((__m128i*) &pX[2 * j + 8], _mm_unpackhi_epi16(e0, o0));
+
+				/* resume the scalar recurrence at pair j + 8 */
+				j += 8;
+
+				H0 = pH[j];
+				X0 = pL[j] - ((pH[j - 1] + H0) / 2);
+				X2 = X0;
+
+				j--;
+				continue;
+			}
+
+			H1 = pH[j + 1];
+			L0 = pL[j + 1];
+
+			X2 = L0 - ((H0 + H1) / 2);
+			X1 = ((X0 + X2) / 2) + (2 * H0);
+
+			pX[2 * j] = X0;
+			pX[2 * j + 1] = X1;
+
+			X0 = X2;
+			H0 = H1;
+		}
+
+		/* the end of the row needs E(nHighCount - 1) and the last high band value */
+		if (nHighCount > 1)
+		{
+			H0 = pH[nHighCount - 1];
+			X2 = pL[nHighCount - 1] - ((pH[nHighCount - 2] + H0) / 2);
+		}
+
+		pL += nHighCount;
+		pX += 2 * (nHighCount - 1);
+
+		if (nLowCount <= (nHighCount + 1))
+		{
+			if (nLowCount <= nHighCount)
+			{
+				pX[0] = X2;
+				pX[1] = X2 + (2 * H0);
+			}
+			else
+			{
+				L0 = *pL;
+
+				X0 = L0 - H0;
+
+				pX[0] = X2;
+				pX[1] = ((X0 + X2) / 2) + (2 * H0);
+				pX[2] = X0;
+			}
+		}
+		else
+		{
+			L0 = *pL;
+			pL++;
+
+			X0 = L0 - (H0 / 2);
+
+			pX[0] = X2;
+			pX[1] = ((X0 + X2) / 2) + (2 * H0);
+			pX[2] = X0;
+
+			L0 = *pL;
+
+			pX[3] = (X0 + L0) / 2;
+		}
+
+		pLowBand += nLowStep;
+		pHighBand += nHighStep;
+		pDstBand += nDstStep;
+	}
+}
+
+/**
+ * Columns are independent, eight of them are transformed at once with the
+ * same recurrence as the scalar code, the remaining ones are left to it.
+ */
+
+static void progressive_rfx_idwt_y_sse2(INT16* pLowBand, int nLowStep, INT16* pHighBand, int nHighStep,
+		INT16* pDstBand, int nDstStep, int nLowCount, int nHighCount, int nDstCount)
+{
+	int i, j;
+	INT16 *pL, *pH, *pX;
+	__m128i L0;
+	__m128i H0, H1;
+	__m128i X0, X1, X2;
+
+	for (i = 0; (i + 8) <= nDstCount; i += 8)
+	{
+		pL = pLowBand;
+		pH = pHighBand;
+		pX = pDstBand;
+
+		H0 = _mm_loadu_si128((__m128i*) pH);
+		pH += nHighStep;
+
+		L0 = _mm_loadu_si128((__m128i*) pL);
+		pL += nLowStep;
+
+		X0 = _mm_sub_epi16(L0, H0);
+		X2 = X0;
+
+		for (j = 0; j < (nHighCount - 1); j++)
+		{
+			H1 = _mm_loadu_si128((__m128i*) pH);
+			pH += nHighStep;
+
+			L0 = _mm_loadu_si128((__m128i*) pL);
+			pL += nLowStep;
+
+			X2 = _mm_sub_epi16(L0, _mm_avg_trunc_epi16(H0, H1));
+			X1 = _mm_add_epi16(_mm_avg_trunc_epi16(X0, X2), _mm_slli_epi16(H0, 1));
+
+			_mm_storeu_si128((__m128i*) pX, X0);
+			pX += nDstStep;
+
+			_mm_storeu_si128((__m128i*) pX, X1);
+			pX += nDstStep;
+
+			X0 = X2;
+			H0 = H1;
+		}
+
+		if (nLowCount <= (nHighCount + 1))
+		{
+			if (nLowCount <= nHighCount)
+			{
+				_mm_storeu_si128((__m128i*) pX, X2);
+				pX += nDstStep;
+
+				_mm_storeu_si128((__m128i*) pX, _mm_add_epi16(X2, _mm_slli_epi16(H0, 1)));
+			}
+			else
+			{
+				L0 = _mm_loadu_si128((__m128i*) pL);
+
+				X0 = _mm_sub_epi16(L0, H0);
+
+				_mm_storeu_si128((__m128i*) pX, X2);
+				pX += nDstStep;
+
+				_mm_storeu_si128((__m128i*) pX, _mm_add_epi16(_mm_avg_trunc_epi16(X0, X2), _mm_slli_epi16(H0, 1)));
+				pX += nDstStep;
+
+				_mm_storeu_si128((__m128i*) pX, X0);
+			}
+		}
+		else
+		{
+			L0 = _mm_loadu_si128((__m128i*) pL);
+			pL += nLowStep;
+
+			X0 = _mm_sub_epi16(L0, _mm_half_trunc_epi16(H0));
+
+			_mm_storeu_si128((__m128i*) pX, X2);
+			pX += nDstStep;
+
+			_mm_storeu_si128((__m128i*) pX, _mm_add_epi16(_mm_avg_trunc_epi16(X0, X2), _mm_slli_epi16(H0, 1)));
+			pX += nDstStep;
+
+			_mm_storeu_si128((__m128i*) pX, X0);
+			pX += nDstStep;
+
+			L0 = _mm_loadu_si128((__m128i*) pL);
+
+			_mm_storeu_si128((__m128i*) pX, _mm_avg_trunc_epi16(X0, L0));
+		}
+
+		pLowBand += 8;
+		pHighBand += 8;
+		pDstBand += 8;
+	}
+
+	if (i < nDstCount)
+	{
+		progressive_rfx_idwt_y(pLowBand, nLowStep, pHighBand, nHighStep,
+				pDstBand, nDstStep, nLowCount, nHighCount, nDstCount - i);
+	}
+}
+
+void progressive_init_sse2(PROGRESSIVE_CONTEXT* progressive)
+{
+	if (!IsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE))
+		return;
+
+	progressive->idwt_x = progressive_rfx_idwt_x_sse2;
+	progressive->idwt_y = progressive_rfx_idwt_y_sse2;
+}
@@ -125,6 +125,149 @@ int test_ClearDecompressExample4()
 	return 1;
 }
 
+static void test_fill_text_image(BYTE* pData, int nStep, int nWidth, int nHeight, int seed)
+{
+	int x, y;
+	UINT32* pPixel;
+
+	for (y = 0; y < nHeight; y++)
+	{
+		pPixel = (UINT32*) &pData[y * nStep];
+
+		for (x = 0; x < nWidth; x++)
+		{
+			/* white background with dark "glyph" strokes and a colored toolbar */
+
+			if (y < 24)
+				pPixel[x] = 0xFF000000 | (((x / 8) % 16) * 0x0F0A05);
+			else if ((((x + seed) % 9) < 2) && (((y / 14) % 2) == 0) && ((y % 14) > 3))
+				pPixel[x] = 0xFF101010 + ((x % 3) * 0x202020);
+			else
+				pPixel[x] = 0xFFFFFFFF;
+		}
+	}
+}
+
+static int test_compare_images(BYTE* pData1, BYTE* pData2, int nStep, int nWidth, int nHeight)
+{
+	int x, y;
+	UINT32* pPixel1;
+	UINT32* pPixel2;
+
+	for (y = 0; y < nHeight; y++)
+	{
+		pPixel1 = (UINT32*) &pData1[y * nStep];
+		pPixel2 = (UINT32*) &pData2[y * nStep];
+
+		for (x = 0; x < nWidth; x++)
+		{
+			if ((pPixel1[x] & 0x00FFFFFF) != (pPixel2[x] & 0x00FFFFFF))
+			{
+				printf("pixel mismatch at %d,%d: 0x%08X != 0x%08X\n", x, y, pPixel1[x], pPixel2[x]);
+				return -1;
+			}
+		}
+	}
+
+	return 1;
+}
+
+int test_ClearCompressRoundTrip()
+{
+	int i;
+	int status;
+	int nStep;
+	int nWidth = 317;
+	int nHeight = 131;
+	BYTE* pSrcData;
+	BYTE* pDstData;
+	BYTE* pEncData = NULL;
+	UINT32 EncSize = 0;
+	UINT32 FirstSize = 0;
+	CLEAR_CONTEXT* encoder;
+	CLEAR_CONTEXT* decoder;
+
+	nStep = nWidth * 4;
+	pSrcData = (BYTE*) malloc(nStep * nHeight);
+	pDstData = (BYTE*) calloc(1, nStep * nHeight);
+	encoder = clear_context_new(TRUE);
+	decoder = clear_context_new(FALSE);
+
+	if (!pSrcData || !pDstData || !encoder || !decoder)
+		return -1;
+
+	status = 1;
+
+	for (i = 0; (i < 3) && (status > 0); i++)
+	{
+		test_fill_text_image(pSrcData, nStep, nWidth, nHeight, (i == 2) ? 4 : 0);
+
+		status = clear_compress(encoder, pSrcData, PIXEL_FORMAT_XRGB32, nStep,
+				nWidth, nHeight, &pEncData, &EncSize);
+
+		if (status < 0)
+			break;
+
+		printf("clear_compress frame %d: %d bytes (residual: %d bands: %d subcodec: %d)\n",
+				i, EncSize, encoder->ResidualByteCount, encoder->BandsByteCount, encoder->SubcodecByteCount);
+
+		status = clear_decompress(decoder, pEncData, EncSize, &pDstData, PIXEL_FORMAT_XRGB32,
+				nStep, 0, 0, nWidth, nHeight);
+
+		free(pEncData);
+		pEncData = NULL;
+
+		if (status < 0)
+		{
+			printf("clear_decompress frame %d failure: %d\n", i, status);
+			break;
+		}
+
+		status = test_compare_images(pSrcData, pDstData, nStep, nWidth, nHeight);
+
+		if (i == 0)
+			FirstSize = EncSize;
+		else if ((i == 1) && (EncSize >= FirstSize))
+		{
+			printf("repeated frame did not benefit from the vbar cache\n");
+			status = -1;
+		}
+	}
+
+	/* small bitmaps go through the glyph cache */
+
+	for (i = 0; (i < 2) && (status > 0); i++)
+	{
+		status = clear_compress(encoder, pSrcData, PIXEL_FORMAT_XRGB32, nStep,
+				16, 32, &pEncData, &EncSize);
+
+		if (status < 0)
+			break;
+
+		if ((i == 1) && (!encoder->GlyphHit || (EncSize != 4)))
+			status = -1;
+
+		ZeroMemory(pDstData, nStep * nHeight);
+
+		if (status > 0)
+			status = clear_decompress(decoder, pEncData, EncSize, &pDstData, PIXEL_FORMAT_XRGB32,
+					nStep, 0, 0, 16, 32);
+
+		free(pEncData);
+		pEncData = NULL;
+
+		if (status > 0)
+			status = test_compare_images(pSrcData, pDstData, nStep, 16, 32);
+	}
+
+	clear_context_free(encoder);
+	clear_context_free(decoder);
+	free(pSrcData);
+	free(pDstData);
+
+	return status;
+}
+
 int TestFreeRDPCodecClear(int argc, char* argv[])
 {
 	//test_ClearDecompressExample1();
@@ -135,6 +278,9 @@ int TestFreeRDPCodecClear(int argc, char* argv[])
 
 	test_ClearDecompressExample4();
 
+	if (test_ClearCompressRoundTrip() < 0)
+		return -1;
+
 	return 0;
 }
 
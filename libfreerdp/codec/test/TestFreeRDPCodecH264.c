@@ -0,0 +1,329 @@
+#include <winpr/crt.h>
+#include <winpr/synch.h>
+#include <winpr/thread.h>
+
+#include <freerdp/codec/color.h>
+#include <freerdp/codec/h264.h>
+
+#define TEST_H264_WIDTH		64
+#define TEST_H264_HEIGHT	64
+#define TEST_H264_FRAMES	64
+
+/**
+ * The build may come without any encoder, the tests drive the AVC420
+ * input buffers with a subsystem that only reports the luma of the
+ * first pixel of the planes it is handed.
+ */
+
+static BYTE g_Bitstream[16];
+
+static BOOL test_h264_init(H264_CONTEXT* h264)
+{
+	return TRUE;
+}
+
+static void test_h264_uninit(H264_CONTEXT* h264)
+{
+}
+
+static int test_h264_compress(H264_CONTEXT* h264, BYTE** ppDstData,
+			      UINT32* pDstSize, UINT32 plane)
+{
+	if (!h264->pYUVData[plane][0] || !h264->pYUVData[plane][1] || !h264->pYUVData[plane][2])
+		return -1;
+
+	g_Bitstream[0] = h264->pYUVData[plane][0][0];
+
+	*ppDstData = g_Bitstream;
+	*pDstSize = sizeof(g_Bitstream);
+
+	return 1;
+}
+
+static H264_CONTEXT_SUBSYSTEM g_Subsystem_test =
+{
+	"test",
+	test_h264_init,
+	test_h264_uninit,
+	NULL,
+	test_h264_compress
+};
+
+static H264_CONTEXT* test_h264_context_new(BOOL DoubleBuffering)
+{
+	H264_CONTEXT* h264;
+
+	if (!(h264 = (H264_CONTEXT*) calloc(1, sizeof(H264_CONTEXT))))
+		return NULL;
+
+	h264->Compressor = TRUE;
+	h264->DoubleBuffering = DoubleBuffering;
+	h264->subsystem = &g_Subsystem_test;
+
+	return h264;
+}
+
+static BYTE* test_h264_frame_new(UINT32 width, UINT32 height, BYTE value)
+{
+	BYTE* pData;
+
+	if (!(pData = (BYTE*) malloc(width * height * 4)))
+		return NULL;
+
+	memset(pData, value, width * height * 4);
+
+	return pData;
+}
+
+static INT32 test_h264_prepare(H264_CONTEXT* h264, BYTE* pData, UINT32 width, UINT32 height)
+{
+	INT32 status;
+	RDPGFX_H264_METABLOCK meta;
+
+	ZeroMemory(&meta, sizeof(meta));
+
+	status = avc420_prepare(h264, pData, PIXEL_FORMAT_XRGB32, width * 4,
+				width, height, NULL, 0, &meta);
+
+	if (status >= 0)
+		h264_metablock_free(&meta);
+
+	return status;
+}
+
+static INT32 test_h264_encode(H264_CONTEXT* h264, BYTE* pLuma)
+{
+	INT32 status;
+	BYTE* pDstData = NULL;
+	UINT32 DstSize = 0;
+
+	status = avc420_encode(h264, &pDstData, &DstSize);
+
+	if (status >= 0)
+		*pLuma = pDstData[0];
+
+	return status;
+}
+
+/**
+ * Two frames prepared ahead are encoded in order, a third one has to wait
+ * until a buffer is released by avc420_encode.
+ */
+static BOOL test_h264_split_prepare_encode(BYTE* pBlack, BYTE* pWhite)
+{
+	BOOL rc = FALSE;
+	BYTE black, white;
+	BYTE luma;
+	H264_CONTEXT* h264;
+
+	if (!(h264 = test_h264_context_new(TRUE)))
+		return FALSE;
+
+	if (test_h264_prepare(h264, pBlack, TEST_H264_WIDTH, TEST_H264_HEIGHT) < 0)
+		goto fail;
+
+	if (test_h264_prepare(h264, pWhite, TEST_H264_WIDTH, TEST_H264_HEIGHT) < 0)
+		goto fail;
+
+	if (test_h264_prepare(h264, pBlack, TEST_H264_WIDTH, TEST_H264_HEIGHT) >= 0)
+	{
+		fprintf(stderr, "%s: prepared a third frame into busy buffers\n", __FUNCTION__);
+		goto fail;
+	}
+
+	if (test_h264_encode(h264, &black) < 0)
+		goto fail;
+
+	if (test_h264_prepare(h264, pBlack, TEST_H264_WIDTH, TEST_H264_HEIGHT) < 0)
+		goto fail;
+
+	if (test_h264_encode(h264, &white) < 0)
+		goto fail;
+
+	if (black >= white)
+	{
+		fprintf(stderr, "%s: frames encoded out of order, luma %u then %u\n",
+			__FUNCTION__, black, white);
+		goto fail;
+	}
+
+	if ((test_h264_encode(h264, &luma) < 0) || (luma != black))
+		goto fail;
+
+	if (test_h264_encode(h264, &luma) >= 0)
+	{
+		fprintf(stderr, "%s: encoded a frame that was never prepared\n", __FUNCTION__);
+		goto fail;
+	}
+
+	rc = TRUE;
+
+fail:
+	h264_context_free(h264);
+	return rc;
+}
+
+/**
+ * A frame size change frees the input buffers, it is refused as long as
+ * a prepared frame has not been encoded.
+ */
+static BOOL test_h264_resize(BYTE* pBlack)
+{
+	BOOL rc = FALSE;
+	BYTE luma;
+	H264_CONTEXT* h264;
+
+	if (!(h264 = test_h264_context_new(TRUE)))
+		return FALSE;
+
+	if (test_h264_prepare(h264, pBlack, TEST_H264_WIDTH, TEST_H264_HEIGHT) < 0)
+		goto fail;
+
+	if (test_h264_prepare(h264, pBlack, TEST_H264_WIDTH / 2, TEST_H264_HEIGHT / 2) >= 0)
+	{
+		fprintf(stderr, "%s: resized with a frame waiting for the encoder\n", __FUNCTION__);
+		goto fail;
+	}
+
+	if (h264_context_reset(h264, TEST_H264_WIDTH / 2, TEST_H264_HEIGHT / 2))
+	{
+		fprintf(stderr, "%s: reset with a frame waiting for the encoder\n", __FUNCTION__);
+		goto fail;
+	}
+
+	if (test_h264_encode(h264, &luma) < 0)
+		goto fail;
+
+	if (test_h264_prepare(h264, pBlack, TEST_H264_WIDTH / 2, TEST_H264_HEIGHT / 2) < 0)
+		goto fail;
+
+	if ((h264->width != TEST_H264_WIDTH / 2) || (h264->height != TEST_H264_HEIGHT / 2))
+		goto fail;
+
+	if (test_h264_encode(h264, &luma) < 0)
+		goto fail;
+
+	rc = TRUE;
+
+fail:
+	h264_context_free(h264);
+	return rc;
+}
+
+struct _TEST_H264_ENCODER
+{
+	H264_CONTEXT* h264;
+	BYTE luma[TEST_H264_FRAMES];
+};
+typedef struct _TEST_H264_ENCODER TEST_H264_ENCODER;
+
+static void* test_h264_encoder_thread(void* arg)
+{
+	UINT32 frame = 0;
+	TEST_H264_ENCODER* encoder = (TEST_H264_ENCODER*) arg;
+
+	while (frame < TEST_H264_FRAMES)
+	{
+		/* Fails until the next frame is prepared */
+		if (test_h264_encode(encoder->h264, &encoder->luma[frame]) < 0)
+		{
+			Sleep(0);
+			continue;
+		}
+
+		frame++;
+	}
+
+	ExitThread(0);
+	return NULL;
+}
+
+/**
+ * Prepare and encode on two threads, the encoder has to see every frame
+ * in the order it was prepared.
+ */
+static BOOL test_h264_threaded(BYTE* pBlack, BYTE* pWhite)
+{
+	BOOL rc = FALSE;
+	UINT32 frame = 0;
+	HANDLE thread;
+	BYTE black, white;
+	TEST_H264_ENCODER encoder;
+
+	ZeroMemory(&encoder, sizeof(encoder));
+
+	if (!(encoder.h264 = test_h264_context_new(TRUE)))
+		return FALSE;
+
+	/* Reference luma values, encoded one after the other */
+	if ((test_h264_prepare(encoder.h264, pBlack, TEST_H264_WIDTH, TEST_H264_HEIGHT) < 0) ||
+	    (test_h264_encode(encoder.h264, &black) < 0) ||
+	    (test_h264_prepare(encoder.h264, pWhite, TEST_H264_WIDTH, TEST_H264_HEIGHT) < 0) ||
+	    (test_h264_encode(encoder.h264, &white) < 0))
+		goto fail;
+
+	if (!(thread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) test_h264_encoder_thread,
+				    &encoder, 0, NULL)))
+		goto fail;
+
+	while (frame < TEST_H264_FRAMES)
+	{
+		/* Fails while both buffers wait for the encoder */
+		if (test_h264_prepare(encoder.h264, (frame & 1) ? pWhite : pBlack,
+				      TEST_H264_WIDTH, TEST_H264_HEIGHT) < 0)
+		{
+			Sleep(0);
+			continue;
+		}
+
+		frame++;
+	}
+
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+
+	for (frame = 0; frame < TEST_H264_FRAMES; frame++)
+	{
+		if (encoder.luma[frame] != ((frame & 1) ? white : black))
+		{
+			fprintf(stderr, "%s: frame %u encoded with luma %u\n",
+				__FUNCTION__, frame, encoder.luma[frame]);
+			goto fail;
+		}
+	}
+
+	rc = TRUE;
+
+fail:
+	h264_context_free(encoder.h264);
+	return rc;
+}
+
+int TestFreeRDPCodecH264(int argc, char* argv[])
+{
+	int rc = -1;
+	BYTE* pBlack;
+	BYTE* pWhite;
+
+	pBlack = test_h264_frame_new(TEST_H264_WIDTH, TEST_H264_HEIGHT, 0x00);
+	pWhite = test_h264_frame_new(TEST_H264_WIDTH, TEST_H264_HEIGHT, 0xFF);
+
+	if (!pBlack || !pWhite)
+		goto fail;
+
+	if (!test_h264_split_prepare_encode(pBlack, pWhite))
+		goto fail;
+
+	if (!test_h264_resize(pBlack))
+		goto fail;
+
+	if (!test_h264_threaded(pBlack, pWhite))
+		goto fail;
+
+	rc = 0;
+
+fail:
+	free(pBlack);
+	free(pWhite);
+	return rc;
+}
@@ -1059,10 +1059,316 @@ int test_progressive_ms_sample(char* ms_sample_path)
 	return 0;
 }
 
+static void test_progressive_fill_image(BYTE* pData, int nStep, int nWidth, int nHeight, int seed)
+{
+	int x, y;
+	UINT32 r, g, b;
+	UINT32* pPixel;
+
+	for (y = 0; y < nHeight; y++)
+	{
+		pPixel = (UINT32*) &pData[y * nStep];
+
+		for (x = 0; x < nWidth; x++)
+		{
+			/* smooth gradients with a few hard edges */
+
+			r = (x * 255) / nWidth;
+			g = (y * 255) / nHeight;
+			b = ((x + y + seed) % 64) * 4;
+
+			if (((x / 40) % 2) && ((y / 30) % 2))
+				r = g = b = (seed % 2) ? 0x20 : 0xE0;
+
+			pPixel[x] = 0xFF000000 | (r << 16) | (g << 8) | b;
+		}
+	}
+}
+
+static double test_progressive_image_error(BYTE* pData1, BYTE* pData2, int nStep, int nWidth, int nHeight)
+{
+	int x, y;
+	int index;
+	int error;
+	double total = 0.0;
+
+	for (y = 0; y < nHeight; y++)
+	{
+		for (x = 0; x < nWidth * 4; x++)
+		{
+			if ((x % 4) == 3)
+				continue;
+
+			index = (y * nStep) + x;
+			error = pData1[index] - pData2[index];
+			total += (error < 0) ? -error : error;
+		}
+	}
+
+	return total / (nWidth * nHeight * 3);
+}
+
+int test_progressive_round_trip()
+{
+	int i;
+	int index;
+	int status;
+	int nStep;
+	int nWidth = 200;
+	int nHeight = 150;
+	double error;
+	double lastError = 1000.0;
+	UINT32 EncSize = 0;
+	UINT32 firstSize = 0;
+	BYTE* pEncData = NULL;
+	BYTE* pSrcData = NULL;
+	BYTE* pDstData = NULL;
+	RECTANGLE_16 tileRect;
+	RECTANGLE_16 updateRect;
+	RECTANGLE_16 clippingRect;
+	RFX_PROGRESSIVE_TILE* tile;
+	PROGRESSIVE_BLOCK_REGION* region;
+	PROGRESSIVE_CONTEXT* encoder;
+	PROGRESSIVE_CONTEXT* decoder;
+
+	nStep = nWidth * 4;
+
+	encoder = progressive_context_new(TRUE);
+	decoder = progressive_context_new(FALSE);
+	pSrcData = (BYTE*) calloc(1, nStep * nHeight);
+	pDstData = (BYTE*) calloc(1, nStep * nHeight);
+
+	if (!encoder || !decoder || !pSrcData || !pDstData)
+		return -1;
+
+	progressive_create_surface_context(encoder, 1, nWidth, nHeight);
+	progressive_create_surface_context(decoder, 1, nWidth, nHeight);
+
+	clippingRect.left = 0;
+	clippingRect.top = 0;
+	clippingRect.right = nWidth;
+	clippingRect.bottom = nHeight;
+
+	status = -1;
+
+	test_progressive_fill_image(pSrcData, nStep, nWidth, nHeight, 0);
+
+	/* first pass, two upgrades, then nothing left to send for a static image */
+
+	for (i = 0; i < 5; i++)
+	{
+		if (i == 4)
+		{
+			/* a change in the first tile only */
+			test_progressive_fill_image(pSrcData, nStep, 32, 32, 1);
+		}
+
+		status = progressive_compress(encoder, pSrcData, PIXEL_FORMAT_XRGB32, nStep,
+				nWidth, nHeight, 1, &pEncData, &EncSize);
+
+		if (i == 3)
+		{
+			if (status != 0)
+			{
+				printf("progressive_compress: unexpected data for a static full quality image\n");
+				status = -1;
+				break;
+			}
+
+			continue;
+		}
+
+		if (status < 1)
+		{
+			printf("progressive_compress frame %d failure: %d\n", i, status);
+			status = -1;
+			break;
+		}
+
+		printf("progressive_compress frame %d: %d bytes\n", i, EncSize);
+
+		if (i == 0)
+			firstSize = EncSize;
+
+		status = progressive_decompress(decoder, pEncData, EncSize, &pDstData, PIXEL_FORMAT_XRGB32,
+				nStep, 0, 0, nWidth, nHeight, 1);
+
+		free(pEncData);
+		pEncData = NULL;
+
+		if (status < 0)
+		{
+			printf("progressive_decompress frame %d failure: %d\n", i, status);
+			break;
+		}
+
+		region = &(decoder->region);
+
+		for (index = 0; index < region->numTiles; index++)
+		{
+			tile = region->tiles[index];
+
+			tileRect.left = tile->x;
+			tileRect.top = tile->y;
+			tileRect.right = tile->x + tile->width;
+			tileRect.bottom = tile->y + tile->height;
+
+			rectangles_intersection(&tileRect, &clippingRect, &updateRect);
+
+			if ((updateRect.right <= updateRect.left) || (updateRect.bottom <= updateRect.top))
+				continue;
+
+			freerdp_image_copy(pDstData, PIXEL_FORMAT_XRGB32, nStep, updateRect.left, updateRect.top,
+					updateRect.right - updateRect.left, updateRect.bottom - updateRect.top, tile->data,
+					PIXEL_FORMAT_XRGB32, 64 * 4, updateRect.left - tile->x, updateRect.top - tile->y, NULL);
+		}
+
+		error = test_progressive_image_error(pSrcData, pDstData, nStep, nWidth, nHeight);
+
+		printf("progressive frame %d: mean error %.3f\n", i, error);
+
+		if ((i < 3) && (error > lastError))
+		{
+			printf("progressive upgrade did not improve the image\n");
+			status = -1;
+			break;
+		}
+
+		if ((i == 2) && (error > 3.0))
+		{
+			printf("progressive full quality mean error too large: %.3f\n", error);
+			status = -1;
+			break;
+		}
+
+		if ((i == 4) && (EncSize >= firstSize / 4))
+		{
+			printf("progressive update of a single tile is too large: %d\n", EncSize);
+			status = -1;
+			break;
+		}
+
+		lastError = error;
+	}
+
+	free(pSrcData);
+	free(pDstData);
+	progressive_context_free(encoder);
+	progressive_context_free(decoder);
+
+	return (status < 0) ? -1 : 1;
+}
+
+void progressive_rfx_idwt_x(INT16* pLowBand, int nLowStep, INT16* pHighBand, int nHighStep,
+		INT16* pDstBand, int nDstStep, int nLowCount, int nHighCount, int nDstCount);
+void progressive_rfx_idwt_y(INT16* pLowBand, int nLowStep, INT16* pHighBand, int nHighStep,
+		INT16* pDstBand, int nDstStep, int nLowCount, int nHighCount, int nDstCount);
+
+static void test_progressive_fill_band(INT16* pBand, int count, int seed)
+{
+	int index;
+
+	srand(seed);
+
+	for (index = 0; index < count; index++)
+	{
+		switch (rand() % 8)
+		{
+			case 0:
+				pBand[index] = 32767;
+				break;
+
+			case 1:
+				pBand[index] = -32768;
+				break;
+
+			default:
+				pBand[index] = (INT16) ((rand() % 65536) - 32768);
+				break;
+		}
+	}
+}
+
+/**
+ * The transform selected for this processor must give exactly the same
+ * coefficients as the generic one, for all the band sizes of a tile.
+ */
+
+int test_progressive_idwt()
+{
+	int band;
+	int pass;
+	int nLowCount;
+	int nHighCount;
+	int status = 1;
+	/* the band sizes of levels 1 to 3, plus the equal sizes case */
+	const int bandCounts[4][2] = { { 33, 31 }, { 17, 16 }, { 9, 8 }, { 16, 16 } };
+	INT16 low[64 * 33];
+	INT16 high[64 * 33];
+	INT16 dst1[64 * 66];
+	INT16 dst2[64 * 66];
+	PROGRESSIVE_CONTEXT* decoder;
+
+	decoder = progressive_context_new(FALSE);
+
+	if (!decoder)
+		return -1;
+
+	for (band = 0; (band < 4) && (status > 0); band++)
+	{
+		nLowCount = bandCounts[band][0];
+		nHighCount = bandCounts[band][1];
+
+		for (pass = 0; pass < 16; pass++)
+		{
+			test_progressive_fill_band(low, 64 * 33, pass * 2);
+			test_progressive_fill_band(high, 64 * 33, pass * 2 + 1);
+			ZeroMemory(dst1, sizeof(dst1));
+			ZeroMemory(dst2, sizeof(dst2));
+
+			/* rows: low and high band rows into a row of twice their width */
+			progressive_rfx_idwt_x(low, nLowCount, high, nHighCount, dst1,
+					nLowCount + nHighCount, nLowCount, nHighCount, nHighCount);
+			decoder->idwt_x(low, nLowCount, high, nHighCount, dst2,
+					nLowCount + nHighCount, nLowCount, nHighCount, nHighCount);
+
+			if (memcmp(dst1, dst2, sizeof(dst1)) != 0)
+			{
+				printf("progressive idwt_x %dx%d mismatch\n", nLowCount, nHighCount);
+				status = -1;
+				break;
+			}
+
+			/* columns: low and high band lines over all the columns */
+			progressive_rfx_idwt_y(low, nLowCount + nHighCount, high, nLowCount + nHighCount,
+					dst1, nLowCount + nHighCount, nLowCount, nHighCount, nLowCount + nHighCount);
+			decoder->idwt_y(low, nLowCount + nHighCount, high, nLowCount + nHighCount,
+					dst2, nLowCount + nHighCount, nLowCount, nHighCount, nLowCount + nHighCount);
+
+			if (memcmp(dst1, dst2, sizeof(dst1)) != 0)
+			{
+				printf("progressive idwt_y %dx%d mismatch\n", nLowCount, nHighCount);
+				status = -1;
+				break;
+			}
+		}
+	}
+
+	progressive_context_free(decoder);
+
+	return status;
+}
+
 int TestFreeRDPCodecProgressive(int argc, char* argv[])
 {
 	char* ms_sample_path;
 
+	if (test_progressive_idwt() < 0)
+		return -1;
+
+	if (test_progressive_round_trip() < 0)
+		return -1;
+
 	ms_sample_path = GetKnownSubPath(KNOWN_PATH_TEMP, "EGFX_PROGRESSIVE_MS_SAMPLE");
 	if (!ms_sample_path)
 	{
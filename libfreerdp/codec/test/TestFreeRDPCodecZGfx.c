@@ -198,6 +198,104 @@ int test_ZGfxCompressConsistent()
 	return 0;
 }
 
+int test_ZGfxCompressRoundTrip()
+{
+	int i;
+	int pdu;
+	int status;
+	UINT32 level;
+	UINT32 Flags;
+	UINT32 seed = 1;
+	UINT32 SrcSize;
+	UINT32 EncSize;
+	UINT32 DstSize;
+	UINT32 TotalSize;
+	UINT32 TotalEncSize;
+	BYTE* pSrcData;
+	BYTE* pEncData;
+	BYTE* pDstData;
+	ZGFX_CONTEXT* encoder;
+	ZGFX_CONTEXT* decoder;
+
+	SrcSize = 150000;
+	pSrcData = (BYTE*) malloc(SrcSize);
+
+	if (!pSrcData)
+		return -1;
+
+	for (level = 0; level <= ZGFX_COMPRESSION_LEVEL_MAX; level += 3)
+	{
+		encoder = zgfx_context_new(TRUE);
+		decoder = zgfx_context_new(FALSE);
+
+		if (!encoder || !decoder)
+			return -1;
+
+		zgfx_context_set_compression_level(encoder, level);
+
+		TotalSize = TotalEncSize = 0;
+
+		for (pdu = 0; pdu < 4; pdu++)
+		{
+			/* repetitive text, a run, noise and a chunk repeated from the previous PDUs */
+
+			for (i = 0; i < (int) SrcSize; i++)
+			{
+				seed = (seed * 1103515245) + 12345;
+
+				if (i < 50000)
+					pSrcData[i] = TEST_FOX_DATA[(i + pdu) % (sizeof(TEST_FOX_DATA) - 1)];
+				else if (i < 60000)
+					pSrcData[i] = 0xFF;
+				else if (i < 80000)
+					pSrcData[i] = (BYTE) (seed >> 16);
+				else
+					pSrcData[i] = (BYTE) ((i * 7) ^ (i >> 8));
+			}
+
+			Flags = 0;
+			status = zgfx_compress(encoder, pSrcData, SrcSize, &pEncData, &EncSize, &Flags);
+
+			if (status < 0)
+			{
+				printf("test_ZGfxCompressRoundTrip: compression failure at level %d\n", level);
+				return -1;
+			}
+
+			status = zgfx_decompress(decoder, pEncData, EncSize, &pDstData, &DstSize, Flags);
+			free(pEncData);
+
+			if ((status < 0) || (DstSize != SrcSize) || (memcmp(pDstData, pSrcData, SrcSize) != 0))
+			{
+				printf("test_ZGfxCompressRoundTrip: round trip mismatch at level %d pdu %d\n", level, pdu);
+				free(pDstData);
+				return -1;
+			}
+
+			free(pDstData);
+
+			TotalSize += SrcSize;
+			TotalEncSize += EncSize;
+		}
+
+		printf("level %d: %d -> %d bytes\n", level, TotalSize, TotalEncSize);
+
+		/* only the noise should remain once compression is enabled */
+
+		if ((level > 0) && (TotalEncSize > (TotalSize / 5)))
+		{
+			printf("test_ZGfxCompressRoundTrip: poor compression ratio at level %d\n", level);
+			return -1;
+		}
+
+		zgfx_context_free(encoder);
+		zgfx_context_free(decoder);
+	}
+
+	free(pSrcData);
+	return 0;
+}
+
 int TestFreeRDPCodecZGfx(int argc, char* argv[])
 {
 	if (test_ZGfxCompressFox() < 0)
@@ -212,6 +310,9 @@ int TestFreeRDPCodecZGfx(int argc, char* argv[])
 	if (test_ZGfxCompressConsistent() < 0)
 		return -1;
 
+	if (test_ZGfxCompressRoundTrip() < 0)
+		return -1;
+
 	return 0;
 }
 
@@ -386,18 +386,435 @@ int zgfx_decompress(ZGFX_CONTEXT* zgfx, const BYTE* pSrcData, UINT32 SrcSize, BY
 	return 1;
 }
 
+/**
+ * RDP8 Compressor
+ *
+ * Matches are searched in the history buffer shared with the decoder using hash chains
+ * of 3-byte prefixes. The chain depth and the matching strategy depend on the level.
+ */
+
+struct _ZGFX_LEVEL_CONFIG
+{
+	UINT32 maxChain;
+	UINT32 niceLength;
+	BOOL lazy;
+	BOOL insertAll;
+};
+typedef struct _ZGFX_LEVEL_CONFIG ZGFX_LEVEL_CONFIG;
+
+static const ZGFX_LEVEL_CONFIG ZGFX_LEVEL_TABLE[ZGFX_COMPRESSION_LEVEL_MAX + 1] =
+{
+	// chain  nice   lazy   insertAll
+	{     0,     0, FALSE, FALSE },    // 0: no compression
+	{     4,    16, FALSE, FALSE },    // 1
+	{     8,    32, FALSE, FALSE },    // 2
+	{    16,    64, FALSE,  TRUE },    // 3
+	{    32,   128,  TRUE,  TRUE },    // 4
+	{    64,   128,  TRUE,  TRUE },    // 5
+	{   128,   256,  TRUE,  TRUE },    // 6
+	{   256,   512,  TRUE,  TRUE },    // 7
+	{  1024,  2048,  TRUE,  TRUE },    // 8
+	{  4096, 65535,  TRUE,  TRUE }     // 9
+};
+
+#define ZGFX_HASH_SIZE		(1 << ZGFX_HASH_BITS)
+#define ZGFX_MIN_MATCH		3
+#define ZGFX_MAX_UNENCODED	32767
+
+#define zgfx_hash(_p) \
+	((((((UINT32) (_p)[0]) << 16) | (((UINT32) (_p)[1]) << 8) | ((UINT32) (_p)[2])) * 2654435761U) >> (32 - ZGFX_HASH_BITS))
+
+static void zgfx_PutBits(ZGFX_CONTEXT* zgfx, UINT32 value, UINT32 nbits)
+{
+	if (!nbits)
+		return;
+
+	zgfx->BitsCurrent = (zgfx->BitsCurrent << nbits) | (value & ((1 << nbits) - 1));
+	zgfx->cBitsCurrent += nbits;
+
+	while (zgfx->cBitsCurrent >= 8)
+	{
+		zgfx->cBitsCurrent -= 8;
+		*(zgfx->pbOutputCurrent)++ = (BYTE) (zgfx->BitsCurrent >> zgfx->cBitsCurrent);
+	}
+
+	zgfx->BitsCurrent &= ((1 << zgfx->cBitsCurrent) - 1);
+}
+
+static UINT32 zgfx_history_index(ZGFX_CONTEXT* zgfx, UINT32 position)
+{
+	UINT32 index;
+
+	index = zgfx->HistoryIndex + zgfx->HistoryBufferSize - (zgfx->HistoryPosition - position);
+
+	if (index >= zgfx->HistoryBufferSize)
+		index -= zgfx->HistoryBufferSize;
+
+	return index;
+}
+
+static UINT32 zgfx_history_min_position(ZGFX_CONTEXT* zgfx)
+{
+	if (zgfx->HistoryPosition > zgfx->HistoryBufferSize)
+		return zgfx->HistoryPosition - zgfx->HistoryBufferSize;
+
+	return 0;
+}
+
+static void zgfx_hash_update(ZGFX_CONTEXT* zgfx, UINT32 position)
+{
+	UINT32 hash;
+	UINT32 index;
+	BYTE prefix[3];
+
+	if (zgfx->HashPosition < zgfx_history_min_position(zgfx))
+		zgfx->HashPosition = zgfx_history_min_position(zgfx);
+
+	/* hashing a position requires the two bytes that follow it */
+
+	if ((position + 2) > zgfx->HistoryPosition)
+		position = zgfx->HistoryPosition - 2;
+
+	while (zgfx->HashPosition < position)
+	{
+		index = zgfx_history_index(zgfx, zgfx->HashPosition);
+
+		prefix[0] = zgfx->HistoryBuffer[index];
+		prefix[1] = zgfx->HistoryBuffer[(index + 1) % zgfx->HistoryBufferSize];
+		prefix[2] = zgfx->HistoryBuffer[(index + 2) % zgfx->HistoryBufferSize];
+
+		hash = zgfx_hash(prefix);
+
+		zgfx->HashChain[index] = zgfx->HashHead[hash];
+		zgfx->HashHead[hash] = zgfx->HashPosition + 1;
+
+		zgfx->HashPosition++;
+	}
+}
+
+static UINT32 zgfx_find_match(ZGFX_CONTEXT* zgfx, const ZGFX_LEVEL_CONFIG* config,
+		UINT32 position, const BYTE* pData, UINT32 maxLength, UINT32* pDistance)
+{
+	UINT32 index;
+	UINT32 length;
+	UINT32 chain;
+	UINT32 candidate;
+	UINT32 minPosition;
+	UINT32 bestLength = 0;
+	UINT32 bestDistance = 0;
+
+	if (maxLength < ZGFX_MIN_MATCH)
+		return 0;
+
+	minPosition = zgfx_history_min_position(zgfx);
+	candidate = zgfx->HashHead[zgfx_hash(pData)];
+
+	for (chain = config->maxChain; candidate && chain; chain--)
+	{
+		candidate--;
+
+		if ((candidate < minPosition) || (candidate >= position))
+			break;
+
+		index = zgfx_history_index(zgfx, candidate);
+
+		if (!bestLength || (zgfx->HistoryBuffer[(index + bestLength) % zgfx->HistoryBufferSize] == pData[bestLength]))
+		{
+			for (length = 0; length < maxLength; length++)
+			{
+				if (zgfx->HistoryBuffer[index] != pData[length])
+					break;
+
+				if (++index == zgfx->HistoryBufferSize)
+					index = 0;
+			}
+
+			if (length > bestLength)
+			{
+				bestLength = length;
+				bestDistance = position - candidate;
+
+				if ((length >= config->niceLength) || (length == maxLength))
+					break;
+			}
+		}
+
+		index = zgfx_history_index(zgfx, candidate);
+
+		if (zgfx->HashChain[index] > candidate)
+			break; /* stale link */
+
+		candidate = zgfx->HashChain[index];
+	}
+
+	if (bestLength < ZGFX_MIN_MATCH)
+		return 0;
+
+	*pDistance = bestDistance;
+	return bestLength;
+}
+
+static int zgfx_match_token(UINT32 distance)
+{
+	int opIndex;
+	int found = -1;
+
+	for (opIndex = 0; ZGFX_TOKEN_TABLE[opIndex].prefixLength != 0; opIndex++)
+	{
+		if (ZGFX_TOKEN_TABLE[opIndex].tokenType != 1)
+			continue;
+
+		if (distance < ZGFX_TOKEN_TABLE[opIndex].valueBase)
+			continue;
+
+		if ((distance - ZGFX_TOKEN_TABLE[opIndex].valueBase) < (1U << ZGFX_TOKEN_TABLE[opIndex].valueBits))
+		{
+			found = opIndex;
+			break;
+		}
+	}
+
+	return found;
+}
+
+static UINT32 zgfx_length_bits(UINT32 count, UINT32* pExtra)
+{
+	UINT32 extra = 2;
+
+	if (count == 3)
+	{
+		*pExtra = 0;
+		return 1;
+	}
+
+	while ((count >> (extra + 1)) != 0)
+		extra++;
+
+	*pExtra = extra;
+	return (extra * 2);
+}
+
+static UINT32 zgfx_match_bits(UINT32 distance, UINT32 count)
+{
+	int opIndex;
+	UINT32 extra;
+
+	opIndex = zgfx_match_token(distance);
+
+	if (opIndex < 0)
+		return 0xFFFFFFFF;
+
+	return ZGFX_TOKEN_TABLE[opIndex].prefixLength + ZGFX_TOKEN_TABLE[opIndex].valueBits + zgfx_length_bits(count, &extra);
+}
+
+static UINT32 zgfx_literal_bits(ZGFX_CONTEXT* zgfx, const BYTE* pData, UINT32 count)
+{
+	UINT32 index;
+	UINT32 bits = 0;
+	const ZGFX_TOKEN* token;
+
+	for (index = 0; index < count; index++)
+	{
+		token = &ZGFX_TOKEN_TABLE[zgfx->LiteralTokens[pData[index]]];
+		bits += token->prefixLength + token->valueBits;
+	}
+
+	return bits;
+}
+
+static void zgfx_write_literals(ZGFX_CONTEXT* zgfx, const BYTE* pData, UINT32 count)
+{
+	UINT32 index;
+	UINT32 bits;
+	UINT32 chunk;
+	const ZGFX_TOKEN* token;
+
+	while (count > 0)
+	{
+		chunk = (count > ZGFX_MAX_UNENCODED) ? ZGFX_MAX_UNENCODED : count;
+		bits = zgfx_literal_bits(zgfx, pData, chunk);
+
+		/* long incompressible runs are cheaper as an unencoded block (token, 15-bit count, byte alignment) */
+
+		if ((chunk >= 32) && (bits > (25 + 7 + (chunk * 8))))
+		{
+			zgfx_PutBits(zgfx, ZGFX_TOKEN_TABLE[1].prefixCode, ZGFX_TOKEN_TABLE[1].prefixLength);
+			zgfx_PutBits(zgfx, 0, ZGFX_TOKEN_TABLE[1].valueBits); /* distance 0 */
+			zgfx_PutBits(zgfx, chunk, 15);
+			zgfx_PutBits(zgfx, 0, (8 - zgfx->cBitsCurrent) % 8);
+
+			CopyMemory(zgfx->pbOutputCurrent, pData, chunk);
+			zgfx->pbOutputCurrent += chunk;
+		}
+		else
+		{
+			for (index = 0; index < chunk; index++)
+			{
+				token = &ZGFX_TOKEN_TABLE[zgfx->LiteralTokens[pData[index]]];
+
+				zgfx_PutBits(zgfx, token->prefixCode, token->prefixLength);
+				zgfx_PutBits(zgfx, pData[index] - token->valueBase, token->valueBits);
+			}
+		}
+
+		pData += chunk;
+		count -= chunk;
+	}
+}
+
+static void zgfx_write_match(ZGFX_CONTEXT* zgfx, UINT32 distance, UINT32 count)
+{
+	int opIndex;
+	UINT32 extra;
+	UINT32 index;
+
+	opIndex = zgfx_match_token(distance);
+
+	zgfx_PutBits(zgfx, ZGFX_TOKEN_TABLE[opIndex].prefixCode, ZGFX_TOKEN_TABLE[opIndex].prefixLength);
+	zgfx_PutBits(zgfx, distance - ZGFX_TOKEN_TABLE[opIndex].valueBase, ZGFX_TOKEN_TABLE[opIndex].valueBits);
+
+	zgfx_length_bits(count, &extra);
+
+	if (!extra)
+	{
+		zgfx_PutBits(zgfx, 0, 1); /* count = 3 */
+		return;
+	}
+
+	/* '1', (extra - 2) '1' bits doubling the base count of 4, '0', then extra bits */
+
+	zgfx_PutBits(zgfx, 1, 1);
+
+	for (index = 2; index < extra; index++)
+		zgfx_PutBits(zgfx, 1, 1);
+
+	zgfx_PutBits(zgfx, 0, 1);
+	zgfx_PutBits(zgfx, count - (1 << extra), extra);
+}
+
+static UINT32 zgfx_compress_segment_data(ZGFX_CONTEXT* zgfx, const BYTE* pSrcData, UINT32 SrcSize, BYTE* pDstData)
+{
+	UINT32 pad;
+	UINT32 index = 0;
+	UINT32 length;
+	UINT32 distance = 0;
+	UINT32 nextLength;
+	UINT32 nextDistance = 0;
+	UINT32 literalStart = 0;
+	UINT32 cachedIndex = 0xFFFFFFFF;
+	UINT32 cachedLength = 0;
+	UINT32 cachedDistance = 0;
+	UINT32 position;
+	const ZGFX_LEVEL_CONFIG* config;
+
+	config = &ZGFX_LEVEL_TABLE[zgfx->CompressionLevel];
+
+	/* the segment is already part of the history, it starts at HistoryPosition - SrcSize */
+
+	position = zgfx->HistoryPosition - SrcSize;
+
+	zgfx->pbOutputCurrent = pDstData;
+	zgfx->BitsCurrent = 0;
+	zgfx->cBitsCurrent = 0;
+
+	while (index < SrcSize)
+	{
+		if (index == cachedIndex)
+		{
+			length = cachedLength;
+			distance = cachedDistance;
+		}
+		else
+		{
+			zgfx_hash_update(zgfx, position + index);
+			length = zgfx_find_match(zgfx, config, position + index, &pSrcData[index], SrcSize - index, &distance);
+		}
+
+		if (length && (zgfx_match_bits(distance, length) >= zgfx_literal_bits(zgfx, &pSrcData[index], length)))
+			length = 0;
+
+		if (length && config->lazy && (length < config->niceLength) && ((index + 1) < SrcSize))
+		{
+			/* lazy evaluation: prefer a literal if the next position has a longer match */
+
+			zgfx_hash_update(zgfx, position + index + 1);
+			nextLength = zgfx_find_match(zgfx, config, position + index + 1, &pSrcData[index + 1],
+					SrcSize - index - 1, &nextDistance);
+
+			cachedIndex = index + 1;
+			cachedLength = nextLength;
+			cachedDistance = nextDistance;
+
+			if (nextLength > length)
+				length = 0;
+		}
+
+		if (!length)
+		{
+			index++;
+			continue;
+		}
+
+		zgfx_write_literals(zgfx, &pSrcData[literalStart], index - literalStart);
+		zgfx_write_match(zgfx, distance, length);
+
+		index += length;
+		literalStart = index;
+
+		if (!config->insertAll && (zgfx->HashPosition < (position + index)))
+			zgfx->HashPosition = position + index;
+	}
+
+	zgfx_write_literals(zgfx, &pSrcData[literalStart], index - literalStart);
+
+	/* the last byte holds the number of padding bits in the byte before it */
+
+	pad = (8 - zgfx->cBitsCurrent) % 8;
+	zgfx_PutBits(zgfx, 0, pad);
+	*(zgfx->pbOutputCurrent)++ = (BYTE) pad;
+
+	return (UINT32) (zgfx->pbOutputCurrent - pDstData);
+}
+
 static int zgfx_compress_segment(ZGFX_CONTEXT* zgfx, wStream* s, const BYTE* pSrcData, UINT32 SrcSize, UINT32* pFlags)
 {
-	/* FIXME: Currently compression not implemented. Just copy the raw source */
-	
-	if (!Stream_EnsureRemainingCapacity(s, SrcSize + 1))
+	UINT32 DstSize = 0;
+
+	/* worst case of the compressed form is bounded by 9 bits per literal */
+
+	if (!Stream_EnsureRemainingCapacity(s, SrcSize + (SrcSize / 8) + 16))
 	{
 		WLog_ERR(TAG, "Stream_EnsureRemainingCapacity failed!");
 		return -1;
 	}
+
 	(*pFlags) |= ZGFX_PACKET_COMPR_TYPE_RDP8; /* RDP 8.0 compression format */
-	Stream_Write_UINT8(s, (*pFlags)); /* header (1 byte) */
-	Stream_Write(s, pSrcData, SrcSize);
+
+	if (zgfx->HistoryPosition > 0xF0000000)
+	{
+		/* rebase absolute positions, previous chains become unreachable */
+
+		ZeroMemory(zgfx->HashHead, ZGFX_HASH_SIZE * sizeof(UINT32));
+		zgfx->HistoryPosition = zgfx->HistoryBufferSize;
+		zgfx->HashPosition = zgfx->HistoryPosition;
+	}
+
+	zgfx_history_buffer_ring_write(zgfx, pSrcData, SrcSize);
+	zgfx->HistoryPosition += SrcSize;
+
+	if ((zgfx->CompressionLevel > ZGFX_COMPRESSION_LEVEL_NONE) && zgfx->HashHead && (SrcSize > ZGFX_MIN_MATCH))
+		DstSize = zgfx_compress_segment_data(zgfx, pSrcData, SrcSize, Stream_Pointer(s) + 1);
+
+	if (DstSize && (DstSize < SrcSize))
+	{
+		Stream_Write_UINT8(s, (*pFlags) | PACKET_COMPRESSED); /* header (1 byte) */
+		Stream_Seek(s, DstSize);
+	}
+	else
+	{
+		Stream_Write_UINT8(s, (*pFlags)); /* header (1 byte) */
+		Stream_Write(s, pSrcData, SrcSize);
+	}
 
 	return 1;
 }
@@ -503,10 +920,26 @@ int zgfx_compress(ZGFX_CONTEXT* zgfx, const BYTE* pSrcData, UINT32 SrcSize, BYTE
 void zgfx_context_reset(ZGFX_CONTEXT* zgfx, BOOL flush)
 {
 	zgfx->HistoryIndex = 0;
+
+	zgfx->HistoryPosition = 0;
+	zgfx->HashPosition = 0;
+
+	if (zgfx->HashHead)
+		ZeroMemory(zgfx->HashHead, ZGFX_HASH_SIZE * sizeof(UINT32));
+}
+
+void zgfx_context_set_compression_level(ZGFX_CONTEXT* zgfx, UINT32 level)
+{
+	if (level > ZGFX_COMPRESSION_LEVEL_MAX)
+		level = ZGFX_COMPRESSION_LEVEL_MAX;
+
+	zgfx->CompressionLevel = level;
 }
 
 ZGFX_CONTEXT* zgfx_context_new(BOOL Compressor)
 {
+	int opIndex;
+	const ZGFX_TOKEN* token;
 	ZGFX_CONTEXT* zgfx;
 
 	zgfx = (ZGFX_CONTEXT*) calloc(1, sizeof(ZGFX_CONTEXT));
@@ -517,6 +950,30 @@ ZGFX_CONTEXT* zgfx_context_new(BOOL Compressor)
 
 		zgfx->HistoryBufferSize = sizeof(zgfx->HistoryBuffer);
 
+		if (Compressor)
+		{
+			zgfx->CompressionLevel = ZGFX_COMPRESSION_LEVEL_DEFAULT;
+
+			zgfx->HashHead = (UINT32*) calloc(ZGFX_HASH_SIZE, sizeof(UINT32));
+			zgfx->HashChain = (UINT32*) calloc(zgfx->HistoryBufferSize, sizeof(UINT32));
+
+			if (!zgfx->HashHead || !zgfx->HashChain)
+			{
+				zgfx_context_free(zgfx);
+				return NULL;
+			}
+
+			/* cheapest literal token for each byte value, entry 0 encodes any byte on 9 bits */
+
+			for (opIndex = 0; ZGFX_TOKEN_TABLE[opIndex].prefixLength != 0; opIndex++)
+			{
+				token = &ZGFX_TOKEN_TABLE[opIndex];
+
+				if ((token->tokenType == 0) && (token->valueBits == 0))
+					zgfx->LiteralTokens[token->valueBase] = (BYTE) opIndex;
+			}
+		}
+
 		zgfx_context_reset(zgfx, FALSE);
 	}
 
@@ -525,6 +982,10 @@ ZGFX_CONTEXT* zgfx_context_new(BOOL Compressor)
 
 void zgfx_context_free(ZGFX_CONTEXT* zgfx)
 {
+	if (!zgfx)
+		return;
+
+	free(zgfx->HashHead);
+	free(zgfx->HashChain);
 	free(zgfx);
 }
-
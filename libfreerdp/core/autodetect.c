@@ -43,6 +43,11 @@
 
 #define RDP_NETCHAR_SYNC_RESPONSE_TYPE 0x0018
 
+/* Continuous measurement defaults (ms) */
+#define AUTODETECT_CONTINUOUS_RTT_INTERVAL		1000
+#define AUTODETECT_CONTINUOUS_BANDWIDTH_INTERVAL	5000
+#define AUTODETECT_CONTINUOUS_BANDWIDTH_WINDOW		1000
+
 typedef struct
 {
 	UINT8 headerLength;
@@ -343,6 +348,57 @@ BOOL autodetect_send_netchar_sync(rdpRdp* rdp, UINT16 sequenceNumber)
 	return rdp_send_message_channel_pdu(rdp, s, SEC_AUTODETECT_RSP);
 }
 
+static BOOL autodetect_notify_network_characteristics(rdpAutoDetect* autodetect)
+{
+	BOOL success = TRUE;
+	AUTODETECT_NETWORK_CHARACTERISTICS characteristics;
+
+	if (!freerdp_autodetect_get_network_characteristics(autodetect, &characteristics))
+		return FALSE;
+
+	IFCALLRET(autodetect->NetworkCharacteristicsUpdate, success, autodetect->context, &characteristics);
+
+	return success;
+}
+
+/**
+ * Round trip time estimate as in RFC 6298: the deviation is updated
+ * before the smoothed value, the first sample initializes both.
+ */
+
+void autodetect_update_rtt(rdpAutoDetect* autodetect, UINT32 rtt)
+{
+	UINT32 delta;
+
+	if (!autodetect->rttSampleCount)
+	{
+		autodetect->netCharSmoothedRTT = rtt;
+		autodetect->netCharJitter = rtt / 2;
+	}
+	else
+	{
+		if (rtt > autodetect->netCharSmoothedRTT)
+			delta = rtt - autodetect->netCharSmoothedRTT;
+		else
+			delta = autodetect->netCharSmoothedRTT - rtt;
+
+		autodetect->netCharJitter = ((autodetect->netCharJitter * 3) + delta) / 4;
+		autodetect->netCharSmoothedRTT = ((autodetect->netCharSmoothedRTT * 7) + rtt) / 8;
+	}
+
+	autodetect->rttSampleCount++;
+}
+
+void autodetect_update_goodput(rdpAutoDetect* autodetect, UINT32 bandwidth)
+{
+	if (!autodetect->bandwidthSampleCount)
+		autodetect->netCharGoodput = bandwidth;
+	else
+		autodetect->netCharGoodput = (UINT32) ((((UINT64) autodetect->netCharGoodput * 3) + bandwidth) / 4);
+
+	autodetect->bandwidthSampleCount++;
+}
+
 static BOOL autodetect_recv_rtt_measure_request(rdpRdp* rdp, wStream* s, AUTODETECT_REQ_PDU* autodetectReqPdu)
 {
 	if (autodetectReqPdu->headerLength != 0x06)
@@ -367,9 +423,15 @@ static BOOL autodetect_recv_rtt_measure_response(rdpRdp* rdp, wStream* s, AUTODE
 	if (rdp->autodetect->netCharBaseRTT == 0 || rdp->autodetect->netCharBaseRTT > rdp->autodetect->netCharAverageRTT)
 		rdp->autodetect->netCharBaseRTT = rdp->autodetect->netCharAverageRTT;
 
+	rdp->autodetect->rttRequestTime = 0;
+	autodetect_update_rtt(rdp->autodetect, rdp->autodetect->netCharAverageRTT);
+
 	IFCALLRET(rdp->autodetect->RTTMeasureResponse, success, rdp->context, autodetectRspPdu->sequenceNumber);
 
-	return success;
+	if (!success)
+		return FALSE;
+
+	return autodetect_notify_network_characteristics(rdp->autodetect);
 }
 
 static BOOL autodetect_recv_bandwidth_measure_start(rdpRdp* rdp, wStream* s, AUTODETECT_REQ_PDU* autodetectReqPdu)
@@ -470,9 +532,17 @@ static BOOL autodetect_recv_bandwidth_measure_results(rdpRdp* rdp, wStream* s, A
 	else
 		rdp->autodetect->netCharBandwidth = 0;
 
+	/* A continuous measurement covers the regular traffic: what the client actually received */
+	if ((autodetectRspPdu->responseType == RDP_BW_RESULTS_RESPONSE_TYPE_CONTINUOUS) &&
+	    (rdp->autodetect->bandwidthMeasureTimeDelta > 0))
+		autodetect_update_goodput(rdp->autodetect, rdp->autodetect->netCharBandwidth);
+
 	IFCALLRET(rdp->autodetect->BandwidthMeasureResults, success, rdp->context, autodetectRspPdu->sequenceNumber);
 
-	return success;
+	if (!success)
+		return FALSE;
+
+	return autodetect_notify_network_characteristics(rdp->autodetect);
 }
 
 static BOOL autodetect_recv_netchar_result(rdpRdp* rdp, wStream* s, AUTODETECT_REQ_PDU* autodetectReqPdu)
@@ -640,4 +710,109 @@ void autodetect_register_server_callbacks(rdpAutoDetect* autodetect)
 	autodetect->BandwidthMeasureStart = autodetect_send_continuous_bandwidth_measure_start;
 	autodetect->BandwidthMeasureStop = autodetect_send_continuous_bandwidth_measure_stop;
 	autodetect->NetworkCharacteristicsResult = autodetect_send_netchar_result;
+
+	freerdp_autodetect_set_continuous_intervals(autodetect, AUTODETECT_CONTINUOUS_RTT_INTERVAL,
+			AUTODETECT_CONTINUOUS_BANDWIDTH_INTERVAL, AUTODETECT_CONTINUOUS_BANDWIDTH_WINDOW);
+}
+
+void freerdp_autodetect_set_continuous_intervals(rdpAutoDetect* autodetect,
+		UINT32 rttInterval, UINT32 bandwidthInterval, UINT32 bandwidthWindow)
+{
+	if (!autodetect)
+		return;
+
+	autodetect->continuousRTTInterval = rttInterval;
+	autodetect->continuousBandwidthInterval = bandwidthInterval;
+	autodetect->continuousBandwidthWindow = (bandwidthWindow > 0) ? bandwidthWindow : 1;
+}
+
+/**
+ * Continuous auto-detection scheduler (server side).
+ *
+ * Sends the RTT and bandwidth requests which are due. A bandwidth
+ * measurement brackets the regular traffic sent during its window, so the
+ * result is the goodput of the session, not the capacity of the link. Only
+ * one RTT request is outstanding at a time, a missing response is given up
+ * after a few intervals.
+ *
+ * It is called when the peer checks its file descriptors, a server which
+ * mostly sends should also call it after its updates.
+ */
+
+BOOL freerdp_autodetect_check_continuous(rdpAutoDetect* autodetect)
+{
+	UINT64 now;
+	rdpRdp* rdp;
+	BOOL success = TRUE;
+	rdpContext* context;
+
+	if (!autodetect || !autodetect->context)
+		return FALSE;
+
+	context = autodetect->context;
+	rdp = context->rdp;
+
+	if (!rdp->settings->ServerMode || !rdp->settings->NetworkAutoDetect)
+		return TRUE;
+
+	if (rdp->state != CONNECTION_STATE_ACTIVE)
+		return TRUE;
+
+	now = GetTickCount64();
+
+	if (autodetect->bandwidthStopTime)
+	{
+		if (now >= autodetect->bandwidthStopTime)
+		{
+			autodetect->bandwidthStopTime = 0;
+
+			IFCALLRET(autodetect->BandwidthMeasureStop, success, context,
+					autodetect->continuousSequenceNumber++);
+		}
+	}
+	else if (autodetect->continuousBandwidthInterval &&
+		 (now >= autodetect->nextBandwidthRequestTime))
+	{
+		autodetect->nextBandwidthRequestTime = now + autodetect->continuousBandwidthInterval;
+		autodetect->bandwidthStopTime = now + autodetect->continuousBandwidthWindow;
+
+		IFCALLRET(autodetect->BandwidthMeasureStart, success, context,
+				autodetect->continuousSequenceNumber++);
+	}
+
+	if (!success)
+		return FALSE;
+
+	if (autodetect->continuousRTTInterval && (now >= autodetect->nextRTTRequestTime))
+	{
+		autodetect->nextRTTRequestTime = now + autodetect->continuousRTTInterval;
+
+		if (!autodetect->rttRequestTime ||
+		    ((now - autodetect->rttRequestTime) > (autodetect->continuousRTTInterval * 4)))
+		{
+			autodetect->rttRequestTime = now;
+
+			IFCALLRET(autodetect->RTTMeasureRequest, success, context,
+					autodetect->continuousSequenceNumber++);
+		}
+	}
+
+	return success;
+}
+
+BOOL freerdp_autodetect_get_network_characteristics(rdpAutoDetect* autodetect,
+		AUTODETECT_NETWORK_CHARACTERISTICS* characteristics)
+{
+	if (!autodetect || !characteristics)
+		return FALSE;
+
+	characteristics->baseRTT = autodetect->netCharBaseRTT;
+	characteristics->smoothedRTT = autodetect->netCharSmoothedRTT;
+	characteristics->jitter = autodetect->netCharJitter;
+	characteristics->bandwidth = autodetect->netCharBandwidth;
+	characteristics->goodput = autodetect->netCharGoodput;
+	characteristics->rttSamples = autodetect->rttSampleCount;
+	characteristics->bandwidthSamples = autodetect->bandwidthSampleCount;
+
+	return TRUE;
 }
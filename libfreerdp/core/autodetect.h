@@ -44,6 +44,9 @@ BOOL autodetect_send_connecttime_bandwidth_measure_start(rdpContext* context, UI
 BOOL autodetect_send_bandwidth_measure_payload(rdpContext* context, UINT16 payloadLength, UINT16 sequenceNumber);
 BOOL autodetect_send_connecttime_bandwidth_measure_stop(rdpContext* context, UINT16 payloadLength, UINT16 sequenceNumber);
 
+void autodetect_update_rtt(rdpAutoDetect* autodetect, UINT32 rtt);
+void autodetect_update_goodput(rdpAutoDetect* autodetect, UINT32 bandwidth);
+
 #define AUTODETECT_TAG FREERDP_TAG("core.autodetect")
 
 #endif /* __AUTODETECT_H */
@@ -921,9 +921,30 @@ wStream* fastpath_update_pdu_init_new(rdpFastPath* fastpath)
 	return s;
 }
 
+/**
+ * Sends the fragments gathered so far, their headers (and compressed
+ * payloads) are stored one after the other in fs.
+ */
+
+static BOOL fastpath_send_gathered_fragments(rdpFastPath* fastpath, DataChunk* chunks, int* count)
+{
+	int status = 0;
+
+	if (*count > 0)
+		status = transport_writev(fastpath->rdp->transport, chunks, *count);
+
+	*count = 0;
+	Stream_SetPosition(fastpath->fs, 0);
+
+	return (status < 0) ? FALSE : TRUE;
+}
+
 BOOL fastpath_send_update_pdu(rdpFastPath* fastpath, BYTE updateCode, wStream* s, BOOL skipCompression)
 {
 	int fragment;
+	BOOL gather;
+	int nchunks = 0;
+	DataChunk chunks[BIO_WRITEV_MAX_CHUNKS];
 	UINT16 maxLength;
 	UINT32 totalLength;
 	BOOL status = TRUE;
@@ -975,6 +996,17 @@ BOOL fastpath_send_update_pdu(rdpFastPath* fastpath, BYTE updateCode, wStream* s
 			rdp->sec_flags |= SEC_SECURE_CHECKSUM;
 	}
 
+	/**
+	 * When the transport writes to the socket in gather writes and the
+	 * fragments need not be signed and encrypted in place, they are
+	 * gathered and sent together with their payload taken from s.
+	 */
+	gather = FALSE;
+
+	if (!(rdp->sec_flags & SEC_ENCRYPT) && transport_supports_writev(rdp->transport))
+		gather = TRUE;
+	Stream_SetPosition(fs, 0);
+
 	for (fragment = 0; (totalLength > 0) || (fragment == 0); fragment++)
 	{
 		BYTE* pSrcData;
@@ -1051,6 +1083,40 @@ BOOL fastpath_send_update_pdu(rdpFastPath* fastpath, BYTE updateCode, wStream* s
 
 		fpUpdatePduHeader.length = fpUpdateHeader.size + fpHeaderSize + pad;
 
+		if (gather)
+		{
+			if ((nchunks > (BIO_WRITEV_MAX_CHUNKS - 2)) ||
+					((Stream_Capacity(fs) - Stream_GetPosition(fs)) < (fpHeaderSize + DstSize)))
+			{
+				if (!fastpath_send_gathered_fragments(fastpath, chunks, &nchunks))
+				{
+					status = FALSE;
+					break;
+				}
+			}
+
+			chunks[nchunks].data = Stream_Pointer(fs);
+			fastpath_write_update_pdu_header(fs, &fpUpdatePduHeader, rdp);
+			fastpath_write_update_header(fs, &fpUpdateHeader);
+
+			/* the compressor reuses its output buffer for the next fragment */
+			if (fpUpdateHeader.compression)
+				Stream_Write(fs, pDstData, DstSize);
+
+			chunks[nchunks].size = Stream_Pointer(fs) - chunks[nchunks].data;
+			nchunks++;
+
+			if (!fpUpdateHeader.compression)
+			{
+				chunks[nchunks].data = pDstData;
+				chunks[nchunks].size = DstSize;
+				nchunks++;
+			}
+
+			Stream_Seek(s, SrcSize);
+			continue;
+		}
+
 		Stream_SetPosition(fs, 0);
 		fastpath_write_update_pdu_header(fs, &fpUpdatePduHeader, rdp);
 		fastpath_write_update_header(fs, &fpUpdateHeader);
@@ -1093,6 +1159,9 @@ BOOL fastpath_send_update_pdu(rdpFastPath* fastpath, BYTE updateCode, wStream* s
 		Stream_Seek(s, SrcSize);
 	}
 
+	if (gather && status && !fastpath_send_gathered_fragments(fastpath, chunks, &nchunks))
+		status = FALSE;
+
 	rdp->sec_flags = 0;
 
 	return status;
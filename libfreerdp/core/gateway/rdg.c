@@ -38,17 +38,6 @@
 
 #define TAG FREERDP_TAG("core.gateway.rdg")
 
-#pragma pack(push, 1)
-
-typedef struct rdg_packet_header
-{
-	UINT16 type;
-	UINT16 reserved;
-	UINT32 packetLength;
-} RdgPacketHeader;
-
-#pragma pack(pop)
-
 BOOL rdg_write_packet(rdpRdg* rdg, wStream* sPacket)
 {
 	int status;
@@ -75,58 +64,160 @@ BOOL rdg_write_packet(rdpRdg* rdg, wStream* sPacket)
 	return TRUE;
 }
 
-wStream* rdg_receive_packet(rdpRdg* rdg)
+/**
+ * Out channel bytes are read from TLS in large blocks into recvStream and
+ * parsed from there, one read usually carries several RDG packets.
+ */
+
+static int rdg_fill_recv_buffer(rdpRdg* rdg)
 {
 	int status;
-	wStream* s;
-	RdgPacketHeader* packet;
-	UINT32 readCount = 0;
-
-	s = Stream_New(NULL, 1024);
+	int total = 0;
+	size_t length;
+	wStream* s = rdg->recvStream;
 
-	if (!s)
-		return NULL;
+	length = Stream_GetRemainingLength(s);
 
-	packet = (RdgPacketHeader*) Stream_Buffer(s);
+	if (Stream_GetPosition(s) > 0)
+	{
+		MoveMemory(Stream_Buffer(s), Stream_Pointer(s), length);
+		Stream_SetPosition(s, 0);
+		Stream_SetLength(s, length);
+	}
 
-	while (readCount < sizeof(RdgPacketHeader))
+	while (Stream_Length(s) < Stream_Capacity(s))
 	{
-		status = BIO_read(rdg->tlsOut->bio, Stream_Pointer(s), sizeof(RdgPacketHeader) - readCount);
+		status = BIO_read(rdg->tlsOut->bio, Stream_Buffer(s) + Stream_Length(s),
+				Stream_Capacity(s) - Stream_Length(s));
 
-		if (status < 0)
+		if (status <= 0)
 		{
-			continue;
+			if (!BIO_should_retry(rdg->tlsOut->bio))
+				return -1;
+
+			break;
 		}
 
-		readCount += status;
-		Stream_Seek(s, readCount);
-	}
+		Stream_SetLength(s, Stream_Length(s) + status);
+		total += status;
 
-	if (Stream_Capacity(s) < packet->packetLength)
-	{
-		if (!Stream_EnsureCapacity(s, packet->packetLength))
-		{
-			Stream_Free(s, TRUE);
-			return NULL;
-		}
-		packet = (RdgPacketHeader*) Stream_Buffer(s);
+		/* a TLS read returns one record, continue only if more were decrypted */
+		if (BIO_pending(rdg->tlsOut->bio) < 1)
+			break;
 	}
 
-	while (readCount < packet->packetLength)
+	return total;
+}
+
+/**
+ * Makes sure count bytes are buffered, returns 1 when they are, 0 when more
+ * data has to arrive first and -1 on error. With wait the call blocks.
+ */
+
+static int rdg_recv_buffered(rdpRdg* rdg, size_t count, BOOL wait)
+{
+	int status;
+	wStream* s = rdg->recvStream;
+
+	if (count > Stream_Capacity(s))
+		return -1;
+
+	while (Stream_GetRemainingLength(s) < count)
 	{
-		status = BIO_read(rdg->tlsOut->bio, Stream_Pointer(s), packet->packetLength - readCount);
+		status = rdg_fill_recv_buffer(rdg);
 
 		if (status < 0)
-		{
+			return -1;
+
+		if (status > 0)
 			continue;
-		}
 
-		readCount += status;
-		Stream_Seek(s, readCount);
+		if (!wait)
+			return 0;
+
+		if (BIO_wait_read(rdg->tlsOut->bio, 50) < 0)
+			return -1;
 	}
 
+	return 1;
+}
+
+static BOOL rdg_peek_packet_header(rdpRdg* rdg, UINT16* type, UINT32* packetLength)
+{
+	wStream* s = rdg->recvStream;
+
+	Stream_Read_UINT16(s, *type); /* Type */
+	Stream_Seek_UINT16(s); /* Reserved */
+	Stream_Read_UINT32(s, *packetLength); /* Packet length */
+	Stream_Rewind(s, RDG_PACKET_HEADER_LENGTH);
+
+	if ((*packetLength < RDG_PACKET_HEADER_LENGTH) ||
+			((*type == PKT_TYPE_DATA) && (*packetLength < RDG_DATA_PACKET_HEADER_LENGTH)) ||
+			((*type != PKT_TYPE_DATA) && (*packetLength > RDG_RECV_BUFFER_SIZE)))
+	{
+		WLog_ERR(TAG, "invalid packet, type: 0x%04X length: %u", *type, *packetLength);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * The read event stays signaled as long as buffered data can be processed
+ * without reading from the socket.
+ */
+
+static void rdg_update_read_event(rdpRdg* rdg)
+{
+	UINT16 type;
+	UINT32 packetLength;
+	BOOL ready = FALSE;
+	wStream* s = rdg->recvStream;
+	size_t remaining = Stream_GetRemainingLength(s);
+
+	if (rdg->packetRemainingCount)
+		ready = (remaining > 0);
+	else if (remaining >= RDG_PACKET_HEADER_LENGTH)
+	{
+		if (!rdg_peek_packet_header(rdg, &type, &packetLength))
+			ready = TRUE; /* let the reader fail */
+		else if (type == PKT_TYPE_DATA)
+			ready = (remaining >= RDG_DATA_PACKET_HEADER_LENGTH);
+		else
+			ready = (remaining >= packetLength);
+	}
+
+	if (ready || (BIO_pending(rdg->tlsOut->bio) > 0))
+		SetEvent(rdg->readEvent);
+	else
+		ResetEvent(rdg->readEvent);
+}
+
+wStream* rdg_receive_packet(rdpRdg* rdg)
+{
+	wStream* s;
+	UINT16 type;
+	UINT32 packetLength;
+
+	if (rdg_recv_buffered(rdg, RDG_PACKET_HEADER_LENGTH, TRUE) < 1)
+		return NULL;
+
+	if (!rdg_peek_packet_header(rdg, &type, &packetLength))
+		return NULL;
+
+	if (rdg_recv_buffered(rdg, packetLength, TRUE) < 1)
+		return NULL;
+
+	s = Stream_New(NULL, packetLength);
+
+	if (!s)
+		return NULL;
+
+	Stream_Copy(rdg->recvStream, s, packetLength);
 	Stream_SealLength(s);
 
+	rdg_update_read_event(rdg);
+
 	return s;
 }
 
@@ -748,7 +839,8 @@ BOOL rdg_check_event_handles(rdpRdg* rdg)
 
 	BIO_get_event(rdg->tlsOut->bio, &event);
 
-	if (WaitForSingleObject(event, 0) == WAIT_OBJECT_0)
+	if ((WaitForSingleObject(event, 0) == WAIT_OBJECT_0) ||
+			(WaitForSingleObject(rdg->readEvent, 0) == WAIT_OBJECT_0))
 	{
 		return rdg_out_channel_recv(rdg);
 	}
@@ -1133,39 +1225,85 @@ BOOL rdg_connect(rdpRdg* rdg, const char* hostname, UINT16 port, int timeout)
 	return TRUE;
 }
 
-int rdg_write_data_packet(rdpRdg* rdg, BYTE* buf, int size)
+/**
+ * Outgoing RDG packets are framed straight into sendStream, after room for
+ * the HTTP chunk size line. Several packets can share one chunk, which is
+ * sent with a single TLS write once complete.
+ */
+
+static BOOL rdg_send_chunk(rdpRdg* rdg)
 {
 	int status;
-	wStream* sChunk;
-	int packetSize = size + 10;
-	char chunkSize[11];
+	BYTE* chunk;
+	size_t length;
+	size_t headerLength;
+	char header[RDG_CHUNK_HEADER_MAX_LENGTH + 1];
+	wStream* s = rdg->sendStream;
 
-	if (size < 1)
-		return 0;
+	length = Stream_GetPosition(s) - RDG_CHUNK_HEADER_MAX_LENGTH;
 
-	sprintf_s(chunkSize, sizeof(chunkSize), "%X\r\n", packetSize);
+	if (!length)
+		return TRUE;
 
-	sChunk = Stream_New(NULL, strlen(chunkSize) + packetSize + 2);
+	sprintf_s(header, sizeof(header), "%X\r\n", (unsigned int) length);
+	headerLength = strlen(header);
 
-	if (!sChunk)
-		return -1;
+	/* the size line is written right in front of the framed packets */
+	chunk = Stream_Buffer(s) + RDG_CHUNK_HEADER_MAX_LENGTH - headerLength;
+	CopyMemory(chunk, header, headerLength);
+	Stream_Write(s, "\r\n", 2);
 
-	Stream_Write(sChunk, chunkSize, strlen(chunkSize));
+	status = tls_write_all(rdg->tlsIn, chunk, headerLength + length + 2);
+	Stream_SetPosition(s, RDG_CHUNK_HEADER_MAX_LENGTH);
+
+	return (status < 0 ? FALSE : TRUE);
+}
 
-	Stream_Write_UINT16(sChunk, PKT_TYPE_DATA);   /* Type */
-	Stream_Write_UINT16(sChunk, 0);   /* Reserved */
-	Stream_Write_UINT32(sChunk, packetSize);   /* Packet length */
+static wStream* rdg_begin_packet(rdpRdg* rdg, UINT16 type, UINT32 packetLength)
+{
+	wStream* s = rdg->sendStream;
 
-	Stream_Write_UINT16(sChunk, size);   /* Data size */
-	Stream_Write(sChunk, buf, size);   /* Data */
+	if ((Stream_GetPosition(s) - RDG_CHUNK_HEADER_MAX_LENGTH + packetLength) > RDG_SEND_BATCH_SIZE)
+	{
+		if (!rdg_send_chunk(rdg))
+			return NULL;
+	}
 
-	Stream_Write(sChunk, "\r\n", 2);
-	Stream_SealLength(sChunk);
+	Stream_Write_UINT16(s, type);   /* Type */
+	Stream_Write_UINT16(s, 0);   /* Reserved */
+	Stream_Write_UINT32(s, packetLength);   /* Packet length */
 
-	status = tls_write_all(rdg->tlsIn, Stream_Buffer(sChunk), Stream_Length(sChunk));
-	Stream_Free(sChunk, TRUE);
+	return s;
+}
 
-	if (status < 0)
+int rdg_write_data_packet(rdpRdg* rdg, BYTE* buf, int size)
+{
+	wStream* s;
+	int length;
+	int written = 0;
+
+	if (size < 1)
+		return 0;
+
+	while (written < size)
+	{
+		length = size - written;
+
+		if (length > (RDG_SEND_BATCH_SIZE - RDG_DATA_PACKET_HEADER_LENGTH))
+			length = RDG_SEND_BATCH_SIZE - RDG_DATA_PACKET_HEADER_LENGTH;
+
+		s = rdg_begin_packet(rdg, PKT_TYPE_DATA, length + RDG_DATA_PACKET_HEADER_LENGTH);
+
+		if (!s)
+			return -1;
+
+		Stream_Write_UINT16(s, length);   /* Data size */
+		Stream_Write(s, &buf[written], length);   /* Data */
+
+		written += length;
+	}
+
+	if (!rdg->batching && !rdg_send_chunk(rdg))
 		return -1;
 
 	return size;
@@ -1173,62 +1311,24 @@ int rdg_write_data_packet(rdpRdg* rdg, BYTE* buf, int size)
 
 BOOL rdg_process_close_packet(rdpRdg* rdg)
 {
-	int status;
-	wStream* sChunk;
-	int packetSize = 12;
-	char chunkSize[11];
-    
-	sprintf_s(chunkSize, sizeof(chunkSize), "%X\r\n", packetSize);
-    
-	sChunk = Stream_New(NULL, strlen(chunkSize) + packetSize + 2);
-    
-	if (!sChunk)
+	wStream* s;
+
+	s = rdg_begin_packet(rdg, PKT_TYPE_CLOSE_CHANNEL_RESPONSE, 12);
+
+	if (!s)
 		return FALSE;
-    
-	Stream_Write(sChunk, chunkSize, strlen(chunkSize));
-    
-	Stream_Write_UINT16(sChunk, PKT_TYPE_CLOSE_CHANNEL_RESPONSE);   /* Type */
-	Stream_Write_UINT16(sChunk, 0);   /* Reserved */
-	Stream_Write_UINT32(sChunk, packetSize);   /* Packet length */
-    
-	Stream_Write_UINT32(sChunk, 0);   /* Status code */
-    
-	Stream_Write(sChunk, "\r\n", 2);
-	Stream_SealLength(sChunk);
-    
-	status = tls_write_all(rdg->tlsIn, Stream_Buffer(sChunk), Stream_Length(sChunk));
-	Stream_Free(sChunk, TRUE);
-    
-	return (status < 0 ? FALSE : TRUE);
+
+	Stream_Write_UINT32(s, 0);   /* Status code */
+
+	return rdg_send_chunk(rdg);
 }
 
 BOOL rdg_process_keep_alive_packet(rdpRdg* rdg)
 {
-	int status;
-	wStream* sChunk;
-	int packetSize = 8;
-	char chunkSize[11];
-    
-	sprintf_s(chunkSize, sizeof(chunkSize), "%X\r\n", packetSize);
-    
-	sChunk = Stream_New(NULL, strlen(chunkSize) + packetSize + 2);
-    
-	if (!sChunk)
+	if (!rdg_begin_packet(rdg, PKT_TYPE_KEEPALIVE, 8))
 		return FALSE;
-    
-	Stream_Write(sChunk, chunkSize, strlen(chunkSize));
-    
-	Stream_Write_UINT16(sChunk, PKT_TYPE_KEEPALIVE);   /* Type */
-	Stream_Write_UINT16(sChunk, 0);   /* Reserved */
-	Stream_Write_UINT32(sChunk, packetSize);   /* Packet length */
-    
-	Stream_Write(sChunk, "\r\n", 2);
-	Stream_SealLength(sChunk);
-    
-	status = tls_write_all(rdg->tlsIn, Stream_Buffer(sChunk), Stream_Length(sChunk));
-	Stream_Free(sChunk, TRUE);
-    
-	return (status < 0 ? FALSE : TRUE);
+
+	return rdg_send_chunk(rdg);
 }
 
 BOOL rdg_process_unknown_packet(rdpRdg* rdg, int type)
@@ -1240,36 +1340,10 @@ BOOL rdg_process_unknown_packet(rdpRdg* rdg, int type)
 
 BOOL rdg_process_control_packet(rdpRdg* rdg, int type, int packetLength)
 {
-	wStream* s = NULL;
-	int readCount = 0;
-	int status;
-	int payloadSize = packetLength - sizeof(RdgPacketHeader);
-
-	if (payloadSize)
-	{
-		s = Stream_New(NULL, payloadSize);
-
-		if (!s)
-			return FALSE;
-
-		while (readCount < payloadSize)
-		{
-			status = BIO_read(rdg->tlsOut->bio, Stream_Pointer(s), sizeof(RdgPacketHeader) - readCount);
-
-			if (status <= 0)
-			{
-				if (!BIO_should_retry(rdg->tlsOut->bio))
-				{
-					Stream_Free(s, TRUE);
-					return FALSE;
-				}
-				continue;
-			}
+	BOOL status;
 
-			Stream_Seek(s, status);
-			readCount += status;
-		}
-	}
+	/* the payload is already buffered, none of the handled packets needs it */
+	Stream_Seek(rdg->recvStream, packetLength);
 
 	switch (type)
 	{
@@ -1290,95 +1364,98 @@ BOOL rdg_process_control_packet(rdpRdg* rdg, int type, int packetLength)
 			break;
 	}
 
-	Stream_Free(s, TRUE);
-
 	return status;
 }
 
+/**
+ * Copies as much buffered data as possible, across data packets, and
+ * processes the control packets found in between. Only reads from TLS
+ * when nothing was copied yet, returns 0 when no data is available.
+ */
+
 int rdg_read_data_packet(rdpRdg* rdg, BYTE* buffer, int size)
 {
-	RdgPacketHeader header;
-	int readCount = 0;
-	int readSize;
 	int status;
-	int pending;
+	UINT16 type;
+	size_t length;
+	UINT32 packetLength;
+	int readCount = 0;
+	wStream* s = rdg->recvStream;
 
-	if (!rdg->packetRemainingCount)
+	while (readCount < size)
 	{
-		while (readCount < sizeof(RdgPacketHeader))
+		if (!rdg->packetRemainingCount)
 		{
-			status = BIO_read(rdg->tlsOut->bio, (BYTE*)(&header) + readCount, sizeof(RdgPacketHeader) - readCount);
+			status = rdg_recv_buffered(rdg, RDG_PACKET_HEADER_LENGTH, FALSE);
 
-			if (status <= 0)
+			if (status < 0)
+				return -1;
+
+			if (!status)
+				break;
+
+			if (!rdg_peek_packet_header(rdg, &type, &packetLength))
+				return -1;
+
+			if (type != PKT_TYPE_DATA)
 			{
-				if (!BIO_should_retry(rdg->tlsOut->bio))
-				{
+				status = rdg_recv_buffered(rdg, packetLength, FALSE);
+
+				if (status < 0)
 					return -1;
-				}
-				if (!readCount)
-				{
-					return 0;
-				}
-				BIO_wait_read(rdg->tlsOut->bio, 50);
+
+				if (!status)
+					break;
+
+				if (!rdg_process_control_packet(rdg, type, packetLength))
+					return -1;
+
 				continue;
 			}
 
-			readCount += status;
-		}
+			status = rdg_recv_buffered(rdg, RDG_DATA_PACKET_HEADER_LENGTH, FALSE);
 
-		if (header.type != PKT_TYPE_DATA)
-		{
-			status = rdg_process_control_packet(rdg, header.type, header.packetLength);
-			if (!status)
-			{
+			if (status < 0)
 				return -1;
-			}
-			return 0;
-		}
 
-		readCount = 0;
+			if (!status)
+				break;
+
+			Stream_Seek(s, RDG_PACKET_HEADER_LENGTH);
+			Stream_Read_UINT16(s, rdg->packetRemainingCount);   /* Data size */
+			continue;
+		}
 
-		while (readCount < 2)
+		if (!Stream_GetRemainingLength(s))
 		{
-			status = BIO_read(rdg->tlsOut->bio, (BYTE*)(&rdg->packetRemainingCount) + readCount, 2 - readCount);
+			if (readCount > 0)
+				break;
+
+			status = rdg_fill_recv_buffer(rdg);
 
 			if (status < 0)
-			{
-				if (!BIO_should_retry(rdg->tlsOut->bio))
-				{
-					return -1;
-				}
-				BIO_wait_read(rdg->tlsOut->bio, 50);
-				continue;
-			}
+				return -1;
 
-			readCount += status;
+			if (!status)
+				break;
 		}
-	}
 
-	readSize = (rdg->packetRemainingCount < size ? rdg->packetRemainingCount : size);
+		length = Stream_GetRemainingLength(s);
 
-	status = BIO_read(rdg->tlsOut->bio, buffer, readSize);
+		if (length > rdg->packetRemainingCount)
+			length = rdg->packetRemainingCount;
 
-	if (status <= 0)
-	{
-		if (!BIO_should_retry(rdg->tlsOut->bio))
-		{
-			return -1;
-		}
-		return 0;
-	}
-
-	rdg->packetRemainingCount -= status;
+		if (length > (size_t) (size - readCount))
+			length = size - readCount;
 
-	pending = BIO_pending(rdg->tlsOut->bio);
+		Stream_Read(s, &buffer[readCount], length);
+		rdg->packetRemainingCount -= length;
+		readCount += length;
+	}
 
-	if (pending > 0)
-		SetEvent(rdg->readEvent);
-	else
-		ResetEvent(rdg->readEvent);
+	rdg_update_read_event(rdg);
 
-	return status;
+	return readCount;
 }
 
 long rdg_bio_callback(BIO* bio, int mode, const char* argp, int argi, long argl, long ret)
@@ -1460,6 +1537,13 @@ static long rdg_bio_ctrl(BIO* bio, int cmd, long arg1, void* arg2)
 
 	if (cmd == BIO_CTRL_FLUSH)
 	{
+		EnterCriticalSection(&rdg->writeSection);
+		status = rdg_send_chunk(rdg);
+		LeaveCriticalSection(&rdg->writeSection);
+
+		if (!status)
+			return -1;
+
 		(void)BIO_flush(tlsOut->bio);
 		(void)BIO_flush(tlsIn->bio);
 		status = 1;
@@ -1476,6 +1560,14 @@ static long rdg_bio_ctrl(BIO* bio, int cmd, long arg1, void* arg2)
 	{
 		status = 1;
 	}
+	else if (cmd == BIO_C_SET_BATCH)
+	{
+		/* the data packets are collected until the batch ends */
+		EnterCriticalSection(&rdg->writeSection);
+		rdg->batching = arg1 ? TRUE : FALSE;
+		status = (rdg->batching || rdg_send_chunk(rdg)) ? 1 : -1;
+		LeaveCriticalSection(&rdg->writeSection);
+	}
 	else if (cmd == BIO_C_READ_BLOCKED)
 	{
 		BIO* bio = tlsOut->bio;
@@ -1616,6 +1708,20 @@ rdpRdg* rdg_new(rdpTransport* transport)
 
 		if (!rdg->readEvent)
 			goto rdg_alloc_error;
+
+		rdg->sendStream = Stream_New(NULL, RDG_CHUNK_HEADER_MAX_LENGTH + RDG_SEND_BATCH_SIZE + 2);
+
+		if (!rdg->sendStream)
+			goto rdg_alloc_error;
+
+		Stream_SetPosition(rdg->sendStream, RDG_CHUNK_HEADER_MAX_LENGTH);
+
+		rdg->recvStream = Stream_New(NULL, RDG_RECV_BUFFER_SIZE);
+
+		if (!rdg->recvStream)
+			goto rdg_alloc_error;
+
+		Stream_SetLength(rdg->recvStream, 0);
         
 		InitializeCriticalSection(&rdg->writeSection);
 	}
@@ -1661,6 +1767,9 @@ void rdg_free(rdpRdg* rdg)
 		CloseHandle(rdg->readEvent);
 		rdg->readEvent = NULL;
 	}
+
+	Stream_Free(rdg->sendStream, TRUE);
+	Stream_Free(rdg->recvStream, TRUE);
     
 	DeleteCriticalSection(&rdg->writeSection);
 
@@ -102,6 +102,19 @@ typedef struct rdp_rdg rdpRdg;
 #define HTTP_CAPABILITY_REAUTH 0x10
 #define HTTP_CAPABILITY_UDP_TRANSPORT 0x20
 
+/* Size of the RDG packet header and of the data packet length prefix. */
+#define RDG_PACKET_HEADER_LENGTH 8
+#define RDG_DATA_PACKET_HEADER_LENGTH 10
+
+/* Room for the largest HTTP chunk size line: 8 hex digits and CRLF. */
+#define RDG_CHUNK_HEADER_MAX_LENGTH 10
+
+/* Data packets framed in one HTTP chunk before it is sent. */
+#define RDG_SEND_BATCH_SIZE 0x10000
+
+/* Bytes taken from the out channel TLS connection at once. */
+#define RDG_RECV_BUFFER_SIZE 0x10000
+
 
 enum
 {
@@ -139,6 +152,13 @@ struct rdp_rdg
 	int state;
 	UINT16 packetRemainingCount;
 	int timeout;
+
+	/* HTTP chunk being framed, sent on its own or at the end of a batch */
+	wStream* sendStream;
+	BOOL batching;
+
+	/* Out channel bytes read ahead, not yet parsed */
+	wStream* recvStream;
 };
 
 
@@ -149,5 +169,8 @@ BOOL rdg_connect(rdpRdg* rdg, const char* hostname, UINT16 port, int timeout);
 DWORD rdg_get_event_handles(rdpRdg* rdg, HANDLE* events, DWORD count);
 BOOL rdg_check_event_handles(rdpRdg* rdg);
 
+int rdg_write_data_packet(rdpRdg* rdg, BYTE* buf, int size);
+int rdg_read_data_packet(rdpRdg* rdg, BYTE* buffer, int size);
+
 
 #endif /* FREERDP_CORE_RDG_H */
@@ -35,7 +35,93 @@
 #include <winpr/collections.h>
 
 #define TAG FREERDP_TAG("core.message")
-#define WITH_STREAM_POOL	1
+
+/**
+ * Bitmap and surface data handed to the update callbacks points into the
+ * receive stream of the PDU being processed. Instead of copying it, the
+ * proxied message takes a reference on that stream, which stays alive
+ * until the message is freed by the update thread. Data which does not
+ * come from the receive pool is copied.
+ */
+
+static BOOL update_message_ref_data(rdpContext* context, BYTE** data, size_t length,
+		wStream* hint, wStream** stream)
+{
+	BYTE* copy;
+	wStream* s = hint;
+	BYTE* ptr = *data;
+
+	*stream = NULL;
+
+	if (!ptr || !length)
+	{
+		*data = NULL;
+		return TRUE;
+	}
+
+	if (!s || (ptr < Stream_Buffer(s)) || (ptr >= Stream_Buffer(s) + Stream_Capacity(s)))
+		s = StreamPool_Find(context->rdp->transport->ReceivePool, ptr);
+
+	if (s && ((size_t) (Stream_Buffer(s) + Stream_Capacity(s) - ptr) >= length))
+	{
+		Stream_AddRef(s);
+		*stream = s;
+		return TRUE;
+	}
+
+	copy = (BYTE*) malloc(length);
+	*data = copy;
+
+	if (!copy)
+		return FALSE;
+
+	CopyMemory(copy, ptr, length);
+
+	return TRUE;
+}
+
+static void update_message_unref_data(BYTE* data, wStream* stream)
+{
+	if (stream)
+		Stream_Release(stream);
+	else
+		free(data);
+}
+
+struct _UPDATE_MESSAGE_BITMAP_UPDATE
+{
+	BITMAP_UPDATE bitmapUpdate; /* must be first, passed on as BITMAP_UPDATE */
+	wStream** streams;
+};
+typedef struct _UPDATE_MESSAGE_BITMAP_UPDATE UPDATE_MESSAGE_BITMAP_UPDATE;
+
+struct _UPDATE_MESSAGE_SURFACE_BITS
+{
+	SURFACE_BITS_COMMAND surfaceBits;
+	wStream* stream;
+};
+typedef struct _UPDATE_MESSAGE_SURFACE_BITS UPDATE_MESSAGE_SURFACE_BITS;
+
+struct _UPDATE_MESSAGE_CACHE_BITMAP
+{
+	CACHE_BITMAP_ORDER cacheBitmap;
+	wStream* stream;
+};
+typedef struct _UPDATE_MESSAGE_CACHE_BITMAP UPDATE_MESSAGE_CACHE_BITMAP;
+
+struct _UPDATE_MESSAGE_CACHE_BITMAP_V2
+{
+	CACHE_BITMAP_V2_ORDER cacheBitmapV2;
+	wStream* stream;
+};
+typedef struct _UPDATE_MESSAGE_CACHE_BITMAP_V2 UPDATE_MESSAGE_CACHE_BITMAP_V2;
+
+struct _UPDATE_MESSAGE_CACHE_BITMAP_V3
+{
+	CACHE_BITMAP_V3_ORDER cacheBitmapV3;
+	wStream* stream;
+};
+typedef struct _UPDATE_MESSAGE_CACHE_BITMAP_V3 UPDATE_MESSAGE_CACHE_BITMAP_V3;
 
 /* Update */
 
@@ -82,41 +168,53 @@ static BOOL update_message_DesktopResize(rdpContext* context)
 static BOOL update_message_BitmapUpdate(rdpContext* context, BITMAP_UPDATE* bitmap)
 {
 	UINT32 index;
+	wStream* stream = NULL;
 	BITMAP_UPDATE* wParam;
+	UPDATE_MESSAGE_BITMAP_UPDATE* message;
 
-	wParam = (BITMAP_UPDATE*) malloc(sizeof(BITMAP_UPDATE));
-	if (!wParam)
+	message = (UPDATE_MESSAGE_BITMAP_UPDATE*) malloc(sizeof(UPDATE_MESSAGE_BITMAP_UPDATE));
+	if (!message)
 		return FALSE;
 
+	wParam = &message->bitmapUpdate;
 	wParam->number = bitmap->number;
 	wParam->count = wParam->number;
 
 	wParam->rectangles = (BITMAP_DATA*) malloc(sizeof(BITMAP_DATA) * wParam->number);
-	if (!wParam->rectangles)
+	message->streams = (wStream**) calloc(wParam->number, sizeof(wStream*));
+
+	if (!wParam->rectangles || !message->streams)
 	{
-		free(wParam);
+		free(wParam->rectangles);
+		free(message->streams);
+		free(message);
 		return FALSE;
 	}
 	CopyMemory(wParam->rectangles, bitmap->rectangles, sizeof(BITMAP_DATA) * wParam->number);
 
 	for (index = 0; index < wParam->number; index++)
 	{
-#ifdef WITH_STREAM_POOL
-		StreamPool_AddRef(context->rdp->transport->ReceivePool, bitmap->rectangles[index].bitmapDataStream);
-#else
-		wParam->rectangles[index].bitmapDataStream = (BYTE*) malloc(wParam->rectangles[index].bitmapLength);
-		if (!wParam->rectangles[index].bitmapDataStream)
+		BITMAP_DATA* rectangle = &wParam->rectangles[index];
+
+		/* rectangles of one update usually share the same receive stream */
+		if (!update_message_ref_data(context, &rectangle->bitmapDataStream,
+				rectangle->bitmapLength, stream, &message->streams[index]))
 		{
-			while(index)
-				free(wParam->rectangles[--index].bitmapDataStream);
+			while (index)
+			{
+				index--;
+				update_message_unref_data(wParam->rectangles[index].bitmapDataStream,
+						message->streams[index]);
+			}
 
 			free(wParam->rectangles);
-			free(wParam);
+			free(message->streams);
+			free(message);
 			return FALSE;
 		}
-		CopyMemory(wParam->rectangles[index].bitmapDataStream, bitmap->rectangles[index].bitmapDataStream,
-				wParam->rectangles[index].bitmapLength);
-#endif
+
+		if (message->streams[index])
+			stream = message->streams[index];
 	}
 
 	return MessageQueue_Post(context->update->queue, (void*) context,
@@ -184,41 +282,60 @@ static BOOL update_message_SuppressOutput(rdpContext* context, BYTE allow, RECTA
 			MakeMessageId(Update, SuppressOutput), (void*) (size_t) allow, (void*) lParam);
 }
 
+/**
+ * The proxied stream wraps the remaining bytes of s, lParam holds the
+ * reference keeping them alive or NULL if they were copied.
+ */
+
 static BOOL update_message_SurfaceCommand(rdpContext* context, wStream* s)
 {
 	wStream* wParam;
+	wStream* lParam;
+	BYTE* data = Stream_Pointer(s);
+	size_t length = Stream_GetRemainingLength(s);
 
-	wParam = Stream_New(NULL, Stream_GetRemainingLength(s));
-	if (!wParam)
+	if (!update_message_ref_data(context, &data, length, s->pool ? s : NULL, &lParam))
 		return FALSE;
 
-	Stream_Copy(s, wParam, Stream_GetRemainingLength(s));
-	Stream_SetPosition(wParam, 0);
+	if (!data)
+	{
+		if (length > 0)
+			return FALSE;
+
+		/* an empty command is posted too, with a buffer of its own */
+		if (!(data = (BYTE*) malloc(1)))
+			return FALSE;
+	}
+
+	wParam = Stream_New(data, length);
+	if (!wParam)
+	{
+		update_message_unref_data(data, lParam);
+		return FALSE;
+	}
 
 	return MessageQueue_Post(context->update->queue, (void*) context,
-			MakeMessageId(Update, SurfaceCommand), (void*) wParam, NULL);
+			MakeMessageId(Update, SurfaceCommand), (void*) wParam, (void*) lParam);
 }
 
 static BOOL update_message_SurfaceBits(rdpContext* context, SURFACE_BITS_COMMAND* surfaceBitsCommand)
 {
 	SURFACE_BITS_COMMAND* wParam;
+	UPDATE_MESSAGE_SURFACE_BITS* message;
 
-	wParam = (SURFACE_BITS_COMMAND*) malloc(sizeof(SURFACE_BITS_COMMAND));
-	if (!wParam)
+	message = (UPDATE_MESSAGE_SURFACE_BITS*) malloc(sizeof(UPDATE_MESSAGE_SURFACE_BITS));
+	if (!message)
 		return FALSE;
+
+	wParam = &message->surfaceBits;
 	CopyMemory(wParam, surfaceBitsCommand, sizeof(SURFACE_BITS_COMMAND));
 
-#ifdef WITH_STREAM_POOL
-	StreamPool_AddRef(context->rdp->transport->ReceivePool, surfaceBitsCommand->bitmapData);
-#else
-	wParam->bitmapData = (BYTE*) malloc(wParam->bitmapDataLength);
-	if (!wParam->bitmapData)
+	if (!update_message_ref_data(context, &wParam->bitmapData,
+			wParam->bitmapDataLength, NULL, &message->stream))
 	{
-		free(wParam);
+		free(message);
 		return FALSE;
 	}
-	CopyMemory(wParam->bitmapData, surfaceBitsCommand->bitmapData, wParam->bitmapDataLength);
-#endif
 
 	return MessageQueue_Post(context->update->queue, (void*) context,
 			MakeMessageId(Update, SurfaceBits), (void*) wParam, NULL);
@@ -589,19 +706,21 @@ static BOOL update_message_EllipseCB(rdpContext* context, ELLIPSE_CB_ORDER* elli
 static BOOL update_message_CacheBitmap(rdpContext* context, CACHE_BITMAP_ORDER* cacheBitmapOrder)
 {
 	CACHE_BITMAP_ORDER* wParam;
+	UPDATE_MESSAGE_CACHE_BITMAP* message;
 
-	wParam = (CACHE_BITMAP_ORDER*) malloc(sizeof(CACHE_BITMAP_ORDER));
-	if (!wParam)
+	message = (UPDATE_MESSAGE_CACHE_BITMAP*) malloc(sizeof(UPDATE_MESSAGE_CACHE_BITMAP));
+	if (!message)
 		return FALSE;
+
+	wParam = &message->cacheBitmap;
 	CopyMemory(wParam, cacheBitmapOrder, sizeof(CACHE_BITMAP_ORDER));
 
-	wParam->bitmapDataStream = (BYTE*) malloc(wParam->bitmapLength);
-	if (!wParam->bitmapDataStream)
+	if (!update_message_ref_data(context, &wParam->bitmapDataStream,
+			wParam->bitmapLength, NULL, &message->stream))
 	{
-		free(wParam);
+		free(message);
 		return FALSE;
 	}
-	CopyMemory(wParam->bitmapDataStream, cacheBitmapOrder, wParam->bitmapLength);
 
 	return MessageQueue_Post(context->update->queue, (void*) context,
 			MakeMessageId(SecondaryUpdate, CacheBitmap), (void*) wParam, NULL);
@@ -610,19 +729,21 @@ static BOOL update_message_CacheBitmap(rdpContext* context, CACHE_BITMAP_ORDER*
 static BOOL update_message_CacheBitmapV2(rdpContext* context, CACHE_BITMAP_V2_ORDER* cacheBitmapV2Order)
 {
 	CACHE_BITMAP_V2_ORDER* wParam;
+	UPDATE_MESSAGE_CACHE_BITMAP_V2* message;
 
-	wParam = (CACHE_BITMAP_V2_ORDER*) malloc(sizeof(CACHE_BITMAP_V2_ORDER));
-	if (!wParam)
+	message = (UPDATE_MESSAGE_CACHE_BITMAP_V2*) malloc(sizeof(UPDATE_MESSAGE_CACHE_BITMAP_V2));
+	if (!message)
 		return FALSE;
+
+	wParam = &message->cacheBitmapV2;
 	CopyMemory(wParam, cacheBitmapV2Order, sizeof(CACHE_BITMAP_V2_ORDER));
 
-	wParam->bitmapDataStream = (BYTE*) malloc(wParam->bitmapLength);
-	if (!wParam->bitmapDataStream)
+	if (!update_message_ref_data(context, &wParam->bitmapDataStream,
+			wParam->bitmapLength, NULL, &message->stream))
 	{
-		free(wParam);
+		free(message);
 		return FALSE;
 	}
-	CopyMemory(wParam->bitmapDataStream, cacheBitmapV2Order->bitmapDataStream, wParam->bitmapLength);
 
 	return MessageQueue_Post(context->update->queue, (void*) context,
 			MakeMessageId(SecondaryUpdate, CacheBitmapV2), (void*) wParam, NULL);
@@ -631,19 +752,21 @@ static BOOL update_message_CacheBitmapV2(rdpContext* context, CACHE_BITMAP_V2_OR
 static BOOL update_message_CacheBitmapV3(rdpContext* context, CACHE_BITMAP_V3_ORDER* cacheBitmapV3Order)
 {
 	CACHE_BITMAP_V3_ORDER* wParam;
+	UPDATE_MESSAGE_CACHE_BITMAP_V3* message;
 
-	wParam = (CACHE_BITMAP_V3_ORDER*) malloc(sizeof(CACHE_BITMAP_V3_ORDER));
-	if (!wParam)
+	message = (UPDATE_MESSAGE_CACHE_BITMAP_V3*) malloc(sizeof(UPDATE_MESSAGE_CACHE_BITMAP_V3));
+	if (!message)
 		return FALSE;
+
+	wParam = &message->cacheBitmapV3;
 	CopyMemory(wParam, cacheBitmapV3Order, sizeof(CACHE_BITMAP_V3_ORDER));
 
-	wParam->bitmapData.data = (BYTE*) malloc(wParam->bitmapData.length);
-	if (!wParam->bitmapData.data)
+	if (!update_message_ref_data(context, &wParam->bitmapData.data,
+			wParam->bitmapData.length, NULL, &message->stream))
 	{
-		free(wParam);
+		free(message);
 		return FALSE;
 	}
-	CopyMemory(wParam->bitmapData.data, cacheBitmapV3Order->bitmapData.data, wParam->bitmapData.length);
 
 	return MessageQueue_Post(context->update->queue, (void*) context,
 			MakeMessageId(SecondaryUpdate, CacheBitmapV3), (void*) wParam, NULL);
@@ -1264,20 +1387,18 @@ static int update_message_free_update_class(wMessage* msg, int type)
 		case Update_BitmapUpdate:
 			{
 				UINT32 index;
-				BITMAP_UPDATE* wParam = (BITMAP_UPDATE*) msg->wParam;
+				UPDATE_MESSAGE_BITMAP_UPDATE* message = (UPDATE_MESSAGE_BITMAP_UPDATE*) msg->wParam;
+				BITMAP_UPDATE* wParam = &message->bitmapUpdate;
 
 				for (index = 0; index < wParam->number; index++)
 				{
-#ifdef WITH_STREAM_POOL
-					rdpContext* context = (rdpContext*) msg->context;
-					StreamPool_Release(context->rdp->transport->ReceivePool, wParam->rectangles[index].bitmapDataStream);
-#else
-					free(wParam->rectangles[index].bitmapDataStream);
-#endif
+					update_message_unref_data(wParam->rectangles[index].bitmapDataStream,
+							message->streams[index]);
 				}
 
 				free(wParam->rectangles);
-				free(wParam);
+				free(message->streams);
+				free(message);
 			}
 			break;
 
@@ -1300,21 +1421,18 @@ static int update_message_free_update_class(wMessage* msg, int type)
 		case Update_SurfaceCommand:
 			{
 				wStream* s = (wStream*) msg->wParam;
-				Stream_Free(s, TRUE);
+
+				update_message_unref_data(Stream_Buffer(s), (wStream*) msg->lParam);
+				Stream_Free(s, FALSE);
 			}
 			break;
 
 		case Update_SurfaceBits:
 			{
-#ifdef WITH_STREAM_POOL
-				rdpContext* context = (rdpContext*) msg->context;
-				SURFACE_BITS_COMMAND* wParam = (SURFACE_BITS_COMMAND*) msg->wParam;
-				StreamPool_Release(context->rdp->transport->ReceivePool, wParam->bitmapData);
-#else
-				SURFACE_BITS_COMMAND* wParam = (SURFACE_BITS_COMMAND*) msg->wParam;
-				free(wParam->bitmapData);
-				free(wParam);
-#endif
+				UPDATE_MESSAGE_SURFACE_BITS* message = (UPDATE_MESSAGE_SURFACE_BITS*) msg->wParam;
+
+				update_message_unref_data(message->surfaceBits.bitmapData, message->stream);
+				free(message);
 			}
 			break;
 
@@ -1643,28 +1761,28 @@ static int update_message_free_secondary_update_class(wMessage* msg, int type)
 	{
 		case SecondaryUpdate_CacheBitmap:
 			{
-				CACHE_BITMAP_ORDER* wParam = (CACHE_BITMAP_ORDER*) msg->wParam;
+				UPDATE_MESSAGE_CACHE_BITMAP* message = (UPDATE_MESSAGE_CACHE_BITMAP*) msg->wParam;
 
-				free(wParam->bitmapDataStream);
-				free(wParam);
+				update_message_unref_data(message->cacheBitmap.bitmapDataStream, message->stream);
+				free(message);
 			}
 			break;
 
 		case SecondaryUpdate_CacheBitmapV2:
 			{
-				CACHE_BITMAP_V2_ORDER* wParam = (CACHE_BITMAP_V2_ORDER*) msg->wParam;
+				UPDATE_MESSAGE_CACHE_BITMAP_V2* message = (UPDATE_MESSAGE_CACHE_BITMAP_V2*) msg->wParam;
 
-				free(wParam->bitmapDataStream);
-				free(wParam);
+				update_message_unref_data(message->cacheBitmapV2.bitmapDataStream, message->stream);
+				free(message);
 			}
 			break;
 
 		case SecondaryUpdate_CacheBitmapV3:
 			{
-				CACHE_BITMAP_V3_ORDER* wParam = (CACHE_BITMAP_V3_ORDER*) msg->wParam;
+				UPDATE_MESSAGE_CACHE_BITMAP_V3* message = (UPDATE_MESSAGE_CACHE_BITMAP_V3*) msg->wParam;
 
-				free(wParam->bitmapData.data);
-				free(wParam);
+				update_message_unref_data(message->cacheBitmapV3.bitmapData.data, message->stream);
+				free(message);
 			}
 			break;
 
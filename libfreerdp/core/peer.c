@@ -270,7 +270,7 @@ static BOOL freerdp_peer_check_fds(freerdp_peer* peer)
 	if (status < 0)
 		return FALSE;
 
-	return TRUE;
+	return freerdp_autodetect_check_continuous(rdp->autodetect);
 }
 
 static BOOL peer_recv_data_pdu(freerdp_peer* client, wStream* s)
@@ -35,6 +35,7 @@
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <net/if.h>
@@ -134,6 +135,76 @@ static int transport_bio_simple_write(BIO* bio, const char* buf, int size)
 	return status;
 }
 
+/**
+ * Gather write of up to BIO_WRITEV_MAX_CHUNKS + 2 chunks, the buffered
+ * socket BIO prepends the (at most two) chunks of its xmit buffer.
+ */
+
+static int transport_bio_simple_writev(BIO* bio, const DataChunk* chunks, int count)
+{
+	int index;
+	int error;
+	int status = 0;
+	WINPR_BIO_SIMPLE_SOCKET* ptr = (WINPR_BIO_SIMPLE_SOCKET*) bio->ptr;
+#ifdef _WIN32
+	DWORD sent = 0;
+	WSABUF buffers[BIO_WRITEV_MAX_CHUNKS + 2];
+#else
+	struct msghdr msg;
+	struct iovec iov[BIO_WRITEV_MAX_CHUNKS + 2];
+#endif
+
+	if (!chunks || (count < 1))
+		return 0;
+
+	if (count > (BIO_WRITEV_MAX_CHUNKS + 2))
+		count = BIO_WRITEV_MAX_CHUNKS + 2;
+
+	BIO_clear_flags(bio, BIO_FLAGS_WRITE);
+
+#ifdef _WIN32
+	for (index = 0; index < count; index++)
+	{
+		buffers[index].buf = (CHAR*) chunks[index].data;
+		buffers[index].len = (ULONG) chunks[index].size;
+	}
+
+	if (WSASend(ptr->socket, buffers, count, &sent, 0, NULL, NULL) == 0)
+		status = (int) sent;
+	else
+		status = -1;
+#else
+	for (index = 0; index < count; index++)
+	{
+		iov[index].iov_base = (void*) chunks[index].data;
+		iov[index].iov_len = chunks[index].size;
+	}
+
+	ZeroMemory(&msg, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = count;
+
+	status = (int) sendmsg((int) ptr->socket, &msg, 0);
+#endif
+
+	if (status <= 0)
+	{
+		error = WSAGetLastError();
+
+		if ((error == WSAEWOULDBLOCK) || (error == WSAEINTR) ||
+			(error == WSAEINPROGRESS) || (error == WSAEALREADY))
+		{
+			BIO_set_flags(bio, (BIO_FLAGS_WRITE | BIO_FLAGS_SHOULD_RETRY));
+		}
+		else
+		{
+			BIO_clear_flags(bio, BIO_FLAGS_SHOULD_RETRY);
+		}
+	}
+
+	return status;
+}
+
 static int transport_bio_simple_read(BIO* bio, char* buf, int size)
 {
 	int error;
@@ -214,6 +285,10 @@ static long transport_bio_simple_ctrl(BIO* bio, int cmd, long arg1, void* arg2)
 
 		return 1;
 	}
+	else if (cmd == BIO_C_WRITEV)
+	{
+		return transport_bio_simple_writev(bio, (const DataChunk*) arg2, (int) arg1);
+	}
 	else if (cmd == BIO_C_SET_NONBLOCK)
 	{
 #ifndef _WIN32
@@ -471,66 +546,122 @@ long transport_bio_buffered_callback(BIO* bio, int mode, const char* argp, int a
 	return 1;
 }
 
-static int transport_bio_buffered_write(BIO* bio, const char* buf, int num)
+/**
+ * Sends the pending bytes of the xmit buffer followed by the given chunks
+ * with as few socket writes as possible. Only what the socket did not take
+ * is copied to the xmit buffer, so outgoing data is written straight from
+ * its source buffers as long as the socket is not blocked.
+ *
+ * Returns the number of bytes taken from the chunks, which is all of them
+ * unless a fatal error occurred.
+ */
+
+static int transport_bio_buffered_send(BIO* bio, const DataChunk* chunks, int count)
 {
-	int i, ret;
+	int index;
 	int status;
 	int nchunks;
-	int committedBytes;
-	DataChunk chunks[2];
+	int nvec = 0;
+	int first = 0;
+	int ret = 0;
+	size_t pending;
+	size_t sent = 0;
+	DataChunk vec[BIO_WRITEV_MAX_CHUNKS + 2];
 	WINPR_BIO_BUFFERED_SOCKET* ptr = (WINPR_BIO_BUFFERED_SOCKET*) bio->ptr;
 
-	ret = num;
+	if (count > BIO_WRITEV_MAX_CHUNKS)
+		return -1;
+
 	ptr->writeBlocked = FALSE;
 	BIO_clear_flags(bio, BIO_FLAGS_WRITE);
 
-	/* we directly append extra bytes in the xmit buffer, this could be prevented
-	 * but for now it makes the code more simple.
-	 */
-	if (buf && num && !ringbuffer_write(&ptr->xmitBuffer, (const BYTE*) buf, num))
+	pending = ringbuffer_used(&ptr->xmitBuffer);
+	nchunks = ringbuffer_peek(&ptr->xmitBuffer, vec, pending);
+	nvec = nchunks;
+
+	for (index = 0; index < count; index++)
 	{
-		WLog_ERR(TAG, "an error occurred when writing (num: %d)", num);
-		return -1;
-	}
+		if (!chunks[index].size)
+			continue;
 
-	committedBytes = 0;
-	nchunks = ringbuffer_peek(&ptr->xmitBuffer, chunks, ringbuffer_used(&ptr->xmitBuffer));
+		vec[nvec++] = chunks[index];
+		ret += (int) chunks[index].size;
+	}
 
-	for (i = 0; i < nchunks; i++)
+	while (first < nvec)
 	{
-		while (chunks[i].size)
+		if ((nvec - first) == 1)
+			status = BIO_write(bio->next_bio, vec[first].data, (int) vec[first].size);
+		else
+			status = BIO_writev(bio->next_bio, &vec[first], nvec - first);
+
+		if (status <= 0)
 		{
-			status = BIO_write(bio->next_bio, chunks[i].data, chunks[i].size);
+			if (!BIO_should_retry(bio->next_bio))
+			{
+				BIO_clear_flags(bio, BIO_FLAGS_SHOULD_RETRY);
+				ret = -1; /* fatal error */
+				goto out;
+			}
 
-			if (status <= 0)
+			if (BIO_should_write(bio->next_bio))
 			{
-				if (!BIO_should_retry(bio->next_bio))
-				{
-					BIO_clear_flags(bio, BIO_FLAGS_SHOULD_RETRY);
-					ret = -1; /* fatal error */
-					goto out;
-				}
+				BIO_set_flags(bio, BIO_FLAGS_WRITE);
+				ptr->writeBlocked = TRUE;
+				goto out; /* EWOULDBLOCK */
+			}
 
-				if (BIO_should_write(bio->next_bio))
-				{
-					BIO_set_flags(bio, BIO_FLAGS_WRITE);
-					ptr->writeBlocked = TRUE;
-					goto out; /* EWOULDBLOCK */
-				}
+			continue;
+		}
+
+		sent += status;
+
+		while (status > 0)
+		{
+			if ((size_t) status < vec[first].size)
+			{
+				vec[first].data += status;
+				vec[first].size -= status;
+				break;
 			}
 
-			committedBytes += status;
-			chunks[i].size -= status;
-			chunks[i].data += status;
+			status -= (int) vec[first].size;
+			first++;
 		}
 	}
 
 out:
-	ringbuffer_commit_read_bytes(&ptr->xmitBuffer, committedBytes);
+	ringbuffer_commit_read_bytes(&ptr->xmitBuffer, (sent < pending) ? sent : pending);
+
+	if (ret < 0)
+		return ret;
+
+	/* keep the unsent tail, xmit buffer chunks left in vec are still in the ring */
+	for (index = (first > nchunks) ? first : nchunks; index < nvec; index++)
+	{
+		if (!ringbuffer_write(&ptr->xmitBuffer, vec[index].data, vec[index].size))
+		{
+			WLog_ERR(TAG, "an error occurred when writing (num: %d)", (int) vec[index].size);
+			return -1;
+		}
+	}
 
 	return ret;
 }
 
+static int transport_bio_buffered_write(BIO* bio, const char* buf, int num)
+{
+	DataChunk chunk;
+
+	chunk.data = (const BYTE*) buf;
+	chunk.size = (buf && (num > 0)) ? (size_t) num : 0;
+
+	if (transport_bio_buffered_send(bio, &chunk, 1) < 0)
+		return -1;
+
+	return num;
+}
+
 static int transport_bio_buffered_read(BIO* bio, char* buf, int size)
 {
 	int status;
@@ -591,6 +722,10 @@ static long transport_bio_buffered_ctrl(BIO* bio, int cmd, long arg1, void* arg2
 			status = ringbuffer_used(&ptr->xmitBuffer);
 			break;
 
+		case BIO_C_WRITEV:
+			status = transport_bio_buffered_send(bio, (const DataChunk*) arg2, (int) arg1);
+			break;
+
 		case BIO_CTRL_PENDING:
 			status = 0;
 			break;
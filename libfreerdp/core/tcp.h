@@ -48,6 +48,11 @@
 #define BIO_C_WRITE_BLOCKED		1106
 #define BIO_C_WAIT_READ			1107
 #define BIO_C_WAIT_WRITE		1108
+#define BIO_C_WRITEV			1109
+#define BIO_C_SET_BATCH			1110
+
+/* maximum number of DataChunk entries accepted by BIO_writev */
+#define BIO_WRITEV_MAX_CHUNKS		32
 
 #define BIO_set_socket(b, s, c)		BIO_ctrl(b, BIO_C_SET_SOCKET, c, s);
 #define BIO_get_socket(b, c)		BIO_ctrl(b, BIO_C_GET_SOCKET, 0, (char*) c)
@@ -57,6 +62,8 @@
 #define BIO_write_blocked(b)		BIO_ctrl(b, BIO_C_WRITE_BLOCKED, 0, NULL)
 #define BIO_wait_read(b, c)		BIO_ctrl(b, BIO_C_WAIT_READ, c, NULL)
 #define BIO_wait_write(b, c)		BIO_ctrl(b, BIO_C_WAIT_WRITE, c, NULL)
+#define BIO_writev(b, v, c)		BIO_ctrl(b, BIO_C_WRITEV, c, (void*) v)
+#define BIO_set_batch(b, c)		BIO_ctrl(b, BIO_C_SET_BATCH, c, NULL)
 
 BIO_METHOD* BIO_s_simple_socket(void);
 BIO_METHOD* BIO_s_buffered_socket(void);
@@ -0,0 +1,413 @@
+#include <winpr/crt.h>
+#include <winpr/stream.h>
+#include <winpr/sysinfo.h>
+
+#include <freerdp/freerdp.h>
+#include <freerdp/autodetect.h>
+
+#include "../rdp.h"
+#include "../autodetect.h"
+
+/**
+ * A server side rdpAutoDetect without a connection: the requests are
+ * counted by the callbacks and the responses are parsed from PDUs built
+ * by the test.
+ */
+
+struct _TEST_AUTODETECT
+{
+	rdpContext context;
+	rdpRdp rdp;
+	rdpAutoDetect* autodetect;
+
+	UINT32 rttRequests;
+	UINT32 bandwidthStarts;
+	UINT32 bandwidthStops;
+	UINT32 updates;
+	UINT16 lastSequenceNumber;
+	AUTODETECT_NETWORK_CHARACTERISTICS characteristics;
+};
+typedef struct _TEST_AUTODETECT TEST_AUTODETECT;
+
+static BOOL test_rtt_measure_request(rdpContext* context, UINT16 sequenceNumber)
+{
+	TEST_AUTODETECT* test = (TEST_AUTODETECT*) context;
+
+	test->rttRequests++;
+	test->lastSequenceNumber = sequenceNumber;
+
+	return TRUE;
+}
+
+static BOOL test_bandwidth_measure_start(rdpContext* context, UINT16 sequenceNumber)
+{
+	TEST_AUTODETECT* test = (TEST_AUTODETECT*) context;
+
+	test->bandwidthStarts++;
+	test->lastSequenceNumber = sequenceNumber;
+
+	return TRUE;
+}
+
+static BOOL test_bandwidth_measure_stop(rdpContext* context, UINT16 sequenceNumber)
+{
+	TEST_AUTODETECT* test = (TEST_AUTODETECT*) context;
+
+	test->bandwidthStops++;
+	test->lastSequenceNumber = sequenceNumber;
+
+	return TRUE;
+}
+
+static BOOL test_network_characteristics_update(rdpContext* context,
+		const AUTODETECT_NETWORK_CHARACTERISTICS* characteristics)
+{
+	TEST_AUTODETECT* test = (TEST_AUTODETECT*) context;
+
+	test->updates++;
+	test->characteristics = *characteristics;
+
+	return TRUE;
+}
+
+static void test_autodetect_free(TEST_AUTODETECT* test)
+{
+	if (!test)
+		return;
+
+	autodetect_free(test->autodetect);
+	freerdp_settings_free(test->rdp.settings);
+	free(test);
+}
+
+static TEST_AUTODETECT* test_autodetect_new(void)
+{
+	TEST_AUTODETECT* test;
+	rdpAutoDetect* autodetect;
+
+	if (!(test = (TEST_AUTODETECT*) calloc(1, sizeof(TEST_AUTODETECT))))
+		return NULL;
+
+	if (!(test->rdp.settings = freerdp_settings_new(0)))
+		goto fail;
+
+	test->rdp.settings->ServerMode = TRUE;
+	test->rdp.settings->NetworkAutoDetect = TRUE;
+	test->rdp.state = CONNECTION_STATE_ACTIVE;
+	test->rdp.context = &test->context;
+	test->context.rdp = &test->rdp;
+	test->context.settings = test->rdp.settings;
+
+	if (!(autodetect = test->autodetect = autodetect_new()))
+		goto fail;
+
+	test->rdp.autodetect = autodetect;
+	autodetect->context = &test->context;
+	autodetect->RTTMeasureRequest = test_rtt_measure_request;
+	autodetect->BandwidthMeasureStart = test_bandwidth_measure_start;
+	autodetect->BandwidthMeasureStop = test_bandwidth_measure_stop;
+	autodetect->NetworkCharacteristicsUpdate = test_network_characteristics_update;
+
+	return test;
+
+fail:
+	test_autodetect_free(test);
+	return NULL;
+}
+
+static BOOL test_autodetect_check(TEST_AUTODETECT* test, UINT32 smoothedRTT, UINT32 jitter,
+				  UINT32 goodput, const char* step)
+{
+	AUTODETECT_NETWORK_CHARACTERISTICS characteristics;
+
+	if (!freerdp_autodetect_get_network_characteristics(test->autodetect, &characteristics))
+		return FALSE;
+
+	if ((characteristics.smoothedRTT != smoothedRTT) || (characteristics.jitter != jitter) ||
+	    (characteristics.goodput != goodput))
+	{
+		fprintf(stderr, "%s: rtt %u jitter %u goodput %u, expected %u %u %u\n", step,
+			characteristics.smoothedRTT, characteristics.jitter, characteristics.goodput,
+			smoothedRTT, jitter, goodput);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* RTT Measure Response (MS-RDPBCGR 2.2.14.2.1) */
+static BOOL test_autodetect_recv_rtt_response(TEST_AUTODETECT* test, UINT16 sequenceNumber)
+{
+	int status;
+	wStream* s;
+
+	if (!(s = Stream_New(NULL, 6)))
+		return FALSE;
+
+	Stream_Write_UINT8(s, 0x06); /* headerLength (1 byte) */
+	Stream_Write_UINT8(s, 0x01); /* headerTypeId (1 byte) */
+	Stream_Write_UINT16(s, sequenceNumber); /* sequenceNumber (2 bytes) */
+	Stream_Write_UINT16(s, 0x0000); /* responseType (2 bytes) */
+	Stream_SealLength(s);
+	Stream_SetPosition(s, 0);
+
+	status = rdp_recv_autodetect_response_packet(&test->rdp, s);
+	Stream_Free(s, TRUE);
+
+	return (status < 0) ? FALSE : TRUE;
+}
+
+/* Bandwidth Measure Results (MS-RDPBCGR 2.2.14.2.2) */
+static BOOL test_autodetect_recv_bandwidth_results(TEST_AUTODETECT* test, UINT16 responseType,
+						   UINT32 timeDelta, UINT32 byteCount)
+{
+	int status;
+	wStream* s;
+
+	if (!(s = Stream_New(NULL, 14)))
+		return FALSE;
+
+	Stream_Write_UINT8(s, 0x0E); /* headerLength (1 byte) */
+	Stream_Write_UINT8(s, 0x01); /* headerTypeId (1 byte) */
+	Stream_Write_UINT16(s, 0); /* sequenceNumber (2 bytes) */
+	Stream_Write_UINT16(s, responseType); /* responseType (2 bytes) */
+	Stream_Write_UINT32(s, timeDelta); /* timeDelta (4 bytes) */
+	Stream_Write_UINT32(s, byteCount); /* byteCount (4 bytes) */
+	Stream_SealLength(s);
+	Stream_SetPosition(s, 0);
+
+	status = rdp_recv_autodetect_response_packet(&test->rdp, s);
+	Stream_Free(s, TRUE);
+
+	return (status < 0) ? FALSE : TRUE;
+}
+
+/**
+ * The smoothed RTT has a gain of 1/8 and the jitter of 1/4, updated from
+ * the deviation to the previous estimate. The goodput has a gain of 1/4.
+ */
+static BOOL test_autodetect_estimators(void)
+{
+	BOOL rc = FALSE;
+	TEST_AUTODETECT* test;
+
+	if (!(test = test_autodetect_new()))
+		return FALSE;
+
+	autodetect_update_rtt(test->autodetect, 100);
+
+	if (!test_autodetect_check(test, 100, 50, 0, "rtt 100"))
+		goto fail;
+
+	/* jitter (50 * 3 + 100) / 4, rtt (100 * 7 + 200) / 8 */
+	autodetect_update_rtt(test->autodetect, 200);
+
+	if (!test_autodetect_check(test, 112, 62, 0, "rtt 200"))
+		goto fail;
+
+	/* jitter (62 * 3 + 12) / 4, rtt (112 * 7 + 100) / 8 */
+	autodetect_update_rtt(test->autodetect, 100);
+
+	if (!test_autodetect_check(test, 110, 49, 0, "rtt 100 again"))
+		goto fail;
+
+	autodetect_update_goodput(test->autodetect, 8000);
+
+	if (!test_autodetect_check(test, 110, 49, 8000, "goodput 8000"))
+		goto fail;
+
+	autodetect_update_goodput(test->autodetect, 4000);
+
+	if (!test_autodetect_check(test, 110, 49, 7000, "goodput 4000"))
+		goto fail;
+
+	/* No overflow with rates near the UINT32 range */
+	autodetect_update_goodput(test->autodetect, 0xFFFFFFF0);
+
+	if (!test_autodetect_check(test, 110, 49, (UINT32) ((7000ULL * 3 + 0xFFFFFFF0) / 4), "goodput max"))
+		goto fail;
+
+	if ((test->autodetect->rttSampleCount != 3) || (test->autodetect->bandwidthSampleCount != 3))
+		goto fail;
+
+	rc = TRUE;
+
+fail:
+	test_autodetect_free(test);
+	return rc;
+}
+
+/**
+ * Continuous bandwidth results feed the goodput, connect-time results and
+ * empty measurements do not. Each result is reported to the update callback.
+ */
+static BOOL test_autodetect_responses(void)
+{
+	BOOL rc = FALSE;
+	TEST_AUTODETECT* test;
+	rdpAutoDetect* autodetect;
+
+	if (!(test = test_autodetect_new()))
+		return FALSE;
+
+	autodetect = test->autodetect;
+
+	/* 50000 bytes in 100 ms: 4000 kbit/s */
+	if (!test_autodetect_recv_bandwidth_results(test, 0x000B, 100, 50000))
+		goto fail;
+
+	if (!test_autodetect_check(test, 0, 0, 4000, "continuous") || (test->updates != 1) ||
+	    (test->characteristics.goodput != 4000) || (test->characteristics.bandwidth != 4000))
+		goto fail;
+
+	if (!test_autodetect_recv_bandwidth_results(test, 0x0003, 100, 100000))
+		goto fail;
+
+	if (!test_autodetect_check(test, 0, 0, 4000, "connect-time") || (test->updates != 2) ||
+	    (test->characteristics.bandwidth != 8000))
+		goto fail;
+
+	if (!test_autodetect_recv_bandwidth_results(test, 0x000B, 0, 100000))
+		goto fail;
+
+	if (!test_autodetect_check(test, 0, 0, 4000, "empty") ||
+	    (test->characteristics.bandwidthSamples != 1))
+		goto fail;
+
+	autodetect->rttRequestTime = GetTickCount64();
+	autodetect->rttMeasureStartTime = GetTickCountPrecise();
+
+	if (!test_autodetect_recv_rtt_response(test, 1))
+		goto fail;
+
+	if ((autodetect->rttRequestTime != 0) || (test->characteristics.rttSamples != 1) ||
+	    (test->characteristics.baseRTT != autodetect->netCharAverageRTT) ||
+	    (test->characteristics.smoothedRTT != autodetect->netCharAverageRTT))
+	{
+		fprintf(stderr, "%s: RTT response not accounted\n", __FUNCTION__);
+		goto fail;
+	}
+
+	rc = TRUE;
+
+fail:
+	test_autodetect_free(test);
+	return rc;
+}
+
+/**
+ * Only one RTT request is outstanding: a due request waits for the
+ * response, or for four intervals without one. A bandwidth measurement
+ * is stopped after its window and started again after its interval.
+ */
+static BOOL test_autodetect_scheduler(void)
+{
+	BOOL rc = FALSE;
+	UINT16 sequenceNumber;
+	TEST_AUTODETECT* test;
+	rdpAutoDetect* autodetect;
+
+	if (!(test = test_autodetect_new()))
+		return FALSE;
+
+	autodetect = test->autodetect;
+	freerdp_autodetect_set_continuous_intervals(autodetect, 1000, 5000, 1000);
+
+	/* Nothing is sent before the connection is active */
+	test->rdp.state = CONNECTION_STATE_ACTIVE - 1;
+
+	if (!freerdp_autodetect_check_continuous(autodetect) || test->rttRequests || test->bandwidthStarts)
+		goto fail;
+
+	test->rdp.state = CONNECTION_STATE_ACTIVE;
+
+	if (!freerdp_autodetect_check_continuous(autodetect))
+		goto fail;
+
+	if ((test->rttRequests != 1) || (test->bandwidthStarts != 1) || test->bandwidthStops)
+		goto fail;
+
+	sequenceNumber = test->lastSequenceNumber;
+
+	/* Nothing is due yet */
+	if (!freerdp_autodetect_check_continuous(autodetect) || (test->rttRequests != 1))
+		goto fail;
+
+	/* Due, but the request is still outstanding */
+	autodetect->nextRTTRequestTime = 0;
+
+	if (!freerdp_autodetect_check_continuous(autodetect) || (test->rttRequests != 1))
+	{
+		fprintf(stderr, "%s: second RTT request while one is outstanding\n", __FUNCTION__);
+		goto fail;
+	}
+
+	autodetect->rttMeasureStartTime = GetTickCountPrecise();
+
+	if (!test_autodetect_recv_rtt_response(test, sequenceNumber))
+		goto fail;
+
+	autodetect->nextRTTRequestTime = 0;
+
+	if (!freerdp_autodetect_check_continuous(autodetect) || (test->rttRequests != 2))
+		goto fail;
+
+	if ((UINT16) (test->lastSequenceNumber - sequenceNumber) != 1)
+		goto fail;
+
+	/* A response missing for four intervals is given up */
+	autodetect->nextRTTRequestTime = 0;
+	autodetect->rttRequestTime -= 4001;
+
+	if (!freerdp_autodetect_check_continuous(autodetect) || (test->rttRequests != 3))
+	{
+		fprintf(stderr, "%s: lost RTT response not given up\n", __FUNCTION__);
+		goto fail;
+	}
+
+	/* The bandwidth window ends, the next measurement waits for its interval */
+	autodetect->bandwidthStopTime = 1;
+
+	if (!freerdp_autodetect_check_continuous(autodetect) ||
+	    (test->bandwidthStops != 1) || (test->bandwidthStarts != 1))
+		goto fail;
+
+	if (!freerdp_autodetect_check_continuous(autodetect) || (test->bandwidthStarts != 1))
+		goto fail;
+
+	autodetect->nextBandwidthRequestTime = 0;
+
+	if (!freerdp_autodetect_check_continuous(autodetect) || (test->bandwidthStarts != 2))
+		goto fail;
+
+	/* A zero interval disables the measurement */
+	freerdp_autodetect_set_continuous_intervals(autodetect, 0, 0, 0);
+	autodetect->nextRTTRequestTime = 0;
+	autodetect->rttRequestTime = 0;
+	autodetect->bandwidthStopTime = 0;
+	autodetect->nextBandwidthRequestTime = 0;
+
+	if (!freerdp_autodetect_check_continuous(autodetect) ||
+	    (test->rttRequests != 3) || (test->bandwidthStarts != 2))
+		goto fail;
+
+	rc = TRUE;
+
+fail:
+	test_autodetect_free(test);
+	return rc;
+}
+
+int TestAutoDetect(int argc, char* argv[])
+{
+	if (!test_autodetect_estimators())
+		return -1;
+
+	if (!test_autodetect_responses())
+		return -1;
+
+	if (!test_autodetect_scheduler())
+		return -1;
+
+	return 0;
+}
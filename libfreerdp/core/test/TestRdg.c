@@ -0,0 +1,466 @@
+#include <winpr/crt.h>
+#include <winpr/synch.h>
+#include <winpr/stream.h>
+
+#include <openssl/bio.h>
+
+#include "../gateway/rdg.h"
+
+/**
+ * The gateway channels are replaced by memory BIOs: the out channel is fed
+ * with RDG packets in pieces of various sizes, the in channel collects the
+ * HTTP chunks written by the client.
+ */
+
+#define TEST_RDG_PAYLOAD_SIZE	(0x10000 + 100)
+
+static BYTE test_rdg_payload_byte(size_t offset)
+{
+	return (BYTE) ((offset * 7) + (offset >> 8));
+}
+
+static BOOL test_rdg_check_payload(const BYTE* data, size_t offset, size_t size)
+{
+	size_t x;
+
+	for (x = 0; x < size; x++)
+	{
+		if (data[x] != test_rdg_payload_byte(offset + x))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void test_rdg_free(rdpRdg* rdg)
+{
+	if (!rdg)
+		return;
+
+	if (rdg->tlsOut)
+	{
+		BIO_free(rdg->tlsOut->bio);
+		free(rdg->tlsOut);
+	}
+
+	if (rdg->tlsIn)
+	{
+		BIO_free(rdg->tlsIn->bio);
+		free(rdg->tlsIn);
+	}
+
+	if (rdg->readEvent)
+		CloseHandle(rdg->readEvent);
+
+	Stream_Free(rdg->sendStream, TRUE);
+	Stream_Free(rdg->recvStream, TRUE);
+	DeleteCriticalSection(&rdg->writeSection);
+
+	free(rdg);
+}
+
+static rdpRdg* test_rdg_new(void)
+{
+	rdpRdg* rdg;
+
+	if (!(rdg = (rdpRdg*) calloc(1, sizeof(rdpRdg))))
+		return NULL;
+
+	InitializeCriticalSection(&rdg->writeSection);
+	rdg->state = RDG_CLIENT_STATE_OPENED;
+
+	rdg->tlsOut = (rdpTls*) calloc(1, sizeof(rdpTls));
+	rdg->tlsIn = (rdpTls*) calloc(1, sizeof(rdpTls));
+
+	if (!rdg->tlsOut || !rdg->tlsIn)
+		goto fail;
+
+	rdg->tlsOut->bio = BIO_new(BIO_s_mem());
+	rdg->tlsIn->bio = BIO_new(BIO_s_mem());
+
+	if (!rdg->tlsOut->bio || !rdg->tlsIn->bio)
+		goto fail;
+
+	if (!(rdg->readEvent = CreateEvent(NULL, TRUE, FALSE, NULL)))
+		goto fail;
+
+	if (!(rdg->sendStream = Stream_New(NULL, RDG_CHUNK_HEADER_MAX_LENGTH + RDG_SEND_BATCH_SIZE + 2)))
+		goto fail;
+
+	Stream_SetPosition(rdg->sendStream, RDG_CHUNK_HEADER_MAX_LENGTH);
+
+	if (!(rdg->recvStream = Stream_New(NULL, RDG_RECV_BUFFER_SIZE)))
+		goto fail;
+
+	Stream_SetLength(rdg->recvStream, 0);
+
+	return rdg;
+
+fail:
+	test_rdg_free(rdg);
+	return NULL;
+}
+
+static void test_rdg_write_header(wStream* s, UINT16 type, UINT32 packetLength)
+{
+	Stream_Write_UINT16(s, type); /* Type */
+	Stream_Write_UINT16(s, 0); /* Reserved */
+	Stream_Write_UINT32(s, packetLength); /* Packet length */
+}
+
+static void test_rdg_write_data(wStream* s, size_t* offset, UINT16 size)
+{
+	UINT16 x;
+
+	test_rdg_write_header(s, PKT_TYPE_DATA, RDG_DATA_PACKET_HEADER_LENGTH + size);
+	Stream_Write_UINT16(s, size); /* Data size */
+
+	for (x = 0; x < size; x++)
+		Stream_Write_UINT8(s, test_rdg_payload_byte((*offset)++));
+}
+
+/**
+ * Data packets with control packets in between, the client answers the
+ * keep-alive and the close channel packets on the in channel.
+ */
+static wStream* test_rdg_out_channel_new(size_t* payloadSize)
+{
+	wStream* s;
+	size_t offset = 0;
+
+	if (!(s = Stream_New(NULL, 1024)))
+		return NULL;
+
+	test_rdg_write_data(s, &offset, 100);
+	test_rdg_write_header(s, PKT_TYPE_KEEPALIVE, 8);
+	test_rdg_write_data(s, &offset, 300);
+	test_rdg_write_header(s, PKT_TYPE_SERVICE_MESSAGE, 14);
+	Stream_Zero(s, 6);
+	test_rdg_write_data(s, &offset, 17);
+	test_rdg_write_header(s, PKT_TYPE_CLOSE_CHANNEL, 12);
+	Stream_Write_UINT32(s, 0); /* Status code */
+	test_rdg_write_data(s, &offset, 1);
+	Stream_SealLength(s);
+
+	*payloadSize = offset;
+
+	return s;
+}
+
+static const char TEST_RDG_CONTROL_RESPONSES[] =
+	"8\r\n"
+	"\x0D\x00\x00\x00\x08\x00\x00\x00"
+	"\r\n"
+	"C\r\n"
+	"\x11\x00\x00\x00\x0C\x00\x00\x00\x00\x00\x00\x00"
+	"\r\n";
+
+/**
+ * Feeds the out channel step bytes at a time and reads whatever is
+ * available after each step into a buffer of size bytes.
+ */
+static BOOL test_rdg_read(wStream* sOut, size_t payloadSize, size_t step, int size)
+{
+	int status;
+	BOOL rc = FALSE;
+	size_t length;
+	size_t offset = 0;
+	size_t received = 0;
+	BYTE* buffer = NULL;
+	BYTE* responses = NULL;
+	rdpRdg* rdg;
+
+	if (!(rdg = test_rdg_new()))
+		return FALSE;
+
+	if (!(buffer = (BYTE*) malloc(size)))
+		goto fail;
+
+	while (offset < Stream_Length(sOut))
+	{
+		length = MIN(step, Stream_Length(sOut) - offset);
+
+		if (BIO_write(rdg->tlsOut->bio, Stream_Buffer(sOut) + offset, length) != (int) length)
+			goto fail;
+
+		offset += length;
+
+		while ((status = rdg_read_data_packet(rdg, buffer, size)) > 0)
+		{
+			if (!test_rdg_check_payload(buffer, received, status))
+			{
+				fprintf(stderr, "%s: step %u size %d: wrong data at offset %u\n",
+					__FUNCTION__, (unsigned int) step, size, (unsigned int) received);
+				goto fail;
+			}
+
+			received += status;
+		}
+
+		if (status < 0)
+		{
+			fprintf(stderr, "%s: step %u size %d: read failed at offset %u\n",
+				__FUNCTION__, (unsigned int) step, size, (unsigned int) offset);
+			goto fail;
+		}
+	}
+
+	if (received != payloadSize)
+	{
+		fprintf(stderr, "%s: step %u size %d: received %u of %u bytes\n", __FUNCTION__,
+			(unsigned int) step, size, (unsigned int) received, (unsigned int) payloadSize);
+		goto fail;
+	}
+
+	if (Stream_GetRemainingLength(rdg->recvStream) || rdg->packetRemainingCount)
+		goto fail;
+
+	if (WaitForSingleObject(rdg->readEvent, 0) != WAIT_TIMEOUT)
+	{
+		fprintf(stderr, "%s: read event signaled without buffered data\n", __FUNCTION__);
+		goto fail;
+	}
+
+	length = sizeof(TEST_RDG_CONTROL_RESPONSES) - 1;
+
+	if (!(responses = (BYTE*) malloc(length + 1)))
+		goto fail;
+
+	if ((BIO_read(rdg->tlsIn->bio, responses, length + 1) != (int) length) ||
+	    (memcmp(responses, TEST_RDG_CONTROL_RESPONSES, length) != 0))
+	{
+		fprintf(stderr, "%s: unexpected control packet responses\n", __FUNCTION__);
+		goto fail;
+	}
+
+	rc = TRUE;
+
+fail:
+	free(buffer);
+	free(responses);
+	test_rdg_free(rdg);
+	return rc;
+}
+
+/**
+ * Data left in the receive buffer keeps the read event signaled, the
+ * transport does not wait for the socket before reading it.
+ */
+static BOOL test_rdg_read_event(wStream* sOut)
+{
+	BYTE data;
+	BOOL rc = FALSE;
+	rdpRdg* rdg;
+
+	if (!(rdg = test_rdg_new()))
+		return FALSE;
+
+	if (BIO_write(rdg->tlsOut->bio, Stream_Buffer(sOut), Stream_Length(sOut)) != (int) Stream_Length(sOut))
+		goto fail;
+
+	if (rdg_read_data_packet(rdg, &data, 1) != 1)
+		goto fail;
+
+	if (WaitForSingleObject(rdg->readEvent, 0) != WAIT_OBJECT_0)
+	{
+		fprintf(stderr, "%s: read event not signaled with buffered data\n", __FUNCTION__);
+		goto fail;
+	}
+
+	rc = TRUE;
+
+fail:
+	test_rdg_free(rdg);
+	return rc;
+}
+
+/**
+ * Parses the HTTP chunks written to the in channel, checks their size
+ * lines and collects the payload of the data packets they carry.
+ */
+static BOOL test_rdg_check_chunks(rdpRdg* rdg, const UINT32* chunkSizes, size_t count,
+				  size_t payloadOffset, size_t payloadSize)
+{
+	int length;
+	char* end;
+	size_t x;
+	UINT16 type;
+	UINT16 dataSize;
+	UINT32 packetLength;
+	UINT32 chunkSize;
+	BOOL rc = FALSE;
+	size_t offset = payloadOffset;
+	BYTE* buffer;
+	wStream* s;
+	wStream* sChunk;
+
+	if (!(buffer = (BYTE*) malloc(2 * RDG_SEND_BATCH_SIZE)))
+		return FALSE;
+
+	length = BIO_read(rdg->tlsIn->bio, buffer, 2 * RDG_SEND_BATCH_SIZE);
+
+	if (length < 1)
+		goto fail;
+
+	if (!(s = Stream_New(buffer, length)))
+		goto fail;
+
+	for (x = 0; x < count; x++)
+	{
+		chunkSize = strtoul((char*) Stream_Pointer(s), &end, 16);
+
+		if ((chunkSize != chunkSizes[x]) || (strncmp(end, "\r\n", 2) != 0))
+		{
+			fprintf(stderr, "%s: chunk %u has size line %.*s\n", __FUNCTION__,
+				(unsigned int) x, (int) ((BYTE*) end - Stream_Pointer(s)),
+				(char*) Stream_Pointer(s));
+			goto fail_stream;
+		}
+
+		Stream_Seek(s, ((BYTE*) end - Stream_Pointer(s)) + 2);
+
+		if (Stream_GetRemainingLength(s) < chunkSize + 2)
+			goto fail_stream;
+
+		if (!(sChunk = Stream_New(Stream_Pointer(s), chunkSize)))
+			goto fail_stream;
+
+		Stream_Seek(s, chunkSize);
+
+		while (Stream_GetRemainingLength(sChunk) >= RDG_DATA_PACKET_HEADER_LENGTH)
+		{
+			Stream_Read_UINT16(sChunk, type); /* Type */
+			Stream_Seek_UINT16(sChunk); /* Reserved */
+			Stream_Read_UINT32(sChunk, packetLength); /* Packet length */
+			Stream_Read_UINT16(sChunk, dataSize); /* Data size */
+
+			if ((type != PKT_TYPE_DATA) || (packetLength != dataSize + RDG_DATA_PACKET_HEADER_LENGTH) ||
+			    (Stream_GetRemainingLength(sChunk) < dataSize) ||
+			    !test_rdg_check_payload(Stream_Pointer(sChunk), offset, dataSize))
+				break;
+
+			Stream_Seek(sChunk, dataSize);
+			offset += dataSize;
+		}
+
+		if (Stream_GetRemainingLength(sChunk))
+		{
+			fprintf(stderr, "%s: chunk %u does not hold complete data packets\n",
+				__FUNCTION__, (unsigned int) x);
+			Stream_Free(sChunk, FALSE);
+			goto fail_stream;
+		}
+
+		Stream_Free(sChunk, FALSE);
+
+		if (memcmp(Stream_Pointer(s), "\r\n", 2) != 0)
+			goto fail_stream;
+
+		Stream_Seek(s, 2);
+	}
+
+	if (Stream_GetRemainingLength(s) || (offset != payloadOffset + payloadSize))
+	{
+		fprintf(stderr, "%s: %u bytes left after the chunks\n", __FUNCTION__,
+			(unsigned int) Stream_GetRemainingLength(s));
+		goto fail_stream;
+	}
+
+	rc = TRUE;
+
+fail_stream:
+	Stream_Free(s, FALSE);
+fail:
+	free(buffer);
+	return rc;
+}
+
+/**
+ * Batched writes share one chunk, a write larger than a data packet is
+ * split into several packets and the chunk is sent once it is full.
+ */
+static BOOL test_rdg_write(void)
+{
+	size_t x;
+	BOOL rc = FALSE;
+	BYTE* payload;
+	rdpRdg* rdg;
+	const UINT32 batchedChunks[] = { 3 * RDG_DATA_PACKET_HEADER_LENGTH + 10 + 20 + 30 };
+	const UINT32 splitChunks[] = { RDG_SEND_BATCH_SIZE, RDG_DATA_PACKET_HEADER_LENGTH + 110 };
+
+	if (!(payload = (BYTE*) malloc(TEST_RDG_PAYLOAD_SIZE)))
+		return FALSE;
+
+	for (x = 0; x < TEST_RDG_PAYLOAD_SIZE; x++)
+		payload[x] = test_rdg_payload_byte(x);
+
+	if (!(rdg = test_rdg_new()))
+		goto fail;
+
+	rdg->batching = TRUE;
+
+	if ((rdg_write_data_packet(rdg, &payload[0], 10) != 10) ||
+	    (rdg_write_data_packet(rdg, &payload[10], 20) != 20))
+		goto fail;
+
+	if (BIO_pending(rdg->tlsIn->bio) != 0)
+	{
+		fprintf(stderr, "%s: batched data sent before the batch ended\n", __FUNCTION__);
+		goto fail;
+	}
+
+	rdg->batching = FALSE;
+
+	if (rdg_write_data_packet(rdg, &payload[30], 30) != 30)
+		goto fail;
+
+	if (!test_rdg_check_chunks(rdg, batchedChunks, ARRAYSIZE(batchedChunks), 0, 60))
+		goto fail;
+
+	if (rdg_write_data_packet(rdg, payload, TEST_RDG_PAYLOAD_SIZE) != TEST_RDG_PAYLOAD_SIZE)
+		goto fail;
+
+	if (!test_rdg_check_chunks(rdg, splitChunks, ARRAYSIZE(splitChunks), 0, TEST_RDG_PAYLOAD_SIZE))
+		goto fail;
+
+	rc = TRUE;
+
+fail:
+	free(payload);
+	test_rdg_free(rdg);
+	return rc;
+}
+
+int TestRdg(int argc, char* argv[])
+{
+	int rc = -1;
+	size_t x, y;
+	size_t payloadSize;
+	wStream* sOut;
+	const size_t steps[] = { 1, 2, 3, 7, 8, 9, 10, 64, 1024 };
+	const int sizes[] = { 1, 5, 100, 4096 };
+
+	if (!(sOut = test_rdg_out_channel_new(&payloadSize)))
+		return -1;
+
+	for (x = 0; x < ARRAYSIZE(steps); x++)
+	{
+		for (y = 0; y < ARRAYSIZE(sizes); y++)
+		{
+			if (!test_rdg_read(sOut, payloadSize, steps[x], sizes[y]))
+				goto fail;
+		}
+	}
+
+	if (!test_rdg_read_event(sOut))
+		goto fail;
+
+	if (!test_rdg_write())
+		goto fail;
+
+	rc = 0;
+
+fail:
+	Stream_Free(sOut, TRUE);
+	return rc;
+}
@@ -0,0 +1,221 @@
+#include <winpr/crt.h>
+#include <winpr/stream.h>
+
+#include <openssl/bio.h>
+
+#include <freerdp/freerdp.h>
+#include <freerdp/settings.h>
+
+#include "../transport.h"
+
+/**
+ * The front BIO is a memory BIO fed with a sequence of fast-path and tpkt
+ * PDUs in pieces of various sizes, the receive callback checks that each
+ * PDU arrives whole and in order.
+ */
+
+#define TEST_TRANSPORT_PDUS	7
+
+static const int g_PduLengths[TEST_TRANSPORT_PDUS] = { 3, 127, 128, 7, 0x7FFF, 20000, 300 };
+
+struct _TEST_TRANSPORT
+{
+	rdpContext context;
+	rdpTransport* transport;
+	BYTE* data;
+	size_t size;
+	size_t offsets[TEST_TRANSPORT_PDUS + 1];
+	int received;
+	int inPlace;
+	BOOL failed;
+};
+typedef struct _TEST_TRANSPORT TEST_TRANSPORT;
+
+static BYTE test_transport_payload_byte(size_t offset)
+{
+	return (BYTE) ((offset * 13) + (offset >> 8));
+}
+
+/* Alternate fast-path and tpkt PDUs, fast-path can't exceed 0x8000 bytes */
+static BOOL test_transport_build(TEST_TRANSPORT* test)
+{
+	int k;
+	size_t x;
+	BYTE* pdu;
+	size_t length;
+
+	for (k = 0; k < TEST_TRANSPORT_PDUS; k++)
+		test->size += g_PduLengths[k];
+
+	if (!(test->data = (BYTE*) malloc(test->size)))
+		return FALSE;
+
+	for (x = 0; x < test->size; x++)
+		test->data[x] = test_transport_payload_byte(x);
+
+	for (k = 0; k < TEST_TRANSPORT_PDUS; k++)
+	{
+		pdu = &test->data[test->offsets[k]];
+		length = g_PduLengths[k];
+		test->offsets[k + 1] = test->offsets[k] + length;
+
+		if ((length > 0x8000) || ((k & 1) && (length >= 7)))
+		{
+			pdu[0] = 0x03;
+			pdu[1] = 0x00;
+			pdu[2] = (length >> 8) & 0xFF;
+			pdu[3] = length & 0xFF;
+		}
+		else if (length < 0x80)
+		{
+			pdu[0] = 0x00;
+			pdu[1] = length & 0xFF;
+		}
+		else
+		{
+			pdu[0] = 0x00;
+			pdu[1] = 0x80 | ((length >> 8) & 0x7F);
+			pdu[2] = length & 0xFF;
+		}
+	}
+
+	return TRUE;
+}
+
+static int test_transport_recv(rdpTransport* transport, wStream* s, void* extra)
+{
+	TEST_TRANSPORT* test = (TEST_TRANSPORT*) extra;
+	int k = test->received;
+
+	if ((k >= TEST_TRANSPORT_PDUS) || (Stream_Length(s) != (size_t) g_PduLengths[k]) ||
+	    (Stream_GetPosition(s) != 0) ||
+	    (memcmp(Stream_Buffer(s), &test->data[test->offsets[k]], Stream_Length(s)) != 0))
+	{
+		fprintf(stderr, "%s: PDU %d received with %d bytes\n", __FUNCTION__, k,
+			(int) Stream_Length(s));
+		test->failed = TRUE;
+		return -1;
+	}
+
+	if ((Stream_Buffer(s) >= transport->ReadAheadBuffer) &&
+	    (Stream_Buffer(s) < transport->ReadAheadBuffer + 65536))
+		test->inPlace++;
+
+	test->received++;
+	return 0;
+}
+
+static void test_transport_free(TEST_TRANSPORT* test)
+{
+	if (!test)
+		return;
+
+	transport_free(test->transport);
+	freerdp_settings_free(test->context.settings);
+	free(test->data);
+	free(test);
+}
+
+static TEST_TRANSPORT* test_transport_new(void)
+{
+	TEST_TRANSPORT* test;
+
+	if (!(test = (TEST_TRANSPORT*) calloc(1, sizeof(TEST_TRANSPORT))))
+		return NULL;
+
+	if (!test_transport_build(test))
+		goto fail;
+
+	if (!(test->context.settings = freerdp_settings_new(0)))
+		goto fail;
+
+	if (!(test->transport = transport_new(&test->context)))
+		goto fail;
+
+	if (!(test->transport->frontBio = BIO_new(BIO_s_mem())))
+		goto fail;
+
+	/* An empty memory BIO asks to retry like a non blocking socket */
+	BIO_set_mem_eof_return(test->transport->frontBio, -1);
+
+	test->transport->blocking = FALSE;
+	test->transport->ReceiveCallback = test_transport_recv;
+	test->transport->ReceiveExtra = test;
+
+	return test;
+
+fail:
+	test_transport_free(test);
+	return NULL;
+}
+
+/**
+ * Feed the PDUs step bytes at a time, every PDU has to be received once
+ * all its bytes were fed.
+ */
+static BOOL test_transport_feed(size_t step)
+{
+	BOOL rc = FALSE;
+	int k;
+	size_t offset = 0;
+	size_t length;
+	TEST_TRANSPORT* test;
+
+	if (!(test = test_transport_new()))
+		return FALSE;
+
+	while (offset < test->size)
+	{
+		length = MIN(step, test->size - offset);
+
+		if (BIO_write(test->transport->frontBio, &test->data[offset], (int) length) != (int) length)
+			goto fail;
+
+		offset += length;
+
+		if ((transport_check_fds(test->transport) < 0) || test->failed)
+			goto fail;
+
+		for (k = 0; k < TEST_TRANSPORT_PDUS; k++)
+		{
+			if (test->offsets[k + 1] > offset)
+				break;
+		}
+
+		if (test->received != k)
+		{
+			fprintf(stderr, "%s: step %d: %d PDUs received after %d bytes, expected %d\n",
+				__FUNCTION__, (int) step, test->received, (int) offset, k);
+			goto fail;
+		}
+	}
+
+	/* Fed at once, the first PDU starts the read and the others lie whole in the buffer */
+	if ((step >= test->size) && (test->inPlace != TEST_TRANSPORT_PDUS - 1))
+	{
+		fprintf(stderr, "%s: %d PDUs were received in place\n", __FUNCTION__, test->inPlace);
+		goto fail;
+	}
+
+	rc = TRUE;
+
+fail:
+	test_transport_free(test);
+	return rc;
+}
+
+int TestTransport(int argc, char* argv[])
+{
+	size_t step;
+
+	for (step = 1; step < 0x10000; step = (step * 3) + 1)
+	{
+		if (!test_transport_feed(step))
+			return -1;
+	}
+
+	if (!test_transport_feed(0x10000))
+		return -1;
+
+	return 0;
+}
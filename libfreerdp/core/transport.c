@@ -56,6 +56,18 @@
 
 #define BUFFER_SIZE 16384
 
+/**
+ * Incoming data is read from the front BIO in chunks of up to
+ * READ_AHEAD_SIZE bytes, the PDU parser then takes its header and body
+ * bytes from that buffer so that a burst of small PDUs costs a single
+ * BIO_read. A PDU lying whole in the buffer is handed to the receive
+ * callback in place, only PDUs split across reads are copied into a
+ * stream. Reads of at least READ_AHEAD_DIRECT bytes with an empty buffer
+ * go straight to the destination stream.
+ */
+#define READ_AHEAD_SIZE 65536
+#define READ_AHEAD_DIRECT 16384
+
 static void* transport_client_thread(void* arg);
 
 
@@ -84,6 +96,17 @@ wStream* transport_send_stream_init(rdpTransport* transport, int size)
 	return s;
 }
 
+/**
+ * The handles returned by transport_get_event_handles belong to the front
+ * BIO or the gateway, waiters compare this counter to know when they were
+ * replaced, even by handles which got the same addresses.
+ */
+
+static void transport_event_handles_changed(rdpTransport* transport)
+{
+	InterlockedIncrement(&transport->EventHandlesVersion);
+}
+
 BOOL transport_attach(rdpTransport* transport, int sockfd)
 {
 	BIO* socketBio;
@@ -104,6 +127,26 @@ BOOL transport_attach(rdpTransport* transport, int sockfd)
 	bufferedBio = BIO_push(bufferedBio, socketBio);
 
 	transport->frontBio = bufferedBio;
+	transport_event_handles_changed(transport);
+	transport->ReadAheadOffset = 0;
+	transport->ReadAheadLength = 0;
+
+	return TRUE;
+}
+
+/**
+ * The security layers are stacked on top of the front BIO, bytes which
+ * were already read ahead from it would never reach them.
+ */
+
+static BOOL transport_check_read_ahead_empty(rdpTransport* transport)
+{
+	if (transport->ReadAheadLength > 0)
+	{
+		WLog_ERR(TAG, "%d unexpected bytes received before the security handshake",
+				(int) transport->ReadAheadLength);
+		return FALSE;
+	}
 
 	return TRUE;
 }
@@ -121,6 +164,9 @@ BOOL transport_connect_tls(rdpTransport* transport)
 	rdpContext* context = transport->context;
 	rdpSettings* settings = transport->settings;
 
+	if (!transport_check_read_ahead_empty(transport))
+		return FALSE;
+
 	if (!(tls = tls_new(settings)))
 		return FALSE;
 
@@ -157,6 +203,7 @@ BOOL transport_connect_tls(rdpTransport* transport)
 	}
 
 	transport->frontBio = tls->bio;
+	transport_event_handles_changed(transport);
 
 	BIO_callback_ctrl(tls->bio, BIO_CTRL_SET_CALLBACK, (bio_info_cb*) transport_ssl_cb);
 	SSL_set_app_data(tls->ssl, transport);
@@ -237,6 +284,7 @@ BOOL transport_connect(rdpTransport* transport, const char* hostname, UINT16 por
 			if (status)
 			{
 				transport->frontBio = transport->rdg->frontBio;
+				transport_event_handles_changed(transport);
 				BIO_set_nonblock(transport->frontBio, 0);
 				transport->layer = TRANSPORT_LAYER_TSG;
 				status = TRUE;
@@ -260,6 +308,7 @@ BOOL transport_connect(rdpTransport* transport, const char* hostname, UINT16 por
 			if (status)
 			{
 				transport->frontBio = transport->tsg->bio;
+				transport_event_handles_changed(transport);
 				transport->layer = TRANSPORT_LAYER_TSG;
 				status = TRUE;
 			}
@@ -317,6 +366,9 @@ BOOL transport_accept_tls(rdpTransport* transport)
 {
 	rdpSettings* settings = transport->settings;
 
+	if (!transport_check_read_ahead_empty(transport))
+		return FALSE;
+
 	if (!transport->tls)
 		transport->tls = tls_new(transport->settings);
 
@@ -423,6 +475,7 @@ int transport_read_layer(rdpTransport* transport, BYTE* data, int bytes)
 {
 	int read = 0;
 	int status = -1;
+	BOOL readAhead;
 
 	if (!transport->frontBio)
 	{
@@ -432,7 +485,26 @@ int transport_read_layer(rdpTransport* transport, BYTE* data, int bytes)
 
 	while (read < bytes)
 	{
-		status = BIO_read(transport->frontBio, data + read, bytes - read);
+		if (transport->ReadAheadLength > 0)
+		{
+			size_t length = transport->ReadAheadLength;
+
+			if (length > (size_t) (bytes - read))
+				length = (size_t) (bytes - read);
+
+			CopyMemory(data + read, &transport->ReadAheadBuffer[transport->ReadAheadOffset], length);
+			transport->ReadAheadOffset += length;
+			transport->ReadAheadLength -= length;
+			read += (int) length;
+			continue;
+		}
+
+		readAhead = (transport->ReadAheadBuffer && ((bytes - read) < READ_AHEAD_DIRECT));
+
+		if (readAhead)
+			status = BIO_read(transport->frontBio, transport->ReadAheadBuffer, READ_AHEAD_SIZE);
+		else
+			status = BIO_read(transport->frontBio, data + read, bytes - read);
 
 		if (status <= 0)
 		{
@@ -463,6 +535,16 @@ int transport_read_layer(rdpTransport* transport, BYTE* data, int bytes)
 			continue;
 		}
 
+		if (readAhead)
+		{
+#ifdef HAVE_VALGRIND_MEMCHECK_H
+			VALGRIND_MAKE_MEM_DEFINED(transport->ReadAheadBuffer, status);
+#endif
+			transport->ReadAheadOffset = 0;
+			transport->ReadAheadLength = (size_t) status;
+			continue;
+		}
+
 #ifdef HAVE_VALGRIND_MEMCHECK_H
 		VALGRIND_MAKE_MEM_DEFINED(data + read, bytes - read);
 #endif
@@ -499,6 +581,103 @@ static int transport_read_layer_bytes(rdpTransport* transport, wStream* s, unsig
 	return status == toRead ? 1 : 0;
 }
 
+/**
+ * Number of header bytes needed to know the length of the PDU starting
+ * with the two bytes at header, -1 on an invalid header.
+ */
+static int transport_pdu_header_length(rdpTransport* transport, const BYTE* header)
+{
+	if (transport->NlaMode)
+	{
+		/*
+		 * In case NlaMode is set TSRequest package(s) are expected
+		 * 0x30 = DER encoded data with these bits set:
+		 * bit 6 P/C constructed
+		 * bit 5 tag number - sequence
+		 */
+		if ((header[0] == 0x30) && (header[1] & 0x80))
+		{
+			if ((header[1] & ~(0x80)) == 1)
+				return 3;
+
+			if ((header[1] & ~(0x80)) == 2)
+				return 4;
+
+			WLog_ERR(TAG, "Error reading TSRequest!");
+			return -1;
+		}
+
+		return 2;
+	}
+
+	/* TPKT header */
+	if (header[0] == 0x03)
+		return 4;
+
+	/* Fast-Path Header */
+	if (header[1] & 0x80)
+		return 3;
+
+	return 2;
+}
+
+/**
+ * Length of the whole PDU from its complete header, -1 on an invalid
+ * length. In NLA mode anything but a TSRequest has a length of 0.
+ */
+static int transport_pdu_length(rdpTransport* transport, const BYTE* header)
+{
+	int pduLength = 0;
+
+	if (transport->NlaMode)
+	{
+		if (header[0] == 0x30)
+		{
+			/* TSRequest (NLA) */
+			if ((header[1] & 0x80) && ((header[1] & ~(0x80)) == 1))
+				pduLength = header[2] + 3;
+			else if (header[1] & 0x80)
+				pduLength = ((header[2] << 8) | header[3]) + 4;
+			else
+				pduLength = header[1] + 2;
+		}
+
+		return pduLength;
+	}
+
+	if (header[0] == 0x03)
+	{
+		pduLength = (header[2] << 8) | header[3];
+
+		/* min and max values according to ITU-T Rec. T.123 (01/2007) section 8 */
+		if (pduLength < 7 || pduLength > 0xFFFF)
+		{
+			WLog_ERR(TAG, "tpkt - invalid pduLength: %d", pduLength);
+			return -1;
+		}
+
+		return pduLength;
+	}
+
+	if (header[1] & 0x80)
+		pduLength = ((header[1] & 0x7F) << 8) | header[2];
+	else
+		pduLength = header[1];
+
+	/*
+	 * fast-path has 7 bits for length so the maximum size, including headers is 0x8000
+	 * The theoretical minimum fast-path PDU consists only of two header bytes plus one
+	 * byte for data (e.g. fast-path input synchronize pdu)
+	 */
+	if (pduLength < 3 || pduLength > 0x8000)
+	{
+		WLog_ERR(TAG, "fast path - invalid pduLength: %d", pduLength);
+		return -1;
+	}
+
+	return pduLength;
+}
+
 /**
  * @brief Try to read a complete PDU (NLA, fast-path or tpkt) from the underlying transport.
  *
@@ -516,11 +695,9 @@ int transport_read_pdu(rdpTransport* transport, wStream* s)
 	int status;
 	int position;
 	int pduLength;
+	int headerLength;
 	BYTE* header;
 
-	position = 0;
-	pduLength = 0;
-
 	if (!transport)
 		return -1;
 
@@ -543,98 +720,16 @@ int transport_read_pdu(rdpTransport* transport, wStream* s)
 	position = Stream_GetPosition(s);
 	header = Stream_Buffer(s);
 
-	if (transport->NlaMode)
-	{
-		/*
-		 * In case NlaMode is set TSRequest package(s) are expected
-		 * 0x30 = DER encoded data with these bits set:
-		 * bit 6 P/C constructed
-		 * bit 5 tag number - sequence
-		 */
-		if (header[0] == 0x30)
-		{
-			/* TSRequest (NLA) */
-			if (header[1] & 0x80)
-			{
-				if ((header[1] & ~(0x80)) == 1)
-				{
-					/* check for header bytes already was readed in previous calls */
-					if (position < 3
-							&& (status = transport_read_layer_bytes(transport, s, 3 - position)) != 1)
-						return status;
-
-					pduLength = header[2];
-					pduLength += 3;
-				}
-				else if ((header[1] & ~(0x80)) == 2)
-				{
-					/* check for header bytes already was readed in previous calls */
-					if (position < 4
-							&& (status = transport_read_layer_bytes(transport, s, 4 - position)) != 1)
-						return status;
-
-					pduLength = (header[2] << 8) | header[3];
-					pduLength += 4;
-				}
-				else
-				{
-					WLog_ERR(TAG, "Error reading TSRequest!");
-					return -1;
-				}
-			}
-			else
-			{
-				pduLength = header[1];
-				pduLength += 2;
-			}
-		}
-	}
-	else
-	{
-		if (header[0] == 0x03)
-		{
-			/* TPKT header */
-			/* check for header bytes already was readed in previous calls */
-			if (position < 4
-					&& (status = transport_read_layer_bytes(transport, s, 4 - position)) != 1)
-				return status;
-
-			pduLength = (header[2] << 8) | header[3];
-
-			/* min and max values according to ITU-T Rec. T.123 (01/2007) section 8 */
-			if (pduLength < 7 || pduLength > 0xFFFF)
-			{
-				WLog_ERR(TAG, "tpkt - invalid pduLength: %d", pduLength);
-				return -1;
-			}
-		}
-		else
-		{
-			/* Fast-Path Header */
-			if (header[1] & 0x80)
-			{
-				/* check for header bytes already was readed in previous calls */
-				if (position < 3
-						&& (status = transport_read_layer_bytes(transport, s, 3 - position)) != 1)
-					return status;
+	if ((headerLength = transport_pdu_header_length(transport, header)) < 0)
+		return -1;
 
-				pduLength = ((header[1] & 0x7F) << 8) | header[2];
-			}
-			else
-				pduLength = header[1];
+	/* check for header bytes already was readed in previous calls */
+	if (position < headerLength
+			&& (status = transport_read_layer_bytes(transport, s, headerLength - position)) != 1)
+		return status;
 
-			/*
-			 * fast-path has 7 bits for length so the maximum size, including headers is 0x8000
-			 * The theoretical minimum fast-path PDU consists only of two header bytes plus one
-			 * byte for data (e.g. fast-path input synchronize pdu)
-			 */
-			if (pduLength < 3 || pduLength > 0x8000)
-			{
-				WLog_ERR(TAG, "fast path - invalid pduLength: %d", pduLength);
-				return -1;
-			}
-		}
-	}
+	if ((pduLength = transport_pdu_length(transport, header)) < 0)
+		return -1;
 
 	if (!Stream_EnsureCapacity(s, Stream_GetPosition(s) + pduLength))
 		return -1;
@@ -651,35 +746,41 @@ int transport_read_pdu(rdpTransport* transport, wStream* s)
 	return Stream_Length(s);
 }
 
-int transport_write(rdpTransport* transport, wStream* s)
-{
-	int length;
-	int status = -1;
-	int writtenlength = 0;
+/**
+ * In blocking mode (or when asked to) the data must have left the
+ * buffered socket BIO before the write returns.
+ */
 
-	if (!transport)
-		return -1;
+static int transport_wait_write_blocked(rdpTransport* transport)
+{
+	if (!transport->blocking && !transport->settings->WaitForOutputBufferFlush)
+		return 0;
 
-	if (!transport->frontBio)
+	while (BIO_write_blocked(transport->frontBio))
 	{
-		transport->layer = TRANSPORT_LAYER_CLOSED;
-		return -1;
-	}
+		if (BIO_wait_write(transport->frontBio, 100) < 0)
+		{
+			WLog_ERR(TAG, "error when selecting for write");
+			return -1;
+		}
 
-	EnterCriticalSection(&(transport->WriteLock));
+		if (BIO_flush(transport->frontBio) < 1)
+		{
+			WLog_ERR(TAG, "error when flushing outputBuffer");
+			return -1;
+		}
+	}
 
-	length = Stream_GetPosition(s);
-	writtenlength = length;
-	Stream_SetPosition(s, 0);
+	return 0;
+}
 
-	if (length > 0)
-	{
-		WLog_Packet(WLog_Get(TAG), WLOG_TRACE, Stream_Buffer(s), length, WLOG_PACKET_OUTBOUND);
-	}
+static int transport_write_layer(rdpTransport* transport, const BYTE* data, int length)
+{
+	int status = -1;
 
 	while (length > 0)
 	{
-		status = BIO_write(transport->frontBio, Stream_Pointer(s), length);
+		status = BIO_write(transport->frontBio, data, length);
 
 		if (status <= 0)
 		{
@@ -690,52 +791,149 @@ int transport_write(rdpTransport* transport, wStream* s)
 			if (!BIO_should_retry(transport->frontBio))
 			{
 				WLog_ERR_BIO(TAG, "BIO_should_retry", transport->frontBio);
-				goto out_cleanup;
+				return status;
 			}
 
 			/* non-blocking can live with blocked IOs */
 			if (!transport->blocking)
 			{
 				WLog_ERR_BIO(TAG, "BIO_write", transport->frontBio);
-				goto out_cleanup;
+				return status;
 			}
 
 			if (BIO_wait_write(transport->frontBio, 100) < 0)
 			{
 				WLog_ERR_BIO(TAG, "BIO_wait_write", transport->frontBio);
-				status = -1;
-				goto out_cleanup;
+				return -1;
 			}
 
 			continue;
 		}
 
-		if (transport->blocking || transport->settings->WaitForOutputBufferFlush)
+		if (transport_wait_write_blocked(transport) < 0)
+			return -1;
+
+		length -= status;
+		data += status;
+	}
+
+	return status;
+}
+
+/**
+ * Through RD Gateway every write reaching the RDG BIO becomes a data packet,
+ * in a batch they are all framed in the same HTTP chunk. Other BIOs ignore
+ * the request.
+ */
+
+static void transport_begin_batch(rdpTransport* transport)
+{
+	if (transport->rdg)
+		BIO_set_batch(transport->frontBio, TRUE);
+}
+
+static int transport_end_batch(rdpTransport* transport, int status)
+{
+	if (transport->rdg && (BIO_set_batch(transport->frontBio, FALSE) < 0))
+	{
+		WLog_ERR_BIO(TAG, "BIO_set_batch", transport->frontBio);
+		return -1;
+	}
+
+	return status;
+}
+
+/**
+ * Without a security layer the front BIO is the buffered socket BIO, the
+ * chunks are then handed over in gather writes and go to the socket
+ * straight from their buffers. The TLS, TSG and RDG BIOs have to process
+ * every byte, the chunks are written one after the other through them.
+ */
+
+static int transport_write_chunks(rdpTransport* transport, const DataChunk* chunks, int count)
+{
+	int index;
+	int batch;
+	int total = 0;
+
+	for (index = 0; index < count; index++)
+	{
+		if (chunks[index].size > 0)
+			WLog_Packet(WLog_Get(TAG), WLOG_TRACE, (BYTE*) chunks[index].data,
+					chunks[index].size, WLOG_PACKET_OUTBOUND);
+
+		total += (int) chunks[index].size;
+	}
+
+	if (BIO_method_type(transport->frontBio) != BIO_TYPE_BUFFERED)
+	{
+		transport_begin_batch(transport);
+
+		for (index = 0; index < count; index++)
 		{
-			while (BIO_write_blocked(transport->frontBio))
-			{
-				if (BIO_wait_write(transport->frontBio, 100) < 0)
-				{
-					WLog_ERR(TAG, "error when selecting for write");
-					status = -1;
-					goto out_cleanup;
-				}
+			if (!chunks[index].size)
+				continue;
 
-				if (BIO_flush(transport->frontBio) < 1)
-				{
-					WLog_ERR(TAG, "error when flushing outputBuffer");
-					status = -1;
-					goto out_cleanup;
-				}
-			}
+			if (transport_write_layer(transport, chunks[index].data, (int) chunks[index].size) < 0)
+				return transport_end_batch(transport, -1);
 		}
 
-		length -= status;
-		Stream_Seek(s, status);
+		return transport_end_batch(transport, total);
 	}
-	transport->written += writtenlength;
 
-out_cleanup:
+	while (count > 0)
+	{
+		batch = (count > BIO_WRITEV_MAX_CHUNKS) ? BIO_WRITEV_MAX_CHUNKS : count;
+
+		if (BIO_writev(transport->frontBio, chunks, batch) < 0)
+		{
+			WLog_ERR_BIO(TAG, "BIO_writev", transport->frontBio);
+			return -1;
+		}
+
+		if (transport_wait_write_blocked(transport) < 0)
+			return -1;
+
+		chunks += batch;
+		count -= batch;
+	}
+
+	return total;
+}
+
+int transport_write(rdpTransport* transport, wStream* s)
+{
+	int length;
+	int status = -1;
+
+	if (!transport)
+		return -1;
+
+	if (!transport->frontBio)
+	{
+		transport->layer = TRANSPORT_LAYER_CLOSED;
+		return -1;
+	}
+
+	EnterCriticalSection(&(transport->WriteLock));
+
+	length = Stream_GetPosition(s);
+	Stream_SetPosition(s, 0);
+
+	if (length > 0)
+	{
+		WLog_Packet(WLog_Get(TAG), WLOG_TRACE, Stream_Buffer(s), length, WLOG_PACKET_OUTBOUND);
+	}
+
+	transport_begin_batch(transport);
+	status = transport_write_layer(transport, Stream_Buffer(s), length);
+	status = transport_end_batch(transport, status);
+
+	if (status >= 0)
+	{
+		Stream_Seek(s, length);
+		transport->written += length;
+	}
 
 	if (status < 0)
 	{
@@ -749,6 +947,51 @@ out_cleanup:
 	return status;
 }
 
+/**
+ * Tells whether transport_writev hands the chunks to the socket in gather
+ * writes. Through a security layer each chunk is a separate write, callers
+ * should then build their PDUs contiguously instead.
+ */
+
+BOOL transport_supports_writev(rdpTransport* transport)
+{
+	if (!transport || !transport->frontBio)
+		return FALSE;
+
+	return (BIO_method_type(transport->frontBio) == BIO_TYPE_BUFFERED) ? TRUE : FALSE;
+}
+
+/**
+ * Writes the chunks in order as a single unit, no other write can be
+ * interleaved. Returns the number of bytes written or -1.
+ */
+
+int transport_writev(rdpTransport* transport, const DataChunk* chunks, int count)
+{
+	int status;
+
+	if (!transport || (count < 0) || (count && !chunks))
+		return -1;
+
+	if (!transport->frontBio)
+	{
+		transport->layer = TRANSPORT_LAYER_CLOSED;
+		return -1;
+	}
+
+	EnterCriticalSection(&(transport->WriteLock));
+
+	status = transport_write_chunks(transport, chunks, count);
+
+	if (status < 0)
+		transport->layer = TRANSPORT_LAYER_CLOSED;
+	else
+		transport->written += status;
+
+	LeaveCriticalSection(&(transport->WriteLock));
+	return status;
+}
+
 DWORD transport_get_event_handles(rdpTransport* transport, HANDLE* events, DWORD count)
 {
 	DWORD nCount = 0;
@@ -785,6 +1028,9 @@ DWORD transport_get_event_handles(rdpTransport* transport, HANDLE* events, DWORD
 		}
 	}
 
+	if (events && (nCount < count))
+		events[nCount++] = transport->ReadAheadEvent;
+
 	return nCount;
 }
 
@@ -824,15 +1070,68 @@ int transport_drain_output_buffer(rdpTransport* transport)
 	return status;
 }
 
+/**
+ * Points s at the next PDU if it lies whole in the read-ahead buffer and no
+ * PDU is partially read into the receive buffer. The bytes are consumed
+ * before the receive callback runs: the callback must not read from the
+ * transport, which would refill the buffer under it. Data the update
+ * proxy keeps past the callback is copied since s has no pool.
+ * Returns the PDU length, 0 if the PDU has to be read into a stream.
+ */
+static int transport_read_ahead_pdu(rdpTransport* transport, wStream* s)
+{
+	int pduLength;
+	int headerLength;
+	BYTE* header;
+	size_t length = transport->ReadAheadLength;
+
+	if ((length < 2) || (Stream_GetPosition(transport->ReceiveBuffer) > 0))
+		return 0;
+
+	header = &transport->ReadAheadBuffer[transport->ReadAheadOffset];
+
+	if ((headerLength = transport_pdu_header_length(transport, header)) < 0)
+		return -1;
+
+	if (length < (size_t) headerLength)
+		return 0;
+
+	if ((pduLength = transport_pdu_length(transport, header)) < 0)
+		return -1;
+
+	if (!pduLength || (length < (size_t) pduLength))
+		return 0;
+
+	transport->ReadAheadOffset += pduLength;
+	transport->ReadAheadLength -= pduLength;
+
+	WLog_Packet(WLog_Get(TAG), WLOG_TRACE, header, pduLength, WLOG_PACKET_INBOUND);
+
+	ZeroMemory(s, sizeof(wStream));
+	Stream_SetBuffer(s, header);
+	Stream_SetCapacity(s, pduLength);
+	Stream_SetLength(s, pduLength);
+	Stream_SetPosition(s, 0);
+
+	return pduLength;
+}
+
 int transport_check_fds(rdpTransport* transport)
 {
 	int status;
 	int recv_status;
 	wStream* received;
+	wStream view;
 
 	if (!transport)
 		return -1;
 
+	if (transport->ReadAheadSignaled)
+	{
+		ResetEvent(transport->ReadAheadEvent);
+		transport->ReadAheadSignaled = FALSE;
+	}
+
 	while(!freerdp_shall_disconnect(transport->context->instance))
 	{
 		/**
@@ -842,18 +1141,30 @@ int transport_check_fds(rdpTransport* transport)
 		 * transport. If transport_read_pdu returns 0 the pdu couldn't be read at
 		 * this point.
 		 * Note that transport->ReceiveBuffer is replaced after each iteration
-		 * of this loop with a fresh stream instance from a pool.
+		 * of this loop with a fresh stream instance from a pool, unless the
+		 * PDU was handed over in place from the read-ahead buffer.
 		 */
-		if ((status = transport_read_pdu(transport, transport->ReceiveBuffer)) <= 0)
-		{
-			if (status < 0)
-				WLog_DBG(TAG, "transport_check_fds: transport_read_pdu() - %i", status);
+		if ((status = transport_read_ahead_pdu(transport, &view)) < 0)
 			return status;
+
+		if (status > 0)
+		{
+			received = &view;
+		}
+		else
+		{
+			if ((status = transport_read_pdu(transport, transport->ReceiveBuffer)) <= 0)
+			{
+				if (status < 0)
+					WLog_DBG(TAG, "transport_check_fds: transport_read_pdu() - %i", status);
+				return status;
+			}
+
+			received = transport->ReceiveBuffer;
+			if (!(transport->ReceiveBuffer = StreamPool_Take(transport->ReceivePool, 0)))
+				return -1;
 		}
 
-		received = transport->ReceiveBuffer;
-		if (!(transport->ReceiveBuffer = StreamPool_Take(transport->ReceivePool, 0)))
-			return -1;
 		/**
 		 * status:
 		 * 	-1: error
@@ -866,6 +1177,13 @@ int transport_check_fds(rdpTransport* transport)
 		/* session redirection or activation */
 		if (recv_status == 1 || recv_status == 2)
 		{
+			/* PDUs left in the read-ahead buffer would not wake up the socket event */
+			if (transport->ReadAheadLength > 0)
+			{
+				SetEvent(transport->ReadAheadEvent);
+				transport->ReadAheadSignaled = TRUE;
+			}
+
 			return recv_status;
 		}
 
@@ -948,12 +1266,90 @@ BOOL transport_disconnect(rdpTransport* transport)
 	}
 
 	transport->frontBio = NULL;
+	transport_event_handles_changed(transport);
+	transport->ReadAheadOffset = 0;
+	transport->ReadAheadLength = 0;
+
+	if (transport->ReadAheadSignaled)
+	{
+		ResetEvent(transport->ReadAheadEvent);
+		transport->ReadAheadSignaled = FALSE;
+	}
 
 	transport->layer = TRANSPORT_LAYER_TCP;
 
 	return status;
 }
 
+/**
+ * The handles of the transport thread are waited on through a persistent
+ * wait set. It is only updated when the handle list or the transport's
+ * event handles changed since the last wait.
+ */
+
+struct _TRANSPORT_WAIT
+{
+	WINPR_WAIT_SET* waitSet;
+	HANDLE handles[64];
+	DWORD nCount;
+	LONG version;
+	BOOL valid;
+};
+typedef struct _TRANSPORT_WAIT TRANSPORT_WAIT;
+
+/**
+ * Returns the index of the first signaled handle like
+ * WaitForMultipleObjects does.
+ */
+
+static DWORD transport_client_wait(rdpTransport* transport, TRANSPORT_WAIT* wait,
+		const HANDLE* handles, DWORD nCount)
+{
+	DWORD index;
+	DWORD status;
+	DWORD signaled;
+	DWORD result;
+	LONG version;
+	HANDLE signaledHandles[64];
+
+	if (!wait->waitSet)
+		return WaitForMultipleObjects(nCount, handles, FALSE, INFINITE);
+
+	version = transport->EventHandlesVersion;
+
+	if (!wait->valid || (wait->version != version) || (wait->nCount != nCount) ||
+			(memcmp(wait->handles, handles, nCount * sizeof(HANDLE)) != 0))
+	{
+		/* the handles belong to the transport and the channels, they can be replaced at any time */
+		wait->valid = WaitSetSetHandles(wait->waitSet, handles, nCount, 0);
+
+		if (!wait->valid)
+			return WaitForMultipleObjects(nCount, handles, FALSE, INFINITE);
+
+		CopyMemory(wait->handles, handles, nCount * sizeof(HANDLE));
+		wait->nCount = nCount;
+		wait->version = version;
+	}
+
+	status = WaitForWaitSet(wait->waitSet, INFINITE, signaledHandles, 64, &signaled);
+
+	if (status != WAIT_OBJECT_0)
+		return status;
+
+	result = nCount;
+
+	while (signaled-- > 0)
+	{
+		for (index = 0; index < nCount; index++)
+		{
+			if ((handles[index] == signaledHandles[signaled]) && (index < result))
+				result = index;
+		}
+	}
+
+	return (result < nCount) ? (WAIT_OBJECT_0 + result) : WAIT_FAILED;
+}
+
 static void* transport_client_thread(void* arg)
 {
 	DWORD dwExitCode = 0;
@@ -961,6 +1357,7 @@ static void* transport_client_thread(void* arg)
 	DWORD nCount;
 	DWORD nCountTmp;
 	HANDLE handles[64];
+	TRANSPORT_WAIT wait;
 	rdpTransport* transport = (rdpTransport*) arg;
 	rdpContext* context = transport->context;
 	rdpRdp* rdp = context->rdp;
@@ -989,6 +1386,10 @@ static void* transport_client_thread(void* arg)
 			goto out;
 	}
 
+	/* falls back to WaitForMultipleObjects without wait set support */
+	ZeroMemory(&wait, sizeof(wait));
+	wait.waitSet = CreateWaitSet();
+
 	while (1)
 	{
 		nCount = 1; /* transport->stopEvent */
@@ -1000,7 +1401,7 @@ static void* transport_client_thread(void* arg)
 		}
 		nCount += nCountTmp;
 
-		status = WaitForMultipleObjects(nCount, handles, FALSE, INFINITE);
+		status = transport_client_wait(transport, &wait, handles, nCount);
 
 		if (transport->layer == TRANSPORT_LAYER_CLOSED)
 		{
@@ -1034,6 +1435,8 @@ static void* transport_client_thread(void* arg)
 		}
 	}
 
+	CloseWaitSet(wait.waitSet);
+
 out:
 	WLog_DBG(TAG, "Terminating transport thread");
 	ExitThread(dwExitCode);
@@ -1063,10 +1466,20 @@ rdpTransport* transport_new(rdpContext* context)
 	if (!transport->ReceiveBuffer)
 		goto out_free_receivepool;
 
+	transport->ReadAheadBuffer = (BYTE*) malloc(READ_AHEAD_SIZE);
+
+	if (!transport->ReadAheadBuffer)
+		goto out_free_receivebuffer;
+
+	transport->ReadAheadEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	if (!transport->ReadAheadEvent || transport->ReadAheadEvent == INVALID_HANDLE_VALUE)
+		goto out_free_readahead;
+
 	transport->connectedEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
 
 	if (!transport->connectedEvent || transport->connectedEvent == INVALID_HANDLE_VALUE)
-		goto out_free_receivebuffer;
+		goto out_free_readaheadevent;
 
 	transport->blocking = TRUE;
 	transport->GatewayEnabled = FALSE;
@@ -1083,6 +1496,10 @@ out_free_readlock:
 	DeleteCriticalSection(&(transport->ReadLock));
 out_free_connectedEvent:
 	CloseHandle(transport->connectedEvent);
+out_free_readaheadevent:
+	CloseHandle(transport->ReadAheadEvent);
+out_free_readahead:
+	free(transport->ReadAheadBuffer);
 out_free_receivebuffer:
 	StreamPool_Return(transport->ReceivePool, transport->ReceiveBuffer);
 out_free_receivepool:
@@ -1103,6 +1520,8 @@ void transport_free(rdpTransport* transport)
 		Stream_Release(transport->ReceiveBuffer);
 
 	StreamPool_Free(transport->ReceivePool);
+	free(transport->ReadAheadBuffer);
+	CloseHandle(transport->ReadAheadEvent);
 	CloseHandle(transport->connectedEvent);
 	DeleteCriticalSection(&(transport->ReadLock));
 	DeleteCriticalSection(&(transport->WriteLock));
@@ -77,6 +77,12 @@ struct rdp_transport
 	CRITICAL_SECTION ReadLock;
 	CRITICAL_SECTION WriteLock;
 	ULONG written;
+	BYTE* ReadAheadBuffer;
+	size_t ReadAheadOffset;
+	size_t ReadAheadLength;
+	HANDLE ReadAheadEvent;
+	BOOL ReadAheadSignaled;
+	LONG volatile EventHandlesVersion;
 };
 
 wStream* transport_send_stream_init(rdpTransport* transport, int size);
@@ -92,6 +98,8 @@ BOOL transport_accept_nla(rdpTransport* transport);
 void transport_stop(rdpTransport* transport);
 int transport_read_pdu(rdpTransport* transport, wStream* s);
 int transport_write(rdpTransport* transport, wStream* s);
+BOOL transport_supports_writev(rdpTransport* transport);
+int transport_writev(rdpTransport* transport, const DataChunk* chunks, int count);
 
 void transport_get_fds(rdpTransport* transport, void** rfds, int* rcount);
 int transport_check_fds(rdpTransport* transport);
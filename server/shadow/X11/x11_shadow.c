@@ -537,6 +537,75 @@ int x11_shadow_query_cursor(x11ShadowSubsystem* subsystem, BOOL getImage)
 	return 1;
 }
 
+#ifdef WITH_XDAMAGE
+
+static BOOL x11_shadow_damage_resize(x11ShadowSubsystem* subsystem, int width, int height)
+{
+	BYTE* tiles;
+	int tilesWidth;
+	int tilesHeight;
+
+	tilesWidth = (width + X11_SHADOW_TILE_SIZE - 1) / X11_SHADOW_TILE_SIZE;
+	tilesHeight = (height + X11_SHADOW_TILE_SIZE - 1) / X11_SHADOW_TILE_SIZE;
+
+	if (subsystem->damageTiles && (tilesWidth == subsystem->damageTilesWidth) &&
+			(tilesHeight == subsystem->damageTilesHeight))
+		return TRUE;
+
+	tiles = (BYTE*) calloc((tilesWidth * tilesHeight) + 1, sizeof(BYTE));
+
+	if (!tiles)
+		return FALSE;
+
+	free(subsystem->damageTiles);
+	subsystem->damageTiles = tiles;
+	subsystem->damageTilesWidth = tilesWidth;
+	subsystem->damageTilesHeight = tilesHeight;
+
+	/* Damage collected for the old geometry is meaningless now */
+	subsystem->damageAll = TRUE;
+
+	return TRUE;
+}
+
+/**
+ * Mark the tiles covered by a damaged area, given in root window coordinates.
+ */
+static void x11_shadow_damage_mark(x11ShadowSubsystem* subsystem, int x, int y, int width, int height)
+{
+	int tx, ty;
+	int left, top;
+	int right, bottom;
+	rdpShadowSurface* surface;
+
+	surface = subsystem->server ? subsystem->server->surface : NULL;
+
+	if (!surface || !subsystem->damageTiles)
+	{
+		subsystem->damageAll = TRUE;
+		return;
+	}
+
+	left = MAX(x - surface->x, 0);
+	top = MAX(y - surface->y, 0);
+	right = MIN(x - surface->x + width, surface->width);
+	bottom = MIN(y - surface->y + height, surface->height);
+
+	if ((right <= left) || (bottom <= top))
+		return;
+
+	right = MIN((right - 1) / X11_SHADOW_TILE_SIZE, subsystem->damageTilesWidth - 1);
+	bottom = MIN((bottom - 1) / X11_SHADOW_TILE_SIZE, subsystem->damageTilesHeight - 1);
+
+	for (ty = top / X11_SHADOW_TILE_SIZE; ty <= bottom; ty++)
+	{
+		for (tx = left / X11_SHADOW_TILE_SIZE; tx <= right; tx++)
+			subsystem->damageTiles[(ty * subsystem->damageTilesWidth) + tx] = 1;
+	}
+}
+
+#endif
+
 int x11_shadow_handle_xevent(x11ShadowSubsystem* subsystem, XEvent* xevent)
 {
 	if (xevent->type == MotionNotify)
@@ -548,6 +617,15 @@ int x11_shadow_handle_xevent(x11ShadowSubsystem* subsystem, XEvent* xevent)
 	{
 		x11_shadow_query_cursor(subsystem, TRUE);
 	}
+#endif
+#ifdef WITH_XDAMAGE
+	else if (subsystem->use_xdamage && (xevent->type == subsystem->xdamage_notify_event))
+	{
+		XDamageNotifyEvent* notify = (XDamageNotifyEvent*) xevent;
+
+		x11_shadow_damage_mark(subsystem, notify->area.x, notify->area.y,
+				notify->area.width, notify->area.height);
+	}
 #endif
 	else
 	{
@@ -569,7 +647,7 @@ void x11_shadow_validate_region(x11ShadowSubsystem* subsystem, int x, int y, int
 	region.width = width;
 	region.height = height;
 
-#ifdef WITH_XFIXES
+#if defined(WITH_XFIXES) && defined(WITH_XDAMAGE)
 	XLockDisplay(subsystem->display);
 	XFixesSetRegion(subsystem->display, subsystem->xdamage_region, &region, 1);
 	XDamageSubtract(subsystem->display, subsystem->xdamage, subsystem->xdamage_region, None);
@@ -740,6 +818,221 @@ static int x11_shadow_error_handler_for_capture(Display * display, XErrorEvent *
 	return 0;
 }
 
+static void x11_shadow_publish_frame(x11ShadowSubsystem* subsystem)
+{
+	int count;
+	rdpShadowServer* server;
+	rdpShadowSurface* surface;
+
+	server = subsystem->server;
+	surface = server->surface;
+
+	//x11_shadow_blend_cursor(subsystem);
+
+	count = ArrayList_Count(server->clients);
+
+	shadow_subsystem_frame_update((rdpShadowSubsystem *)subsystem);
+
+	if (count == 1)
+	{
+		rdpShadowClient* client;
+
+		client = (rdpShadowClient*) ArrayList_GetItem(server->clients, 0);
+
+		if (client)
+		{
+			subsystem->captureFrameRate = shadow_encoder_preferred_fps(client->encoder);
+		}
+	}
+
+	region16_clear(&(surface->invalidRegion));
+}
+
+#ifdef WITH_XDAMAGE
+
+/**
+ * Reset the server side damage and move everything reported so far
+ * into the tile map. Damage arriving after the reset is reported again
+ * and picked up by the next frame, so nothing falls in between.
+ */
+static BOOL x11_shadow_damage_collect(x11ShadowSubsystem* subsystem)
+{
+	XEvent xevent;
+	rdpShadowSurface* surface;
+
+	surface = subsystem->server->surface;
+
+	if (!x11_shadow_damage_resize(subsystem, surface->width, surface->height))
+		return FALSE;
+
+	XLockDisplay(subsystem->display);
+
+	XDamageSubtract(subsystem->display, subsystem->xdamage, None, None);
+	XSync(subsystem->display, False);
+
+	while (XPending(subsystem->display) > 0)
+	{
+		XNextEvent(subsystem->display, &xevent);
+		x11_shadow_handle_xevent(subsystem, &xevent);
+	}
+
+	XUnlockDisplay(subsystem->display);
+
+	return TRUE;
+}
+
+/**
+ * Fetch a surface rectangle from the X server, compare it against the
+ * surface and copy the changed part. Must be called with the display locked.
+ */
+static int x11_shadow_grab_rect(x11ShadowSubsystem* subsystem, rdpShadowSurface* surface,
+		const RECTANGLE_16* rect)
+{
+	int status;
+	int nSrcStep;
+	int width, height;
+	BYTE* pSrcData;
+	BYTE* pDstData;
+	XImage* image;
+	int index;
+	int nbRects;
+	REGION16 invalidRegion;
+	RECTANGLE_16 invalidRect;
+	const RECTANGLE_16* rects;
+
+	width = rect->right - rect->left;
+	height = rect->bottom - rect->top;
+
+	if (subsystem->use_xshm)
+	{
+		image = subsystem->fb_image;
+
+		XCopyArea(subsystem->display, subsystem->root_window, subsystem->fb_pixmap,
+				subsystem->xshm_gc, surface->x + rect->left, surface->y + rect->top,
+				width, height, rect->left, rect->top);
+
+		XSync(subsystem->display, False);
+
+		nSrcStep = image->bytes_per_line;
+		pSrcData = (BYTE*) &(image->data[(rect->top * nSrcStep) + (rect->left * 4)]);
+	}
+	else
+	{
+		image = XGetImage(subsystem->display, subsystem->root_window,
+				surface->x + rect->left, surface->y + rect->top, width, height, AllPlanes, ZPixmap);
+
+		if (!image)
+			return -1;
+
+		nSrcStep = image->bytes_per_line;
+		pSrcData = (BYTE*) image->data;
+	}
+
+	pDstData = &(surface->data[(rect->top * surface->scanline) + (rect->left * 4)]);
+
+	region16_init(&invalidRegion);
+
+	status = shadow_capture_compare_region(pDstData, surface->scanline, width, height,
+			pSrcData, nSrcStep, &invalidRegion);
+
+	if (status > 0)
+	{
+		rects = region16_rects(&invalidRegion, &nbRects);
+
+		for (index = 0; index < nbRects; index++)
+		{
+			invalidRect = rects[index];
+
+			freerdp_image_copy(pDstData, PIXEL_FORMAT_XRGB32, surface->scanline,
+					invalidRect.left, invalidRect.top,
+					invalidRect.right - invalidRect.left, invalidRect.bottom - invalidRect.top,
+					pSrcData, PIXEL_FORMAT_XRGB32, nSrcStep, invalidRect.left, invalidRect.top, NULL);
+
+			invalidRect.left += rect->left;
+			invalidRect.top += rect->top;
+			invalidRect.right += rect->left;
+			invalidRect.bottom += rect->top;
+
+			region16_union_rect(&(surface->invalidRegion), &(surface->invalidRegion), &invalidRect);
+		}
+	}
+
+	region16_uninit(&invalidRegion);
+
+	if (!subsystem->use_xshm)
+		XDestroyImage(image);
+
+	return status;
+}
+
+/**
+ * Only fetch and compare the tiles reported by XDamage. Horizontal runs
+ * of dirty tiles are fetched with a single request.
+ */
+static int x11_shadow_screen_grab_damage(x11ShadowSubsystem* subsystem)
+{
+	int tx, ty;
+	int first;
+	int status = 1;
+	BYTE* tiles;
+	RECTANGLE_16 rect;
+	rdpShadowSurface* surface;
+
+	surface = subsystem->server->surface;
+
+	XLockDisplay(subsystem->display);
+
+	XSetErrorHandler(x11_shadow_error_handler_for_capture);
+
+	for (ty = 0; (ty < subsystem->damageTilesHeight) && (status >= 0); ty++)
+	{
+		tiles = &(subsystem->damageTiles[ty * subsystem->damageTilesWidth]);
+
+		for (tx = 0; (tx < subsystem->damageTilesWidth) && (status >= 0); tx++)
+		{
+			if (!tiles[tx])
+				continue;
+
+			first = tx;
+
+			while ((tx < subsystem->damageTilesWidth) && tiles[tx])
+				tiles[tx++] = 0;
+
+			rect.left = first * X11_SHADOW_TILE_SIZE;
+			rect.top = ty * X11_SHADOW_TILE_SIZE;
+			rect.right = MIN(tx * X11_SHADOW_TILE_SIZE, surface->width);
+			rect.bottom = MIN((ty + 1) * X11_SHADOW_TILE_SIZE, surface->height);
+
+			if ((rect.right > rect.left) && (rect.bottom > rect.top))
+				status = x11_shadow_grab_rect(subsystem, surface, &rect);
+		}
+	}
+
+	XSetErrorHandler(NULL);
+
+	XSync(subsystem->display, False);
+
+	XUnlockDisplay(subsystem->display);
+
+	if (status < 0)
+	{
+		/*
+		 * BadMatch error happened, the screen size is changing.
+		 * Fall back to a full sweep once the surface has been resized.
+		 */
+		ZeroMemory(subsystem->damageTiles, subsystem->damageTilesWidth * subsystem->damageTilesHeight);
+		subsystem->damageAll = TRUE;
+		return 0;
+	}
+
+	if (!region16_is_empty(&(surface->invalidRegion)))
+		x11_shadow_publish_frame(subsystem);
+
+	return 1;
+}
+
+#endif
+
 int x11_shadow_screen_grab(x11ShadowSubsystem* subsystem)
 {
 	int count;
@@ -750,9 +1043,10 @@ int x11_shadow_screen_grab(x11ShadowSubsystem* subsystem)
 	rdpShadowScreen* screen;
 	rdpShadowServer* server;
 	rdpShadowSurface* surface;
-	RECTANGLE_16 invalidRect;
+	int index;
+	int nbRects;
 	RECTANGLE_16 surfaceRect;
-	const RECTANGLE_16 *extents;
+	const RECTANGLE_16* rects;
 
 	server = subsystem->server;
 	surface = server->surface;
@@ -768,6 +1062,22 @@ int x11_shadow_screen_grab(x11ShadowSubsystem* subsystem)
 	surfaceRect.right = surface->width;
 	surfaceRect.bottom = surface->height;
 
+#ifdef WITH_XDAMAGE
+	if (subsystem->use_xdamage)
+	{
+		if (!x11_shadow_damage_collect(subsystem))
+			return -1;
+
+		if (!subsystem->damageAll && (GetTickCount64() < subsystem->nextFullSweep))
+			return x11_shadow_screen_grab_damage(subsystem);
+
+		/* Periodic safety sweep, catches anything XDamage did not report */
+		ZeroMemory(subsystem->damageTiles, subsystem->damageTilesWidth * subsystem->damageTilesHeight);
+		subsystem->damageAll = FALSE;
+		subsystem->nextFullSweep = GetTickCount64() + X11_SHADOW_FULL_SWEEP_INTERVAL;
+	}
+#endif
+
 	XLockDisplay(subsystem->display);
 
 	/*
@@ -783,8 +1093,8 @@ int x11_shadow_screen_grab(x11ShadowSubsystem* subsystem)
 		XCopyArea(subsystem->display, subsystem->root_window, subsystem->fb_pixmap,
 				subsystem->xshm_gc, 0, 0, subsystem->width, subsystem->height, 0, 0);
 
-		status = shadow_capture_compare(surface->data, surface->scanline, surface->width, surface->height,
-				(BYTE*) &(image->data[surface->width * 4]), image->bytes_per_line, &invalidRect);
+		status = shadow_capture_compare_region(surface->data, surface->scanline, surface->width, surface->height,
+				(BYTE*) &(image->data[surface->width * 4]), image->bytes_per_line, &(surface->invalidRegion));
 	}
 	else
 	{
@@ -800,8 +1110,8 @@ int x11_shadow_screen_grab(x11ShadowSubsystem* subsystem)
 			goto fail_capture;
 		}
 
-		status = shadow_capture_compare(surface->data, surface->scanline, surface->width, surface->height,
-				(BYTE*) image->data, image->bytes_per_line, &invalidRect);
+		status = shadow_capture_compare_region(surface->data, surface->scanline, surface->width, surface->height,
+				(BYTE*) image->data, image->bytes_per_line, &(surface->invalidRegion));
 	}
 
 	/* Restore the default error handler */
@@ -811,42 +1121,26 @@ int x11_shadow_screen_grab(x11ShadowSubsystem* subsystem)
 
 	XUnlockDisplay(subsystem->display);
 
-	region16_union_rect(&(surface->invalidRegion), &(surface->invalidRegion), &invalidRect);
 	region16_intersect_rect(&(surface->invalidRegion), &(surface->invalidRegion), &surfaceRect);
 
-	if (!region16_is_empty(&(surface->invalidRegion)))
+	if ((status >= 0) && !region16_is_empty(&(surface->invalidRegion)))
 	{
-		extents = region16_extents(&(surface->invalidRegion));
-
-		x = extents->left;
-		y = extents->top;
-		width = extents->right - extents->left;
-		height = extents->bottom - extents->top;
-
-		freerdp_image_copy(surface->data, PIXEL_FORMAT_XRGB32,
-				surface->scanline, x, y, width, height,
-				(BYTE*) image->data, PIXEL_FORMAT_XRGB32,
-				image->bytes_per_line, x, y, NULL);
-
-		//x11_shadow_blend_cursor(subsystem);
-
-		count = ArrayList_Count(server->clients);
-
-		shadow_subsystem_frame_update((rdpShadowSubsystem *)subsystem);
+		rects = region16_rects(&(surface->invalidRegion), &nbRects);
 
-		if (count == 1)
+		for (index = 0; index < nbRects; index++)
 		{
-			rdpShadowClient* client;
-
-			client = (rdpShadowClient*) ArrayList_GetItem(server->clients, 0);
-
-			if (client)
-			{
-				subsystem->captureFrameRate = shadow_encoder_preferred_fps(client->encoder);
-			}
+			x = rects[index].left;
+			y = rects[index].top;
+			width = rects[index].right - rects[index].left;
+			height = rects[index].bottom - rects[index].top;
+
+			freerdp_image_copy(surface->data, PIXEL_FORMAT_XRGB32,
+					surface->scanline, x, y, width, height,
+					(BYTE*) image->data, PIXEL_FORMAT_XRGB32,
+					image->bytes_per_line, x, y, NULL);
 		}
 
-		region16_clear(&(surface->invalidRegion));
+		x11_shadow_publish_frame(subsystem);
 	}
 
 	if (!subsystem->use_xshm)
@@ -924,7 +1218,7 @@ void* x11_shadow_subsystem_thread(x11ShadowSubsystem* subsystem)
 		{
 			XLockDisplay(subsystem->display);
 
-			if (XEventsQueued(subsystem->display, QueuedAlready))
+			while (XPending(subsystem->display) > 0)
 			{
 				XNextEvent(subsystem->display, &xevent);
 				x11_shadow_handle_xevent(subsystem, &xevent);
@@ -1377,6 +1671,11 @@ int x11_shadow_subsystem_uninit(x11ShadowSubsystem* subsystem)
 		subsystem->cursorPixels = NULL;
 	}
 
+	free(subsystem->damageTiles);
+	subsystem->damageTiles = NULL;
+	subsystem->damageTilesWidth = 0;
+	subsystem->damageTilesHeight = 0;
+
 	return 1;
 }
 
@@ -1434,7 +1733,7 @@ x11ShadowSubsystem* x11_shadow_subsystem_new()
 	subsystem->composite = FALSE;
 	subsystem->use_xshm = FALSE; /* temporarily disabled */
 	subsystem->use_xfixes = TRUE;
-	subsystem->use_xdamage = FALSE;
+	subsystem->use_xdamage = TRUE;
 	subsystem->use_xinerama = TRUE;
 
 	return subsystem;
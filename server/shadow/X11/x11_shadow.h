@@ -51,6 +51,9 @@ typedef struct x11_shadow_subsystem x11ShadowSubsystem;
 #include <X11/extensions/Xinerama.h>
 #endif
 
+#define X11_SHADOW_TILE_SIZE			64
+#define X11_SHADOW_FULL_SWEEP_INTERVAL		2000 /* ms */
+
 struct x11_shadow_subsystem
 {
 	RDP_SHADOW_SUBSYSTEM_COMMON();
@@ -75,11 +78,19 @@ struct x11_shadow_subsystem
 	BOOL use_xdamage;
 	BOOL use_xinerama;
 
+	GC xshm_gc;
 	XImage* fb_image;
 	Pixmap fb_pixmap;
 	Window root_window;
 	XShmSegmentInfo fb_shm_info;
 
+	/* Damage-driven capture: one byte per X11_SHADOW_TILE_SIZE tile */
+	BYTE* damageTiles;
+	int damageTilesWidth;
+	int damageTilesHeight;
+	BOOL damageAll;
+	UINT64 nextFullSweep;
+
 	int cursorHotX;
 	int cursorHotY;
 	int cursorWidth;
@@ -91,7 +102,6 @@ struct x11_shadow_subsystem
 	rdpShadowClient* lastMouseClient;
 
 #ifdef WITH_XDAMAGE
-	GC xshm_gc;
 	Damage xdamage;
 	int xdamage_notify_event;
 	XserverRegion xdamage_region;
@@ -22,6 +22,15 @@
 
 #include <winpr/crt.h>
 #include <winpr/print.h>
+#include <winpr/sysinfo.h>
+
+#ifdef WITH_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef WITH_NEON
+#include <arm_neon.h>
+#endif
 
 #include <freerdp/log.h>
 
@@ -80,35 +89,142 @@ int shadow_capture_align_clip_rect(RECTANGLE_16* rect, RECTANGLE_16* clip)
 	return 1;
 }
 
-int shadow_capture_compare(BYTE* pData1, int nStep1, int nWidth, int nHeight, BYTE* pData2, int nStep2, RECTANGLE_16* rect)
+/**
+ * Tile comparison kernels, nWidth is at most 16 pixels.
+ * Return TRUE if both tiles are equal.
+ */
+
+typedef BOOL (*pfnShadowCaptureTileEqual)(const BYTE* pData1, int nStep1,
+		const BYTE* pData2, int nStep2, int nWidth, int nHeight);
+
+static BOOL shadow_capture_tile_equal_generic(const BYTE* pData1, int nStep1,
+		const BYTE* pData2, int nStep2, int nWidth, int nHeight)
 {
-	BOOL equal;
-	BOOL allEqual;
-	int tw, th;
-	int tx, ty, k;
-	int nrow, ncol;
-	int l, t, r, b;
-	BYTE *p1, *p2;
-	BOOL rows[1024];
-#ifdef WITH_DEBUG_SHADOW_CAPTURE
-	BOOL cols[1024];
+	int y;
+
+	for (y = 0; y < nHeight; y++)
+	{
+		if (memcmp(pData1, pData2, nWidth * 4) != 0)
+			return FALSE;
+
+		pData1 += nStep1;
+		pData2 += nStep2;
+	}
+
+	return TRUE;
+}
+
+#ifdef WITH_SSE2
+static BOOL shadow_capture_tile_equal_sse2(const BYTE* pData1, int nStep1,
+		const BYTE* pData2, int nStep2, int nWidth, int nHeight)
+{
+	int y;
+	__m128i diff;
+
+	if (nWidth != 16)
+		return shadow_capture_tile_equal_generic(pData1, nStep1, pData2, nStep2, nWidth, nHeight);
+
+	/* Accumulate the differences of the whole tile, most tiles are unchanged */
+	diff = _mm_setzero_si128();
+
+	for (y = 0; y < nHeight; y++)
+	{
+		const __m128i* p1 = (const __m128i*) pData1;
+		const __m128i* p2 = (const __m128i*) pData2;
+
+		diff = _mm_or_si128(diff, _mm_xor_si128(_mm_loadu_si128(&p1[0]), _mm_loadu_si128(&p2[0])));
+		diff = _mm_or_si128(diff, _mm_xor_si128(_mm_loadu_si128(&p1[1]), _mm_loadu_si128(&p2[1])));
+		diff = _mm_or_si128(diff, _mm_xor_si128(_mm_loadu_si128(&p1[2]), _mm_loadu_si128(&p2[2])));
+		diff = _mm_or_si128(diff, _mm_xor_si128(_mm_loadu_si128(&p1[3]), _mm_loadu_si128(&p2[3])));
+
+		pData1 += nStep1;
+		pData2 += nStep2;
+	}
+
+	return (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) == 0xFFFF) ? TRUE : FALSE;
+}
 #endif
 
-	allEqual = TRUE;
-	ZeroMemory(rect, sizeof(RECTANGLE_16));
-	FillMemory(rows, sizeof(rows), 0xFF);
-#ifdef WITH_DEBUG_SHADOW_CAPTURE
-	FillMemory(cols, sizeof(cols), 0xFF);
+#ifdef WITH_NEON
+static BOOL shadow_capture_tile_equal_neon(const BYTE* pData1, int nStep1,
+		const BYTE* pData2, int nStep2, int nWidth, int nHeight)
+{
+	int y;
+	uint32x4_t diff;
+	uint32x2_t fold;
+
+	if (nWidth != 16)
+		return shadow_capture_tile_equal_generic(pData1, nStep1, pData2, nStep2, nWidth, nHeight);
+
+	diff = vdupq_n_u32(0);
+
+	for (y = 0; y < nHeight; y++)
+	{
+		const uint32_t* p1 = (const uint32_t*) pData1;
+		const uint32_t* p2 = (const uint32_t*) pData2;
+
+		diff = vorrq_u32(diff, veorq_u32(vld1q_u32(&p1[0]), vld1q_u32(&p2[0])));
+		diff = vorrq_u32(diff, veorq_u32(vld1q_u32(&p1[4]), vld1q_u32(&p2[4])));
+		diff = vorrq_u32(diff, veorq_u32(vld1q_u32(&p1[8]), vld1q_u32(&p2[8])));
+		diff = vorrq_u32(diff, veorq_u32(vld1q_u32(&p1[12]), vld1q_u32(&p2[12])));
+
+		pData1 += nStep1;
+		pData2 += nStep2;
+	}
+
+	fold = vorr_u32(vget_low_u32(diff), vget_high_u32(diff));
+
+	return ((vget_lane_u32(fold, 0) | vget_lane_u32(fold, 1)) == 0) ? TRUE : FALSE;
+}
+#endif
+
+static INIT_ONCE shadow_capture_init_once = INIT_ONCE_STATIC_INIT;
+static pfnShadowCaptureTileEqual shadow_capture_tile_equal = shadow_capture_tile_equal_generic;
+
+static BOOL CALLBACK shadow_capture_init_kernels(PINIT_ONCE once, PVOID param, PVOID* context)
+{
+	pfnShadowCaptureTileEqual tileEqual = shadow_capture_tile_equal_generic;
+
+#if defined(WITH_SSE2)
+	if (IsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE))
+		tileEqual = shadow_capture_tile_equal_sse2;
+#elif defined(WITH_NEON)
+	if (IsProcessorFeaturePresent(PF_ARM_NEON_INSTRUCTIONS_AVAILABLE))
+		tileEqual = shadow_capture_tile_equal_neon;
 #endif
 
+	shadow_capture_tile_equal = tileEqual;
+
+	return TRUE;
+}
+
+/**
+ * Compare two frames in 16x16 tiles and add the changed tiles to region.
+ * Changed tiles are merged into horizontal runs, and runs spanning the
+ * same columns in consecutive tile rows are merged vertically.
+ * Returns 1 if anything changed, 0 if both frames are equal, -1 on failure.
+ */
+int shadow_capture_compare_region(BYTE* pData1, int nStep1, int nWidth, int nHeight,
+		BYTE* pData2, int nStep2, REGION16* region)
+{
+	int tw, th;
+	int tx, ty;
+	int nrow, ncol;
+	int first;
+	BOOL changed = FALSE;
+	BOOL pending = FALSE;
+	RECTANGLE_16 run;
+	RECTANGLE_16 prev;
+	pfnShadowCaptureTileEqual tileEqual;
+
+	InitOnceExecuteOnce(&shadow_capture_init_once, shadow_capture_init_kernels, NULL, NULL);
+
+	tileEqual = shadow_capture_tile_equal;
+
 	nrow = (nHeight + 15) / 16;
 	ncol = (nWidth + 15) / 16;
 
-	l = ncol + 1;
-	r = -1;
-
-	t = nrow + 1;
-	b = -1;
+	ZeroMemory(&prev, sizeof(RECTANGLE_16));
 
 	for (ty = 0; ty < nrow; ty++)
 	{
@@ -119,103 +235,80 @@ int shadow_capture_compare(BYTE* pData1, int nStep1, int nWidth, int nHeight, BY
 
 		for (tx = 0; tx < ncol; tx++)
 		{
-			equal = TRUE;
-
 			tw = ((tx + 1) == ncol) ? (nWidth % 16) : 16;
 
 			if (!tw)
 				tw = 16;
 
-			p1 = &pData1[(ty * 16 * nStep1) + (tx * 16 * 4)];
-			p2 = &pData2[(ty * 16 * nStep2) + (tx * 16 * 4)];
+			if (tileEqual(&pData1[(ty * 16 * nStep1) + (tx * 16 * 4)], nStep1,
+					&pData2[(ty * 16 * nStep2) + (tx * 16 * 4)], nStep2, tw, th))
+				continue;
 
-			for (k = 0; k < th; k++)
+			/* Extend the run over the following changed tiles */
+			first = tx;
+
+			while ((tx + 1) < ncol)
 			{
-				if (memcmp(p1, p2, tw * 4) != 0)
-				{
-					equal = FALSE;
+				tw = ((tx + 2) == ncol) ? (nWidth % 16) : 16;
+
+				if (!tw)
+					tw = 16;
+
+				if (tileEqual(&pData1[(ty * 16 * nStep1) + ((tx + 1) * 16 * 4)], nStep1,
+						&pData2[(ty * 16 * nStep2) + ((tx + 1) * 16 * 4)], nStep2, tw, th))
 					break;
-				}
 
-				p1 += nStep1;
-				p2 += nStep2;
+				tx++;
 			}
 
-			if (!equal)
-			{
-				rows[ty] = FALSE;
-#ifdef WITH_DEBUG_SHADOW_CAPTURE
-				cols[tx] = FALSE;
-#endif
+			run.left = first * 16;
+			run.top = ty * 16;
+			run.right = MIN((tx + 1) * 16, nWidth);
+			run.bottom = run.top + th;
 
-				if (l > tx)
-					l = tx;
+			changed = TRUE;
 
-				if (r < tx)
-					r = tx;
+			if (pending && (prev.left == run.left) && (prev.right == run.right) &&
+					(prev.bottom == run.top))
+			{
+				prev.bottom = run.bottom;
+				continue;
 			}
-		}
 
-		if (!rows[ty])
-		{
-			allEqual = FALSE;
+			if (pending && !region16_union_rect(region, region, &prev))
+				return -1;
 
-			if (t > ty)
-				t = ty;
-
-			if (b < ty)
-				b = ty;
+			prev = run;
+			pending = TRUE;
 		}
 	}
 
-	if (allEqual)
-		return 0;
-
-	rect->left = l * 16;
-	rect->top = t * 16;
-	rect->right = (r + 1) * 16;
-	rect->bottom = (b + 1) * 16;
+	if (pending && !region16_union_rect(region, region, &prev))
+		return -1;
 
-	if (rect->right > nWidth)
-		rect->right = nWidth;
-
-	if (rect->bottom > nHeight)
-		rect->bottom = nHeight;
+	return changed ? 1 : 0;
+}
 
-#ifdef WITH_DEBUG_SHADOW_CAPTURE
-	char *col_str = calloc(ncol + 1, sizeof(char));
-	if (!col_str)
-	{
-		WLog_ERR(TAG, "calloc failed!");
-		return 1;
-	}
+/**
+ * Compare two frames, rect receives the extents of the changed tiles.
+ */
+int shadow_capture_compare(BYTE* pData1, int nStep1, int nWidth, int nHeight, BYTE* pData2, int nStep2, RECTANGLE_16* rect)
+{
+	int status;
+	REGION16 region;
 
-	for (tx = 0; tx < ncol; tx++)
-		sprintf(&col_str[tx], "-");
-	WLog_INFO(TAG, "%s", col_str);
+	ZeroMemory(rect, sizeof(RECTANGLE_16));
 
-	for (tx = 0; tx < ncol; tx++)
-		sprintf(&col_str[tx], "%c", cols[tx] ? 'O' : 'X');
-	WLog_INFO(TAG, "%s", col_str);
+	region16_init(&region);
 
-	for (tx = 0; tx < ncol; tx++)
-		sprintf(&col_str[tx], "-");
-	WLog_INFO(TAG, "%s", col_str);
+	status = shadow_capture_compare_region(pData1, nStep1, nWidth, nHeight, pData2, nStep2, &region);
 
-	for (ty = 0; ty < nrow; ty++)
-	{
-		for (tx = 0; tx < ncol; tx++)
-			sprintf(&col_str[tx], "%c", cols[tx] ? 'O' : 'X');
-		WLog_INFO(TAG, "%s", col_str);
-		WLog_INFO(TAG, "|%s|", rows[ty] ? "O" : "X");
-	}
+	if (status > 0)
+		CopyMemory(rect, region16_extents(&region), sizeof(RECTANGLE_16));
 
-	WLog_INFO(TAG, "left: %d top: %d right: %d bottom: %d ncol: %d nrow: %d",
-			l, t, r, b, ncol, nrow);
-	free(col_str);
-#endif
+	region16_uninit(&region);
 
-	return 1;
+	return status;
 }
 
 rdpShadowCapture* shadow_capture_new(rdpShadowServer* server)
@@ -145,6 +145,7 @@ static BOOL shadow_client_context_new(freerdp_peer* peer, rdpShadowClient* clien
 	settings->SurfaceFrameMarkerEnabled = TRUE;
 	settings->SupportGraphicsPipeline = TRUE;
 	settings->GfxH264 = FALSE;
+	settings->GfxAVC444 = FALSE;
 
 	settings->DrawAllowSkipAlpha = TRUE;
 	settings->DrawAllowColorSubsampling = TRUE;
@@ -608,18 +609,35 @@ static UINT shadow_client_rdpgfx_frame_acknowledge(RdpgfxServerContext* context,
 }
 static UINT shadow_client_rdpgfx_qoe_frame_acknowledge(RdpgfxServerContext* context, RDPGFX_QOE_FRAME_ACKNOWLEDGE_PDU* qoeFrameAcknowledge)
 {
-	shadow_client_common_frame_acknowledge((rdpShadowClient *)context->custom, 
-	                                       qoeFrameAcknowledge->frameId);
+	rdpShadowClient* client = (rdpShadowClient*) context->custom;
+
+	shadow_client_common_frame_acknowledge(client, qoeFrameAcknowledge->frameId);
+
+	/* From the start of the frame until it is rendered */
+	shadow_encoder_decode_time_sample(client->encoder,
+			qoeFrameAcknowledge->timeDiffSE + qoeFrameAcknowledge->timeDiffEDR);
+
 	return CHANNEL_RC_OK;
 }
 
+static BOOL shadow_client_network_characteristics_update(rdpContext* context,
+		const AUTODETECT_NETWORK_CHARACTERISTICS* characteristics)
+{
+	rdpShadowClient* client = (rdpShadowClient*) context;
+
+	shadow_encoder_network_update(client->encoder, characteristics);
+
+	return TRUE;
+}
+
 /**
  * Function description
  *
  * @return TRUE on success
  */
 static BOOL shadow_client_send_surface_gfx(rdpShadowClient* client, 
-		BYTE* pSrcData, int nSrcStep, int nXSrc, int nYSrc, int nWidth, int nHeight)
+		BYTE* pSrcData, int nSrcStep, int nXSrc, int nYSrc, int nWidth, int nHeight,
+		const RECTANGLE_16* rects, int numRects)
 {
 	UINT error = CHANNEL_RC_OK;
 	rdpUpdate* update;
@@ -657,23 +675,31 @@ static BOOL shadow_client_send_surface_gfx(rdpShadowClient* client,
 	cmd.width = nWidth;
 	cmd.height = nHeight;
 
-	if (settings->GfxH264)
+	if (settings->GfxAVC444 && shadow_encoder_use_avc444(encoder))
 	{
-		RDPGFX_AVC420_BITMAP_STREAM avc420;
+		BYTE op;
+		RDPGFX_AVC444_BITMAP_STREAM avc444;
 		RECTANGLE_16 regionRect;
 		RDPGFX_H264_QUANT_QUALITY quantQualityVal;
 
-		if (shadow_encoder_prepare(encoder, FREERDP_CODEC_AVC420) < 0)
+		if (shadow_encoder_prepare(encoder, FREERDP_CODEC_AVC444) < 0)
 		{
-			WLog_ERR(TAG, "Failed to prepare encoder FREERDP_CODEC_AVC420");
+			WLog_ERR(TAG, "Failed to prepare encoder FREERDP_CODEC_AVC444");
 			return FALSE;
 		}
 
-		avc420_compress(encoder->h264, pSrcData, PIXEL_FORMAT_RGB32, nSrcStep, 
-		                nWidth, nHeight, &avc420.data, &avc420.length);
+		/* The op mode (luma, chroma or both) is chosen per frame by the encoder */
+		if (avc444_compress(encoder->h264, pSrcData, PIXEL_FORMAT_RGB32, nSrcStep,
+		                    nWidth, nHeight, &op,
+		                    &avc444.bitstream[0].data, &avc444.bitstream[0].length,
+		                    &avc444.bitstream[1].data, &avc444.bitstream[1].length) < 0)
+		{
+			WLog_ERR(TAG, "avc444_compress failed");
+			return FALSE;
+		}
 
-		cmd.codecId = RDPGFX_CODECID_AVC420;
-		cmd.extra = (void *)&avc420;
+		cmd.codecId = RDPGFX_CODECID_AVC444;
+		cmd.extra = (void *)&avc444;
 		regionRect.left = cmd.left;
 		regionRect.top = cmd.top;
 		regionRect.right = cmd.right;
@@ -682,115 +708,371 @@ static BOOL shadow_client_send_surface_gfx(rdpShadowClient* client,
 		quantQualityVal.r = 0;
 		quantQualityVal.p = 0;
 		quantQualityVal.qualityVal = 100 - quantQualityVal.qp;
-		avc420.meta.numRegionRects = 1;
-		avc420.meta.regionRects = &regionRect;
-		avc420.meta.quantQualityVals = &quantQualityVal;
+		avc444.LC = op;
+		avc444.cbAvc420EncodedBitstream1 = 0; /* computed by rdpgfx */
+		avc444.bitstream[0].meta.numRegionRects = 1;
+		avc444.bitstream[0].meta.regionRects = &regionRect;
+		avc444.bitstream[0].meta.quantQualityVals = &quantQualityVal;
+		avc444.bitstream[1].meta = avc444.bitstream[0].meta;
+
+		IFCALLRET(client->rdpgfx->SurfaceFrameCommand, error, client->rdpgfx, &cmd, &cmdstart, &cmdend);
+		if (error)
+		{
+			WLog_ERR(TAG, "SurfaceFrameCommand failed with error %lu", error);
+			return FALSE;
+		}
+
+		shadow_encoder_frame_sent(encoder, avc444.bitstream[0].length + avc444.bitstream[1].length,
+				context->peer->IsWriteBlocked(context->peer));
+	}
+	else if (settings->GfxH264)
+	{
+		RDPGFX_AVC420_BITMAP_STREAM avc420;
+
+		if (shadow_encoder_prepare(encoder, FREERDP_CODEC_AVC420) < 0)
+		{
+			WLog_ERR(TAG, "Failed to prepare encoder FREERDP_CODEC_AVC420");
+			return FALSE;
+		}
+
+		/* Only the damaged rectangles are converted and listed in the metablock */
+		if (avc420_compress(encoder->h264, pSrcData, PIXEL_FORMAT_RGB32, nSrcStep,
+		                    nWidth, nHeight, rects, numRects,
+		                    &avc420.data, &avc420.length, &avc420.meta) < 0)
+		{
+			WLog_ERR(TAG, "avc420_compress failed");
+			return FALSE;
+		}
+
+		cmd.codecId = RDPGFX_CODECID_AVC420;
+		cmd.extra = (void *)&avc420;
 
 		IFCALLRET(client->rdpgfx->SurfaceFrameCommand, error, client->rdpgfx, &cmd, &cmdstart, &cmdend);
+
+		h264_metablock_free(&avc420.meta);
+
 		if (error)
 		{
 			WLog_ERR(TAG, "SurfaceFrameCommand failed with error %lu", error);
 			return FALSE;
 		}
+
+		shadow_encoder_frame_sent(encoder, avc420.length,
+				context->peer->IsWriteBlocked(context->peer));
 	}
 
 	return TRUE;
 }
 
+typedef BOOL (*pfnShadowClientEncode)(rdpShadowClient* client, rdpShadowEncodedPayload* payload,
+		BYTE* pSrcData, int nSrcStep, int nXSrc, int nYSrc, int nWidth, int nHeight);
+
+static void shadow_client_init_encode_key(rdpShadowClient* client, SHADOW_ENCODE_KEY* key,
+		UINT32 codecs, int nXSrc, int nYSrc, int nWidth, int nHeight)
+{
+	rdpShadowServer* server = client->server;
+	rdpSettings* settings = ((rdpContext*) client)->settings;
+
+	/* Zeroed as a whole, keys are compared with memcmp */
+	ZeroMemory(key, sizeof(SHADOW_ENCODE_KEY));
+
+	key->surface = client->inLobby ? server->lobby : server->surface;
+	key->codecs = codecs;
+	key->params[0] = settings->DesktopWidth;
+	key->params[1] = settings->DesktopHeight;
+	key->rect.left = nXSrc;
+	key->rect.top = nYSrc;
+	key->rect.right = nXSrc + nWidth;
+	key->rect.bottom = nYSrc + nHeight;
+}
+
 /**
  * Function description
+ * Get the encoded payload of the current frame. Clients with the same key
+ * share one encode, the first of them encodes it while the others wait.
  *
- * @return TRUE on success
+ * @return referenced payload, NULL on failure
  */
-static BOOL shadow_client_send_surface_bits(rdpShadowClient* client, 
+static rdpShadowEncodedPayload* shadow_client_get_payload(rdpShadowClient* client,
+		const SHADOW_ENCODE_KEY* key, BOOL shareable, pfnShadowClientEncode encode,
+		BYTE* pSrcData, int nSrcStep, int nXSrc, int nYSrc, int nWidth, int nHeight)
+{
+	BOOL valid;
+	BOOL owner = TRUE;
+	rdpShadowEncodedPayload* payload = NULL;
+	rdpShadowEncodeCache* cache = client->server->encodeCache;
+
+	if (shareable && cache)
+	{
+		payload = shadow_encode_cache_acquire(cache, key, &owner);
+
+		if (payload && !owner && !payload->valid)
+		{
+			/* The owner failed to encode, try on our own */
+			shadow_encoded_payload_unref(payload);
+			payload = NULL;
+		}
+	}
+
+	if (!payload)
+	{
+		owner = TRUE;
+
+		if (!(payload = shadow_encoded_payload_new(key)))
+			return NULL;
+	}
+
+	if (owner)
+	{
+		valid = encode(client, payload, pSrcData, nSrcStep, nXSrc, nYSrc, nWidth, nHeight);
+
+		shadow_encode_cache_complete(payload, valid);
+
+		if (!valid)
+		{
+			shadow_encoded_payload_unref(payload);
+			return NULL;
+		}
+	}
+
+	return payload;
+}
+
+static BOOL shadow_client_encode_rfx(rdpShadowClient* client, rdpShadowEncodedPayload* payload,
 		BYTE* pSrcData, int nSrcStep, int nXSrc, int nYSrc, int nWidth, int nHeight)
 {
-	BOOL ret = TRUE;
 	int i;
-	BOOL first;
-	BOOL last;
 	wStream* s;
+	BOOL ret = TRUE;
+	RFX_RECT rect;
 	int numMessages;
+	RFX_MESSAGE* messages;
+	RFX_RECT* messageRects = NULL;
+	rdpSettings* settings = ((rdpContext*) client)->settings;
+	rdpShadowEncoder* encoder = client->encoder;
+
+	rect.x = nXSrc;
+	rect.y = nYSrc;
+	rect.width = nWidth;
+	rect.height = nHeight;
+
+	if (!(messages = rfx_encode_messages(encoder->rfx, &rect, 1, pSrcData,
+			settings->DesktopWidth, settings->DesktopHeight, nSrcStep, &numMessages,
+			settings->MultifragMaxRequestSize)))
+	{
+		WLog_ERR(TAG, "rfx_encode_messages failed");
+		return FALSE;
+	}
+
+	if (numMessages > 0)
+		messageRects = messages[0].rects;
+
+	for (i = 0; i < numMessages; i++)
+	{
+		if (ret)
+		{
+			/* Headers, frame begin, region, tileset and frame end blocks */
+			s = Stream_New(NULL, messages[i].tilesDataSize + (messages[i].numQuant * 5) +
+					(messages[i].numRects * 8) + 128);
+
+			if (!s || !rfx_write_message(encoder->rfx, s, &messages[i]))
+			{
+				WLog_ERR(TAG, "rfx_write_message failed");
+				ret = FALSE;
+			}
+			else if (!shadow_encoded_payload_add_part(payload, Stream_Buffer(s),
+					Stream_GetPosition(s)))
+			{
+				ret = FALSE;
+			}
+			else
+			{
+				/* The buffer is owned by the payload now */
+				Stream_Free(s, FALSE);
+				s = NULL;
+			}
+
+			if (s)
+				Stream_Free(s, TRUE);
+		}
+
+		rfx_message_free(encoder->rfx, &messages[i]);
+	}
+
+	free(messageRects);
+	free(messages);
+
+	return ret;
+}
+
+static BOOL shadow_client_encode_nsc(rdpShadowClient* client, rdpShadowEncodedPayload* payload,
+		BYTE* pSrcData, int nSrcStep, int nXSrc, int nYSrc, int nWidth, int nHeight)
+{
+	wStream* s;
+	rdpShadowEncoder* encoder = client->encoder;
+
+	if (!(s = Stream_New(NULL, 1024)))
+		return FALSE;
+
+	pSrcData = &pSrcData[(nYSrc * nSrcStep) + (nXSrc * 4)];
+
+	nsc_compose_message(encoder->nsc, s, pSrcData, nWidth, nHeight, nSrcStep);
+
+	if ((Stream_GetPosition(s) == 0) ||
+	    !shadow_encoded_payload_add_part(payload, Stream_Buffer(s), Stream_GetPosition(s)))
+	{
+		Stream_Free(s, TRUE);
+		return FALSE;
+	}
+
+	Stream_Free(s, FALSE);
+
+	return TRUE;
+}
+
+/**
+ * Function description
+ * Encode each rectangle on its own and send all of them in one frame.
+ *
+ * @return TRUE on success
+ */
+static BOOL shadow_client_send_surface_bits(rdpShadowClient* client,
+		BYTE* pSrcData, int nSrcStep, const RECTANGLE_16* rects, int numRects)
+{
+	BOOL ret = TRUE;
+	UINT32 i;
+	int index;
+	BOOL first;
+	BOOL last;
+	BOOL shareable;
+	UINT32 codec;
+	UINT32 part;
+	UINT32 numParts;
 	UINT32 frameId = 0;
+	UINT32 size = 0;
+	int nXSrc, nYSrc;
+	int nWidth, nHeight;
 	rdpUpdate* update;
 	rdpContext* context;
 	rdpSettings* settings;
-	rdpShadowServer* server;
 	rdpShadowEncoder* encoder;
 	SURFACE_BITS_COMMAND cmd;
+	SHADOW_ENCODE_KEY key;
+	pfnShadowClientEncode encode;
+	rdpShadowEncodedPayload** payloads;
 
 	context = (rdpContext*) client;
 	update = context->update;
 	settings = context->settings;
 
-	server = client->server;
 	encoder = client->encoder;
 
-	if (encoder->frameAck)
-		frameId = shadow_encoder_create_frame_id(encoder);
-
 	if (settings->RemoteFxCodec)
 	{
-		RFX_RECT rect;
-		RFX_MESSAGE* messages;
-		RFX_RECT *messageRects = NULL;
+		codec = FREERDP_CODEC_REMOTEFX;
+		encode = shadow_client_encode_rfx;
+	}
+	else if (settings->NSCodec)
+	{
+		codec = FREERDP_CODEC_NSCODEC;
+		encode = shadow_client_encode_nsc;
+	}
+	else
+	{
+		return TRUE;
+	}
 
-		if (shadow_encoder_prepare(encoder, FREERDP_CODEC_REMOTEFX) < 0)
-		{
-			WLog_ERR(TAG, "Failed to prepare encoder FREERDP_CODEC_REMOTEFX");
-			return FALSE;
-		}
+	if (shadow_encoder_prepare(encoder, codec) < 0)
+	{
+		WLog_ERR(TAG, "Failed to prepare encoder %s",
+				(codec == FREERDP_CODEC_REMOTEFX) ? "FREERDP_CODEC_REMOTEFX" : "FREERDP_CODEC_NSCODEC");
+		return FALSE;
+	}
 
-		s = encoder->bs;
+	if (!(payloads = (rdpShadowEncodedPayload**) calloc(numRects, sizeof(rdpShadowEncodedPayload*))))
+		return FALSE;
+
+	numParts = 0;
 
-		rect.x = nXSrc;
-		rect.y = nYSrc;
-		rect.width = nWidth;
-		rect.height = nHeight;
+	for (index = 0; index < numRects; index++)
+	{
+		nXSrc = rects[index].left;
+		nYSrc = rects[index].top;
+		nWidth = rects[index].right - rects[index].left;
+		nHeight = rects[index].bottom - rects[index].top;
 
-		if (!(messages = rfx_encode_messages(encoder->rfx, &rect, 1, pSrcData,
-				settings->DesktopWidth, settings->DesktopHeight, nSrcStep, &numMessages,
-				settings->MultifragMaxRequestSize)))
+		shadow_client_init_encode_key(client, &key, codec, nXSrc, nYSrc, nWidth, nHeight);
+
+		if (codec == FREERDP_CODEC_REMOTEFX)
 		{
-			WLog_ERR(TAG, "rfx_encode_messages failed");
-			return FALSE;
+			key.params[2] = settings->MultifragMaxRequestSize;
+			key.params[3] = encoder->rfx->mode;
+			key.params[4] = encoder->quality; /* quantization */
+
+			/* The first message of a client carries the codec headers */
+			shareable = (encoder->rfx->state != RFX_STATE_SEND_HEADERS);
+		}
+		else
+		{
+			key.params[2] = encoder->nsc->ColorLossLevel;
+			key.params[3] = encoder->nsc->ChromaSubsamplingLevel;
+			key.params[4] = encoder->nsc->DynamicColorFidelity;
+			shareable = TRUE;
 		}
 
-		cmd.codecID = settings->RemoteFxCodecId;
+		if (!(payloads[index] = shadow_client_get_payload(client, &key, shareable,
+				encode, pSrcData, nSrcStep, nXSrc, nYSrc, nWidth, nHeight)))
+		{
+			ret = FALSE;
+			goto out;
+		}
 
-		cmd.destLeft = 0;
-		cmd.destTop = 0;
-		cmd.destRight = settings->DesktopWidth;
-		cmd.destBottom = settings->DesktopHeight;
+		numParts += payloads[index]->numParts;
+	}
 
-		cmd.bpp = 32;
-		cmd.width = settings->DesktopWidth;
-		cmd.height = settings->DesktopHeight;
-		cmd.skipCompression = TRUE;
+	if (encoder->frameAck && (numParts > 0))
+		frameId = shadow_encoder_create_frame_id(encoder);
 
-		if (numMessages > 0)
-			messageRects = messages[0].rects;
+	cmd.bpp = 32;
+	part = 0;
 
-		for (i = 0; i < numMessages; i++)
+	for (index = 0; (index < numRects) && ret; index++)
+	{
+		if (codec == FREERDP_CODEC_REMOTEFX)
 		{
-			Stream_SetPosition(s, 0);
-			if (!rfx_write_message(encoder->rfx, s, &messages[i]))
-			{
-				while (i < numMessages)
-				{
-					rfx_message_free(encoder->rfx, &messages[i++]);
-				}
-				WLog_ERR(TAG, "rfx_write_message failed");
-				ret = FALSE;
-				break;
-			}
-			rfx_message_free(encoder->rfx, &messages[i]);
+			cmd.codecID = settings->RemoteFxCodecId;
+
+			cmd.destLeft = 0;
+			cmd.destTop = 0;
+			cmd.destRight = settings->DesktopWidth;
+			cmd.destBottom = settings->DesktopHeight;
+
+			cmd.width = settings->DesktopWidth;
+			cmd.height = settings->DesktopHeight;
+			cmd.skipCompression = TRUE;
+		}
+		else
+		{
+			cmd.codecID = settings->NSCodecId;
+
+			cmd.destLeft = rects[index].left;
+			cmd.destTop = rects[index].top;
+			cmd.destRight = rects[index].right;
+			cmd.destBottom = rects[index].bottom;
 
-			cmd.bitmapDataLength = Stream_GetPosition(s);
-			cmd.bitmapData = Stream_Buffer(s);
+			cmd.width = cmd.destRight - cmd.destLeft;
+			cmd.height = cmd.destBottom - cmd.destTop;
+		}
+
+		for (i = 0; i < payloads[index]->numParts; i++)
+		{
+			cmd.bitmapDataLength = payloads[index]->parts[i].length;
+			cmd.bitmapData = payloads[index]->parts[i].data;
+			size += cmd.bitmapDataLength;
 
-			first = (i == 0) ? TRUE : FALSE;
-			last = ((i + 1) == numMessages) ? TRUE : FALSE;
+			first = (part == 0) ? TRUE : FALSE;
+			last = ((part + 1) == numParts) ? TRUE : FALSE;
+			part++;
 
 			if (!encoder->frameAck)
 				IFCALLRET(update->SurfaceBits, ret, update->context, &cmd);
@@ -799,135 +1081,54 @@ static BOOL shadow_client_send_surface_bits(rdpShadowClient* client,
 
 			if (!ret)
 			{
-				WLog_ERR(TAG, "Send surface bits(RemoteFxCodec) failed");
+				WLog_ERR(TAG, "Send surface bits(%s) failed",
+						(codec == FREERDP_CODEC_REMOTEFX) ? "RemoteFxCodec" : "NSCodec");
 				break;
 			}
 		}
-
-		free(messageRects);
-		free(messages);
 	}
-	else if (settings->NSCodec)
-	{
-		if (shadow_encoder_prepare(encoder, FREERDP_CODEC_NSCODEC) < 0)
-		{
-			WLog_ERR(TAG, "Failed to prepare encoder FREERDP_CODEC_NSCODEC");
-			return FALSE;
-		}
 
-		s = encoder->bs;
-		Stream_SetPosition(s, 0);
+	if (ret && (numParts > 0))
+		shadow_encoder_frame_sent(encoder, size, context->peer->IsWriteBlocked(context->peer));
 
-		pSrcData = &pSrcData[(nYSrc * nSrcStep) + (nXSrc * 4)];
-
-		nsc_compose_message(encoder->nsc, s, pSrcData, nWidth, nHeight, nSrcStep);
-
-		cmd.bpp = 32;
-		cmd.codecID = settings->NSCodecId;
-		cmd.destLeft = nXSrc;
-		cmd.destTop = nYSrc;
-		cmd.destRight = cmd.destLeft + nWidth;
-		cmd.destBottom = cmd.destTop + nHeight;
-		cmd.width = nWidth;
-		cmd.height = nHeight;
-
-		cmd.bitmapDataLength = Stream_GetPosition(s);
-		cmd.bitmapData = Stream_Buffer(s);
-
-		first = TRUE;
-		last = TRUE;
-
-		if (!encoder->frameAck)
-			IFCALLRET(update->SurfaceBits, ret, update->context, &cmd);
-		else
-			IFCALLRET(update->SurfaceFrameBits, ret, update->context, &cmd, first, last, frameId);
+out:
+	for (index = 0; index < numRects; index++)
+		shadow_encoded_payload_unref(payloads[index]);
 
-		if (!ret)
-		{
-			WLog_ERR(TAG, "Send surface bits(NSCodec) failed");
-		}
-	}
+	free(payloads);
 
 	return ret;
 }
 
-/**
- * Function description
- *
- * @return TRUE on success
- */
-static BOOL shadow_client_send_bitmap_update(rdpShadowClient* client, 
+static BOOL shadow_client_encode_bitmap(rdpShadowClient* client, rdpShadowEncodedPayload* payload,
 		BYTE* pSrcData, int nSrcStep, int nXSrc, int nYSrc, int nWidth, int nHeight)
 {
-	BOOL ret = TRUE;
 	BYTE* data;
 	BYTE* buffer;
 	int yIdx, xIdx, k;
 	int rows, cols;
 	UINT32 DstSize;
 	UINT32 SrcFormat;
+	UINT32 offset;
 	BITMAP_DATA* bitmap;
-	rdpUpdate* update;
-	rdpContext* context;
 	rdpSettings* settings;
-	UINT32 maxUpdateSize;
 	UINT32 totalBitmapSize;
-	UINT32 updateSizeEstimate;
 	BITMAP_DATA* bitmapData;
-	BITMAP_UPDATE bitmapUpdate;
-	rdpShadowServer* server;
 	rdpShadowEncoder* encoder;
 
-	context = (rdpContext*) client;
-	update = context->update;
-	settings = context->settings;
-
-	server = client->server;
+	settings = ((rdpContext*) client)->settings;
 	encoder = client->encoder;
 
-	maxUpdateSize = settings->MultifragMaxRequestSize;
-
-	if (settings->ColorDepth < 32)
-	{
-		if (shadow_encoder_prepare(encoder, FREERDP_CODEC_INTERLEAVED) < 0)
-		{
-			WLog_ERR(TAG, "Failed to prepare encoder FREERDP_CODEC_INTERLEAVED");
-			return FALSE;
-		}
-	}
-	else
-	{
-		if (shadow_encoder_prepare(encoder, FREERDP_CODEC_PLANAR) < 0)
-		{
-			WLog_ERR(TAG, "Failed to prepare encoder FREERDP_CODEC_PLANAR");
-			return FALSE;
-		}
-	}
-
 	SrcFormat = PIXEL_FORMAT_RGB32;
 
-	if ((nXSrc % 4) != 0)
-	{
-		nWidth += (nXSrc % 4);
-		nXSrc -= (nXSrc % 4);
-	}
-
-	if ((nYSrc % 4) != 0)
-	{
-		nHeight += (nYSrc % 4);
-		nYSrc -= (nYSrc % 4);
-	}
-
 	rows = (nHeight / 64) + ((nHeight % 64) ? 1 : 0);
 	cols = (nWidth / 64) + ((nWidth % 64) ? 1 : 0);
 
 	k = 0;
 	totalBitmapSize = 0;
 
-	bitmapUpdate.count = bitmapUpdate.number = rows * cols;
-	if (!(bitmapData = (BITMAP_DATA*) malloc(sizeof(BITMAP_DATA) * bitmapUpdate.number)))
+	if (!(bitmapData = (BITMAP_DATA*) malloc(sizeof(BITMAP_DATA) * rows * cols)))
 		return FALSE;
-	bitmapUpdate.rectangles = bitmapData;
 
 	if ((nWidth % 4) != 0)
 	{
@@ -1005,7 +1206,150 @@ static BOOL shadow_client_send_bitmap_update(rdpShadowClient* client,
 		}
 	}
 
+	/* Move the tiles out of the encoder grid, it is reused by the next frame */
+	if (!(payload->bitmapBuffer = (BYTE*) malloc(totalBitmapSize + 1)))
+	{
+		free(bitmapData);
+		return FALSE;
+	}
+
+	offset = 0;
+
+	for (yIdx = 0; yIdx < k; yIdx++)
+	{
+		bitmap = &bitmapData[yIdx];
+
+		CopyMemory(&(payload->bitmapBuffer[offset]), bitmap->bitmapDataStream, bitmap->bitmapLength);
+		bitmap->bitmapDataStream = &(payload->bitmapBuffer[offset]);
+		offset += bitmap->bitmapLength;
+	}
+
+	payload->bitmaps = bitmapData;
+	payload->numBitmaps = k;
+
+	return TRUE;
+}
+
+/**
+ * Function description
+ * Encode each rectangle on its own and send all tiles in as few
+ * bitmap updates as the fragmentation limit allows.
+ *
+ * @return TRUE on success
+ */
+static BOOL shadow_client_send_bitmap_update(rdpShadowClient* client,
+		BYTE* pSrcData, int nSrcStep, const RECTANGLE_16* rects, int numRects)
+{
+	BOOL ret = TRUE;
+	int nXSrc, nYSrc;
+	int nWidth, nHeight;
+	int rectIndex;
+	UINT32 k, index;
+	rdpUpdate* update;
+	rdpContext* context;
+	rdpSettings* settings;
+	UINT32 maxUpdateSize;
+	UINT32 totalBitmapSize;
+	UINT32 updateSizeEstimate;
+	BITMAP_DATA* bitmapData;
+	BITMAP_UPDATE bitmapUpdate;
+	rdpShadowEncoder* encoder;
+	SHADOW_ENCODE_KEY key;
+	rdpShadowEncodedPayload** payloads;
+
+	context = (rdpContext*) client;
+	update = context->update;
+	settings = context->settings;
+
+	encoder = client->encoder;
+
+	maxUpdateSize = settings->MultifragMaxRequestSize;
+
+	if (settings->ColorDepth < 32)
+	{
+		if (shadow_encoder_prepare(encoder, FREERDP_CODEC_INTERLEAVED) < 0)
+		{
+			WLog_ERR(TAG, "Failed to prepare encoder FREERDP_CODEC_INTERLEAVED");
+			return FALSE;
+		}
+	}
+	else
+	{
+		if (shadow_encoder_prepare(encoder, FREERDP_CODEC_PLANAR) < 0)
+		{
+			WLog_ERR(TAG, "Failed to prepare encoder FREERDP_CODEC_PLANAR");
+			return FALSE;
+		}
+	}
+
+	if (!(payloads = (rdpShadowEncodedPayload**) calloc(numRects, sizeof(rdpShadowEncodedPayload*))))
+		return FALSE;
+
+	k = 0;
+	bitmapData = NULL;
+
+	for (rectIndex = 0; rectIndex < numRects; rectIndex++)
+	{
+		nXSrc = rects[rectIndex].left;
+		nYSrc = rects[rectIndex].top;
+		nWidth = rects[rectIndex].right - rects[rectIndex].left;
+		nHeight = rects[rectIndex].bottom - rects[rectIndex].top;
+
+		if ((nXSrc % 4) != 0)
+		{
+			nWidth += (nXSrc % 4);
+			nXSrc -= (nXSrc % 4);
+		}
+
+		if ((nYSrc % 4) != 0)
+		{
+			nHeight += (nYSrc % 4);
+			nYSrc -= (nYSrc % 4);
+		}
+
+		shadow_client_init_encode_key(client, &key,
+				(settings->ColorDepth < 32) ? FREERDP_CODEC_INTERLEAVED : FREERDP_CODEC_PLANAR,
+				nXSrc, nYSrc, nWidth, nHeight);
+		key.params[2] = settings->ColorDepth;
+		key.params[3] = settings->DrawAllowSkipAlpha;
+
+		if (!(payloads[rectIndex] = shadow_client_get_payload(client, &key, TRUE,
+				shadow_client_encode_bitmap, pSrcData, nSrcStep, nXSrc, nYSrc, nWidth, nHeight)))
+		{
+			ret = FALSE;
+			goto out;
+		}
+
+		k += payloads[rectIndex]->numBitmaps;
+	}
+
+	/**
+	 * The bitmap data is shared, but the BITMAP_DATA headers are
+	 * rewritten while sending (compression header flags)
+	 */
+	totalBitmapSize = 0;
+
+	if (k > 0)
+	{
+		if (!(bitmapData = (BITMAP_DATA*) malloc(sizeof(BITMAP_DATA) * k)))
+		{
+			ret = FALSE;
+			goto out;
+		}
+
+		for (index = 0, rectIndex = 0; rectIndex < numRects; rectIndex++)
+		{
+			CopyMemory(&bitmapData[index], payloads[rectIndex]->bitmaps,
+					sizeof(BITMAP_DATA) * payloads[rectIndex]->numBitmaps);
+			index += payloads[rectIndex]->numBitmaps;
+		}
+	}
+
+	for (index = 0; index < k; index++)
+		totalBitmapSize += bitmapData[index].bitmapLength;
+
 	bitmapUpdate.count = bitmapUpdate.number = k;
+	bitmapUpdate.rectangles = bitmapData;
 
 	updateSizeEstimate = totalBitmapSize + (k * bitmapUpdate.count) + 16;
 
@@ -1071,12 +1415,130 @@ static BOOL shadow_client_send_bitmap_update(rdpShadowClient* client,
 		}
 	}
 
+	if (ret && (k > 0))
+		shadow_encoder_frame_sent(encoder, totalBitmapSize, context->peer->IsWriteBlocked(context->peer));
+
 out:
 	free(bitmapData);
 
+	for (rectIndex = 0; rectIndex < numRects; rectIndex++)
+		shadow_encoded_payload_unref(payloads[rectIndex]);
+
+	free(payloads);
+
 	return ret;
 }
 
+#define SHADOW_CLIENT_MAX_UPDATE_RECTS		32
+#define SHADOW_CLIENT_MAX_MERGE_RECTS		256
+#define SHADOW_CLIENT_RECT_OVERHEAD		(64 * 64) /* pixels */
+
+static INLINE UINT32 shadow_client_rect_area(const RECTANGLE_16* rect)
+{
+	return (rect->right - rect->left) * (rect->bottom - rect->top);
+}
+
+static INLINE void shadow_client_rect_union(const RECTANGLE_16* a, const RECTANGLE_16* b,
+		RECTANGLE_16* dst)
+{
+	dst->left = MIN(a->left, b->left);
+	dst->top = MIN(a->top, b->top);
+	dst->right = MAX(a->right, b->right);
+	dst->bottom = MAX(a->bottom, b->bottom);
+}
+
+/**
+ * Function description
+ * Choose the rectangles to encode for a region. Every rectangle costs a
+ * fixed overhead (message headers, codec setup), so rectangles are merged
+ * as long as the merged box adds fewer pixels than the overhead it saves,
+ * and until at most SHADOW_CLIENT_MAX_UPDATE_RECTS remain.
+ *
+ * @return number of rectangles written to rects, 0 on failure
+ */
+static int shadow_client_choose_rects(const REGION16* region, RECTANGLE_16** ppRects)
+{
+	int i, j;
+	int count;
+	int numRects;
+	int bestI, bestJ;
+	INT64 cost, bestCost;
+	RECTANGLE_16 merged;
+	RECTANGLE_16* rects;
+	const RECTANGLE_16* regionRects;
+
+	regionRects = region16_rects(region, &numRects);
+
+	if (numRects < 1)
+		return 0;
+
+	if (!(rects = (RECTANGLE_16*) calloc(numRects, sizeof(RECTANGLE_16))))
+		return 0;
+
+	/* Region rectangles are sorted in bands, merge cheap neighbours first */
+	count = 0;
+
+	for (i = 0; i < numRects; i++)
+	{
+		if (count > 0)
+		{
+			shadow_client_rect_union(&rects[count - 1], &regionRects[i], &merged);
+
+			cost = (INT64) shadow_client_rect_area(&merged) - shadow_client_rect_area(&rects[count - 1]) -
+					shadow_client_rect_area(&regionRects[i]);
+
+			if (cost <= SHADOW_CLIENT_RECT_OVERHEAD)
+			{
+				rects[count - 1] = merged;
+				continue;
+			}
+		}
+
+		rects[count++] = regionRects[i];
+	}
+
+	if (count > SHADOW_CLIENT_MAX_MERGE_RECTS)
+	{
+		/* Too scattered to be worth the search */
+		rects[0] = *region16_extents(region);
+		count = 1;
+	}
+
+	while (count > 1)
+	{
+		bestI = bestJ = -1;
+		bestCost = 0;
+
+		for (i = 0; i < count; i++)
+		{
+			for (j = i + 1; j < count; j++)
+			{
+				shadow_client_rect_union(&rects[i], &rects[j], &merged);
+
+				cost = (INT64) shadow_client_rect_area(&merged) - shadow_client_rect_area(&rects[i]) -
+						shadow_client_rect_area(&rects[j]);
+
+				if ((bestI < 0) || (cost < bestCost))
+				{
+					bestCost = cost;
+					bestI = i;
+					bestJ = j;
+				}
+			}
+		}
+
+		if ((bestCost > SHADOW_CLIENT_RECT_OVERHEAD) && (count <= SHADOW_CLIENT_MAX_UPDATE_RECTS))
+			break;
+
+		shadow_client_rect_union(&rects[bestI], &rects[bestJ], &rects[bestI]);
+		rects[bestJ] = rects[--count];
+	}
+
+	*ppRects = rects;
+
+	return count;
+}
+
 /**
  * Function description
  *
@@ -1085,7 +1547,6 @@ out:
 static BOOL shadow_client_send_surface_update(rdpShadowClient* client, SHADOW_GFX_STATUS* pStatus)
 {
 	BOOL ret = TRUE;
-	int nXSrc, nYSrc;
 	int nWidth, nHeight;
 	rdpContext* context;
 	rdpSettings* settings;
@@ -1094,7 +1555,8 @@ static BOOL shadow_client_send_surface_update(rdpShadowClient* client, SHADOW_GF
 	rdpShadowEncoder* encoder;
 	REGION16 invalidRegion;
 	RECTANGLE_16 surfaceRect;
-	const RECTANGLE_16* extents;
+	RECTANGLE_16* updateRects = NULL;
+	int subX = 0, subY = 0;
 	BYTE* pSrcData;
 	int nSrcStep;
 	int index;
@@ -1140,37 +1602,37 @@ static BOOL shadow_client_send_surface_update(rdpShadowClient* client, SHADOW_GF
 		goto out;
 	}
 
-	extents = region16_extents(&invalidRegion);
-
-	nXSrc = extents->left;
-	nYSrc = extents->top;
-	nWidth = extents->right - extents->left;
-	nHeight = extents->bottom - extents->top;
-
 	pSrcData = surface->data;
 	nSrcStep = surface->scanline;
 
-	/* Move to new pSrcData / nXSrc / nYSrc according to sub rect */
+	/* Move to new pSrcData according to sub rect */
 	if (server->shareSubRect)
 	{
-		int subX, subY;
-
 		subX = server->subRect.left;
 		subY = server->subRect.top;
 
-		nXSrc -= subX;
-		nYSrc -= subY;
 		pSrcData = &pSrcData[(subY * nSrcStep) + (subX * 4)];
 	}
 
-	//WLog_INFO(TAG, "shadow_client_send_surface_update: x: %d y: %d width: %d height: %d right: %d bottom: %d",
-	//	nXSrc, nYSrc, nWidth, nHeight, nXSrc + nWidth, nYSrc + nHeight);
+	if (!(numRects = shadow_client_choose_rects(&invalidRegion, &updateRects)))
+	{
+		ret = FALSE;
+		goto out;
+	}
+
+	for (index = 0; index < numRects; index++)
+	{
+		updateRects[index].left -= subX;
+		updateRects[index].top -= subY;
+		updateRects[index].right -= subX;
+		updateRects[index].bottom -= subY;
+	}
 
 	if (settings->SupportGraphicsPipeline && 
 	    settings->GfxH264 &&
 	    pStatus->gfxOpened)
 	{
-		/* GFX/h264 always full screen encoded */
+		/* GFX/h264 encodes the full screen, but only converts the damaged rectangles */
 		nWidth = settings->DesktopWidth;
 		nHeight = settings->DesktopHeight;
 
@@ -1185,20 +1647,27 @@ static BOOL shadow_client_send_surface_update(rdpShadowClient* client, SHADOW_GF
 				goto out;
 
 			pStatus->gfxSurfaceCreated = TRUE;
+
+			/* A new surface is empty, it has to be filled as a whole */
+			numRects = 0;
 		}
 
-		ret = shadow_client_send_surface_gfx(client, pSrcData, nSrcStep, 0, 0, nWidth, nHeight);
+		ret = shadow_client_send_surface_gfx(client, pSrcData, nSrcStep, 0, 0, nWidth, nHeight,
+				(numRects > 0) ? updateRects : NULL, numRects);
+		goto out;
 	}
-	else if (settings->RemoteFxCodec || settings->NSCodec)
+
+	if (settings->RemoteFxCodec || settings->NSCodec)
 	{
-		ret = shadow_client_send_surface_bits(client, pSrcData, nSrcStep, nXSrc, nYSrc, nWidth, nHeight);
+		ret = shadow_client_send_surface_bits(client, pSrcData, nSrcStep, updateRects, numRects);
 	}
 	else
 	{
-		ret = shadow_client_send_bitmap_update(client, pSrcData, nSrcStep, nXSrc, nYSrc, nWidth, nHeight);
+		ret = shadow_client_send_bitmap_update(client, pSrcData, nSrcStep, updateRects, numRects);
 	}
 
 out:
+	free(updateRects);
 	region16_uninit(&invalidRegion);
 
 	return ret;
@@ -1435,6 +1904,8 @@ static void* shadow_client_thread(rdpShadowClient* client)
 	peer->update->SuppressOutput = (pSuppressOutput)shadow_client_suppress_output;
 	peer->update->SurfaceFrameAcknowledge = (pSurfaceFrameAcknowledge)shadow_client_surface_frame_acknowledge;
 
+	peer->autodetect->NetworkCharacteristicsUpdate = shadow_client_network_characteristics_update;
+
 	if ((!client->vcm) || (!subsystem->updateEvent))
 		goto out;
 
@@ -1488,6 +1959,13 @@ static void* shadow_client_thread(rdpShadowClient* client)
 						WLog_ERR(TAG, "Failed to send surface update");
 						break;
 					}
+
+					/* The client may not send anything while it only receives frames */
+					if (!freerdp_autodetect_check_continuous(peer->autodetect))
+					{
+						WLog_ERR(TAG, "Failed to send network auto-detection requests");
+						break;
+					}
 				}
 			}
 			else
@@ -0,0 +1,237 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <winpr/crt.h>
+#include <winpr/interlocked.h>
+
+#include <freerdp/log.h>
+
+#include "shadow.h"
+
+#include "shadow_encodecache.h"
+
+#define TAG SERVER_TAG("shadow.encodecache")
+
+rdpShadowEncodedPayload* shadow_encoded_payload_new(const SHADOW_ENCODE_KEY* key)
+{
+	rdpShadowEncodedPayload* payload;
+
+	payload = (rdpShadowEncodedPayload*) calloc(1, sizeof(rdpShadowEncodedPayload));
+
+	if (!payload)
+		return NULL;
+
+	payload->refCount = 1;
+	CopyMemory(&(payload->key), key, sizeof(SHADOW_ENCODE_KEY));
+
+	return payload;
+}
+
+static void shadow_encoded_payload_free(rdpShadowEncodedPayload* payload)
+{
+	UINT32 index;
+
+	for (index = 0; index < payload->numParts; index++)
+		free(payload->parts[index].data);
+
+	free(payload->parts);
+	free(payload->bitmaps);
+	free(payload->bitmapBuffer);
+
+	if (payload->readyEvent)
+		CloseHandle(payload->readyEvent);
+
+	free(payload);
+}
+
+void shadow_encoded_payload_ref(rdpShadowEncodedPayload* payload)
+{
+	if (payload)
+		InterlockedIncrement(&(payload->refCount));
+}
+
+void shadow_encoded_payload_unref(rdpShadowEncodedPayload* payload)
+{
+	if (!payload)
+		return;
+
+	if (InterlockedDecrement(&(payload->refCount)) <= 0)
+		shadow_encoded_payload_free(payload);
+}
+
+/**
+ * Append an encoded message, the payload takes ownership of data
+ */
+BOOL shadow_encoded_payload_add_part(rdpShadowEncodedPayload* payload, BYTE* data, UINT32 length)
+{
+	SHADOW_ENCODED_PART* parts;
+
+	parts = (SHADOW_ENCODED_PART*) realloc(payload->parts,
+			(payload->numParts + 1) * sizeof(SHADOW_ENCODED_PART));
+
+	if (!parts)
+		return FALSE;
+
+	payload->parts = parts;
+	payload->parts[payload->numParts].data = data;
+	payload->parts[payload->numParts].length = length;
+	payload->numParts++;
+
+	return TRUE;
+}
+
+static void shadow_encode_cache_object_free(void* obj)
+{
+	shadow_encoded_payload_unref((rdpShadowEncodedPayload*) obj);
+}
+
+/**
+ * Look up the payload for key, or insert an empty one.
+ * The returned payload holds a reference for the caller.
+ * If owner is set the caller must encode it and then call
+ * shadow_encode_cache_complete, otherwise the payload is ready
+ * and usable if valid is set.
+ */
+rdpShadowEncodedPayload* shadow_encode_cache_acquire(rdpShadowEncodeCache* cache,
+		const SHADOW_ENCODE_KEY* key, BOOL* owner)
+{
+	int index;
+	int count;
+	rdpShadowEncodedPayload* payload = NULL;
+
+	*owner = FALSE;
+
+	EnterCriticalSection(&(cache->lock));
+
+	count = ArrayList_Count(cache->payloads);
+
+	for (index = 0; index < count; index++)
+	{
+		rdpShadowEncodedPayload* item;
+
+		item = (rdpShadowEncodedPayload*) ArrayList_GetItem(cache->payloads, index);
+
+		if (memcmp(&(item->key), key, sizeof(SHADOW_ENCODE_KEY)) == 0)
+		{
+			payload = item;
+			shadow_encoded_payload_ref(payload);
+			cache->shared++;
+			break;
+		}
+	}
+
+	if (!payload)
+	{
+		payload = shadow_encoded_payload_new(key);
+
+		if (payload)
+		{
+			payload->readyEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+			if (!payload->readyEvent || (ArrayList_Add(cache->payloads, payload) < 0))
+			{
+				shadow_encoded_payload_free(payload);
+				payload = NULL;
+			}
+			else
+			{
+				/* One reference for the cache, one for the caller */
+				shadow_encoded_payload_ref(payload);
+				cache->encoded++;
+				*owner = TRUE;
+			}
+		}
+	}
+
+	LeaveCriticalSection(&(cache->lock));
+
+	if (payload && !(*owner))
+		WaitForSingleObject(payload->readyEvent, INFINITE);
+
+	return payload;
+}
+
+void shadow_encode_cache_complete(rdpShadowEncodedPayload* payload, BOOL valid)
+{
+	payload->valid = valid;
+
+	if (payload->readyEvent)
+		SetEvent(payload->readyEvent);
+}
+
+/**
+ * Drop all payloads of the current frame.
+ * Payloads still being sent are released by their last user.
+ */
+void shadow_encode_cache_flush(rdpShadowEncodeCache* cache)
+{
+	if (!cache)
+		return;
+
+	EnterCriticalSection(&(cache->lock));
+
+	if (cache->shared > 0)
+	{
+		WLog_VRB(TAG, "%u payloads encoded, %u shared", cache->encoded, cache->shared);
+	}
+
+	ArrayList_Clear(cache->payloads);
+	cache->encoded = 0;
+	cache->shared = 0;
+
+	LeaveCriticalSection(&(cache->lock));
+}
+
+rdpShadowEncodeCache* shadow_encode_cache_new(void)
+{
+	rdpShadowEncodeCache* cache;
+
+	cache = (rdpShadowEncodeCache*) calloc(1, sizeof(rdpShadowEncodeCache));
+
+	if (!cache)
+		return NULL;
+
+	if (!(cache->payloads = ArrayList_New(FALSE)))
+		goto fail_payloads;
+
+	ArrayList_Object(cache->payloads)->fnObjectFree = shadow_encode_cache_object_free;
+
+	if (!InitializeCriticalSectionAndSpinCount(&(cache->lock), 4000))
+		goto fail_lock;
+
+	return cache;
+
+fail_lock:
+	ArrayList_Free(cache->payloads);
+fail_payloads:
+	free(cache);
+	return NULL;
+}
+
+void shadow_encode_cache_free(rdpShadowEncodeCache* cache)
+{
+	if (!cache)
+		return;
+
+	ArrayList_Free(cache->payloads);
+	DeleteCriticalSection(&(cache->lock));
+
+	free(cache);
+}
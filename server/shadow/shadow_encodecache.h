@@ -0,0 +1,101 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FREERDP_SHADOW_SERVER_ENCODECACHE_H
+#define FREERDP_SHADOW_SERVER_ENCODECACHE_H
+
+#include <freerdp/server/shadow.h>
+
+#include <winpr/crt.h>
+#include <winpr/synch.h>
+#include <winpr/collections.h>
+
+/*
+ * Frames published to the clients are encoded once per codec and codec
+ * settings. The first client asking for a key encodes the payload, all
+ * other clients with the same key wait for it and send the same bytes.
+ * The cache only lives for one published frame: the surface must not
+ * change while clients look up payloads, see shadow_subsystem_frame_update.
+ */
+
+#define SHADOW_ENCODE_KEY_PARAMS	6
+
+struct _SHADOW_ENCODE_KEY
+{
+	rdpShadowSurface* surface;
+	UINT32 codecs; /* FREERDP_CODEC_* which produced the payload */
+	UINT32 params[SHADOW_ENCODE_KEY_PARAMS]; /* settings shaping the bitstream */
+	RECTANGLE_16 rect;
+};
+typedef struct _SHADOW_ENCODE_KEY SHADOW_ENCODE_KEY;
+
+struct _SHADOW_ENCODED_PART
+{
+	BYTE* data;
+	UINT32 length;
+};
+typedef struct _SHADOW_ENCODED_PART SHADOW_ENCODED_PART;
+
+struct rdp_shadow_encoded_payload
+{
+	LONG refCount;
+	SHADOW_ENCODE_KEY key;
+	HANDLE readyEvent;
+	BOOL valid;
+
+	/* Surface bits (one part per message) */
+	UINT32 numParts;
+	SHADOW_ENCODED_PART* parts;
+
+	/* Bitmap update, bitmapDataStream points into bitmapBuffer */
+	UINT32 numBitmaps;
+	BITMAP_DATA* bitmaps;
+	BYTE* bitmapBuffer;
+};
+typedef struct rdp_shadow_encoded_payload rdpShadowEncodedPayload;
+
+struct rdp_shadow_encode_cache
+{
+	wArrayList* payloads;
+	CRITICAL_SECTION lock;
+
+	/* Statistics */
+	UINT32 encoded;
+	UINT32 shared;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+rdpShadowEncodedPayload* shadow_encoded_payload_new(const SHADOW_ENCODE_KEY* key);
+void shadow_encoded_payload_ref(rdpShadowEncodedPayload* payload);
+void shadow_encoded_payload_unref(rdpShadowEncodedPayload* payload);
+BOOL shadow_encoded_payload_add_part(rdpShadowEncodedPayload* payload, BYTE* data, UINT32 length);
+
+rdpShadowEncodedPayload* shadow_encode_cache_acquire(rdpShadowEncodeCache* cache,
+		const SHADOW_ENCODE_KEY* key, BOOL* owner);
+void shadow_encode_cache_complete(rdpShadowEncodedPayload* payload, BOOL valid);
+void shadow_encode_cache_flush(rdpShadowEncodeCache* cache);
+
+rdpShadowEncodeCache* shadow_encode_cache_new(void);
+void shadow_encode_cache_free(rdpShadowEncodeCache* cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FREERDP_SHADOW_SERVER_ENCODECACHE_H */
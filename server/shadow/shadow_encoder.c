@@ -20,10 +20,22 @@
 #include "config.h"
 #endif
 
+#include <winpr/sysinfo.h>
+
+#include <freerdp/log.h>
+
 #include "shadow.h"
 
 #include "shadow_encoder.h"
 
+#define TAG SERVER_TAG("shadow.encoder")
+
+/* RemoteFX encoder defaults: LL3, LH3, HL3, HH3, LH2, HL2, HH2, LH1, HL1, HH1 */
+static const UINT32 shadow_encoder_rfx_quants[10] =
+{
+	6, 6, 6, 6, 7, 7, 8, 8, 8, 9
+};
+
 int shadow_encoder_preferred_fps(rdpShadowEncoder* encoder)
 {
 	/* Return preferred fps calculated according to the last
@@ -66,6 +78,9 @@ UINT32 shadow_encoder_create_frame_id(rdpShadowEncoder* encoder)
 			encoder->fps = encoder->maxFps;
 	}
 
+	if (encoder->fps > encoder->rateMaxFps)
+		encoder->fps = encoder->rateMaxFps;
+
 	if (encoder->fps < 1)
 		encoder->fps = 1;
 
@@ -74,6 +89,207 @@ UINT32 shadow_encoder_create_frame_id(rdpShadowEncoder* encoder)
 	return frameId;
 }
 
+/**
+ * Applies the current quality level to the codec contexts: coarser RemoteFX
+ * quantization, more NSCodec color loss, a higher H.264 QP and a lower
+ * bitrate.
+ */
+
+static void shadow_encoder_apply_quality(rdpShadowEncoder* encoder)
+{
+	int index;
+	UINT32 drop;
+	UINT32 value;
+	rdpShadowServer* server = encoder->server;
+	rdpSettings* settings = ((rdpContext*) encoder->client)->settings;
+
+	drop = SHADOW_ENCODER_QUALITY_MAX - encoder->quality;
+
+	if (encoder->rfx)
+	{
+		RFX_CONTEXT* rfx = encoder->rfx;
+
+		if (!rfx->numQuant)
+		{
+			if (!(rfx->quants = (UINT32*) malloc(sizeof(shadow_encoder_rfx_quants))))
+				return;
+
+			rfx->numQuant = 1;
+			rfx->quantIdxY = 0;
+			rfx->quantIdxCb = 0;
+			rfx->quantIdxCr = 0;
+		}
+
+		for (index = 0; index < 10; index++)
+		{
+			value = shadow_encoder_rfx_quants[index] + drop;
+			rfx->quants[index] = (value > 15) ? 15 : value;
+		}
+	}
+
+	if (encoder->nsc)
+	{
+		value = settings->NSCodecColorLossLevel + drop;
+		encoder->nsc->ColorLossLevel = (value > 7) ? 7 : value;
+	}
+
+	if (encoder->h264)
+	{
+		value = server->h264QP + (drop * 4);
+		encoder->h264->QP = (value > 51) ? 51 : value;
+
+		encoder->h264->BitRate = server->h264BitRate >> drop;
+
+		encoder->h264->FrameRate = server->h264FrameRate;
+
+		if (encoder->h264->FrameRate > encoder->rateMaxFps)
+			encoder->h264->FrameRate = (FLOAT) encoder->rateMaxFps;
+	}
+}
+
+/**
+ * Evaluates a rate control window. Write backpressure or a queueing delay,
+ * the smoothed round trip time plus its jitter well above the idle one,
+ * mean the path is congested: the quality is lowered at once and the frame
+ * rate is cut to what the goodput carries at the current frame size, or
+ * halved when writes block. Otherwise the frame rate grows additively and
+ * the quality is raised one level after a few clean windows. The time the
+ * client needs to decode a frame always bounds the frame rate.
+ *
+ * The goodput is only measured over the traffic actually sent, it is not
+ * an upper bound while the link is not congested.
+ */
+
+void shadow_encoder_rate_control(rdpShadowEncoder* encoder, UINT32 elapsed)
+{
+	int maxFps;
+	UINT64 fps;
+	BOOL congested;
+	UINT32 sendRate;
+	UINT32 frameSize;
+	UINT32 quality = encoder->quality;
+
+	if (!elapsed || !encoder->windowFrames)
+		return;
+
+	sendRate = (UINT32) (((UINT64) encoder->windowBytes * 8) / elapsed);
+	frameSize = encoder->windowBytes / encoder->windowFrames;
+
+	congested = encoder->windowBlocked;
+
+	if (encoder->baseRtt &&
+	    ((encoder->rtt + encoder->jitter) > ((encoder->baseRtt * 2) + 50)))
+		congested = TRUE;
+
+	maxFps = encoder->rateMaxFps;
+
+	if (congested)
+	{
+		if (quality > 0)
+			quality--;
+
+		encoder->stableWindows = 0;
+
+		if (encoder->goodput && frameSize)
+		{
+			/* kbit/s to bytes per second */
+			fps = ((UINT64) encoder->goodput * 125) / frameSize;
+
+			if (fps < (UINT64) maxFps)
+				maxFps = (int) fps;
+		}
+
+		if (encoder->windowBlocked && ((encoder->fps / 2) < maxFps))
+			maxFps = encoder->fps / 2;
+	}
+	else
+	{
+		maxFps += SHADOW_ENCODER_FPS_INCREASE;
+
+		if (++encoder->stableWindows >= 3)
+		{
+			encoder->stableWindows = 0;
+
+			if (quality < SHADOW_ENCODER_QUALITY_MAX)
+				quality++;
+		}
+	}
+
+	if (maxFps > encoder->maxFps)
+		maxFps = encoder->maxFps;
+
+	if (encoder->decodeTime && ((int) (1000 / encoder->decodeTime) < maxFps))
+		maxFps = 1000 / encoder->decodeTime;
+
+	if (maxFps < 1)
+		maxFps = 1;
+
+	WLog_DBG(TAG, "rate control: %u kbit/s sent, goodput %u kbit/s, rtt %u ms (base %u ms, "
+			"jitter %u ms), decode %u ms%s, quality %u -> %u, max fps %d",
+			sendRate, encoder->goodput, encoder->rtt, encoder->baseRtt, encoder->jitter,
+			encoder->decodeTime, encoder->windowBlocked ? ", blocked" : "",
+			encoder->quality, quality, maxFps);
+
+	encoder->rateMaxFps = maxFps;
+
+	if (encoder->fps > maxFps)
+		encoder->fps = maxFps;
+
+	encoder->quality = quality;
+	shadow_encoder_apply_quality(encoder);
+}
+
+void shadow_encoder_network_update(rdpShadowEncoder* encoder,
+		const AUTODETECT_NETWORK_CHARACTERISTICS* characteristics)
+{
+	encoder->rtt = characteristics->smoothedRTT;
+	encoder->baseRtt = characteristics->baseRTT;
+	encoder->jitter = characteristics->jitter;
+	encoder->goodput = characteristics->goodput;
+}
+
+void shadow_encoder_decode_time_sample(rdpShadowEncoder* encoder, UINT32 decodeTime)
+{
+	if (!encoder->decodeTime)
+		encoder->decodeTime = decodeTime;
+	else
+		encoder->decodeTime = ((encoder->decodeTime * 3) + decodeTime) / 4;
+}
+
+/**
+ * Accounts a frame handed to the transport, writeBlocked tells whether the
+ * output buffer of the peer is still full after sending it.
+ */
+
+void shadow_encoder_frame_sent(rdpShadowEncoder* encoder, UINT32 size, BOOL writeBlocked)
+{
+	UINT64 now = GetTickCount64();
+
+	if (!encoder->windowStart)
+		encoder->windowStart = now;
+
+	encoder->windowBytes += size;
+	encoder->windowFrames++;
+
+	if (writeBlocked)
+		encoder->windowBlocked = TRUE;
+
+	if ((now - encoder->windowStart) < SHADOW_ENCODER_RATE_WINDOW)
+		return;
+
+	shadow_encoder_rate_control(encoder, (UINT32) (now - encoder->windowStart));
+
+	encoder->windowStart = now;
+	encoder->windowBytes = 0;
+	encoder->windowFrames = 0;
+	encoder->windowBlocked = FALSE;
+}
+
+BOOL shadow_encoder_use_avc444(rdpShadowEncoder* encoder)
+{
+	return (encoder->quality >= SHADOW_ENCODER_QUALITY_AVC444) ? TRUE : FALSE;
+}
+
 int shadow_encoder_init_grid(rdpShadowEncoder* encoder)
 {
 	int i, j, k;
@@ -249,7 +465,8 @@ int shadow_encoder_init_h264(rdpShadowEncoder* encoder)
 	encoder->h264->FrameRate = encoder->server->h264FrameRate;
 	encoder->h264->QP = encoder->server->h264QP;
 
-	encoder->codecs |= FREERDP_CODEC_AVC420;
+	/* AVC420 and AVC444 share the same H.264 context */
+	encoder->codecs |= (FREERDP_CODEC_AVC420 | FREERDP_CODEC_AVC444);
 
 	return 1;
 
@@ -337,7 +554,7 @@ int shadow_encoder_uninit_h264(rdpShadowEncoder* encoder)
 		encoder->h264= NULL;
 	}
 
-	encoder->codecs &= ~FREERDP_CODEC_AVC420;
+	encoder->codecs &= ~(FREERDP_CODEC_AVC420 | FREERDP_CODEC_AVC444);
 
 	return 1;
 }
@@ -372,7 +589,7 @@ int shadow_encoder_uninit(rdpShadowEncoder* encoder)
 		shadow_encoder_uninit_interleaved(encoder);
 	}
 
-	if (encoder->codecs & FREERDP_CODEC_AVC420)
+	if (encoder->codecs & (FREERDP_CODEC_AVC420 | FREERDP_CODEC_AVC444))
 	{
 		shadow_encoder_uninit_h264(encoder);
 	}
@@ -447,14 +664,25 @@ int shadow_encoder_prepare(rdpShadowEncoder* encoder, UINT32 codecs)
 			return -1;
 	}
 
-	if ((codecs & FREERDP_CODEC_AVC420) && !(encoder->codecs & FREERDP_CODEC_AVC420))
+	if (codecs & (FREERDP_CODEC_AVC420 | FREERDP_CODEC_AVC444))
 	{
-		status = shadow_encoder_init_h264(encoder);
+		/* A new H.264 context starts the other stream with a key frame */
+		if (encoder->h264 && !(codecs & encoder->h264Codecs))
+			shadow_encoder_uninit_h264(encoder);
 
-		if (status < 0)
-			return -1;
+		if (!(encoder->codecs & (FREERDP_CODEC_AVC420 | FREERDP_CODEC_AVC444)))
+		{
+			status = shadow_encoder_init_h264(encoder);
+
+			if (status < 0)
+				return -1;
+		}
+
+		encoder->h264Codecs = codecs & (FREERDP_CODEC_AVC420 | FREERDP_CODEC_AVC444);
 	}
 
+	shadow_encoder_apply_quality(encoder);
+
 	return 1;
 }
 
@@ -473,6 +701,8 @@ rdpShadowEncoder* shadow_encoder_new(rdpShadowClient* client)
 
 	encoder->fps = 16;
 	encoder->maxFps = 32;
+	encoder->rateMaxFps = encoder->maxFps;
+	encoder->quality = SHADOW_ENCODER_QUALITY_MAX;
 
 	if (shadow_encoder_init(encoder) < 0)
 	{
@@ -27,6 +27,21 @@
 
 #include <freerdp/server/shadow.h>
 
+/**
+ * Quality levels of the rate control, the highest one encodes with the
+ * configured codec settings, each level below trades detail for size.
+ */
+#define SHADOW_ENCODER_QUALITY_MAX		4
+
+/* AVC444 doubles the bitstream, below this level AVC420 is sent instead */
+#define SHADOW_ENCODER_QUALITY_AVC444		2
+
+/* Length of a rate control window in ms */
+#define SHADOW_ENCODER_RATE_WINDOW		1000
+
+/* Frame rate gained per window without congestion */
+#define SHADOW_ENCODER_FPS_INCREASE		2
+
 struct rdp_shadow_encoder
 {
 	rdpShadowClient* client;
@@ -50,12 +65,29 @@ struct rdp_shadow_encoder
 	BITMAP_PLANAR_CONTEXT* planar;
 	BITMAP_INTERLEAVED_CONTEXT* interleaved;
 	H264_CONTEXT* h264;
+	UINT32 h264Codecs;
 
 	int fps;
 	int maxFps;
 	BOOL frameAck;
 	UINT32 frameId;
 	UINT32 lastAckframeId;
+
+	/* Network feedback, 0 until measured */
+	UINT32 rtt; /* smoothed round trip time (ms) */
+	UINT32 baseRtt; /* lowest round trip time seen (ms) */
+	UINT32 jitter; /* round trip time variation (ms) */
+	UINT32 goodput; /* throughput received by the client (kbit/s) */
+	UINT32 decodeTime; /* smoothed client decode and render time (ms) */
+
+	/* Rate control */
+	UINT32 quality;
+	int rateMaxFps;
+	UINT64 windowStart;
+	UINT32 windowBytes;
+	UINT32 windowFrames;
+	BOOL windowBlocked;
+	UINT32 stableWindows;
 };
 
 #ifdef __cplusplus
@@ -66,6 +98,13 @@ int shadow_encoder_reset(rdpShadowEncoder* encoder);
 int shadow_encoder_prepare(rdpShadowEncoder* encoder, UINT32 codecs);
 UINT32 shadow_encoder_create_frame_id(rdpShadowEncoder* encoder);
 
+void shadow_encoder_network_update(rdpShadowEncoder* encoder,
+		const AUTODETECT_NETWORK_CHARACTERISTICS* characteristics);
+void shadow_encoder_decode_time_sample(rdpShadowEncoder* encoder, UINT32 decodeTime);
+void shadow_encoder_frame_sent(rdpShadowEncoder* encoder, UINT32 size, BOOL writeBlocked);
+void shadow_encoder_rate_control(rdpShadowEncoder* encoder, UINT32 elapsed);
+BOOL shadow_encoder_use_avc444(rdpShadowEncoder* encoder);
+
 rdpShadowEncoder* shadow_encoder_new(rdpShadowClient* client);
 void shadow_encoder_free(rdpShadowEncoder* encoder);
 
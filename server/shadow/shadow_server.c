@@ -680,6 +680,11 @@ int shadow_server_init(rdpShadowServer* server)
 	if (status < 0)
 		goto fail_certificate;
 
+	server->encodeCache = shadow_encode_cache_new();
+
+	if (!server->encodeCache)
+		goto fail_encode_cache;
+
 	server->listener = freerdp_listener_new();
 
 	if (!server->listener)
@@ -703,6 +708,9 @@ fail_subsystem_new:
 	freerdp_listener_free(server->listener);
 	server->listener = NULL;
 fail_listener:
+	shadow_encode_cache_free(server->encodeCache);
+	server->encodeCache = NULL;
+fail_encode_cache:
 	free(server->CertificateFile);
 	server->CertificateFile = NULL;
 	free(server->PrivateKeyFile);
@@ -737,6 +745,9 @@ int shadow_server_uninit(rdpShadowServer* server)
 	freerdp_listener_free(server->listener);
 	server->listener = NULL;
 
+	shadow_encode_cache_free(server->encodeCache);
+	server->encodeCache = NULL;
+
 	free(server->CertificateFile);
 	server->CertificateFile = NULL;
 	free(server->PrivateKeyFile);
@@ -270,4 +270,8 @@ int shadow_subsystem_pointer_convert_alpha_pointer_data(BYTE* pixels, BOOL premu
 void shadow_subsystem_frame_update(rdpShadowSubsystem* subsystem)
 {
 	shadow_multiclient_publish_and_wait(subsystem->updateEvent);
+
+	/* All clients are done with this frame, its shared payloads are stale */
+	if (subsystem->server)
+		shadow_encode_cache_flush(subsystem->server->encodeCache);
 }
@@ -0,0 +1,260 @@
+#include <winpr/crt.h>
+
+#include <freerdp/codec/region.h>
+#include <freerdp/server/shadow.h>
+
+/**
+ * The tile kernels and the run merging are checked against the scalar
+ * compare shadow_capture_compare used before, which walked every tile
+ * with memcmp and only reported the extents of the changed tiles.
+ */
+
+#define TEST_CAPTURE_PADDING	24
+
+static UINT32 g_Seed = 0x12345678;
+
+static UINT32 test_capture_rand(void)
+{
+	g_Seed = (g_Seed * 1103515245) + 12345;
+	return (g_Seed >> 16) & 0x7FFF;
+}
+
+static BOOL test_capture_tile_equal(const BYTE* pData1, int nStep1, const BYTE* pData2,
+				    int nStep2, int nWidth, int nHeight, int tx, int ty)
+{
+	int k, tw, th;
+	const BYTE* p1;
+	const BYTE* p2;
+
+	tw = MIN(16, nWidth - (tx * 16));
+	th = MIN(16, nHeight - (ty * 16));
+
+	p1 = &pData1[(ty * 16 * nStep1) + (tx * 16 * 4)];
+	p2 = &pData2[(ty * 16 * nStep2) + (tx * 16 * 4)];
+
+	for (k = 0; k < th; k++)
+	{
+		if (memcmp(p1, p2, tw * 4) != 0)
+			return FALSE;
+
+		p1 += nStep1;
+		p2 += nStep2;
+	}
+
+	return TRUE;
+}
+
+/* The scalar compare, returns the extents of the changed tiles */
+static int test_capture_compare_scalar(const BYTE* pData1, int nStep1, int nWidth, int nHeight,
+				       const BYTE* pData2, int nStep2, RECTANGLE_16* rect)
+{
+	int tx, ty;
+	int nrow, ncol;
+	int l, t, r, b;
+
+	ZeroMemory(rect, sizeof(RECTANGLE_16));
+
+	nrow = (nHeight + 15) / 16;
+	ncol = (nWidth + 15) / 16;
+
+	l = ncol + 1;
+	r = -1;
+	t = nrow + 1;
+	b = -1;
+
+	for (ty = 0; ty < nrow; ty++)
+	{
+		for (tx = 0; tx < ncol; tx++)
+		{
+			if (test_capture_tile_equal(pData1, nStep1, pData2, nStep2, nWidth, nHeight, tx, ty))
+				continue;
+
+			l = MIN(l, tx);
+			r = MAX(r, tx);
+			t = MIN(t, ty);
+			b = MAX(b, ty);
+		}
+	}
+
+	if (r < 0)
+		return 0;
+
+	rect->left = l * 16;
+	rect->top = t * 16;
+	rect->right = MIN((r + 1) * 16, nWidth);
+	rect->bottom = MIN((b + 1) * 16, nHeight);
+
+	return 1;
+}
+
+/**
+ * The region has to cover every changed tile completely and no unchanged
+ * tile at all, its extents have to match the scalar compare.
+ */
+static BOOL test_capture_check(BYTE* pData1, int nStep1, int nWidth, int nHeight,
+			       BYTE* pData2, int nStep2, const char* step)
+{
+	BOOL rc = FALSE;
+	int tx, ty;
+	int status, expected;
+	BOOL equal;
+	RECTANGLE_16 tile;
+	RECTANGLE_16 rect;
+	REGION16 region;
+	REGION16 covered;
+
+	region16_init(&region);
+	region16_init(&covered);
+
+	expected = test_capture_compare_scalar(pData1, nStep1, nWidth, nHeight, pData2, nStep2, &rect);
+	status = shadow_capture_compare_region(pData1, nStep1, nWidth, nHeight, pData2, nStep2, &region);
+
+	if (status != expected)
+	{
+		fprintf(stderr, "%s: %dx%d status %d, expected %d\n", step, nWidth, nHeight, status, expected);
+		goto fail;
+	}
+
+	if ((status > 0) && !rectangles_equal(region16_extents(&region), &rect))
+	{
+		fprintf(stderr, "%s: %dx%d extents differ from the scalar compare\n", step, nWidth, nHeight);
+		goto fail;
+	}
+
+	if ((status == 0) && !region16_is_empty(&region))
+	{
+		fprintf(stderr, "%s: %dx%d equal frames left a region\n", step, nWidth, nHeight);
+		goto fail;
+	}
+
+	for (ty = 0; ty < (nHeight + 15) / 16; ty++)
+	{
+		for (tx = 0; tx < (nWidth + 15) / 16; tx++)
+		{
+			tile.left = tx * 16;
+			tile.top = ty * 16;
+			tile.right = MIN(tile.left + 16, nWidth);
+			tile.bottom = MIN(tile.top + 16, nHeight);
+
+			equal = test_capture_tile_equal(pData1, nStep1, pData2, nStep2, nWidth, nHeight, tx, ty);
+
+			if (!region16_intersect_rect(&covered, &region, &tile))
+				goto fail;
+
+			if (equal && !region16_is_empty(&covered))
+			{
+				fprintf(stderr, "%s: %dx%d unchanged tile %d,%d in the region\n",
+					step, nWidth, nHeight, tx, ty);
+				goto fail;
+			}
+
+			if (!equal && ((region16_n_rects(&covered) != 1) ||
+				       !rectangles_equal(region16_extents(&covered), &tile)))
+			{
+				fprintf(stderr, "%s: %dx%d changed tile %d,%d not covered\n",
+					step, nWidth, nHeight, tx, ty);
+				goto fail;
+			}
+		}
+	}
+
+	rc = TRUE;
+
+fail:
+	region16_uninit(&covered);
+	region16_uninit(&region);
+	return rc;
+}
+
+static BOOL test_capture_size(int nWidth, int nHeight)
+{
+	BOOL rc = FALSE;
+	int x, y, k;
+	int nStep1, nStep2;
+	BYTE* pData1;
+	BYTE* pData2;
+	BYTE* p;
+
+	/* Different strides, the padding never takes part in the compare */
+	nStep1 = nWidth * 4;
+	nStep2 = (nWidth * 4) + TEST_CAPTURE_PADDING;
+
+	pData1 = (BYTE*) malloc(nStep1 * nHeight);
+	pData2 = (BYTE*) malloc(nStep2 * nHeight);
+
+	if (!pData1 || !pData2)
+		goto fail;
+
+	for (y = 0; y < nHeight; y++)
+	{
+		for (x = 0; x < nStep1; x++)
+			pData1[(y * nStep1) + x] = (BYTE) test_capture_rand();
+
+		CopyMemory(&pData2[y * nStep2], &pData1[y * nStep1], nStep1);
+		FillMemory(&pData2[(y * nStep2) + nStep1], TEST_CAPTURE_PADDING, 0xAA);
+	}
+
+	if (!test_capture_check(pData1, nStep1, nWidth, nHeight, pData2, nStep2, "equal"))
+		goto fail;
+
+	/* A single byte at the last column and row of each tile in turn */
+	for (y = 15; y < nHeight + 15; y += 16)
+	{
+		for (x = 15; x < nWidth + 15; x += 16)
+		{
+			p = &pData2[(MIN(y, nHeight - 1) * nStep2) + (MIN(x, nWidth - 1) * 4) + 3];
+			*p ^= 0x01;
+
+			if (!test_capture_check(pData1, nStep1, nWidth, nHeight, pData2, nStep2, "edge"))
+				goto fail;
+
+			*p ^= 0x01;
+		}
+	}
+
+	/* Random pixels, a few at a time so that runs and gaps both show up */
+	for (k = 0; k < 64; k++)
+	{
+		x = test_capture_rand() % nWidth;
+		y = test_capture_rand() % nHeight;
+		pData2[(y * nStep2) + (x * 4) + (k % 4)] ^= 0x80;
+
+		if (!test_capture_check(pData1, nStep1, nWidth, nHeight, pData2, nStep2, "random"))
+			goto fail;
+	}
+
+	for (y = 0; y < nHeight; y++)
+		FillMemory(&pData2[y * nStep2], nStep1, 0x55);
+
+	if (!test_capture_check(pData1, nStep1, nWidth, nHeight, pData2, nStep2, "all"))
+		goto fail;
+
+	rc = TRUE;
+
+fail:
+	free(pData1);
+	free(pData2);
+	return rc;
+}
+
+int TestShadowCapture(int argc, char* argv[])
+{
+	int k;
+	static const int sizes[][2] =
+	{
+		{ 1, 1 },
+		{ 16, 16 },
+		{ 17, 15 },
+		{ 64, 48 },
+		{ 70, 37 },
+		{ 200, 100 }
+	};
+
+	for (k = 0; k < ARRAYSIZE(sizes); k++)
+	{
+		if (!test_capture_size(sizes[k][0], sizes[k][1]))
+			return -1;
+	}
+
+	return 0;
+}
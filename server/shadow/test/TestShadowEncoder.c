@@ -0,0 +1,310 @@
+#include <winpr/crt.h>
+
+#include <freerdp/settings.h>
+#include <freerdp/server/shadow.h>
+
+#include "../shadow_screen.h"
+#include "../shadow_encoder.h"
+
+/**
+ * The rate control is driven window by window, with the network state
+ * the autodetect callback would report and the traffic of each window.
+ */
+
+#define TEST_COLOR_LOSS_LEVEL	3
+
+struct _TEST_SHADOW_ENCODER
+{
+	rdpShadowServer server;
+	rdpShadowScreen screen;
+	rdpShadowClient client;
+	rdpShadowEncoder* encoder;
+};
+typedef struct _TEST_SHADOW_ENCODER TEST_SHADOW_ENCODER;
+
+static void test_encoder_free(TEST_SHADOW_ENCODER* test)
+{
+	if (!test)
+		return;
+
+	shadow_encoder_free(test->encoder);
+	freerdp_settings_free(test->client.context.settings);
+	free(test);
+}
+
+static TEST_SHADOW_ENCODER* test_encoder_new(void)
+{
+	TEST_SHADOW_ENCODER* test;
+
+	if (!(test = (TEST_SHADOW_ENCODER*) calloc(1, sizeof(TEST_SHADOW_ENCODER))))
+		return NULL;
+
+	test->screen.width = 64;
+	test->screen.height = 64;
+	test->server.screen = &test->screen;
+	test->server.rfxMode = RLGR3;
+	test->client.server = &test->server;
+
+	if (!(test->client.context.settings = freerdp_settings_new(0)))
+		goto fail;
+
+	test->client.context.settings->NSCodecColorLossLevel = TEST_COLOR_LOSS_LEVEL;
+
+	if (!(test->encoder = shadow_encoder_new(&test->client)))
+		goto fail;
+
+	if (shadow_encoder_prepare(test->encoder, FREERDP_CODEC_REMOTEFX | FREERDP_CODEC_NSCODEC) < 0)
+		goto fail;
+
+	return test;
+
+fail:
+	test_encoder_free(test);
+	return NULL;
+}
+
+static void test_encoder_network(rdpShadowEncoder* encoder, UINT32 rtt, UINT32 baseRtt,
+				 UINT32 jitter, UINT32 goodput)
+{
+	AUTODETECT_NETWORK_CHARACTERISTICS characteristics;
+
+	ZeroMemory(&characteristics, sizeof(characteristics));
+	characteristics.smoothedRTT = rtt;
+	characteristics.baseRTT = baseRtt;
+	characteristics.jitter = jitter;
+	characteristics.goodput = goodput;
+
+	shadow_encoder_network_update(encoder, &characteristics);
+}
+
+/* One second of traffic, frames of frameSize bytes */
+static void test_encoder_window(rdpShadowEncoder* encoder, UINT32 frames, UINT32 frameSize,
+				BOOL writeBlocked)
+{
+	encoder->windowBytes = frames * frameSize;
+	encoder->windowFrames = frames;
+	encoder->windowBlocked = writeBlocked;
+
+	shadow_encoder_rate_control(encoder, SHADOW_ENCODER_RATE_WINDOW);
+}
+
+/* Each level below the top adds one step to the RemoteFX and NSCodec loss */
+static BOOL test_encoder_check(rdpShadowEncoder* encoder, UINT32 quality, int rateMaxFps,
+			       const char* step)
+{
+	UINT32 drop = SHADOW_ENCODER_QUALITY_MAX - quality;
+
+	if ((encoder->quality != quality) || (encoder->rateMaxFps != rateMaxFps))
+	{
+		fprintf(stderr, "%s: quality %u max fps %d, expected %u and %d\n",
+			step, encoder->quality, encoder->rateMaxFps, quality, rateMaxFps);
+		return FALSE;
+	}
+
+	if (encoder->fps > encoder->rateMaxFps)
+	{
+		fprintf(stderr, "%s: fps %d above the max fps %d\n",
+			step, encoder->fps, encoder->rateMaxFps);
+		return FALSE;
+	}
+
+	if ((encoder->rfx->quants[0] != MIN(6 + drop, 15)) ||
+	    (encoder->rfx->quants[9] != MIN(9 + drop, 15)) ||
+	    (encoder->nsc->ColorLossLevel != MIN(TEST_COLOR_LOSS_LEVEL + drop, 7)))
+	{
+		fprintf(stderr, "%s: codec settings do not match quality %u\n", step, quality);
+		return FALSE;
+	}
+
+	if (shadow_encoder_use_avc444(encoder) != (quality >= SHADOW_ENCODER_QUALITY_AVC444))
+	{
+		fprintf(stderr, "%s: wrong AVC444 choice at quality %u\n", step, quality);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Clean windows raise the frame rate by SHADOW_ENCODER_FPS_INCREASE up to
+ * the encoder limit and the quality by one level every third window.
+ */
+static BOOL test_encoder_clean(void)
+{
+	BOOL rc = FALSE;
+	rdpShadowEncoder* encoder;
+	TEST_SHADOW_ENCODER* test;
+
+	if (!(test = test_encoder_new()))
+		return FALSE;
+
+	encoder = test->encoder;
+	encoder->quality = 1;
+	encoder->rateMaxFps = 20;
+
+	/* Queueing delay just under the threshold: 20 * 2 + 50 */
+	test_encoder_network(encoder, 60, 20, 30, 8000);
+
+	test_encoder_window(encoder, 20, 10000, FALSE);
+	test_encoder_window(encoder, 20, 10000, FALSE);
+
+	if (!test_encoder_check(encoder, 1, 24, "clean 2"))
+		goto fail;
+
+	test_encoder_window(encoder, 20, 10000, FALSE);
+
+	if (!test_encoder_check(encoder, 2, 26, "clean 3"))
+		goto fail;
+
+	test_encoder_window(encoder, 20, 10000, FALSE);
+	test_encoder_window(encoder, 20, 10000, FALSE);
+	test_encoder_window(encoder, 20, 10000, FALSE);
+
+	if (!test_encoder_check(encoder, 3, encoder->maxFps, "clean 6"))
+		goto fail;
+
+	test_encoder_window(encoder, 20, 10000, FALSE);
+	test_encoder_window(encoder, 20, 10000, FALSE);
+	test_encoder_window(encoder, 20, 10000, FALSE);
+	test_encoder_window(encoder, 20, 10000, FALSE);
+	test_encoder_window(encoder, 20, 10000, FALSE);
+	test_encoder_window(encoder, 20, 10000, FALSE);
+
+	if (!test_encoder_check(encoder, SHADOW_ENCODER_QUALITY_MAX, encoder->maxFps, "clean 12"))
+		goto fail;
+
+	rc = TRUE;
+
+fail:
+	test_encoder_free(test);
+	return rc;
+}
+
+/**
+ * A queueing delay lowers the quality at once and cuts the frame rate to
+ * what the goodput carries, write backpressure halves it.
+ */
+static BOOL test_encoder_congested(void)
+{
+	int x;
+	BOOL rc = FALSE;
+	rdpShadowEncoder* encoder;
+	TEST_SHADOW_ENCODER* test;
+
+	if (!(test = test_encoder_new()))
+		return FALSE;
+
+	encoder = test->encoder;
+
+	/* 4000 kbit/s carry 12 frames of 40000 bytes per second */
+	test_encoder_network(encoder, 60, 20, 31, 4000);
+	test_encoder_window(encoder, 10, 40000, FALSE);
+
+	if (!test_encoder_check(encoder, SHADOW_ENCODER_QUALITY_MAX - 1, 12, "delay"))
+		goto fail;
+
+	/* Two clean windows do not raise the quality, a congested one resets the count */
+	test_encoder_network(encoder, 30, 20, 5, 4000);
+	test_encoder_window(encoder, 10, 40000, FALSE);
+	test_encoder_window(encoder, 10, 40000, FALSE);
+
+	test_encoder_network(encoder, 200, 20, 10, 4000);
+	test_encoder_window(encoder, 10, 40000, FALSE);
+
+	if (!test_encoder_check(encoder, SHADOW_ENCODER_QUALITY_MAX - 2, 12, "delay again"))
+		goto fail;
+
+	test_encoder_network(encoder, 30, 20, 5, 4000);
+	test_encoder_window(encoder, 10, 40000, FALSE);
+	test_encoder_window(encoder, 10, 40000, FALSE);
+
+	if (!test_encoder_check(encoder, SHADOW_ENCODER_QUALITY_MAX - 2, 16, "recovering"))
+		goto fail;
+
+	/* Backpressure without any delay, the goodput does not bind small frames */
+	encoder->fps = 14;
+	test_encoder_window(encoder, 10, 1000, TRUE);
+
+	if (!test_encoder_check(encoder, SHADOW_ENCODER_QUALITY_MAX - 3, 7, "blocked"))
+		goto fail;
+
+	for (x = 0; x < 8; x++)
+		test_encoder_window(encoder, 10, 1000, TRUE);
+
+	if (!test_encoder_check(encoder, 0, 1, "floor"))
+		goto fail;
+
+	rc = TRUE;
+
+fail:
+	test_encoder_free(test);
+	return rc;
+}
+
+/**
+ * The client decode and render time bounds the frame rate whatever the
+ * network state.
+ */
+static BOOL test_encoder_decode_time(void)
+{
+	BOOL rc = FALSE;
+	rdpShadowEncoder* encoder;
+	TEST_SHADOW_ENCODER* test;
+
+	if (!(test = test_encoder_new()))
+		return FALSE;
+
+	encoder = test->encoder;
+	test_encoder_network(encoder, 20, 20, 2, 100000);
+
+	shadow_encoder_decode_time_sample(encoder, 50);
+	test_encoder_window(encoder, 20, 1000, FALSE);
+
+	if (!test_encoder_check(encoder, SHADOW_ENCODER_QUALITY_MAX, 20, "decode 50 ms"))
+		goto fail;
+
+	/* Smoothed: (50 * 3 + 100) / 4 */
+	shadow_encoder_decode_time_sample(encoder, 100);
+	test_encoder_window(encoder, 20, 1000, FALSE);
+
+	if ((encoder->decodeTime != 62) ||
+	    !test_encoder_check(encoder, SHADOW_ENCODER_QUALITY_MAX, 1000 / 62, "decode 62 ms"))
+		goto fail;
+
+	/* Faster decoding lets the frame rate grow back additively */
+	shadow_encoder_decode_time_sample(encoder, 2);
+	shadow_encoder_decode_time_sample(encoder, 2);
+	shadow_encoder_decode_time_sample(encoder, 2);
+	shadow_encoder_decode_time_sample(encoder, 2);
+	shadow_encoder_decode_time_sample(encoder, 2);
+	test_encoder_window(encoder, 20, 1000, FALSE);
+
+	if (!test_encoder_check(encoder, SHADOW_ENCODER_QUALITY_MAX, 1000 / 62 + 2, "decode fast"))
+		goto fail;
+
+	/* An empty window changes nothing */
+	test_encoder_window(encoder, 0, 1000, TRUE);
+
+	if (!test_encoder_check(encoder, SHADOW_ENCODER_QUALITY_MAX, 1000 / 62 + 2, "empty"))
+		goto fail;
+
+	rc = TRUE;
+
+fail:
+	test_encoder_free(test);
+	return rc;
+}
+
+int TestShadowEncoder(int argc, char* argv[])
+{
+	if (!test_encoder_clean())
+		return -1;
+
+	if (!test_encoder_congested())
+		return -1;
+
+	if (!test_encoder_decode_time())
+		return -1;
+
+	return 0;
+}
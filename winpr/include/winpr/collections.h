@@ -53,6 +53,11 @@ typedef struct _wObject wObject;
 
 /* System.Collections.Queue */
 
+#define QUEUE_LOCK_FREE_SPSC	0x00000001 /* one producer thread, one consumer thread */
+#define QUEUE_LOCK_FREE_MPMC	0x00000002 /* any number of producer and consumer threads */
+
+struct _wLockFreeQueue;
+
 struct _wQueue
 {
 	int capacity;
@@ -67,6 +72,9 @@ struct _wQueue
 	HANDLE event;
 
 	wObject object;
+
+	/* bounded lock-free storage, replaces array when set */
+	struct _wLockFreeQueue* lockFree;
 };
 typedef struct _wQueue wQueue;
 
@@ -85,10 +93,12 @@ WINPR_API BOOL Queue_Contains(wQueue* queue, void* obj);
 
 WINPR_API BOOL Queue_Enqueue(wQueue* queue, void* obj);
 WINPR_API void* Queue_Dequeue(wQueue* queue);
+WINPR_API int Queue_DequeueBatch(wQueue* queue, void** objs, int count);
 
 WINPR_API void* Queue_Peek(wQueue* queue);
 
 WINPR_API wQueue* Queue_New(BOOL synchronized, int capacity, int growthFactor);
+WINPR_API wQueue* Queue_NewLockFree(int capacity, DWORD flags);
 WINPR_API void Queue_Free(wQueue* queue);
 
 /* System.Collections.Stack */
@@ -468,6 +478,9 @@ struct _wMessageQueue
 	HANDLE event;
 
 	wObject object;
+
+	/* bounded lock-free storage, replaces array when set */
+	struct _wLockFreeQueue* lockFree;
 };
 typedef struct _wMessageQueue wMessageQueue;
 
@@ -483,6 +496,7 @@ WINPR_API BOOL MessageQueue_PostQuit(wMessageQueue* queue, int nExitCode);
 
 WINPR_API int MessageQueue_Get(wMessageQueue* queue, wMessage* message);
 WINPR_API int MessageQueue_Peek(wMessageQueue* queue, wMessage* message, BOOL remove);
+WINPR_API int MessageQueue_GetBatch(wMessageQueue* queue, wMessage* messages, int count);
 
 /*! \brief Clears all elements in a message queue.
  *
@@ -510,6 +524,20 @@ WINPR_API int MessageQueue_Clear(wMessageQueue *queue);
  */
 WINPR_API wMessageQueue* MessageQueue_New(const wObject *callback);
 
+/*! \brief Creates a new bounded lock-free message queue.
+ * 				 Posting to a full queue fails instead of growing it.
+ *
+ * \param callback see MessageQueue_New.
+ * \param capacity the number of messages the queue can hold, rounded
+ * 								 up to the next power of two.
+ * \param flags QUEUE_LOCK_FREE_SPSC if only one thread posts and one
+ * 							thread retrieves messages, QUEUE_LOCK_FREE_MPMC otherwise.
+ *
+ * \return A pointer to a newly allocated MessageQueue or NULL.
+ */
+WINPR_API wMessageQueue* MessageQueue_NewLockFree(const wObject *callback, int capacity,
+		DWORD flags);
+
 /*! \brief Frees resources allocated by a message queue.
  * 				 This function will only free resources allocated
  *				 internally.
@@ -325,21 +325,39 @@ static INLINE BOOL Stream_SafeSeek(wStream* s, size_t size) {
 
 /* StreamPool */
 
+struct _wStreamPoolClass;
+struct _wStreamPoolCache;
+struct _wStreamPoolIndex;
+
 struct _wStreamPool
 {
-	int aSize;
-	int aCapacity;
-	wStream** aArray;
-
-	int uSize;
-	int uCapacity;
-	wStream** uArray;
+	LONG volatile aSize; /* streams available for reuse */
+	LONG volatile uSize; /* streams currently taken */
 
 	CRITICAL_SECTION lock;
 	BOOL synchronized;
 	size_t defaultSize;
+
+	size_t maxRetained;
+	LONG volatile retained; /* bytes held by available streams */
+	UINT64 hits;
+	UINT64 misses;
+
+	struct _wStreamPoolClass* classes;
+	struct _wStreamPoolCache* caches;
+	struct _wStreamPoolIndex* index;
 };
 
+struct _wStreamPoolStatistics
+{
+	UINT64 hits;
+	UINT64 misses;
+	size_t retainedBytes;
+	int available;
+	int used;
+};
+typedef struct _wStreamPoolStatistics wStreamPoolStatistics;
+
 WINPR_API wStream* StreamPool_Take(wStreamPool* pool, size_t size);
 WINPR_API void StreamPool_Return(wStreamPool* pool, wStream* s);
 
@@ -350,6 +368,9 @@ WINPR_API wStream* StreamPool_Find(wStreamPool* pool, BYTE* ptr);
 WINPR_API void StreamPool_AddRef(wStreamPool* pool, BYTE* ptr);
 WINPR_API void StreamPool_Release(wStreamPool* pool, BYTE* ptr);
 
+WINPR_API void StreamPool_SetMaxRetained(wStreamPool* pool, size_t maxRetained);
+WINPR_API void StreamPool_GetStatistics(wStreamPool* pool, wStreamPoolStatistics* stats);
+
 WINPR_API void StreamPool_Clear(wStreamPool* pool);
 
 WINPR_API wStreamPool* StreamPool_New(BOOL synchronized, size_t defaultSize);
@@ -381,6 +381,32 @@ WINPR_API int SetEventFileDescriptor(HANDLE hEvent, int FileDescriptor, ULONG mo
 
 WINPR_API void* GetEventWaitObject(HANDLE hEvent);
 
+/**
+ * Wait sets keep a registered set of handles between waits instead of
+ * passing them on every call, and are not limited to MAXIMUM_WAIT_OBJECTS.
+ * WaitForWaitSet returns WAIT_OBJECT_0 and the signaled handles, up to nCount.
+ * Handles must not be closed while a wait on the set is in progress, a set
+ * never dereferences a handle again after it left the set.
+ * WaitSetSetHandles replaces the content of the set with a list of open
+ * handles, for handles owned by someone else which may be closed between
+ * waits: entries of closed handles are dropped without touching them.
+ */
+
+#define WAIT_SET_EDGE_TRIGGERED		0x00000001
+
+typedef struct winpr_wait_set WINPR_WAIT_SET;
+
+WINPR_API WINPR_WAIT_SET* CreateWaitSet(void);
+WINPR_API void CloseWaitSet(WINPR_WAIT_SET* waitSet);
+
+WINPR_API BOOL WaitSetAddHandle(WINPR_WAIT_SET* waitSet, HANDLE hHandle, DWORD dwFlags);
+WINPR_API BOOL WaitSetRemoveHandle(WINPR_WAIT_SET* waitSet, HANDLE hHandle);
+WINPR_API BOOL WaitSetSetHandles(WINPR_WAIT_SET* waitSet, const HANDLE* lpHandles, DWORD nCount, DWORD dwFlags);
+WINPR_API DWORD WaitSetGetCount(WINPR_WAIT_SET* waitSet);
+
+WINPR_API DWORD WaitForWaitSet(WINPR_WAIT_SET* waitSet, DWORD dwMilliseconds,
+		HANDLE* lpHandles, DWORD nCount, LPDWORD lpNumberOfSignaled);
+
 #ifdef __cplusplus
 }
 #endif
@@ -100,6 +100,18 @@ typedef struct _wLogMessage wLogMessage;
 typedef struct _wLogLayout wLogLayout;
 typedef struct _wLogAppender wLogAppender;
 typedef struct _wLog wLog;
+typedef struct _wLogTag wLogTag;
+
+/**
+ * Kept by each use of the tag macros: the tag string seen first there and
+ * the tag it resolved to, both set once.
+ */
+struct _wLogTagCache
+{
+	LPCSTR Key;
+	wLogTag* volatile Tag;
+};
+typedef struct _wLogTagCache wLogTagCache;
 
 #define WLOG_PACKET_INBOUND     1
 #define WLOG_PACKET_OUTBOUND    2
@@ -185,13 +197,36 @@ WINPR_API BOOL WLog_PrintMessageVA(wLog* log, wLogMessage* message, va_list args
 #define WLog_IsLevelActive(_log, _log_level) \
 	(_log ? _log_level >= WLog_GetLogLevel(_log) : FALSE)
 
-#define WLog_LVL(tag, lvl, fmt, ...) WLog_Print(WLog_Get(tag), lvl, fmt, ## __VA_ARGS__)
-#define WLog_VRB(tag, fmt, ...) WLog_Print(WLog_Get(tag), WLOG_TRACE, fmt, ## __VA_ARGS__)
-#define WLog_DBG(tag, fmt, ...) WLog_Print(WLog_Get(tag), WLOG_DEBUG, fmt, ## __VA_ARGS__)
-#define WLog_INFO(tag, fmt, ...) WLog_Print(WLog_Get(tag), WLOG_INFO, fmt, ## __VA_ARGS__)
-#define WLog_WARN(tag, fmt, ...) WLog_Print(WLog_Get(tag), WLOG_WARN, fmt, ## __VA_ARGS__)
-#define WLog_ERR(tag, fmt, ...) WLog_Print(WLog_Get(tag), WLOG_ERROR, fmt, ## __VA_ARGS__)
-#define WLog_FATAL(tag, fmt, ...) WLog_Print(WLog_Get(tag), WLOG_FATAL, fmt, ## __VA_ARGS__)
+/**
+ * Messages below WLOG_MIN_LEVEL are compiled out of the tag macros,
+ * define it to one of the log levels to build without them.
+ */
+#ifndef WLOG_MIN_LEVEL
+#define WLOG_MIN_LEVEL WLOG_TRACE
+#endif
+
+/**
+ * Each use of the tag macros keeps the tag it got for its tag string, a
+ * later call with the same pointer finds its logger without looking at the
+ * name. The tag has to be a string literal or otherwise never change,
+ * functions passing a caller's tag on use WLog_Get and WLog_Print.
+ */
+#define WLog_Tag(tag, lvl, fmt, ...) \
+	do { \
+		if ((lvl) >= WLOG_MIN_LEVEL) { \
+			static wLogTagCache _log_tag = { NULL, NULL }; \
+			wLog* _log_cached = WLog_GetCached(&_log_tag, tag); \
+			WLog_Print(_log_cached, lvl, fmt, ## __VA_ARGS__); \
+		} \
+	} while (0)
+
+#define WLog_LVL(tag, lvl, fmt, ...) WLog_Tag(tag, lvl, fmt, ## __VA_ARGS__)
+#define WLog_VRB(tag, fmt, ...) WLog_Tag(tag, WLOG_TRACE, fmt, ## __VA_ARGS__)
+#define WLog_DBG(tag, fmt, ...) WLog_Tag(tag, WLOG_DEBUG, fmt, ## __VA_ARGS__)
+#define WLog_INFO(tag, fmt, ...) WLog_Tag(tag, WLOG_INFO, fmt, ## __VA_ARGS__)
+#define WLog_WARN(tag, fmt, ...) WLog_Tag(tag, WLOG_WARN, fmt, ## __VA_ARGS__)
+#define WLog_ERR(tag, fmt, ...) WLog_Tag(tag, WLOG_ERROR, fmt, ## __VA_ARGS__)
+#define WLog_FATAL(tag, fmt, ...) WLog_Tag(tag, WLOG_FATAL, fmt, ## __VA_ARGS__)
 
 WINPR_API DWORD WLog_GetLogLevel(wLog* log);
 WINPR_API BOOL WLog_SetLogLevel(wLog* log, DWORD logLevel);
@@ -210,6 +245,7 @@ WINPR_API BOOL WLog_Layout_SetPrefixFormat(wLog* log, wLogLayout* layout, const
 
 WINPR_API wLog* WLog_GetRoot(void);
 WINPR_API wLog* WLog_Get(LPCSTR name);
+WINPR_API wLog* WLog_GetCached(wLogTagCache* cache, LPCSTR name);
 
 WINPR_API BOOL WLog_Init(void);
 WINPR_API BOOL WLog_Uninit(void);
@@ -23,11 +23,239 @@
 
 #include <winpr/crt.h>
 #include <winpr/pool.h>
+#include <winpr/interlocked.h>
+
+#include "pool.h"
+#include "../handle/handle.h"
+#include "../log.h"
+#define TAG WINPR_TAG("pool")
 
 #ifdef WINPR_THREAD_POOL
 
+#ifdef WINPR_POOL_DISPATCH
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+/**
+ * There are no completion ports here: an I/O object is a readiness
+ * notification. Every StartThreadpoolIo arms one callback which is queued
+ * once the handle is signaled (readable for WINPR_FD_READ handles, writable
+ * for WINPR_FD_WRITE ones). The callback gets no OVERLAPPED and no byte
+ * count, it is expected to perform the non-blocking I/O itself.
+ */
+
+static BOOL threadpool_io_arm(PTP_IO io, BOOL enable)
+{
+	struct epoll_event event;
+
+	ZeroMemory(&event, sizeof(event));
+	event.events = enable ? (io->Events | EPOLLONESHOT) : 0;
+	event.data.ptr = io;
+
+	if (!io->Registered)
+	{
+		if (epoll_ctl(io->Pool->EpollFd, EPOLL_CTL_ADD, io->fd, &event) < 0)
+		{
+			WLog_ERR(TAG, "epoll_ctl(EPOLL_CTL_ADD) failure [%d] %s", errno, strerror(errno));
+			return FALSE;
+		}
+
+		io->Registered = TRUE;
+		return TRUE;
+	}
+
+	if (epoll_ctl(io->Pool->EpollFd, EPOLL_CTL_MOD, io->fd, &event) < 0)
+	{
+		WLog_ERR(TAG, "epoll_ctl(EPOLL_CTL_MOD) failure [%d] %s", errno, strerror(errno));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+void threadpool_io_dispatch(PTP_IO io, UINT32 events)
+{
+	PTP_POOL pool = io->Pool;
+
+	EnterCriticalSection(&pool->DispatchLock);
+
+	if (io->Registered && (io->Started > 0))
+	{
+		io->Started--;
+		io->IoResult = (events & EPOLLERR) ? ERROR_IO_DEVICE : NO_ERROR;
+		SubmitThreadpoolWork(io->Work);
+
+		if (io->Started > 0)
+			threadpool_io_arm(io, TRUE);
+	}
+
+	LeaveCriticalSection(&pool->DispatchLock);
+}
+
+/**
+ * Drop the reference a closed I/O object holds until the dispatch thread
+ * can no longer see it in a batch of events.
+ */
+
+void threadpool_io_release_closed(PTP_POOL pool)
+{
+	PTP_IO io;
+	PTP_IO next;
+
+	EnterCriticalSection(&pool->DispatchLock);
+	io = pool->ClosedIo;
+	pool->ClosedIo = NULL;
+	LeaveCriticalSection(&pool->DispatchLock);
+
+	while (io)
+	{
+		next = io->Next;
+		threadpool_work_release(io->Work);
+		io = next;
+	}
+}
+
+static VOID CALLBACK threadpool_io_work(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_WORK work)
+{
+	PTP_IO io = (PTP_IO) context;
+
+	io->IoCallback(instance, io->CallbackParameter, NULL, io->IoResult, 0, io);
+}
+
+static void threadpool_io_free(PVOID owner)
+{
+	free(owner);
+}
+
 PTP_IO winpr_CreateThreadpoolIo(HANDLE fl, PTP_WIN32_IO_CALLBACK pfnio, PVOID pv, PTP_CALLBACK_ENVIRON pcbe)
 {
+	PTP_IO io;
+	ULONG type;
+	WINPR_HANDLE* handle;
+
+	if (!winpr_Handle_GetInfo(fl, &type, &handle))
+		return NULL;
+
+	if (!(io = (PTP_IO) calloc(1, sizeof(TP_IO))))
+		return NULL;
+
+	io->Handle = fl;
+	io->IoCallback = pfnio;
+	io->CallbackParameter = pv;
+	io->fd = winpr_Handle_getFd(fl);
+	io->Events = (handle->Mode & WINPR_FD_WRITE) ? EPOLLOUT : EPOLLIN;
+
+	if (io->fd < 0)
+	{
+		WLog_ERR(TAG, "handle type %u has no file descriptor", type);
+		free(io);
+		return NULL;
+	}
+
+	if (!(io->Work = winpr_CreateThreadpoolWork(threadpool_io_work, io, pcbe)))
+	{
+		free(io);
+		return NULL;
+	}
+
+	io->Pool = io->Work->CallbackEnvironment->Pool;
+
+	if (!io->Pool)
+		io->Pool = GetDefaultThreadpool();
+
+	io->Work->Owner = io;
+	io->Work->FreeOwner = threadpool_io_free;
+
+	EnterCriticalSection(&io->Pool->DispatchLock);
+
+	if (!threadpool_dispatch_start(io->Pool))
+	{
+		LeaveCriticalSection(&io->Pool->DispatchLock);
+		winpr_CloseThreadpoolWork(io->Work);
+		return NULL;
+	}
+
+	LeaveCriticalSection(&io->Pool->DispatchLock);
+
+	return io;
+}
+
+VOID winpr_CloseThreadpoolIo(PTP_IO pio)
+{
+	UINT64 value = 1;
+	PTP_POOL pool = pio->Pool;
+
+	EnterCriticalSection(&pool->DispatchLock);
+
+	if (pio->Registered)
+	{
+		epoll_ctl(pool->EpollFd, EPOLL_CTL_DEL, pio->fd, NULL);
+		pio->Registered = FALSE;
+	}
+
+	pio->Started = 0;
+
+	InterlockedIncrement(&pio->Work->RefCount);
+	pio->Next = pool->ClosedIo;
+	pool->ClosedIo = pio;
+
+	if (write(pool->WakeFd, &value, sizeof(value)) < 0)
+		WLog_ERR(TAG, "failed to wake the dispatch thread");
+
+	LeaveCriticalSection(&pool->DispatchLock);
+
+	/* the I/O object is freed along with its work once pending callbacks returned */
+	winpr_CloseThreadpoolWork(pio->Work);
+}
+
+VOID winpr_StartThreadpoolIo(PTP_IO pio)
+{
+	EnterCriticalSection(&pio->Pool->DispatchLock);
+
+	if (pio->Started++ == 0)
+	{
+		if (!threadpool_io_arm(pio, TRUE))
+			pio->Started--;
+	}
+
+	LeaveCriticalSection(&pio->Pool->DispatchLock);
+}
+
+VOID winpr_CancelThreadpoolIo(PTP_IO pio)
+{
+	EnterCriticalSection(&pio->Pool->DispatchLock);
+
+	if ((pio->Started > 0) && (--pio->Started == 0))
+		threadpool_io_arm(pio, FALSE);
+
+	LeaveCriticalSection(&pio->Pool->DispatchLock);
+}
+
+VOID winpr_WaitForThreadpoolIoCallbacks(PTP_IO pio, BOOL fCancelPendingCallbacks)
+{
+	if (fCancelPendingCallbacks)
+	{
+		EnterCriticalSection(&pio->Pool->DispatchLock);
+
+		if (pio->Started > 0)
+		{
+			pio->Started = 0;
+			threadpool_io_arm(pio, FALSE);
+		}
+
+		LeaveCriticalSection(&pio->Pool->DispatchLock);
+	}
+
+	winpr_WaitForThreadpoolWorkCallbacks(pio->Work, fCancelPendingCallbacks);
+}
+
+#else
+
+PTP_IO winpr_CreateThreadpoolIo(HANDLE fl, PTP_WIN32_IO_CALLBACK pfnio, PVOID pv, PTP_CALLBACK_ENVIRON pcbe)
+{
+	WLog_ERR(TAG, "CreateThreadpoolIo is not implemented");
 	return NULL;
 }
 
@@ -51,4 +279,6 @@ VOID winpr_WaitForThreadpoolIoCallbacks(PTP_IO pio, BOOL fCancelPendingCallbacks
 
 }
 
-#endif
+#endif /* WINPR_POOL_DISPATCH */
+
+#endif /* WINPR_THREAD_POOL defined */
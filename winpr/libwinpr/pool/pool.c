@@ -24,8 +24,20 @@
 #include <winpr/crt.h>
 #include <winpr/pool.h>
 #include <winpr/library.h>
+#include <winpr/sysinfo.h>
+#include <winpr/interlocked.h>
 
 #include "pool.h"
+#include "../log.h"
+#define TAG WINPR_TAG("pool")
+
+#ifdef WINPR_POOL_DISPATCH
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#endif
 
 #ifdef WINPR_THREAD_POOL
 
@@ -52,112 +64,627 @@ static BOOL CALLBACK init_module(PINIT_ONCE once, PVOID param, PVOID *context)
 
 static TP_POOL DEFAULT_POOL =
 {
-	0,    /* DWORD Minimum */
-	500,  /* DWORD Maximum */
-	NULL, /* wArrayList* Threads */
-	NULL, /* wQueue* PendingQueue */
-	NULL, /* HANDLE TerminateEvent */
-	NULL, /* wCountdownEvent* WorkComplete */
+	0,      /* DWORD Minimum */
+	500,    /* DWORD Maximum */
+	FALSE,  /* BOOL Initialized */
+	0,      /* LONG Terminate */
+	0,      /* DWORD NumProcessors */
+	0,      /* DWORD TlsIndex */
+	{ 0 },  /* CRITICAL_SECTION Lock */
+	0,      /* LONG NumSlots */
+	0,      /* LONG NumWorkers */
+	0,      /* LONG NextSlot */
+	{ NULL }, /* TP_WORKER* Workers[] */
+	0,      /* LONG NumIdle */
+	{ NULL }, /* TP_WORKER* IdleWorkers[] */
+	{ 0 },  /* CRITICAL_SECTION DispatchLock */
+	NULL,   /* HANDLE DispatchThread */
+	-1,     /* int EpollFd */
+	-1,     /* int TimerFd */
+	-1,     /* int WakeFd */
+	NULL,   /* PTP_TIMER* Timers */
+	0,      /* UINT32 NumTimers */
+	0,      /* UINT32 MaxTimers */
+	NULL,   /* PTP_IO ClosedIo */
 };
 
-static void* thread_pool_work_func(void* arg)
+/**
+ * Work deque, the owner takes the newest item, thieves the oldest one.
+ */
+
+static BOOL threadpool_worker_push(TP_WORKER* worker, PTP_WORK work)
+{
+	UINT32 index;
+	UINT32 capacity;
+	PTP_WORK* items;
+
+	EnterCriticalSection(&worker->Lock);
+
+	if ((UINT32) worker->Count == worker->Capacity)
+	{
+		capacity = worker->Capacity ? worker->Capacity * 2 : 64;
+		items = (PTP_WORK*) calloc(capacity, sizeof(PTP_WORK));
+
+		if (!items)
+		{
+			LeaveCriticalSection(&worker->Lock);
+			return FALSE;
+		}
+
+		for (index = 0; index < (UINT32) worker->Count; index++)
+			items[index] = worker->Items[(worker->Head + index) & (worker->Capacity - 1)];
+
+		free(worker->Items);
+		worker->Items = items;
+		worker->Capacity = capacity;
+		worker->Head = 0;
+	}
+
+	index = (worker->Head + worker->Count) & (worker->Capacity - 1);
+	worker->Items[index] = work;
+	worker->Count++;
+
+	LeaveCriticalSection(&worker->Lock);
+
+	return TRUE;
+}
+
+static PTP_WORK threadpool_worker_take(TP_WORKER* worker, BOOL newest)
+{
+	PTP_WORK work = NULL;
+
+	/* unlocked peek, the deque is rechecked under the lock */
+	if (worker->Count < 1)
+		return NULL;
+
+	EnterCriticalSection(&worker->Lock);
+
+	if (worker->Count > 0)
+	{
+		worker->Count--;
+
+		if (newest)
+		{
+			work = worker->Items[(worker->Head + worker->Count) & (worker->Capacity - 1)];
+		}
+		else
+		{
+			work = worker->Items[worker->Head];
+			worker->Head = (worker->Head + 1) & (worker->Capacity - 1);
+		}
+	}
+
+	LeaveCriticalSection(&worker->Lock);
+
+	return work;
+}
+
+static PTP_WORK threadpool_take_work(PTP_POOL pool, TP_WORKER* worker)
+{
+	LONG index;
+	LONG numSlots;
+	PTP_WORK work;
+	TP_WORKER* victim;
+
+	if ((work = threadpool_worker_take(worker, TRUE)))
+		return work;
+
+	numSlots = InterlockedCompareExchange(&pool->NumSlots, 0, 0);
+
+	for (index = 1; index <= numSlots; index++)
+	{
+		victim = pool->Workers[(worker->Index + index) % numSlots];
+
+		if (victim == worker)
+			continue;
+
+		if ((work = threadpool_worker_take(victim, FALSE)))
+			return work;
+	}
+
+	return NULL;
+}
+
+static void threadpool_run_work(TP_WORKER* worker, PTP_WORK work)
+{
+	worker->Instance.Work = work;
+	work->WorkCallback(&worker->Instance, work->CallbackParameter, work);
+	worker->Instance.Work = NULL;
+
+	CountdownEvent_Signal(work->Pending, 1);
+	threadpool_work_release(work);
+}
+
+static void threadpool_remove_idle(PTP_POOL pool, TP_WORKER* worker)
+{
+	LONG index;
+
+	for (index = 0; index < pool->NumIdle; index++)
+	{
+		if (pool->IdleWorkers[index] == worker)
+		{
+			pool->IdleWorkers[index] = pool->IdleWorkers[pool->NumIdle - 1];
+			InterlockedDecrement(&pool->NumIdle);
+			break;
+		}
+	}
+
+	worker->Idle = FALSE;
+}
+
+/**
+ * Park an idle worker until work is submitted.
+ * Returns FALSE if the worker has to exit, either because the pool
+ * is closed or because it has been idle for too long.
+ */
+
+static BOOL threadpool_worker_wait(PTP_POOL pool, TP_WORKER* worker)
 {
 	DWORD status;
+	LONG minimum;
+	LONG index;
+	LONG numSlots;
+
+	EnterCriticalSection(&pool->Lock);
+
+	if (pool->Terminate)
+	{
+		LeaveCriticalSection(&pool->Lock);
+		return FALSE;
+	}
+
+	ResetEvent(worker->WakeEvent);
+	worker->Idle = TRUE;
+	pool->IdleWorkers[pool->NumIdle] = worker;
+	InterlockedIncrement(&pool->NumIdle);
+	LeaveCriticalSection(&pool->Lock);
+
+	/**
+	 * Submitters push before they look for idle workers,
+	 * so recheck the deques now that this worker is visible.
+	 */
+
+	numSlots = InterlockedCompareExchange(&pool->NumSlots, 0, 0);
+
+	for (index = 0; index < numSlots; index++)
+	{
+		if (pool->Workers[index]->Count > 0)
+			break;
+	}
+
+	if (index < numSlots)
+		status = WAIT_OBJECT_0;
+	else
+		status = WaitForSingleObject(worker->WakeEvent, TP_POOL_IDLE_TIMEOUT);
+
+	EnterCriticalSection(&pool->Lock);
+
+	if (worker->Idle)
+	{
+		threadpool_remove_idle(pool, worker);
+
+		minimum = (pool->Minimum > 1) ? (LONG) pool->Minimum : 1;
+
+		if ((status == WAIT_TIMEOUT) && (pool->NumWorkers > minimum) && (worker->Count < 1))
+		{
+			pool->NumWorkers--;
+			worker->Retired = TRUE;
+			LeaveCriticalSection(&pool->Lock);
+			return FALSE;
+		}
+	}
+
+	LeaveCriticalSection(&pool->Lock);
+
+	return pool->Terminate ? FALSE : TRUE;
+}
+
+static DWORD WINAPI thread_pool_work_func(LPVOID arg)
+{
 	PTP_POOL pool;
 	PTP_WORK work;
-	HANDLE events[2];
-	PTP_CALLBACK_INSTANCE callbackInstance;
+	TP_WORKER* worker;
 
-	pool = (PTP_POOL) arg;
+	worker = (TP_WORKER*) arg;
+	pool = worker->Pool;
 
-	events[0] = pool->TerminateEvent;
-	events[1] = Queue_Event(pool->PendingQueue);
+	TlsSetValue(pool->TlsIndex, worker);
 
-	while (1)
+	while (!pool->Terminate)
 	{
-		status = WaitForMultipleObjects(2, events, FALSE, INFINITE);
+		work = threadpool_take_work(pool, worker);
+
+		if (work)
+		{
+			threadpool_run_work(worker, work);
+			continue;
+		}
 
-		if (status == WAIT_OBJECT_0)
+		if (!threadpool_worker_wait(pool, worker))
 			break;
+	}
+
+	ExitThread(0);
+	return 0;
+}
+
+static TP_WORKER* threadpool_worker_new(PTP_POOL pool, LONG index)
+{
+	TP_WORKER* worker;
+
+	if (!(worker = (TP_WORKER*) calloc(1, sizeof(TP_WORKER))))
+		return NULL;
+
+	worker->Pool = pool;
+	worker->Index = index;
+
+	if (!InitializeCriticalSectionAndSpinCount(&worker->Lock, 4000))
+		goto fail_lock;
+
+	if (!(worker->WakeEvent = CreateEvent(NULL, TRUE, FALSE, NULL)))
+		goto fail_wake_event;
 
-		if (status != (WAIT_OBJECT_0 + 1))
+	return worker;
+
+fail_wake_event:
+	DeleteCriticalSection(&worker->Lock);
+fail_lock:
+	free(worker);
+	return NULL;
+}
+
+static void threadpool_worker_free(TP_WORKER* worker)
+{
+	PTP_WORK work;
+
+	/* callbacks never started are cancelled */
+	while ((work = threadpool_worker_take(worker, FALSE)))
+	{
+		CountdownEvent_Signal(work->Pending, 1);
+		threadpool_work_release(work);
+	}
+
+	CloseHandle(worker->WakeEvent);
+	DeleteCriticalSection(&worker->Lock);
+	free(worker->Items);
+	free(worker);
+}
+
+/**
+ * Start one more worker thread, reusing the slot of a retired worker if any.
+ * The caller must hold the pool lock.
+ */
+
+static BOOL threadpool_add_worker(PTP_POOL pool)
+{
+	LONG index;
+	TP_WORKER* worker = NULL;
+
+	for (index = 0; index < pool->NumSlots; index++)
+	{
+		if (pool->Workers[index]->Retired)
+		{
+			worker = pool->Workers[index];
+			WaitForSingleObject(worker->Thread, INFINITE);
+			CloseHandle(worker->Thread);
+			worker->Thread = NULL;
 			break;
+		}
+	}
 
-		callbackInstance = (PTP_CALLBACK_INSTANCE) Queue_Dequeue(pool->PendingQueue);
+	if (!worker)
+	{
+		if (pool->NumSlots >= TP_POOL_MAX_WORKERS)
+			return FALSE;
 
-		if (callbackInstance)
+		if (!(worker = threadpool_worker_new(pool, pool->NumSlots)))
+			return FALSE;
+	}
+
+	worker->Idle = FALSE;
+	worker->Retired = FALSE;
+
+	if (!(worker->Thread = CreateThread(NULL, 0, thread_pool_work_func, (void*) worker, 0, NULL)))
+	{
+		if (worker->Index < pool->NumSlots)
+			worker->Retired = TRUE;
+		else
+			threadpool_worker_free(worker);
+
+		return FALSE;
+	}
+
+	if (worker->Index == pool->NumSlots)
+	{
+		pool->Workers[worker->Index] = worker;
+		InterlockedIncrement(&pool->NumSlots);
+	}
+
+	pool->NumWorkers++;
+
+	return TRUE;
+}
+
+static LONG threadpool_thread_limit(PTP_POOL pool)
+{
+	DWORD limit;
+
+	/* grow on demand up to one thread per processor, beyond that on request only */
+	limit = (pool->Minimum > pool->NumProcessors) ? pool->Minimum : pool->NumProcessors;
+
+	if (limit > pool->Maximum)
+		limit = pool->Maximum;
+
+	if (limit > TP_POOL_MAX_WORKERS)
+		limit = TP_POOL_MAX_WORKERS;
+
+	return (LONG) limit;
+}
+
+static TP_WORKER* threadpool_next_worker(PTP_POOL pool)
+{
+	LONG index;
+	LONG numSlots;
+	DWORD start;
+	TP_WORKER* worker;
+
+	numSlots = InterlockedCompareExchange(&pool->NumSlots, 0, 0);
+
+	if (numSlots < 1)
+		return NULL;
+
+	start = (DWORD) InterlockedIncrement(&pool->NextSlot);
+
+	for (index = 0; index < numSlots; index++)
+	{
+		worker = pool->Workers[(start + index) % numSlots];
+
+		if (!worker->Retired)
+			return worker;
+	}
+
+	/* the deque of a retired worker is still drained by the others */
+	return pool->Workers[start % numSlots];
+}
+
+BOOL threadpool_submit_work(PTP_POOL pool, PTP_WORK work)
+{
+	TP_WORKER* worker;
+	TP_WORKER* idle = NULL;
+
+	/* work submitted from a callback stays on the local deque */
+	worker = (TP_WORKER*) TlsGetValue(pool->TlsIndex);
+
+	if (!worker || worker->Retired)
+		worker = threadpool_next_worker(pool);
+
+	if (!worker || !threadpool_worker_push(worker, work))
+		return FALSE;
+
+	if (InterlockedCompareExchange(&pool->NumIdle, 0, 0) > 0)
+	{
+		EnterCriticalSection(&pool->Lock);
+
+		if (pool->NumIdle > 0)
+		{
+			idle = pool->IdleWorkers[pool->NumIdle - 1];
+			threadpool_remove_idle(pool, idle);
+			SetEvent(idle->WakeEvent);
+		}
+
+		LeaveCriticalSection(&pool->Lock);
+	}
+	else if (pool->NumWorkers < threadpool_thread_limit(pool))
+	{
+		EnterCriticalSection(&pool->Lock);
+
+		if (!pool->Terminate && (pool->NumIdle < 1) &&
+				(pool->NumWorkers < threadpool_thread_limit(pool)))
+			threadpool_add_worker(pool);
+
+		LeaveCriticalSection(&pool->Lock);
+	}
+
+	return TRUE;
+}
+
+#ifdef WINPR_POOL_DISPATCH
+
+/**
+ * One thread per pool waits on an epoll set holding a timerfd armed for the
+ * earliest timer and the descriptors of started I/O objects. It only queues
+ * callbacks, they run on the pool workers.
+ */
+
+static DWORD WINAPI thread_pool_dispatch_func(LPVOID arg)
+{
+	int index;
+	int status;
+	UINT64 value;
+	PTP_POOL pool;
+	struct epoll_event events[32];
+
+	pool = (PTP_POOL) arg;
+
+	while (!pool->Terminate)
+	{
+		/* closed I/O objects may still be in the previous batch of events */
+		threadpool_io_release_closed(pool);
+
+		status = epoll_wait(pool->EpollFd, events, 32, -1);
+
+		if (status < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			WLog_ERR(TAG, "epoll_wait failure [%d] %s", errno, strerror(errno));
+			break;
+		}
+
+		for (index = 0; index < status; index++)
 		{
-			work = callbackInstance->Work;
-			work->WorkCallback(callbackInstance, work->CallbackParameter, work);
-			CountdownEvent_Signal(pool->WorkComplete, 1);
-			free(callbackInstance);
+			if (events[index].data.ptr == &pool->WakeFd)
+			{
+				if (read(pool->WakeFd, &value, sizeof(value)) < 0)
+					continue;
+			}
+			else if (events[index].data.ptr == &pool->TimerFd)
+			{
+				if (read(pool->TimerFd, &value, sizeof(value)) < 0)
+					continue;
+
+				threadpool_timer_dispatch(pool);
+			}
+			else
+			{
+				threadpool_io_dispatch((PTP_IO) events[index].data.ptr, events[index].events);
+			}
 		}
 	}
 
 	ExitThread(0);
-	return NULL;
+	return 0;
+}
+
+/**
+ * Start the dispatch thread, the caller must hold the dispatch lock.
+ */
+
+BOOL threadpool_dispatch_start(PTP_POOL pool)
+{
+	struct epoll_event event;
+
+	if (pool->DispatchThread)
+		return TRUE;
+
+	if ((pool->EpollFd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		goto fail_epoll;
+
+	if ((pool->TimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+		goto fail_timerfd;
+
+	if ((pool->WakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		goto fail_eventfd;
+
+	ZeroMemory(&event, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.ptr = &pool->TimerFd;
+
+	if (epoll_ctl(pool->EpollFd, EPOLL_CTL_ADD, pool->TimerFd, &event) < 0)
+		goto fail_epoll_ctl;
+
+	event.data.ptr = &pool->WakeFd;
+
+	if (epoll_ctl(pool->EpollFd, EPOLL_CTL_ADD, pool->WakeFd, &event) < 0)
+		goto fail_epoll_ctl;
+
+	if (!(pool->DispatchThread = CreateThread(NULL, 0, thread_pool_dispatch_func,
+			(void*) pool, 0, NULL)))
+		goto fail_epoll_ctl;
+
+	return TRUE;
+
+fail_epoll_ctl:
+	close(pool->WakeFd);
+	pool->WakeFd = -1;
+fail_eventfd:
+	close(pool->TimerFd);
+	pool->TimerFd = -1;
+fail_timerfd:
+	close(pool->EpollFd);
+	pool->EpollFd = -1;
+fail_epoll:
+	WLog_ERR(TAG, "failed to start the timer and I/O dispatch thread");
+	return FALSE;
+}
+
+static void threadpool_dispatch_stop(PTP_POOL pool)
+{
+	UINT64 value = 1;
+
+	if (pool->DispatchThread)
+	{
+		if (write(pool->WakeFd, &value, sizeof(value)) < 0)
+			WLog_ERR(TAG, "failed to wake the dispatch thread");
+
+		WaitForSingleObject(pool->DispatchThread, INFINITE);
+		CloseHandle(pool->DispatchThread);
+		pool->DispatchThread = NULL;
+
+		close(pool->WakeFd);
+		close(pool->TimerFd);
+		close(pool->EpollFd);
+	}
+
+	threadpool_io_release_closed(pool);
+
+	free(pool->Timers);
+	pool->Timers = NULL;
+	pool->NumTimers = pool->MaxTimers = 0;
+	pool->EpollFd = pool->TimerFd = pool->WakeFd = -1;
 }
 
-static void threads_close(void *thread)
+#else
+
+BOOL threadpool_dispatch_start(PTP_POOL pool)
 {
-	WaitForSingleObject(thread, INFINITE);
-	CloseHandle(thread);
+	WLog_ERR(TAG, "thread pool timers and I/O are not supported on this platform");
+	return FALSE;
 }
 
+static void threadpool_dispatch_stop(PTP_POOL pool)
+{
+	free(pool->Timers);
+	pool->Timers = NULL;
+	pool->NumTimers = pool->MaxTimers = 0;
+}
+
+#endif /* WINPR_POOL_DISPATCH */
+
 static BOOL InitializeThreadpool(PTP_POOL pool)
 {
-	int index;
-	HANDLE thread;
+	BOOL status;
+	SYSTEM_INFO sysinfo;
 
-	if (pool->Threads)
+	if (pool->Initialized)
 		return TRUE;
 
 	pool->Minimum = 0;
 	pool->Maximum = 500;
 
-	if (!(pool->PendingQueue = Queue_New(TRUE, -1, -1)))
-		goto fail_queue_new;
+	GetNativeSystemInfo(&sysinfo);
+	pool->NumProcessors = sysinfo.dwNumberOfProcessors ? sysinfo.dwNumberOfProcessors : 1;
 
-	if (!(pool->WorkComplete = CountdownEvent_New(0)))
-		goto fail_countdown_event;
+	if ((pool->TlsIndex = TlsAlloc()) == TLS_OUT_OF_INDEXES)
+		goto fail_tls_alloc;
 
-	if (!(pool->TerminateEvent = CreateEvent(NULL, TRUE, FALSE, NULL)))
-		goto fail_terminate_event;
+	if (!InitializeCriticalSectionAndSpinCount(&pool->Lock, 4000))
+		goto fail_lock;
 
-	if (!(pool->Threads = ArrayList_New(TRUE)))
-		goto fail_thread_array;
+	if (!InitializeCriticalSectionAndSpinCount(&pool->DispatchLock, 4000))
+		goto fail_dispatch_lock;
 
-	pool->Threads->object.fnObjectFree = threads_close;
+	pool->EpollFd = pool->TimerFd = pool->WakeFd = -1;
 
-	for (index = 0; index < 4; index++)
-	{
-		if (!(thread = CreateThread(NULL, 0,
-					(LPTHREAD_START_ROUTINE) thread_pool_work_func,
-					(void*) pool, 0, NULL)))
-		{
-			goto fail_create_threads;
-		}
+	EnterCriticalSection(&pool->Lock);
+	status = threadpool_add_worker(pool);
+	LeaveCriticalSection(&pool->Lock);
 
-		if (ArrayList_Add(pool->Threads, thread) < 0)
-			goto fail_create_threads;
-	}
+	if (!status)
+		goto fail_create_threads;
+
+	pool->Initialized = TRUE;
 
 	return TRUE;
 
 fail_create_threads:
-	SetEvent(pool->TerminateEvent);
-	ArrayList_Free(pool->Threads);
-	pool->Threads = NULL;
-fail_thread_array:
-	CloseHandle(pool->TerminateEvent);
-	pool->TerminateEvent = NULL;
-fail_terminate_event:
-	CountdownEvent_Free(pool->WorkComplete);
-	pool->WorkComplete = NULL;
-fail_countdown_event:
-	Queue_Free(pool->PendingQueue);
-	pool->WorkComplete = NULL;
-fail_queue_new:
+	DeleteCriticalSection(&pool->DispatchLock);
+fail_dispatch_lock:
+	DeleteCriticalSection(&pool->Lock);
+fail_lock:
+	TlsFree(pool->TlsIndex);
+fail_tls_alloc:
 
 	return FALSE;
 }
@@ -196,6 +723,7 @@ PTP_POOL winpr_CreateThreadpool(PVOID reserved)
 
 VOID winpr_CloseThreadpool(PTP_POOL ptpp)
 {
+	LONG index;
 #ifdef _WIN32
 	InitOnceExecuteOnce(&init_once_module, init_module, NULL, NULL);
 	if (pCloseThreadpool)
@@ -204,19 +732,35 @@ VOID winpr_CloseThreadpool(PTP_POOL ptpp)
 		return;
 	}
 #endif
-	SetEvent(ptpp->TerminateEvent);
+	InterlockedExchange(&ptpp->Terminate, TRUE);
+
+	threadpool_dispatch_stop(ptpp);
+
+	EnterCriticalSection(&ptpp->Lock);
+
+	for (index = 0; index < ptpp->NumSlots; index++)
+		SetEvent(ptpp->Workers[index]->WakeEvent);
 
-	ArrayList_Free(ptpp->Threads);
-	Queue_Free(ptpp->PendingQueue);
-	CountdownEvent_Free(ptpp->WorkComplete);
-	CloseHandle(ptpp->TerminateEvent);
+	LeaveCriticalSection(&ptpp->Lock);
+
+	for (index = 0; index < ptpp->NumSlots; index++)
+	{
+		WaitForSingleObject(ptpp->Workers[index]->Thread, INFINITE);
+		CloseHandle(ptpp->Workers[index]->Thread);
+	}
+
+	for (index = 0; index < ptpp->NumSlots; index++)
+		threadpool_worker_free(ptpp->Workers[index]);
+
+	DeleteCriticalSection(&ptpp->DispatchLock);
+	DeleteCriticalSection(&ptpp->Lock);
+	TlsFree(ptpp->TlsIndex);
 
 	if (ptpp == &DEFAULT_POOL)
 	{
-		ptpp->Threads = NULL;
-		ptpp->PendingQueue = NULL;
-		ptpp->WorkComplete = NULL;
-		ptpp->TerminateEvent = NULL;
+		ZeroMemory(ptpp, sizeof(TP_POOL));
+		ptpp->Maximum = 500;
+		ptpp->EpollFd = ptpp->TimerFd = ptpp->WakeFd = -1;
 	}
 	else
 	{
@@ -226,28 +770,31 @@ VOID winpr_CloseThreadpool(PTP_POOL ptpp)
 
 BOOL winpr_SetThreadpoolThreadMinimum(PTP_POOL ptpp, DWORD cthrdMic)
 {
-	HANDLE thread;
+	BOOL status = TRUE;
 #ifdef _WIN32
 	InitOnceExecuteOnce(&init_once_module, init_module, NULL, NULL);
 	if (pSetThreadpoolThreadMinimum)
 		return pSetThreadpoolThreadMinimum(ptpp, cthrdMic);
 #endif
+	EnterCriticalSection(&ptpp->Lock);
+
 	ptpp->Minimum = cthrdMic;
 
-	while (ArrayList_Count(ptpp->Threads) < ptpp->Minimum)
+	if (ptpp->Maximum < ptpp->Minimum)
+		ptpp->Maximum = ptpp->Minimum;
+
+	while ((DWORD) ptpp->NumWorkers < ptpp->Minimum)
 	{
-		if (!(thread = CreateThread(NULL, 0,
-				(LPTHREAD_START_ROUTINE) thread_pool_work_func,
-				(void*) ptpp, 0, NULL)))
+		if (!threadpool_add_worker(ptpp))
 		{
-			return FALSE;
+			status = FALSE;
+			break;
 		}
-
-		if (ArrayList_Add(ptpp->Threads, thread) < 0)
-			return FALSE;
 	}
 
-	return TRUE;
+	LeaveCriticalSection(&ptpp->Lock);
+
+	return status;
 }
 
 VOID winpr_SetThreadpoolThreadMaximum(PTP_POOL ptpp, DWORD cthrdMost)
@@ -260,7 +807,15 @@ VOID winpr_SetThreadpoolThreadMaximum(PTP_POOL ptpp, DWORD cthrdMost)
 		return;
 	}
 #endif
+	EnterCriticalSection(&ptpp->Lock);
+
+	/* surplus threads retire once they have been idle for a while */
 	ptpp->Maximum = cthrdMost;
+
+	if (ptpp->Minimum > ptpp->Maximum)
+		ptpp->Minimum = ptpp->Maximum;
+
+	LeaveCriticalSection(&ptpp->Lock);
 }
 
 #endif /* WINPR_THREAD_POOL defined */
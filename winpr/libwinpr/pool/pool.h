@@ -25,19 +25,71 @@
 #include <winpr/thread.h>
 #include <winpr/collections.h>
 
+#if defined(__linux__) && defined(HAVE_TIMERFD_H) && defined(HAVE_EVENTFD_H)
+#define WINPR_POOL_DISPATCH		1
+#endif
+
+#define TP_POOL_MAX_WORKERS		256
+#define TP_POOL_IDLE_TIMEOUT		10000 /* ms */
+
 struct _TP_CALLBACK_INSTANCE
 {
 	PTP_WORK Work;
 };
 
+/**
+ * Each worker owns a deque of submitted work: the owner pops the most
+ * recent item, idle workers steal the oldest one from the other deques.
+ * The callback instance is owned by the worker and reused for every callback.
+ */
+
+struct _TP_WORKER
+{
+	PTP_POOL Pool;
+	LONG Index;
+	HANDLE Thread;
+	HANDLE WakeEvent;
+	LONG Retired;
+	LONG Idle;
+
+	CRITICAL_SECTION Lock;
+	PTP_WORK* Items;
+	UINT32 Capacity;
+	UINT32 Head;
+	LONG Count;
+
+	TP_CALLBACK_INSTANCE Instance;
+};
+typedef struct _TP_WORKER TP_WORKER;
+
 struct _TP_POOL
 {
 	DWORD Minimum;
 	DWORD Maximum;
-	wArrayList* Threads;
-	wQueue* PendingQueue;
-	HANDLE TerminateEvent;
-	wCountdownEvent* WorkComplete;
+	BOOL Initialized;
+	LONG Terminate;
+	DWORD NumProcessors;
+	DWORD TlsIndex;
+
+	CRITICAL_SECTION Lock;
+	LONG NumSlots;
+	LONG NumWorkers;
+	LONG NextSlot;
+	TP_WORKER* Workers[TP_POOL_MAX_WORKERS];
+
+	LONG NumIdle;
+	TP_WORKER* IdleWorkers[TP_POOL_MAX_WORKERS];
+
+	/* Timer and I/O dispatch, started on first use */
+	CRITICAL_SECTION DispatchLock;
+	HANDLE DispatchThread;
+	int EpollFd;
+	int TimerFd;
+	int WakeFd;
+	PTP_TIMER* Timers;
+	UINT32 NumTimers;
+	UINT32 MaxTimers;
+	PTP_IO ClosedIo;
 };
 
 struct _TP_WORK
@@ -45,11 +97,26 @@ struct _TP_WORK
 	PVOID CallbackParameter;
 	PTP_WORK_CALLBACK WorkCallback;
 	PTP_CALLBACK_ENVIRON CallbackEnvironment;
+	LONG RefCount;
+	wCountdownEvent* Pending;
+	PVOID Owner;
+	void (*FreeOwner)(PVOID owner);
 };
 
+/**
+ * Timers and I/O objects run their callbacks through an internal work
+ * object, they are freed along with it once all callbacks returned.
+ */
+
 struct _TP_TIMER
 {
-	void* dummy;
+	PTP_POOL Pool;
+	PTP_WORK Work;
+	PVOID CallbackParameter;
+	PTP_TIMER_CALLBACK TimerCallback;
+	UINT64 DueTime; /* CLOCK_MONOTONIC ns, 0 if not set */
+	UINT64 Period; /* ns */
+	INT32 HeapIndex;
 };
 
 struct _TP_WAIT
@@ -59,7 +126,17 @@ struct _TP_WAIT
 
 struct _TP_IO
 {
-	void* dummy;
+	PTP_POOL Pool;
+	PTP_WORK Work;
+	PVOID CallbackParameter;
+	PTP_WIN32_IO_CALLBACK IoCallback;
+	HANDLE Handle;
+	int fd;
+	UINT32 Events;
+	BOOL Registered;
+	LONG Started;
+	ULONG IoResult;
+	PTP_IO Next;
 };
 
 struct _TP_CLEANUP_GROUP
@@ -68,6 +145,13 @@ struct _TP_CLEANUP_GROUP
 };
 
 PTP_POOL GetDefaultThreadpool();
+BOOL threadpool_submit_work(PTP_POOL pool, PTP_WORK work);
+void threadpool_work_release(PTP_WORK work);
+
+BOOL threadpool_dispatch_start(PTP_POOL pool);
+void threadpool_timer_dispatch(PTP_POOL pool);
+void threadpool_io_dispatch(PTP_IO io, UINT32 events);
+void threadpool_io_release_closed(PTP_POOL pool);
 
 #endif /* WINPR_POOL_PRIVATE_H */
 
@@ -1,9 +1,86 @@
 
 #include <winpr/crt.h>
 #include <winpr/pool.h>
+#include <winpr/pipe.h>
+#include <winpr/file.h>
+#include <winpr/synch.h>
+
+static HANDLE readPipe = NULL;
+static HANDLE completeEvent = NULL;
+static char received[64];
+
+static VOID CALLBACK test_IoCallback(PTP_CALLBACK_INSTANCE instance, PVOID context,
+		PVOID overlapped, ULONG ioResult, ULONG_PTR numberOfBytesTransferred, PTP_IO io)
+{
+	DWORD numberOfBytesRead = 0;
+
+	if (ioResult != NO_ERROR)
+		return;
+
+	if (ReadFile(readPipe, received, sizeof(received) - 1, &numberOfBytesRead, NULL))
+		received[numberOfBytesRead] = '\0';
+
+	SetEvent(completeEvent);
+}
 
 int TestPoolIO(int argc, char* argv[])
 {
+	PTP_IO io;
+	HANDLE writePipe;
+	DWORD numberOfBytesWritten;
+	const char message[] = "thread pool I/O";
+
+	if (!CreatePipe(&readPipe, &writePipe, NULL, 0))
+	{
+		printf("CreatePipe failure\n");
+		return -1;
+	}
+
+	if (!(completeEvent = CreateEvent(NULL, TRUE, FALSE, NULL)))
+		return -1;
+
+	if (!(io = CreateThreadpoolIo(readPipe, test_IoCallback, NULL, NULL)))
+	{
+		printf("CreateThreadpoolIo failure\n");
+		return -1;
+	}
+
+	/* a cancelled start must not produce a callback */
+	StartThreadpoolIo(io);
+	CancelThreadpoolIo(io);
+
+	if (!WriteFile(writePipe, message, sizeof(message) - 1, &numberOfBytesWritten, NULL))
+	{
+		printf("WriteFile failure\n");
+		return -1;
+	}
+
+	if (WaitForSingleObject(completeEvent, 100) != WAIT_TIMEOUT)
+	{
+		printf("callback of a cancelled I/O\n");
+		return -1;
+	}
+
+	StartThreadpoolIo(io);
+
+	if (WaitForSingleObject(completeEvent, 5000) != WAIT_OBJECT_0)
+	{
+		printf("I/O callback did not run\n");
+		return -1;
+	}
+
+	WaitForThreadpoolIoCallbacks(io, FALSE);
+
+	if (strcmp(received, message) != 0)
+	{
+		printf("unexpected data: %s\n", received);
+		return -1;
+	}
+
+	CloseThreadpoolIo(io);
+	CloseHandle(completeEvent);
+	CloseHandle(readPipe);
+	CloseHandle(writePipe);
+
 	return 0;
 }
-
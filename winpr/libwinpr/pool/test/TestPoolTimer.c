@@ -1,9 +1,120 @@
 
 #include <winpr/crt.h>
 #include <winpr/pool.h>
+#include <winpr/synch.h>
+#include <winpr/sysinfo.h>
+#include <winpr/interlocked.h>
+
+static LONG periodicCount = 0;
+static HANDLE oneShotEvent = NULL;
+
+static VOID CALLBACK test_PeriodicTimerCallback(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_TIMER timer)
+{
+	InterlockedIncrement(&periodicCount);
+}
+
+static VOID CALLBACK test_OneShotTimerCallback(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_TIMER timer)
+{
+	SetEvent(oneShotEvent);
+}
+
+static void test_SetRelativeDueTime(FILETIME* dueTime, LONGLONG milliseconds)
+{
+	ULARGE_INTEGER due;
+
+	/* negative values are relative, in 100ns units */
+	due.QuadPart = (ULONGLONG) (milliseconds * -10000LL);
+	dueTime->dwLowDateTime = due.LowPart;
+	dueTime->dwHighDateTime = due.HighPart;
+}
 
 int TestPoolTimer(int argc, char* argv[])
 {
+	LONG count;
+	DWORD start;
+	DWORD elapsed;
+	FILETIME dueTime;
+	PTP_TIMER periodic;
+	PTP_TIMER oneShot;
+
+	if (!(oneShotEvent = CreateEvent(NULL, TRUE, FALSE, NULL)))
+		return -1;
+
+	periodic = CreateThreadpoolTimer(test_PeriodicTimerCallback, NULL, NULL);
+	oneShot = CreateThreadpoolTimer(test_OneShotTimerCallback, NULL, NULL);
+
+	if (!periodic || !oneShot)
+	{
+		printf("CreateThreadpoolTimer failure\n");
+		return -1;
+	}
+
+	if (IsThreadpoolTimerSet(oneShot))
+	{
+		printf("IsThreadpoolTimerSet: unexpected timer set\n");
+		return -1;
+	}
+
+	start = GetTickCount();
+
+	test_SetRelativeDueTime(&dueTime, 50);
+	SetThreadpoolTimer(oneShot, &dueTime, 0, 0);
+
+	test_SetRelativeDueTime(&dueTime, 10);
+	SetThreadpoolTimer(periodic, &dueTime, 10, 0);
+
+	if (!IsThreadpoolTimerSet(oneShot))
+	{
+		printf("IsThreadpoolTimerSet: timer not set\n");
+		return -1;
+	}
+
+	if (WaitForSingleObject(oneShotEvent, 5000) != WAIT_OBJECT_0)
+	{
+		printf("one shot timer did not fire\n");
+		return -1;
+	}
+
+	elapsed = GetTickCount() - start;
+
+	if (elapsed < 40)
+	{
+		printf("one shot timer fired too early: %u ms\n", (unsigned) elapsed);
+		return -1;
+	}
+
+	WaitForThreadpoolTimerCallbacks(oneShot, FALSE);
+
+	if (IsThreadpoolTimerSet(oneShot))
+	{
+		printf("IsThreadpoolTimerSet: one shot timer still set\n");
+		return -1;
+	}
+
+	Sleep(100);
+
+	/* cancel the periodic timer, no callback is queued afterwards */
+	SetThreadpoolTimer(periodic, NULL, 0, 0);
+	WaitForThreadpoolTimerCallbacks(periodic, FALSE);
+	count = InterlockedCompareExchange(&periodicCount, 0, 0);
+
+	if (count < 2)
+	{
+		printf("periodic timer fired %d times\n", (int) count);
+		return -1;
+	}
+
+	Sleep(50);
+
+	if (InterlockedCompareExchange(&periodicCount, 0, 0) != count)
+	{
+		printf("periodic timer fired after being cancelled\n");
+		return -1;
+	}
+
+	CloseThreadpoolTimer(periodic);
+	CloseThreadpoolTimer(oneShot);
+	CloseHandle(oneShotEvent);
+
 	return 0;
 }
-
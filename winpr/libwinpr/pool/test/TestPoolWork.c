@@ -54,6 +54,13 @@ int TestPoolWork(int argc, char* argv[])
 		SubmitThreadpoolWork(work);
 
 	WaitForThreadpoolWorkCallbacks(work, FALSE);
+
+	if (count != 10)
+	{
+		printf("WaitForThreadpoolWorkCallbacks returned early: %d callbacks\n", (int) count);
+		return -1;
+	}
+
 	CloseThreadpoolWork(work);
 
 	printf("Private Thread Pool\n");
@@ -98,6 +105,12 @@ int TestPoolWork(int argc, char* argv[])
 
 	WaitForThreadpoolWorkCallbacks(work, FALSE);
 
+	if (count != 20)
+	{
+		printf("WaitForThreadpoolWorkCallbacks returned early: %d callbacks\n", (int) count);
+		return -1;
+	}
+
 	CloseThreadpoolCleanupGroupMembers(cleanupGroup, TRUE, NULL);
 
 	CloseThreadpoolCleanupGroup(cleanupGroup);
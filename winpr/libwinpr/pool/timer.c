@@ -23,11 +23,317 @@
 
 #include <winpr/crt.h>
 #include <winpr/pool.h>
+#include <winpr/sysinfo.h>
+
+#include "pool.h"
+#include "../log.h"
+#define TAG WINPR_TAG("pool")
 
 #ifdef WINPR_THREAD_POOL
 
+#ifdef WINPR_POOL_DISPATCH
+
+#include <time.h>
+#include <sys/timerfd.h>
+
+/**
+ * Timers are kept in a binary min-heap ordered by due time,
+ * the pool timerfd is armed for the root of the heap.
+ */
+
+static UINT64 threadpool_timer_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((UINT64) ts.tv_sec * 1000000000ULL) + (UINT64) ts.tv_nsec;
+}
+
+static void threadpool_timer_swap(PTP_POOL pool, UINT32 a, UINT32 b)
+{
+	PTP_TIMER timer = pool->Timers[a];
+
+	pool->Timers[a] = pool->Timers[b];
+	pool->Timers[b] = timer;
+	pool->Timers[a]->HeapIndex = (INT32) a;
+	pool->Timers[b]->HeapIndex = (INT32) b;
+}
+
+static void threadpool_timer_sift_up(PTP_POOL pool, UINT32 index)
+{
+	UINT32 parent;
+
+	while (index > 0)
+	{
+		parent = (index - 1) / 2;
+
+		if (pool->Timers[parent]->DueTime <= pool->Timers[index]->DueTime)
+			break;
+
+		threadpool_timer_swap(pool, parent, index);
+		index = parent;
+	}
+}
+
+static void threadpool_timer_sift_down(PTP_POOL pool, UINT32 index)
+{
+	UINT32 child;
+
+	while ((child = (index * 2) + 1) < pool->NumTimers)
+	{
+		if ((child + 1 < pool->NumTimers) &&
+				(pool->Timers[child + 1]->DueTime < pool->Timers[child]->DueTime))
+			child++;
+
+		if (pool->Timers[index]->DueTime <= pool->Timers[child]->DueTime)
+			break;
+
+		threadpool_timer_swap(pool, index, child);
+		index = child;
+	}
+}
+
+static BOOL threadpool_timer_insert(PTP_POOL pool, PTP_TIMER timer)
+{
+	UINT32 size;
+	PTP_TIMER* timers;
+
+	if (pool->NumTimers == pool->MaxTimers)
+	{
+		size = pool->MaxTimers ? pool->MaxTimers * 2 : 16;
+		timers = (PTP_TIMER*) realloc(pool->Timers, size * sizeof(PTP_TIMER));
+
+		if (!timers)
+			return FALSE;
+
+		pool->Timers = timers;
+		pool->MaxTimers = size;
+	}
+
+	timer->HeapIndex = (INT32) pool->NumTimers;
+	pool->Timers[pool->NumTimers++] = timer;
+	threadpool_timer_sift_up(pool, (UINT32) timer->HeapIndex);
+
+	return TRUE;
+}
+
+static void threadpool_timer_remove(PTP_POOL pool, PTP_TIMER timer)
+{
+	UINT32 index;
+
+	if (timer->HeapIndex < 0)
+		return;
+
+	index = (UINT32) timer->HeapIndex;
+	timer->HeapIndex = -1;
+	pool->NumTimers--;
+
+	if (index == pool->NumTimers)
+		return;
+
+	pool->Timers[index] = pool->Timers[pool->NumTimers];
+	pool->Timers[index]->HeapIndex = (INT32) index;
+	threadpool_timer_sift_down(pool, index);
+	threadpool_timer_sift_up(pool, index);
+}
+
+/**
+ * Arm the timerfd for the earliest timer, the caller holds the dispatch lock.
+ */
+
+static void threadpool_timer_arm(PTP_POOL pool)
+{
+	struct itimerspec its;
+
+	ZeroMemory(&its, sizeof(its));
+
+	if (pool->NumTimers > 0)
+	{
+		its.it_value.tv_sec = pool->Timers[0]->DueTime / 1000000000ULL;
+		its.it_value.tv_nsec = pool->Timers[0]->DueTime % 1000000000ULL;
+	}
+
+	if (timerfd_settime(pool->TimerFd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		WLog_ERR(TAG, "timerfd_settime failure");
+}
+
+void threadpool_timer_dispatch(PTP_POOL pool)
+{
+	UINT64 now;
+	PTP_TIMER timer;
+
+	EnterCriticalSection(&pool->DispatchLock);
+
+	now = threadpool_timer_now();
+
+	while ((pool->NumTimers > 0) && (pool->Timers[0]->DueTime <= now))
+	{
+		timer = pool->Timers[0];
+		threadpool_timer_remove(pool, timer);
+
+		/* submitted under the lock, CloseThreadpoolTimer can't race with it */
+		SubmitThreadpoolWork(timer->Work);
+
+		if (timer->Period)
+		{
+			/* keep the original phase, skip periods missed entirely */
+			timer->DueTime += timer->Period;
+
+			if (timer->DueTime <= now)
+				timer->DueTime += ((now - timer->DueTime) / timer->Period + 1) * timer->Period;
+
+			if (!threadpool_timer_insert(pool, timer))
+				timer->DueTime = 0;
+		}
+		else
+		{
+			timer->DueTime = 0;
+		}
+	}
+
+	threadpool_timer_arm(pool);
+
+	LeaveCriticalSection(&pool->DispatchLock);
+}
+
+static VOID CALLBACK threadpool_timer_work(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_WORK work)
+{
+	PTP_TIMER timer = (PTP_TIMER) context;
+
+	timer->TimerCallback(instance, timer->CallbackParameter, timer);
+}
+
+static void threadpool_timer_free(PVOID owner)
+{
+	free(owner);
+}
+
+PTP_TIMER winpr_CreateThreadpoolTimer(PTP_TIMER_CALLBACK pfnti, PVOID pv, PTP_CALLBACK_ENVIRON pcbe)
+{
+	PTP_TIMER timer;
+
+	if (!(timer = (PTP_TIMER) calloc(1, sizeof(TP_TIMER))))
+		return NULL;
+
+	if (!(timer->Work = winpr_CreateThreadpoolWork(threadpool_timer_work, timer, pcbe)))
+	{
+		free(timer);
+		return NULL;
+	}
+
+	timer->Pool = timer->Work->CallbackEnvironment->Pool;
+
+	if (!timer->Pool)
+		timer->Pool = GetDefaultThreadpool();
+
+	timer->TimerCallback = pfnti;
+	timer->CallbackParameter = pv;
+	timer->HeapIndex = -1;
+	timer->Work->Owner = timer;
+	timer->Work->FreeOwner = threadpool_timer_free;
+
+	EnterCriticalSection(&timer->Pool->DispatchLock);
+
+	if (!threadpool_dispatch_start(timer->Pool))
+	{
+		LeaveCriticalSection(&timer->Pool->DispatchLock);
+		winpr_CloseThreadpoolWork(timer->Work);
+		return NULL;
+	}
+
+	LeaveCriticalSection(&timer->Pool->DispatchLock);
+
+	return timer;
+}
+
+VOID winpr_CloseThreadpoolTimer(PTP_TIMER pti)
+{
+	PTP_POOL pool = pti->Pool;
+
+	EnterCriticalSection(&pool->DispatchLock);
+	threadpool_timer_remove(pool, pti);
+	pti->DueTime = 0;
+	LeaveCriticalSection(&pool->DispatchLock);
+
+	/* the timer is freed along with its work once pending callbacks returned */
+	winpr_CloseThreadpoolWork(pti->Work);
+}
+
+BOOL winpr_IsThreadpoolTimerSet(PTP_TIMER pti)
+{
+	BOOL status;
+
+	EnterCriticalSection(&pti->Pool->DispatchLock);
+	status = (pti->DueTime != 0) ? TRUE : FALSE;
+	LeaveCriticalSection(&pti->Pool->DispatchLock);
+
+	return status;
+}
+
+/**
+ * A negative due time is relative to now, a positive one an absolute
+ * FILETIME, both in 100ns units. msWindowLength is a coalescing hint
+ * allowing late delivery and is not used, timers fire when due.
+ */
+
+VOID winpr_SetThreadpoolTimer(PTP_TIMER pti, PFILETIME pftDueTime, DWORD msPeriod, DWORD msWindowLength)
+{
+	INT64 due;
+	UINT64 delay = 0;
+	FILETIME now;
+	PTP_POOL pool = pti->Pool;
+
+	if (pftDueTime)
+	{
+		due = (INT64) (((UINT64) pftDueTime->dwHighDateTime << 32) | pftDueTime->dwLowDateTime);
+
+		if (due < 0)
+		{
+			delay = (UINT64) (-due) * 100;
+		}
+		else if (due > 0)
+		{
+			GetSystemTimeAsFileTime(&now);
+			due -= (INT64) (((UINT64) now.dwHighDateTime << 32) | now.dwLowDateTime);
+
+			if (due > 0)
+				delay = (UINT64) due * 100;
+		}
+	}
+
+	EnterCriticalSection(&pool->DispatchLock);
+
+	threadpool_timer_remove(pool, pti);
+	pti->DueTime = 0;
+	pti->Period = (UINT64) msPeriod * 1000000ULL;
+
+	if (pftDueTime)
+	{
+		pti->DueTime = threadpool_timer_now() + delay;
+
+		if (!threadpool_timer_insert(pool, pti))
+		{
+			WLog_ERR(TAG, "failed to queue thread pool timer");
+			pti->DueTime = 0;
+		}
+	}
+
+	threadpool_timer_arm(pool);
+
+	LeaveCriticalSection(&pool->DispatchLock);
+}
+
+VOID winpr_WaitForThreadpoolTimerCallbacks(PTP_TIMER pti, BOOL fCancelPendingCallbacks)
+{
+	winpr_WaitForThreadpoolWorkCallbacks(pti->Work, fCancelPendingCallbacks);
+}
+
+#else
+
 PTP_TIMER winpr_CreateThreadpoolTimer(PTP_TIMER_CALLBACK pfnti, PVOID pv, PTP_CALLBACK_ENVIRON pcbe)
 {
+	WLog_ERR(TAG, "CreateThreadpoolTimer is not implemented");
 	return NULL;
 }
 
@@ -51,4 +357,6 @@ VOID winpr_WaitForThreadpoolTimerCallbacks(PTP_TIMER pti, BOOL fCancelPendingCal
 
 }
 
-#endif
\ No newline at end of file
+#endif /* WINPR_POOL_DISPATCH */
+
+#endif /* WINPR_THREAD_POOL defined */
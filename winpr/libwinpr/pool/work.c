@@ -24,6 +24,7 @@
 #include <winpr/crt.h>
 #include <winpr/pool.h>
 #include <winpr/library.h>
+#include <winpr/interlocked.h>
 
 #include "pool.h"
 #include "../log.h"
@@ -74,7 +75,7 @@ PTP_WORK winpr_CreateThreadpoolWork(PTP_WORK_CALLBACK pfnwk, PVOID pv, PTP_CALLB
 	if (pCreateThreadpoolWork)
 		return pCreateThreadpoolWork(pfnwk, pv, pcbe);
 #endif
-	work = (PTP_WORK) malloc(sizeof(TP_WORK));
+	work = (PTP_WORK) calloc(1, sizeof(TP_WORK));
 
 	if (work)
 	{
@@ -86,11 +87,35 @@ PTP_WORK winpr_CreateThreadpoolWork(PTP_WORK_CALLBACK pfnwk, PVOID pv, PTP_CALLB
 		work->CallbackEnvironment = pcbe;
 		work->WorkCallback = pfnwk;
 		work->CallbackParameter = pv;
+		work->RefCount = 1;
+
+		if (!(work->Pending = CountdownEvent_New(0)))
+		{
+			free(work);
+			return NULL;
+		}
 	}
 
 	return work;
 }
 
+/**
+ * Every submitted callback holds a reference on the work object,
+ * so it can be closed while callbacks are still pending.
+ */
+
+void threadpool_work_release(PTP_WORK work)
+{
+	if (InterlockedDecrement(&work->RefCount) > 0)
+		return;
+
+	if (work->FreeOwner)
+		work->FreeOwner(work->Owner);
+
+	CountdownEvent_Free(work->Pending);
+	free(work);
+}
+
 VOID winpr_CloseThreadpoolWork(PTP_WORK pwk)
 {
 #ifdef _WIN32
@@ -101,13 +126,12 @@ VOID winpr_CloseThreadpoolWork(PTP_WORK pwk)
 		return;
 	}
 #endif
-	free(pwk);
+	threadpool_work_release(pwk);
 }
 
 VOID winpr_SubmitThreadpoolWork(PTP_WORK pwk)
 {
 	PTP_POOL pool;
-	PTP_CALLBACK_INSTANCE callbackInstance;
 #ifdef _WIN32
 	InitOnceExecuteOnce(&init_once_module, init_module, NULL, NULL);
 	if (pSubmitThreadpoolWork)
@@ -117,13 +141,18 @@ VOID winpr_SubmitThreadpoolWork(PTP_WORK pwk)
 	}
 #endif
 	pool = pwk->CallbackEnvironment->Pool;
-	callbackInstance = (PTP_CALLBACK_INSTANCE) malloc(sizeof(TP_CALLBACK_INSTANCE));
 
-	if (callbackInstance)
+	if (!pool)
+		pool = GetDefaultThreadpool();
+
+	InterlockedIncrement(&pwk->RefCount);
+	CountdownEvent_AddCount(pwk->Pending, 1);
+
+	if (!pool || !threadpool_submit_work(pool, pwk))
 	{
-		callbackInstance->Work = pwk;
-		CountdownEvent_AddCount(pool->WorkComplete, 1);
-		Queue_Enqueue(pool->PendingQueue, callbackInstance);
+		WLog_ERR(TAG, "failed to submit work");
+		CountdownEvent_Signal(pwk->Pending, 1);
+		threadpool_work_release(pwk);
 	}
 }
 
@@ -141,7 +170,6 @@ BOOL winpr_TrySubmitThreadpoolCallback(PTP_SIMPLE_CALLBACK pfns, PVOID pv, PTP_C
 VOID winpr_WaitForThreadpoolWorkCallbacks(PTP_WORK pwk, BOOL fCancelPendingCallbacks)
 {
 	HANDLE event;
-	PTP_POOL pool;
 #ifdef _WIN32
 	InitOnceExecuteOnce(&init_once_module, init_module, NULL, NULL);
 	if (pWaitForThreadpoolWorkCallbacks)
@@ -150,8 +178,7 @@ VOID winpr_WaitForThreadpoolWorkCallbacks(PTP_WORK pwk, BOOL fCancelPendingCallb
 		return;
 	}
 #endif
-	pool = pwk->CallbackEnvironment->Pool;
-	event = CountdownEvent_WaitHandle(pool->WorkComplete);
+	event = CountdownEvent_WaitHandle(pwk->Pending);
 
 	if (WaitForSingleObject(event, INFINITE) != WAIT_OBJECT_0)
 		WLog_ERR(TAG, "error waiting on work completion");
@@ -0,0 +1,252 @@
+
+#include <winpr/crt.h>
+#include <winpr/synch.h>
+
+#define TEST_WAIT_SET_EVENTS	100
+
+static BOOL test_wait_set_reported(WINPR_WAIT_SET* waitSet, HANDLE hHandle, DWORD* count)
+{
+	DWORD index;
+	DWORD signaled;
+	HANDLE handles[8];
+
+	*count = 0;
+
+	if (WaitForWaitSet(waitSet, 0, handles, 8, &signaled) != WAIT_OBJECT_0)
+		return FALSE;
+
+	*count = signaled;
+
+	for (index = 0; index < signaled; index++)
+	{
+		if (handles[index] == hHandle)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static BOOL test_wait_set_handles(void)
+{
+	DWORD count;
+	BOOL result = FALSE;
+	HANDLE list[2];
+	HANDLE first = NULL;
+	HANDLE second = NULL;
+	HANDLE shared = NULL;
+	WINPR_WAIT_SET* waitSet;
+
+	if (!(waitSet = CreateWaitSet()))
+		return FALSE;
+
+	if (!(first = CreateEvent(NULL, TRUE, FALSE, NULL)) ||
+			!(second = CreateEvent(NULL, TRUE, FALSE, NULL)))
+		goto out;
+
+	list[0] = first;
+	list[1] = second;
+
+	if (!WaitSetSetHandles(waitSet, list, 2, 0) || (WaitSetGetCount(waitSet) != 2))
+	{
+		printf("WaitSetSetHandles failure\n");
+		goto out;
+	}
+
+	/* the owner closes a handle and creates another one, the set follows the list */
+	CloseHandle(second);
+
+	if (!(second = CreateEvent(NULL, TRUE, FALSE, NULL)))
+		goto out;
+
+	list[1] = second;
+	SetEvent(second);
+
+	if (!WaitSetSetHandles(waitSet, list, 2, 0) || !test_wait_set_reported(waitSet, second, &count) ||
+			(count != 1))
+	{
+		printf("WaitSetSetHandles: replaced handle not reported\n");
+		goto out;
+	}
+
+	ResetEvent(second);
+
+	if (!WaitSetSetHandles(waitSet, list, 1, 0) || (WaitSetGetCount(waitSet) != 1))
+	{
+		printf("WaitSetSetHandles: handle not removed\n");
+		goto out;
+	}
+
+#ifndef _WIN32
+	/* two handles on the same file descriptor are both waited on */
+	if (!(shared = CreateFileDescriptorEvent(NULL, TRUE, FALSE, GetEventFileDescriptor(first), WINPR_FD_READ)))
+		goto out;
+
+	if (!WaitSetAddHandle(waitSet, shared, 0))
+	{
+		printf("WaitSetAddHandle: handle sharing a descriptor refused\n");
+		goto out;
+	}
+
+	SetEvent(first);
+
+	if (!test_wait_set_reported(waitSet, shared, &count) || (count != 2))
+	{
+		printf("WaitForWaitSet: handles sharing a descriptor not both reported\n");
+		goto out;
+	}
+
+	WaitSetRemoveHandle(waitSet, first);
+
+	if (!test_wait_set_reported(waitSet, shared, &count) || (count != 1))
+	{
+		printf("WaitForWaitSet: shared descriptor unregistered with its first handle\n");
+		goto out;
+	}
+
+	WaitSetRemoveHandle(waitSet, shared);
+#endif
+
+	result = TRUE;
+
+out:
+	CloseWaitSet(waitSet);
+
+	if (shared)
+		CloseHandle(shared);
+
+	if (first)
+		CloseHandle(first);
+
+	if (second)
+		CloseHandle(second);
+
+	return result;
+}
+
+int TestSynchWaitSet(int argc, char* argv[])
+{
+	int index;
+	int result = -1;
+	DWORD status;
+	DWORD signaled;
+	HANDLE handles[8];
+	HANDLE edgeEvent = NULL;
+	HANDLE events[TEST_WAIT_SET_EVENTS];
+	WINPR_WAIT_SET* waitSet;
+
+	ZeroMemory(events, sizeof(events));
+
+	if (!(waitSet = CreateWaitSet()))
+	{
+		printf("CreateWaitSet failure\n");
+		return -1;
+	}
+
+	/* more handles than WaitForMultipleObjects accepts */
+	for (index = 0; index < TEST_WAIT_SET_EVENTS; index++)
+	{
+		if (!(events[index] = CreateEvent(NULL, TRUE, FALSE, NULL)))
+			goto out;
+
+		if (!WaitSetAddHandle(waitSet, events[index], 0))
+		{
+			printf("WaitSetAddHandle failure\n");
+			goto out;
+		}
+	}
+
+	if (WaitSetAddHandle(waitSet, events[0], 0))
+	{
+		printf("WaitSetAddHandle accepted a duplicate handle\n");
+		goto out;
+	}
+
+	if (WaitSetGetCount(waitSet) != TEST_WAIT_SET_EVENTS)
+	{
+		printf("WaitSetGetCount: unexpected count %u\n", (unsigned) WaitSetGetCount(waitSet));
+		goto out;
+	}
+
+	status = WaitForWaitSet(waitSet, 10, handles, 8, &signaled);
+
+	if (status != WAIT_TIMEOUT)
+	{
+		printf("WaitForWaitSet: expected WAIT_TIMEOUT, got 0x%08X\n", (unsigned) status);
+		goto out;
+	}
+
+	SetEvent(events[TEST_WAIT_SET_EVENTS - 1]);
+	status = WaitForWaitSet(waitSet, INFINITE, handles, 8, &signaled);
+
+	if ((status != WAIT_OBJECT_0) || (signaled != 1) ||
+			(handles[0] != events[TEST_WAIT_SET_EVENTS - 1]))
+	{
+		printf("WaitForWaitSet: the signaled handle was not reported\n");
+		goto out;
+	}
+
+	/* level triggered: a manual reset event stays signaled */
+	status = WaitForWaitSet(waitSet, 0, handles, 8, &signaled);
+
+	if ((status != WAIT_OBJECT_0) || (signaled != 1))
+	{
+		printf("WaitForWaitSet: level triggered handle not reported again\n");
+		goto out;
+	}
+
+	if (!WaitSetRemoveHandle(waitSet, events[TEST_WAIT_SET_EVENTS - 1]))
+	{
+		printf("WaitSetRemoveHandle failure\n");
+		goto out;
+	}
+
+	status = WaitForWaitSet(waitSet, 0, handles, 8, &signaled);
+
+	if (status != WAIT_TIMEOUT)
+	{
+		printf("WaitForWaitSet: removed handle still reported\n");
+		goto out;
+	}
+
+	if (!(edgeEvent = CreateEvent(NULL, TRUE, FALSE, NULL)))
+		goto out;
+
+	if (!WaitSetAddHandle(waitSet, edgeEvent, WAIT_SET_EDGE_TRIGGERED))
+	{
+		printf("WaitSetAddHandle (edge triggered) failure\n");
+		goto out;
+	}
+
+	SetEvent(edgeEvent);
+	status = WaitForWaitSet(waitSet, INFINITE, handles, 8, &signaled);
+
+	if ((status != WAIT_OBJECT_0) || (signaled != 1) || (handles[0] != edgeEvent))
+	{
+		printf("WaitForWaitSet: edge triggered handle not reported\n");
+		goto out;
+	}
+
+	WaitSetRemoveHandle(waitSet, edgeEvent);
+
+	if (!test_wait_set_handles())
+		goto out;
+
+	result = 0;
+
+out:
+	for (index = 0; index < TEST_WAIT_SET_EVENTS; index++)
+	{
+		if (events[index])
+		{
+			WaitSetRemoveHandle(waitSet, events[index]);
+			CloseHandle(events[index]);
+		}
+	}
+
+	if (edgeEvent)
+		CloseHandle(edgeEvent);
+
+	CloseWaitSet(waitSet);
+
+	return result;
+}
@@ -0,0 +1,722 @@
+/**
+ * WinPR: Windows Portable Runtime
+ * Synchronization Functions (Wait Sets)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+
+#include <winpr/crt.h>
+#include <winpr/synch.h>
+#include <winpr/sysinfo.h>
+
+#include "synch.h"
+
+#include "../log.h"
+#define TAG WINPR_TAG("sync.waitset")
+
+/**
+ * CreateWaitSet
+ * CloseWaitSet
+ * WaitSetAddHandle
+ * WaitSetRemoveHandle
+ * WaitSetGetCount
+ * WaitForWaitSet
+ *
+ * On Linux the set is an epoll instance, the file descriptors are
+ * registered once and a wait is a single epoll_wait() call.
+ * Elsewhere the poll() array is only rebuilt when the set changes,
+ * edge triggering is not available there and handles are level triggered.
+ */
+
+#if defined(__linux__)
+#define WINPR_WAIT_SET_EPOLL	1
+#include <sys/epoll.h>
+#elif !defined(_WIN32) && defined(HAVE_POLL_H)
+#define WINPR_WAIT_SET_POLL	1
+#include <poll.h>
+#endif
+
+#ifndef _WIN32
+#include <unistd.h>
+#include "../handle/handle.h"
+#endif
+
+#define WAIT_SET_MAX_EVENTS	64
+
+/**
+ * The file descriptor of a handle is stored when it is added, the handle
+ * itself is never looked at again once it may be closed. Several handles
+ * can share a descriptor, they then share its epoll registration.
+ */
+
+struct winpr_wait_set_entry
+{
+	HANDLE handle;
+#ifndef _WIN32
+	int fd;
+	ULONG mode;
+	DWORD flags;
+#endif
+};
+typedef struct winpr_wait_set_entry WINPR_WAIT_SET_ENTRY;
+
+struct winpr_wait_set
+{
+	CRITICAL_SECTION lock;
+	WINPR_WAIT_SET_ENTRY* entries;
+	DWORD count;
+	DWORD size;
+
+#if defined(WINPR_WAIT_SET_EPOLL)
+	int epfd;
+#elif defined(WINPR_WAIT_SET_POLL)
+	struct pollfd* pollfds;
+#endif
+};
+
+static int wait_set_find(WINPR_WAIT_SET* waitSet, HANDLE hHandle)
+{
+	DWORD index;
+
+	for (index = 0; index < waitSet->count; index++)
+	{
+		if (waitSet->entries[index].handle == hHandle)
+			return (int) index;
+	}
+
+	return -1;
+}
+
+static BOOL wait_set_equal(const WINPR_WAIT_SET_ENTRY* a, const WINPR_WAIT_SET_ENTRY* b)
+{
+#ifndef _WIN32
+	if ((a->fd != b->fd) || (a->mode != b->mode) || (a->flags != b->flags))
+		return FALSE;
+#endif
+
+	return (a->handle == b->handle) ? TRUE : FALSE;
+}
+
+static BOOL wait_set_reserve(WINPR_WAIT_SET* waitSet, DWORD count)
+{
+	DWORD size;
+	WINPR_WAIT_SET_ENTRY* entries;
+#if defined(WINPR_WAIT_SET_POLL)
+	struct pollfd* pollfds;
+#endif
+
+	if (count <= waitSet->size)
+		return TRUE;
+
+	size = waitSet->size ? waitSet->size : 16;
+
+	while (size < count)
+		size *= 2;
+
+	if (!(entries = (WINPR_WAIT_SET_ENTRY*) realloc(waitSet->entries, size * sizeof(WINPR_WAIT_SET_ENTRY))))
+		return FALSE;
+
+	waitSet->entries = entries;
+
+#if defined(WINPR_WAIT_SET_POLL)
+	if (!(pollfds = (struct pollfd*) realloc(waitSet->pollfds, size * sizeof(struct pollfd))))
+		return FALSE;
+
+	waitSet->pollfds = pollfds;
+#endif
+
+	waitSet->size = size;
+
+	return TRUE;
+}
+
+#if defined(WINPR_WAIT_SET_EPOLL)
+/**
+ * Registers fd for the union of the events its entries wait for, edge
+ * triggered only if all of them asked for it, or unregisters it once no
+ * entry uses it. A descriptor closed by its owner already left the epoll
+ * set, and a new one may have the same number, ENOENT and EEXIST only tell
+ * which of the two operations applies.
+ */
+
+static BOOL wait_set_update_fd(WINPR_WAIT_SET* waitSet, int fd)
+{
+	int op;
+	DWORD index;
+	BOOL used = FALSE;
+	BOOL edge = TRUE;
+	struct epoll_event event;
+
+	ZeroMemory(&event, sizeof(event));
+	event.data.fd = fd;
+
+	for (index = 0; index < waitSet->count; index++)
+	{
+		WINPR_WAIT_SET_ENTRY* entry = &waitSet->entries[index];
+
+		if (entry->fd != fd)
+			continue;
+
+		used = TRUE;
+
+		if (entry->mode & WINPR_FD_READ)
+			event.events |= EPOLLIN;
+
+		if (entry->mode & WINPR_FD_WRITE)
+			event.events |= EPOLLOUT;
+
+		if (!(entry->flags & WAIT_SET_EDGE_TRIGGERED))
+			edge = FALSE;
+	}
+
+	if (!used)
+	{
+		epoll_ctl(waitSet->epfd, EPOLL_CTL_DEL, fd, &event);
+		return TRUE;
+	}
+
+	if (edge)
+		event.events |= EPOLLET;
+
+	op = EPOLL_CTL_MOD;
+
+	if (epoll_ctl(waitSet->epfd, op, fd, &event) < 0)
+	{
+		if (errno != ENOENT)
+			goto fail;
+
+		op = EPOLL_CTL_ADD;
+
+		if (epoll_ctl(waitSet->epfd, op, fd, &event) < 0)
+			goto fail;
+	}
+
+	return TRUE;
+
+fail:
+	WLog_ERR(TAG, "epoll_ctl(%s) failure [%d] %s",
+			(op == EPOLL_CTL_ADD) ? "EPOLL_CTL_ADD" : "EPOLL_CTL_MOD", errno, strerror(errno));
+	return FALSE;
+}
+#endif
+
+WINPR_WAIT_SET* CreateWaitSet(void)
+{
+	WINPR_WAIT_SET* waitSet;
+
+	waitSet = (WINPR_WAIT_SET*) calloc(1, sizeof(WINPR_WAIT_SET));
+
+	if (!waitSet)
+		return NULL;
+
+	if (!InitializeCriticalSectionAndSpinCount(&waitSet->lock, 4000))
+		goto fail_lock;
+
+#if defined(WINPR_WAIT_SET_EPOLL)
+	if ((waitSet->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+	{
+		WLog_ERR(TAG, "epoll_create1 failure [%d] %s", errno, strerror(errno));
+		goto fail_epoll;
+	}
+#endif
+
+	return waitSet;
+
+#if defined(WINPR_WAIT_SET_EPOLL)
+fail_epoll:
+	DeleteCriticalSection(&waitSet->lock);
+#endif
+fail_lock:
+	free(waitSet);
+	return NULL;
+}
+
+void CloseWaitSet(WINPR_WAIT_SET* waitSet)
+{
+	if (!waitSet)
+		return;
+
+#if defined(WINPR_WAIT_SET_EPOLL)
+	close(waitSet->epfd);
+#elif defined(WINPR_WAIT_SET_POLL)
+	free(waitSet->pollfds);
+#endif
+
+	DeleteCriticalSection(&waitSet->lock);
+	free(waitSet->entries);
+	free(waitSet);
+}
+
+BOOL WaitSetAddHandle(WINPR_WAIT_SET* waitSet, HANDLE hHandle, DWORD dwFlags)
+{
+	BOOL status = FALSE;
+	WINPR_WAIT_SET_ENTRY* entry;
+#ifndef _WIN32
+	int fd;
+	ULONG Type;
+	WINPR_HANDLE* Object;
+#endif
+
+	if (!waitSet)
+		return FALSE;
+
+#ifndef _WIN32
+	if (!winpr_Handle_GetInfo(hHandle, &Type, &Object))
+	{
+		SetLastError(ERROR_INVALID_HANDLE);
+		return FALSE;
+	}
+
+	if ((fd = winpr_Handle_getFd(Object)) < 0)
+	{
+		WLog_ERR(TAG, "invalid file descriptor");
+		SetLastError(ERROR_INVALID_HANDLE);
+		return FALSE;
+	}
+#endif
+
+	EnterCriticalSection(&waitSet->lock);
+
+	if (wait_set_find(waitSet, hHandle) >= 0)
+	{
+		SetLastError(ERROR_ALREADY_EXISTS);
+		goto out;
+	}
+
+#if defined(_WIN32)
+	if (waitSet->count >= MAXIMUM_WAIT_OBJECTS)
+	{
+		SetLastError(ERROR_NOT_SUPPORTED);
+		goto out;
+	}
+#endif
+
+	if (!wait_set_reserve(waitSet, waitSet->count + 1))
+		goto out;
+
+	entry = &waitSet->entries[waitSet->count];
+	entry->handle = hHandle;
+#ifndef _WIN32
+	entry->fd = fd;
+	entry->mode = Object->Mode;
+	entry->flags = dwFlags;
+#endif
+
+#if defined(WINPR_WAIT_SET_POLL)
+	waitSet->pollfds[waitSet->count].fd = fd;
+	waitSet->pollfds[waitSet->count].events = 0;
+	waitSet->pollfds[waitSet->count].revents = 0;
+
+	if (Object->Mode & WINPR_FD_READ)
+		waitSet->pollfds[waitSet->count].events |= POLLIN;
+
+	if (Object->Mode & WINPR_FD_WRITE)
+		waitSet->pollfds[waitSet->count].events |= POLLOUT;
+#endif
+
+	waitSet->count++;
+
+#if defined(WINPR_WAIT_SET_EPOLL)
+	if (!wait_set_update_fd(waitSet, fd))
+	{
+		waitSet->count--;
+		SetLastError(ERROR_INVALID_HANDLE);
+		goto out;
+	}
+#endif
+
+	status = TRUE;
+
+out:
+	LeaveCriticalSection(&waitSet->lock);
+	return status;
+}
+
+BOOL WaitSetRemoveHandle(WINPR_WAIT_SET* waitSet, HANDLE hHandle)
+{
+	int index;
+#if defined(WINPR_WAIT_SET_EPOLL)
+	int fd;
+#endif
+
+	if (!waitSet)
+		return FALSE;
+
+	EnterCriticalSection(&waitSet->lock);
+
+	if ((index = wait_set_find(waitSet, hHandle)) < 0)
+	{
+		LeaveCriticalSection(&waitSet->lock);
+		SetLastError(ERROR_NOT_FOUND);
+		return FALSE;
+	}
+
+#if defined(WINPR_WAIT_SET_EPOLL)
+	fd = waitSet->entries[index].fd;
+#endif
+
+	/* keep the registration order, WaitForWaitSet reports in that order on poll */
+	waitSet->count--;
+	MoveMemory(&waitSet->entries[index], &waitSet->entries[index + 1],
+			(waitSet->count - index) * sizeof(WINPR_WAIT_SET_ENTRY));
+#if defined(WINPR_WAIT_SET_POLL)
+	MoveMemory(&waitSet->pollfds[index], &waitSet->pollfds[index + 1],
+			(waitSet->count - index) * sizeof(struct pollfd));
+#endif
+
+#if defined(WINPR_WAIT_SET_EPOLL)
+	wait_set_update_fd(waitSet, fd);
+#endif
+
+	LeaveCriticalSection(&waitSet->lock);
+
+	return TRUE;
+}
+
+/**
+ * Makes the set hold exactly the given handles, all of them open. Entries
+ * for other handles, or for a handle now backed by another descriptor
+ * (a new object at the address of a closed one), are dropped using their
+ * stored descriptor. Nothing changes when the list is the same as before.
+ */
+
+BOOL WaitSetSetHandles(WINPR_WAIT_SET* waitSet, const HANDLE* lpHandles, DWORD nCount, DWORD dwFlags)
+{
+	DWORD index;
+	BOOL status = FALSE;
+	WINPR_WAIT_SET_ENTRY* entries = NULL;
+#ifndef _WIN32
+	ULONG Type;
+	WINPR_HANDLE* Object;
+#endif
+#if defined(WINPR_WAIT_SET_EPOLL)
+	int* oldFds = NULL;
+	DWORD oldCount;
+#endif
+
+	if (!waitSet || (nCount && !lpHandles))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+
+	if (!(entries = (WINPR_WAIT_SET_ENTRY*) calloc(nCount ? nCount : 1, sizeof(WINPR_WAIT_SET_ENTRY))))
+		return FALSE;
+
+	for (index = 0; index < nCount; index++)
+	{
+		entries[index].handle = lpHandles[index];
+#ifndef _WIN32
+		if (!winpr_Handle_GetInfo(lpHandles[index], &Type, &Object) ||
+				((entries[index].fd = winpr_Handle_getFd(Object)) < 0))
+		{
+			SetLastError(ERROR_INVALID_HANDLE);
+			goto out;
+		}
+
+		entries[index].mode = Object->Mode;
+		entries[index].flags = dwFlags;
+#endif
+	}
+
+	EnterCriticalSection(&waitSet->lock);
+
+	if (nCount == waitSet->count)
+	{
+		for (index = 0; index < nCount; index++)
+		{
+			if (!wait_set_equal(&entries[index], &waitSet->entries[index]))
+				break;
+		}
+
+		if (index == nCount)
+		{
+			LeaveCriticalSection(&waitSet->lock);
+			status = TRUE;
+			goto out;
+		}
+	}
+
+#if defined(_WIN32)
+	if (nCount > MAXIMUM_WAIT_OBJECTS)
+	{
+		LeaveCriticalSection(&waitSet->lock);
+		SetLastError(ERROR_NOT_SUPPORTED);
+		goto out;
+	}
+#endif
+
+	if (!wait_set_reserve(waitSet, nCount))
+	{
+		LeaveCriticalSection(&waitSet->lock);
+		goto out;
+	}
+
+#if defined(WINPR_WAIT_SET_EPOLL)
+	/* the descriptors of the dropped entries are only used as numbers */
+	oldCount = waitSet->count;
+
+	if (!(oldFds = (int*) calloc(oldCount ? oldCount : 1, sizeof(int))))
+	{
+		LeaveCriticalSection(&waitSet->lock);
+		goto out;
+	}
+
+	for (index = 0; index < oldCount; index++)
+		oldFds[index] = waitSet->entries[index].fd;
+
+	CopyMemory(waitSet->entries, entries, nCount * sizeof(WINPR_WAIT_SET_ENTRY));
+	waitSet->count = nCount;
+	status = TRUE;
+
+	for (index = 0; index < oldCount; index++)
+		wait_set_update_fd(waitSet, oldFds[index]);
+
+	for (index = 0; index < nCount; index++)
+	{
+		if (!wait_set_update_fd(waitSet, entries[index].fd))
+			status = FALSE;
+	}
+
+	free(oldFds);
+#else
+	CopyMemory(waitSet->entries, entries, nCount * sizeof(WINPR_WAIT_SET_ENTRY));
+	waitSet->count = nCount;
+	status = TRUE;
+
+#if defined(WINPR_WAIT_SET_POLL)
+	for (index = 0; index < nCount; index++)
+	{
+		waitSet->pollfds[index].fd = entries[index].fd;
+		waitSet->pollfds[index].events = 0;
+		waitSet->pollfds[index].revents = 0;
+
+		if (entries[index].mode & WINPR_FD_READ)
+			waitSet->pollfds[index].events |= POLLIN;
+
+		if (entries[index].mode & WINPR_FD_WRITE)
+			waitSet->pollfds[index].events |= POLLOUT;
+	}
+#endif
+#endif
+
+	LeaveCriticalSection(&waitSet->lock);
+
+out:
+	free(entries);
+	return status;
+}
+
+DWORD WaitSetGetCount(WINPR_WAIT_SET* waitSet)
+{
+	DWORD count;
+
+	if (!waitSet)
+		return 0;
+
+	EnterCriticalSection(&waitSet->lock);
+	count = waitSet->count;
+	LeaveCriticalSection(&waitSet->lock);
+
+	return count;
+}
+
+#if defined(WINPR_WAIT_SET_EPOLL) || defined(WINPR_WAIT_SET_POLL)
+/**
+ * Time left until deadline for a wait that woke up without a signaled
+ * handle, FALSE once it has expired. An infinite wait keeps its timeout.
+ */
+
+static BOOL wait_set_remaining(DWORD dwMilliseconds, UINT64 deadline, int* timeout)
+{
+	UINT64 now;
+
+	if (dwMilliseconds == INFINITE)
+		return TRUE;
+
+	now = GetTickCount64();
+
+	if (now >= deadline)
+		return FALSE;
+
+	*timeout = (int) (deadline - now);
+	return TRUE;
+}
+#endif
+
+DWORD WaitForWaitSet(WINPR_WAIT_SET* waitSet, DWORD dwMilliseconds,
+		HANDLE* lpHandles, DWORD nCount, LPDWORD lpNumberOfSignaled)
+{
+	int index;
+	int status;
+	DWORD signaled = 0;
+#if defined(WINPR_WAIT_SET_EPOLL) || defined(WINPR_WAIT_SET_POLL)
+	int timeout;
+	UINT64 deadline = 0;
+#endif
+#if defined(WINPR_WAIT_SET_EPOLL)
+	struct epoll_event events[WAIT_SET_MAX_EVENTS];
+#elif defined(_WIN32)
+	DWORD count;
+	HANDLE handles[MAXIMUM_WAIT_OBJECTS];
+#endif
+
+	if (!waitSet || !lpHandles || !nCount)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return WAIT_FAILED;
+	}
+
+	if (lpNumberOfSignaled)
+		*lpNumberOfSignaled = 0;
+
+#if defined(WINPR_WAIT_SET_EPOLL) || defined(WINPR_WAIT_SET_POLL)
+	timeout = (dwMilliseconds == INFINITE) ? -1 : (int) dwMilliseconds;
+
+	if (dwMilliseconds != INFINITE)
+		deadline = GetTickCount64() + dwMilliseconds;
+#endif
+
+#if defined(WINPR_WAIT_SET_EPOLL)
+	if (nCount > WAIT_SET_MAX_EVENTS)
+		nCount = WAIT_SET_MAX_EVENTS;
+
+	/* events of descriptors no handle waits for anymore do not end the wait */
+	while (!signaled)
+	{
+		do
+		{
+			status = epoll_wait(waitSet->epfd, events, (int) nCount, timeout);
+		}
+		while ((status < 0) && (errno == EINTR));
+
+		if (status < 0)
+		{
+			WLog_ERR(TAG, "epoll_wait failure [%d] %s", errno, strerror(errno));
+			SetLastError(ERROR_INTERNAL_ERROR);
+			return WAIT_FAILED;
+		}
+
+		if (!status)
+			break;
+
+		EnterCriticalSection(&waitSet->lock);
+
+		for (index = 0; index < status; index++)
+		{
+			DWORD entryIndex;
+			uint32_t revents = events[index].events;
+
+			for (entryIndex = 0; (entryIndex < waitSet->count) && (signaled < nCount); entryIndex++)
+			{
+				WINPR_WAIT_SET_ENTRY* entry = &waitSet->entries[entryIndex];
+
+				if (entry->fd != events[index].data.fd)
+					continue;
+
+				/* a descriptor shared for reading and writing is only ready for some handles */
+				if (!(revents & (EPOLLERR | EPOLLHUP)) &&
+						!((revents & EPOLLIN) && (entry->mode & WINPR_FD_READ)) &&
+						!((revents & EPOLLOUT) && (entry->mode & WINPR_FD_WRITE)))
+					continue;
+
+				if (winpr_Handle_cleanup(entry->handle) != WAIT_OBJECT_0)
+				{
+					LeaveCriticalSection(&waitSet->lock);
+					return WAIT_FAILED;
+				}
+
+				lpHandles[signaled++] = entry->handle;
+			}
+		}
+
+		LeaveCriticalSection(&waitSet->lock);
+
+		if (!signaled && !wait_set_remaining(dwMilliseconds, deadline, &timeout))
+			break;
+	}
+#elif defined(WINPR_WAIT_SET_POLL)
+	/* a single thread waits on a poll based set at a time */
+	while (!signaled)
+	{
+		do
+		{
+			status = poll(waitSet->pollfds, waitSet->count, timeout);
+		}
+		while ((status < 0) && (errno == EINTR));
+
+		if (status < 0)
+		{
+			WLog_ERR(TAG, "poll failure [%d] %s", errno, strerror(errno));
+			SetLastError(ERROR_INTERNAL_ERROR);
+			return WAIT_FAILED;
+		}
+
+		if (!status)
+			break;
+
+		for (index = 0; (index < (int) waitSet->count) && (signaled < nCount); index++)
+		{
+			if (!(waitSet->pollfds[index].revents & waitSet->pollfds[index].events))
+				continue;
+
+			if (winpr_Handle_cleanup(waitSet->entries[index].handle) != WAIT_OBJECT_0)
+				return WAIT_FAILED;
+
+			lpHandles[signaled++] = waitSet->entries[index].handle;
+		}
+
+		if (!signaled && !wait_set_remaining(dwMilliseconds, deadline, &timeout))
+			break;
+	}
+#elif defined(_WIN32)
+	EnterCriticalSection(&waitSet->lock);
+	count = waitSet->count;
+
+	for (index = 0; index < (int) count; index++)
+		handles[index] = waitSet->entries[index].handle;
+	LeaveCriticalSection(&waitSet->lock);
+
+	if (!count)
+	{
+		Sleep((dwMilliseconds == INFINITE) ? 0 : dwMilliseconds);
+		return WAIT_TIMEOUT;
+	}
+
+	status = (int) WaitForMultipleObjects(count, handles, FALSE, dwMilliseconds);
+
+	if ((status < WAIT_OBJECT_0) || (status >= (int) (WAIT_OBJECT_0 + count)))
+		return (DWORD) status;
+
+	index = status - WAIT_OBJECT_0;
+	lpHandles[signaled++] = handles[index];
+#else
+	WLog_ERR(TAG, "wait sets are not supported on this platform");
+	SetLastError(ERROR_NOT_SUPPORTED);
+	return WAIT_FAILED;
+#endif
+
+	if (!signaled)
+		return WAIT_TIMEOUT;
+
+	if (lpNumberOfSignaled)
+		*lpNumberOfSignaled = signaled;
+
+	return WAIT_OBJECT_0;
+}
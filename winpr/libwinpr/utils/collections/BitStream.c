@@ -163,6 +163,7 @@ const char* BYTE_BIT_STRINGS_MSB[256] =
 
 void BitDump(const char* tag, UINT32 level, const BYTE* buffer, UINT32 length, UINT32 flags)
 {
+	wLog* log = WLog_Get(tag);
 	DWORD i;
 	int nbits;
 	const char* str;
@@ -180,12 +181,12 @@ void BitDump(const char* tag, UINT32 level, const BYTE* buffer, UINT32 length, U
 		if ((i % 64) == 0)
 		{
 			pos = 0;
-			WLog_LVL(tag, level, "%s", pbuffer);
+			WLog_Print(log, level, "%s", pbuffer);
 		}
 	}
 
 	if (i)
-		WLog_LVL(tag, level, "%s ", pbuffer);
+		WLog_Print(log, level, "%s ", pbuffer);
 }
 
 UINT32 ReverseBits32(UINT32 bits, UINT32 nbits)
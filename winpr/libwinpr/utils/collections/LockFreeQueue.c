@@ -0,0 +1,357 @@
+/**
+ * WinPR: Windows Portable Runtime
+ * Bounded Lock-Free Queue
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <winpr/crt.h>
+#include <winpr/synch.h>
+#include <winpr/interlocked.h>
+
+#include "LockFreeQueue.h"
+
+/**
+ * The multi producer / multi consumer ring follows Dmitry Vyukov's bounded
+ * MPMC queue: each cell carries a sequence number telling whether it is
+ * ready to be written (seq == pos) or read (seq == pos + 1) for the lap
+ * given by pos. Producers and consumers claim positions with a CAS on
+ * tail and head and publish the cell by storing the next sequence number.
+ *
+ * The single producer / single consumer ring only needs the indices,
+ * each of them being written by one side only.
+ *
+ * Positions are free running 32 bit counters, they are compared through
+ * their unsigned difference so that wrapping is harmless.
+ */
+
+#if defined(__GNUC__) || defined(__clang__)
+#define lfq_load_acquire(_p)		__atomic_load_n((_p), __ATOMIC_ACQUIRE)
+#define lfq_load_relaxed(_p)		__atomic_load_n((_p), __ATOMIC_RELAXED)
+#define lfq_store_release(_p, _v)	__atomic_store_n((_p), (_v), __ATOMIC_RELEASE)
+#else
+#define lfq_load_acquire(_p)		InterlockedCompareExchange((_p), 0, 0)
+#define lfq_load_relaxed(_p)		(*(_p))
+#define lfq_store_release(_p, _v)	InterlockedExchange((_p), (_v))
+#endif
+
+#define LFQ_DIFF(_a, _b)	((LONG) ((UINT32) (_a) - (UINT32) (_b)))
+#define LFQ_NEXT(_a, _n)	((LONG) ((UINT32) (_a) + (UINT32) (_n)))
+
+#define LFQ_CELL(_q, _pos)	(&(_q)->cells[((UINT32) (_pos) & (_q)->mask) * (_q)->cellSize])
+#define LFQ_SEQ(_cell)		((LONG volatile*) (_cell))
+#define LFQ_DATA(_q, _cell)	((_q)->flags & QUEUE_LOCK_FREE_MPMC ? (_cell) + sizeof(UINT64) : (_cell))
+
+/**
+ * The event follows the element count: it is set by the push which takes
+ * the count from 0 to 1, and reset by the pop which takes it back to 0.
+ * The count is raised before an element is published and lowered after it
+ * has been taken, so it never is lower than the number of elements in the
+ * ring and a zero count really means the ring is empty. A push racing with
+ * the reset may have seen a non-zero count, this is why the count is read
+ * again once the event has been reset.
+ */
+
+static void lfq_count_add(wLockFreeQueue* queue)
+{
+	if (InterlockedIncrement(&queue->count) == 1)
+		SetEvent(queue->event);
+}
+
+static void lfq_count_sub(wLockFreeQueue* queue, LONG count)
+{
+	if ((InterlockedExchangeAdd(&queue->count, -count) - count) > 0)
+		return;
+
+	ResetEvent(queue->event);
+
+	if (lfq_load_acquire(&queue->count) > 0)
+		SetEvent(queue->event);
+}
+
+static BOOL lfq_mpmc_push(wLockFreeQueue* queue, const void* element)
+{
+	BYTE* cell;
+	LONG seq;
+	LONG diff;
+	LONG pos = lfq_load_relaxed(&queue->tail);
+
+	for (;;)
+	{
+		cell = LFQ_CELL(queue, pos);
+		seq = lfq_load_acquire(LFQ_SEQ(cell));
+		diff = LFQ_DIFF(seq, pos);
+
+		if (diff == 0)
+		{
+			LONG prev = InterlockedCompareExchange(&queue->tail, LFQ_NEXT(pos, 1), pos);
+
+			if (prev == pos)
+				break;
+
+			pos = prev;
+		}
+		else if (diff < 0)
+		{
+			return FALSE; /* full */
+		}
+		else
+		{
+			pos = lfq_load_relaxed(&queue->tail);
+		}
+	}
+
+	CopyMemory(LFQ_DATA(queue, cell), element, queue->elementSize);
+	lfq_store_release(LFQ_SEQ(cell), LFQ_NEXT(pos, 1));
+
+	return TRUE;
+}
+
+static BOOL lfq_mpmc_pop(wLockFreeQueue* queue, void* element)
+{
+	BYTE* cell;
+	LONG seq;
+	LONG diff;
+	LONG pos = lfq_load_relaxed(&queue->head);
+
+	for (;;)
+	{
+		cell = LFQ_CELL(queue, pos);
+		seq = lfq_load_acquire(LFQ_SEQ(cell));
+		diff = LFQ_DIFF(seq, LFQ_NEXT(pos, 1));
+
+		if (diff == 0)
+		{
+			LONG prev = InterlockedCompareExchange(&queue->head, LFQ_NEXT(pos, 1), pos);
+
+			if (prev == pos)
+				break;
+
+			pos = prev;
+		}
+		else if (diff < 0)
+		{
+			return FALSE; /* empty */
+		}
+		else
+		{
+			pos = lfq_load_relaxed(&queue->head);
+		}
+	}
+
+	CopyMemory(element, LFQ_DATA(queue, cell), queue->elementSize);
+	lfq_store_release(LFQ_SEQ(cell), LFQ_NEXT(pos, queue->capacity));
+
+	return TRUE;
+}
+
+/**
+ * Copies the head cell out without claiming it. The copy is only returned
+ * if neither the cell nor the head moved while it was being made.
+ */
+
+static BOOL lfq_mpmc_peek(wLockFreeQueue* queue, void* element)
+{
+	BYTE* cell;
+	LONG pos;
+
+	for (;;)
+	{
+		pos = lfq_load_acquire(&queue->head);
+		cell = LFQ_CELL(queue, pos);
+
+		if (lfq_load_acquire(LFQ_SEQ(cell)) != LFQ_NEXT(pos, 1))
+		{
+			if (pos == lfq_load_acquire(&queue->head))
+				return FALSE; /* empty */
+
+			continue;
+		}
+
+		CopyMemory(element, LFQ_DATA(queue, cell), queue->elementSize);
+
+		if ((lfq_load_acquire(LFQ_SEQ(cell)) == LFQ_NEXT(pos, 1)) &&
+				(lfq_load_acquire(&queue->head) == pos))
+			return TRUE;
+	}
+}
+
+static BOOL lfq_spsc_push(wLockFreeQueue* queue, const void* element)
+{
+	LONG tail = lfq_load_relaxed(&queue->tail);
+	LONG head = lfq_load_acquire(&queue->head);
+
+	if ((UINT32) LFQ_DIFF(tail, head) >= queue->capacity)
+		return FALSE; /* full */
+
+	CopyMemory(LFQ_CELL(queue, tail), element, queue->elementSize);
+	lfq_store_release(&queue->tail, LFQ_NEXT(tail, 1));
+
+	return TRUE;
+}
+
+static int lfq_spsc_pop(wLockFreeQueue* queue, void* elements, int count, BOOL remove)
+{
+	int index;
+	BYTE* dst = (BYTE*) elements;
+	LONG head = lfq_load_relaxed(&queue->head);
+	LONG tail = lfq_load_acquire(&queue->tail);
+	LONG available = LFQ_DIFF(tail, head);
+
+	if (count > available)
+		count = available;
+
+	for (index = 0; index < count; index++)
+	{
+		CopyMemory(dst, LFQ_CELL(queue, LFQ_NEXT(head, index)), queue->elementSize);
+		dst += queue->elementSize;
+	}
+
+	if (remove && (count > 0))
+		lfq_store_release(&queue->head, LFQ_NEXT(head, count));
+
+	return count;
+}
+
+int LockFreeQueue_Count(wLockFreeQueue* queue)
+{
+	return lfq_load_acquire(&queue->count);
+}
+
+BOOL LockFreeQueue_Push(wLockFreeQueue* queue, const void* element)
+{
+	BOOL status;
+
+	lfq_count_add(queue);
+
+	if (queue->flags & QUEUE_LOCK_FREE_MPMC)
+		status = lfq_mpmc_push(queue, element);
+	else
+		status = lfq_spsc_push(queue, element);
+
+	if (!status)
+		lfq_count_sub(queue, 1);
+
+	return status;
+}
+
+BOOL LockFreeQueue_Pop(wLockFreeQueue* queue, void* element)
+{
+	return (LockFreeQueue_PopBatch(queue, element, 1) == 1) ? TRUE : FALSE;
+}
+
+/**
+ * Removes up to count elements, the count is adjusted and the event
+ * possibly reset once for the whole batch.
+ */
+
+int LockFreeQueue_PopBatch(wLockFreeQueue* queue, void* elements, int count)
+{
+	int popped = 0;
+
+	if (count < 1)
+		return 0;
+
+	if (queue->flags & QUEUE_LOCK_FREE_MPMC)
+	{
+		BYTE* dst = (BYTE*) elements;
+
+		while ((popped < count) && lfq_mpmc_pop(queue, dst))
+		{
+			dst += queue->elementSize;
+			popped++;
+		}
+	}
+	else
+	{
+		popped = lfq_spsc_pop(queue, elements, count, TRUE);
+	}
+
+	if (popped > 0)
+		lfq_count_sub(queue, popped);
+
+	return popped;
+}
+
+BOOL LockFreeQueue_Peek(wLockFreeQueue* queue, void* element)
+{
+	if (queue->flags & QUEUE_LOCK_FREE_MPMC)
+		return lfq_mpmc_peek(queue, element);
+
+	return (lfq_spsc_pop(queue, element, 1, FALSE) == 1) ? TRUE : FALSE;
+}
+
+wLockFreeQueue* LockFreeQueue_New(UINT32 capacity, size_t elementSize, DWORD flags, HANDLE event)
+{
+	UINT32 index;
+	wLockFreeQueue* queue;
+
+	if (!event || !elementSize || (capacity > 0x40000000))
+		return NULL;
+
+	queue = (wLockFreeQueue*) _aligned_malloc(sizeof(wLockFreeQueue), LOCK_FREE_QUEUE_CACHE_LINE);
+
+	if (!queue)
+		return NULL;
+
+	ZeroMemory(queue, sizeof(wLockFreeQueue));
+
+	queue->flags = (flags & QUEUE_LOCK_FREE_MPMC) ? QUEUE_LOCK_FREE_MPMC : QUEUE_LOCK_FREE_SPSC;
+	queue->event = event;
+	queue->elementSize = elementSize;
+
+	queue->capacity = 2;
+
+	while (queue->capacity < capacity)
+		queue->capacity <<= 1;
+
+	queue->mask = queue->capacity - 1;
+
+	/* elements stay pointer aligned, MPMC cells are prefixed by their sequence */
+	queue->cellSize = (elementSize + sizeof(UINT64) - 1) & ~(sizeof(UINT64) - 1);
+
+	if (queue->flags & QUEUE_LOCK_FREE_MPMC)
+		queue->cellSize += sizeof(UINT64);
+
+	queue->cells = (BYTE*) _aligned_malloc(queue->capacity * queue->cellSize,
+			LOCK_FREE_QUEUE_CACHE_LINE);
+
+	if (!queue->cells)
+	{
+		_aligned_free(queue);
+		return NULL;
+	}
+
+	ZeroMemory(queue->cells, queue->capacity * queue->cellSize);
+
+	if (queue->flags & QUEUE_LOCK_FREE_MPMC)
+	{
+		for (index = 0; index < queue->capacity; index++)
+			*LFQ_SEQ(LFQ_CELL(queue, index)) = (LONG) index;
+	}
+
+	return queue;
+}
+
+void LockFreeQueue_Free(wLockFreeQueue* queue)
+{
+	if (!queue)
+		return;
+
+	_aligned_free(queue->cells);
+	_aligned_free(queue);
+}
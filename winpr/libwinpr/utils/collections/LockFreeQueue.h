@@ -0,0 +1,67 @@
+/**
+ * WinPR: Windows Portable Runtime
+ * Bounded Lock-Free Queue
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef WINPR_COLLECTIONS_LOCK_FREE_QUEUE_H
+#define WINPR_COLLECTIONS_LOCK_FREE_QUEUE_H
+
+#include <winpr/winpr.h>
+#include <winpr/wtypes.h>
+#include <winpr/collections.h>
+
+#define LOCK_FREE_QUEUE_CACHE_LINE	64
+
+/**
+ * Fixed capacity ring of fixed size elements, shared by wQueue and
+ * wMessageQueue. QUEUE_LOCK_FREE_SPSC rings only synchronize one producer
+ * with one consumer, QUEUE_LOCK_FREE_MPMC rings tag every cell with a
+ * sequence number so any thread may push or pop.
+ *
+ * The event is set when the ring goes from empty to non-empty and reset
+ * when it becomes empty again, it is not touched on any other operation.
+ */
+
+struct _wLockFreeQueue
+{
+	DWORD flags;
+	UINT32 capacity;
+	UINT32 mask;
+	size_t elementSize;
+	size_t cellSize;
+	BYTE* cells;
+	HANDLE event;
+
+	BYTE pad0[LOCK_FREE_QUEUE_CACHE_LINE];
+	LONG volatile head;
+	BYTE pad1[LOCK_FREE_QUEUE_CACHE_LINE - sizeof(LONG)];
+	LONG volatile tail;
+	BYTE pad2[LOCK_FREE_QUEUE_CACHE_LINE - sizeof(LONG)];
+	LONG volatile count;
+	BYTE pad3[LOCK_FREE_QUEUE_CACHE_LINE - sizeof(LONG)];
+};
+typedef struct _wLockFreeQueue wLockFreeQueue;
+
+wLockFreeQueue* LockFreeQueue_New(UINT32 capacity, size_t elementSize, DWORD flags, HANDLE event);
+void LockFreeQueue_Free(wLockFreeQueue* queue);
+
+int LockFreeQueue_Count(wLockFreeQueue* queue);
+
+BOOL LockFreeQueue_Push(wLockFreeQueue* queue, const void* element);
+BOOL LockFreeQueue_Pop(wLockFreeQueue* queue, void* element);
+int LockFreeQueue_PopBatch(wLockFreeQueue* queue, void* elements, int count);
+BOOL LockFreeQueue_Peek(wLockFreeQueue* queue, void* element);
+
+#endif /* WINPR_COLLECTIONS_LOCK_FREE_QUEUE_H */
@@ -26,6 +26,8 @@
 
 #include <winpr/collections.h>
 
+#include "LockFreeQueue.h"
+
 /**
  * Message Queue inspired from Windows:
  * http://msdn.microsoft.com/en-us/library/ms632590/
@@ -50,6 +52,9 @@ HANDLE MessageQueue_Event(wMessageQueue* queue)
 
 int MessageQueue_Size(wMessageQueue* queue)
 {
+	if (queue->lockFree)
+		return LockFreeQueue_Count(queue->lockFree);
+
 	return queue->size;
 }
 
@@ -70,6 +75,17 @@ BOOL MessageQueue_Wait(wMessageQueue* queue)
 BOOL MessageQueue_Dispatch(wMessageQueue* queue, wMessage* message)
 {
 	BOOL ret = FALSE;
+
+	if (queue->lockFree)
+	{
+		wMessage item;
+
+		CopyMemory(&item, message, sizeof(wMessage));
+		item.time = (UINT64) GetTickCount();
+
+		return LockFreeQueue_Push(queue->lockFree, &item);
+	}
+
 	EnterCriticalSection(&queue->lock);
 
 	if (queue->size == queue->capacity)
@@ -96,13 +112,11 @@ BOOL MessageQueue_Dispatch(wMessageQueue* queue, wMessage* message)
 	}
 
 	CopyMemory(&(queue->array[queue->tail]), message, sizeof(wMessage));
+	queue->array[queue->tail].time = (UINT64) GetTickCount();
 	queue->tail = (queue->tail + 1) % queue->capacity;
 	queue->size++;
 
-	message = &(queue->array[queue->tail]);
-	message->time = (UINT64) GetTickCount();
-
-	if (queue->size > 0)
+	if (queue->size == 1)
 		SetEvent(queue->event);
 
 	ret = TRUE;
@@ -136,6 +150,14 @@ int MessageQueue_Get(wMessageQueue* queue, wMessage* message)
 	if (!MessageQueue_Wait(queue))
 		return status;
 
+	if (queue->lockFree)
+	{
+		if (LockFreeQueue_Pop(queue->lockFree, message))
+			status = (message->id != WMQ_QUIT) ? 1 : 0;
+
+		return status;
+	}
+
 	EnterCriticalSection(&queue->lock);
 
 	if (queue->size > 0)
@@ -160,6 +182,16 @@ int MessageQueue_Peek(wMessageQueue* queue, wMessage* message, BOOL remove)
 {
 	int status = 0;
 
+	if (queue->lockFree)
+	{
+		if (remove)
+			status = LockFreeQueue_Pop(queue->lockFree, message) ? 1 : 0;
+		else
+			status = LockFreeQueue_Peek(queue->lockFree, message) ? 1 : 0;
+
+		return status;
+	}
+
 	EnterCriticalSection(&queue->lock);
 
 	if (queue->size > 0)
@@ -183,6 +215,51 @@ int MessageQueue_Peek(wMessageQueue* queue, wMessage* message, BOOL remove)
 	return status;
 }
 
+/**
+ * Waits for the queue to be non-empty and removes up to count messages.
+ * Returns the number of messages retrieved, which may be 0 if another
+ * thread emptied the queue first, or -1 if waiting failed. WMQ_QUIT is
+ * returned like any other message and must be checked by the caller.
+ */
+
+int MessageQueue_GetBatch(wMessageQueue* queue, wMessage* messages, int count)
+{
+	int index;
+
+	if (!MessageQueue_Wait(queue))
+		return -1;
+
+	if (count < 1)
+		return 0;
+
+	if (queue->lockFree)
+		return LockFreeQueue_PopBatch(queue->lockFree, messages, count);
+
+	EnterCriticalSection(&queue->lock);
+
+	if (count > queue->size)
+		count = queue->size;
+
+	for (index = 0; index < count; index++)
+	{
+		CopyMemory(&messages[index], &(queue->array[queue->head]), sizeof(wMessage));
+		ZeroMemory(&(queue->array[queue->head]), sizeof(wMessage));
+		queue->head = (queue->head + 1) % queue->capacity;
+	}
+
+	if (count > 0)
+	{
+		queue->size -= count;
+
+		if (queue->size < 1)
+			ResetEvent(queue->event);
+	}
+
+	LeaveCriticalSection(&queue->lock);
+
+	return count;
+}
+
 /**
  * Construction, Destruction
  */
@@ -221,6 +298,46 @@ error_array:
 	return NULL;
 }
 
+wMessageQueue* MessageQueue_NewLockFree(const wObject *callback, int capacity, DWORD flags)
+{
+	wMessageQueue* queue = NULL;
+
+	if (!(flags & (QUEUE_LOCK_FREE_SPSC | QUEUE_LOCK_FREE_MPMC)))
+		return NULL;
+
+	queue = (wMessageQueue*) calloc(1, sizeof(wMessageQueue));
+	if (!queue)
+		return NULL;
+
+	queue->capacity = (capacity > 0) ? capacity : 32;
+
+	if (!InitializeCriticalSectionAndSpinCount(&queue->lock, 4000))
+		goto error_spinlock;
+
+	queue->event = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (!queue->event)
+		goto error_event;
+
+	queue->lockFree = LockFreeQueue_New(queue->capacity, sizeof(wMessage), flags, queue->event);
+	if (!queue->lockFree)
+		goto error_lock_free;
+
+	queue->capacity = (int) queue->lockFree->capacity;
+
+	if (callback)
+		queue->object = *callback;
+
+	return queue;
+
+error_lock_free:
+	CloseHandle(queue->event);
+error_event:
+	DeleteCriticalSection(&queue->lock);
+error_spinlock:
+	free(queue);
+	return NULL;
+}
+
 void MessageQueue_Free(wMessageQueue* queue)
 {
 	if (!queue)
@@ -228,6 +345,7 @@ void MessageQueue_Free(wMessageQueue* queue)
 
 	CloseHandle(queue->event);
 	DeleteCriticalSection(&queue->lock);
+	LockFreeQueue_Free(queue->lockFree);
 
 	free(queue->array);
 	free(queue);
@@ -237,6 +355,21 @@ int MessageQueue_Clear(wMessageQueue *queue)
 {
 	int status = 0;
 
+	if (queue->lockFree)
+	{
+		wMessage msg;
+
+		while (LockFreeQueue_Pop(queue->lockFree, &msg))
+		{
+			if (queue->object.fnObjectUninit)
+				queue->object.fnObjectUninit(&msg);
+			if (queue->object.fnObjectFree)
+				queue->object.fnObjectFree(&msg);
+		}
+
+		return status;
+	}
+
 	EnterCriticalSection(&queue->lock);
 
 	while(queue->size > 0)
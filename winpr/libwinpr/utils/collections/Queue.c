@@ -25,6 +25,8 @@
 
 #include <winpr/collections.h>
 
+#include "LockFreeQueue.h"
+
 /**
  * C equivalent of the C# Queue Class:
  * http://msdn.microsoft.com/en-us/library/system.collections.queue.aspx
@@ -41,6 +43,10 @@
 int Queue_Count(wQueue* queue)
 {
 	int ret;
+
+	if (queue->lockFree)
+		return LockFreeQueue_Count(queue->lockFree);
+
 	if (queue->synchronized)
 		EnterCriticalSection(&queue->lock);
 
@@ -90,6 +96,19 @@ void Queue_Clear(wQueue* queue)
 {
 	int index;
 
+	if (queue->lockFree)
+	{
+		void* obj;
+
+		while (LockFreeQueue_Pop(queue->lockFree, &obj))
+		{
+			if (queue->object.fnObjectFree)
+				queue->object.fnObjectFree(obj);
+		}
+
+		return;
+	}
+
 	if (queue->synchronized)
 		EnterCriticalSection(&queue->lock);
 
@@ -104,6 +123,8 @@ void Queue_Clear(wQueue* queue)
 	queue->size = 0;
 	queue->head = queue->tail = 0;
 
+	ResetEvent(queue->event);
+
 	if (queue->synchronized)
 		LeaveCriticalSection(&queue->lock);
 }
@@ -117,6 +138,10 @@ BOOL Queue_Contains(wQueue* queue, void* obj)
 	int index;
 	BOOL found = FALSE;
 
+	/* lock-free queues cannot be walked while producers are running */
+	if (queue->lockFree)
+		return FALSE;
+
 	if (queue->synchronized)
 		EnterCriticalSection(&queue->lock);
 
@@ -137,12 +162,16 @@ BOOL Queue_Contains(wQueue* queue, void* obj)
 
 /**
  * Adds an object to the end of the Queue.
+ * Lock-free queues are bounded, enqueueing fails when they are full.
  */
 
 BOOL Queue_Enqueue(wQueue* queue, void* obj)
 {
 	BOOL ret = TRUE;
 
+	if (queue->lockFree)
+		return LockFreeQueue_Push(queue->lockFree, &obj);
+
 	if (queue->synchronized)
 		EnterCriticalSection(&queue->lock);
 
@@ -177,7 +206,8 @@ BOOL Queue_Enqueue(wQueue* queue, void* obj)
 	queue->tail = (queue->tail + 1) % queue->capacity;
 	queue->size++;
 
-	SetEvent(queue->event);
+	if (queue->size == 1)
+		SetEvent(queue->event);
 
 out:
 	if (queue->synchronized)
@@ -193,6 +223,12 @@ void* Queue_Dequeue(wQueue* queue)
 {
 	void* obj = NULL;
 
+	if (queue->lockFree)
+	{
+		LockFreeQueue_Pop(queue->lockFree, &obj);
+		return obj;
+	}
+
 	if (queue->synchronized)
 		EnterCriticalSection(&queue->lock);
 
@@ -202,10 +238,10 @@ void* Queue_Dequeue(wQueue* queue)
 		queue->array[queue->head] = NULL;
 		queue->head = (queue->head + 1) % queue->capacity;
 		queue->size--;
-	}
 
-	if (queue->size < 1)
-		ResetEvent(queue->event);
+		if (queue->size < 1)
+			ResetEvent(queue->event);
+	}
 
 	if (queue->synchronized)
 		LeaveCriticalSection(&queue->lock);
@@ -213,6 +249,48 @@ void* Queue_Dequeue(wQueue* queue)
 	return obj;
 }
 
+/**
+ * Removes up to count objects from the beginning of the Queue,
+ * returns the number of objects stored in objs.
+ */
+
+int Queue_DequeueBatch(wQueue* queue, void** objs, int count)
+{
+	int index;
+
+	if (count < 1)
+		return 0;
+
+	if (queue->lockFree)
+		return LockFreeQueue_PopBatch(queue->lockFree, objs, count);
+
+	if (queue->synchronized)
+		EnterCriticalSection(&queue->lock);
+
+	if (count > queue->size)
+		count = queue->size;
+
+	for (index = 0; index < count; index++)
+	{
+		objs[index] = queue->array[queue->head];
+		queue->array[queue->head] = NULL;
+		queue->head = (queue->head + 1) % queue->capacity;
+	}
+
+	if (count > 0)
+	{
+		queue->size -= count;
+
+		if (queue->size < 1)
+			ResetEvent(queue->event);
+	}
+
+	if (queue->synchronized)
+		LeaveCriticalSection(&queue->lock);
+
+	return count;
+}
+
 /**
  * Returns the object at the beginning of the Queue without removing it.
  */
@@ -221,6 +299,12 @@ void* Queue_Peek(wQueue* queue)
 {
 	void* obj = NULL;
 
+	if (queue->lockFree)
+	{
+		LockFreeQueue_Peek(queue->lockFree, &obj);
+		return obj;
+	}
+
 	if (queue->synchronized)
 		EnterCriticalSection(&queue->lock);
 
@@ -284,6 +368,52 @@ out_free:
 	return NULL;
 }
 
+/**
+ * Creates a bounded queue which never takes a lock, capacity is rounded up
+ * to the next power of two. The event is only touched when the queue goes
+ * from empty to non-empty and back. Queue_Lock and Queue_Unlock do not
+ * protect lock-free queues.
+ */
+
+wQueue* Queue_NewLockFree(int capacity, DWORD flags)
+{
+	wQueue* queue = NULL;
+
+	if (!(flags & (QUEUE_LOCK_FREE_SPSC | QUEUE_LOCK_FREE_MPMC)))
+		return NULL;
+
+	queue = (wQueue *)calloc(1, sizeof(wQueue));
+	if (!queue)
+		return NULL;
+
+	queue->capacity = (capacity > 0) ? capacity : 32;
+	queue->growthFactor = 1;
+	queue->synchronized = FALSE;
+
+	queue->event = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (!queue->event)
+		goto out_free;
+
+	if (!InitializeCriticalSectionAndSpinCount(&queue->lock, 4000))
+		goto out_free_event;
+
+	queue->lockFree = LockFreeQueue_New(queue->capacity, sizeof(void*), flags, queue->event);
+	if (!queue->lockFree)
+		goto out_free_lock;
+
+	queue->capacity = (int) queue->lockFree->capacity;
+	queue->object.fnObjectEquals = default_queue_equals;
+	return queue;
+
+out_free_lock:
+	DeleteCriticalSection(&queue->lock);
+out_free_event:
+	CloseHandle(queue->event);
+out_free:
+	free(queue);
+	return NULL;
+}
+
 void Queue_Free(wQueue* queue)
 {
 	if (!queue)
@@ -293,6 +423,7 @@ void Queue_Free(wQueue* queue)
 
 	CloseHandle(queue->event);
 	DeleteCriticalSection(&queue->lock);
+	LockFreeQueue_Free(queue->lockFree);
 	free(queue->array);
 	free(queue);
 }
@@ -22,121 +22,258 @@
 #endif
 
 #include <winpr/crt.h>
+#include <winpr/thread.h>
+#include <winpr/interlocked.h>
 
 #include <winpr/collections.h>
 
+#include "StreamPool.h"
+
 /**
- * Methods
+ * Available streams are kept in power of two size classes, a request is
+ * served from the smallest class fitting it. Each class has a shared free
+ * list protected by the pool lock, small classes are also cached in a few
+ * per-thread caches: a thread always uses the same cache, selected from
+ * its thread id, which is only try-locked so that a collision falls back
+ * to the shared lists instead of waiting.
+ *
+ * Taken streams are indexed by the chunks of their buffer: a buffer of
+ * capacity up to 2^n overlaps at most two 2^n aligned chunks, which are
+ * hashed into buckets protected by striped spin locks.
  */
 
-void StreamPool_ShiftUsed(wStreamPool* pool, int index, int count)
+#define STREAM_POOL_MIN_SHIFT		8	/* 256 bytes */
+#define STREAM_POOL_NUM_CLASSES		20	/* up to 128 MiB */
+#define STREAM_POOL_MAX_SHIFT		(sizeof(size_t) * 8 - 1)
+
+#define STREAM_POOL_CACHE_BITS		3
+#define STREAM_POOL_NUM_CACHES		(1 << STREAM_POOL_CACHE_BITS)
+#define STREAM_POOL_CACHE_DEPTH		4
+#define STREAM_POOL_CACHE_CLASSES	10	/* streams up to 128 KiB */
+
+#define STREAM_POOL_BUCKET_BITS		10
+#define STREAM_POOL_NUM_BUCKETS		(1 << STREAM_POOL_BUCKET_BITS)
+#define STREAM_POOL_NUM_STRIPES		32
+
+#define STREAM_POOL_DEFAULT_MAX_RETAINED	(32 * 1024 * 1024)
+#define STREAM_POOL_LIMIT_MAX_RETAINED		(1024 * 1024 * 1024)
+
+struct _wStreamPoolClass
 {
-	if (count > 0)
-	{
-		if (pool->uSize + count > pool->uCapacity)
-		{
-			int new_cap;
-			wStream **new_arr;
+	int size;
+	int capacity;
+	wStream** streams;
+};
 
-			new_cap = pool->uCapacity * 2;
-			new_arr = (wStream**) realloc(pool->uArray, sizeof(wStream*) * new_cap);
-			if (!new_arr)
-				return;
-			pool->uCapacity = new_cap;
-			pool->uArray = new_arr;
-		}
+struct _wStreamPoolCache
+{
+	LONG volatile lock;
+	UINT64 hits;
+	int size[STREAM_POOL_CACHE_CLASSES];
+	wStream* streams[STREAM_POOL_CACHE_CLASSES][STREAM_POOL_CACHE_DEPTH];
+};
 
-		MoveMemory(&pool->uArray[index + count], &pool->uArray[index], (pool->uSize - index) * sizeof(wStream*));
-		pool->uSize += count;
-	}
-	else if (count < 0)
-	{
-		if (pool->uSize - index + count > 0)
-		{
-			MoveMemory(&pool->uArray[index], &pool->uArray[index - count],
-					(pool->uSize - index + count) * sizeof(wStream*));
-		}
+struct _wStreamPoolSpan
+{
+	ULONG_PTR chunk;
+	UINT32 shift;
+	wStream* s;
+	struct _wStreamPoolSpan* next;
+};
+typedef struct _wStreamPoolSpan wStreamPoolSpan;
 
-		pool->uSize += count;
-	}
+struct _wStreamPoolIndex
+{
+	LONG volatile locks[STREAM_POOL_NUM_STRIPES];
+	wStreamPoolSpan* free[STREAM_POOL_NUM_STRIPES];
+	wStreamPoolSpan* buckets[STREAM_POOL_NUM_BUCKETS];
+	LONG volatile shifts[sizeof(size_t) * 8]; /* taken streams per chunk shift */
+};
+
+static void stream_pool_spin_lock(LONG volatile* lock)
+{
+	while (InterlockedCompareExchange(lock, 1, 0) != 0)
+		SwitchToThread();
+}
+
+static BOOL stream_pool_try_lock(LONG volatile* lock)
+{
+	return (InterlockedCompareExchange(lock, 1, 0) == 0) ? TRUE : FALSE;
+}
+
+static void stream_pool_spin_unlock(LONG volatile* lock)
+{
+	InterlockedExchange(lock, 0);
 }
 
 /**
- * Adds a used stream to the pool.
+ * Smallest shift such that 1 << shift >= size
  */
 
-void StreamPool_AddUsed(wStreamPool* pool, wStream* s)
+static UINT32 stream_pool_shift(size_t size)
 {
-	if ((pool->uSize + 1) >= pool->uCapacity)
-	{
-		int new_cap;
-		wStream **new_arr;
+	UINT32 shift = STREAM_POOL_MIN_SHIFT;
 
-		new_cap = pool->uCapacity * 2;
-		new_arr = (wStream**) realloc(pool->uArray, sizeof(wStream*) * new_cap);
-		if (!new_arr)
-			return;
-		pool->uCapacity = new_cap;
-		pool->uArray = new_arr;
-	}
+	while ((shift < STREAM_POOL_MAX_SHIFT) && (((size_t) 1 << shift) < size))
+		shift++;
+
+	return shift;
+}
+
+/**
+ * Class serving a request of size bytes, -1 if too large to be pooled
+ */
+
+static int stream_pool_class_for_size(size_t size)
+{
+	int index = (int) (stream_pool_shift(size) - STREAM_POOL_MIN_SHIFT);
 
-	pool->uArray[(pool->uSize)++] = s;
+	return (index < STREAM_POOL_NUM_CLASSES) ? index : -1;
 }
 
 /**
- * Removes a used stream from the pool.
+ * Class a returned stream can serve, its capacity may have grown
+ * since it was taken. -1 if too small to be kept.
  */
 
-void StreamPool_RemoveUsed(wStreamPool* pool, wStream* s)
+static int stream_pool_class_for_capacity(size_t capacity)
 {
 	int index;
+	UINT32 shift = stream_pool_shift(capacity);
+
+	if (capacity < ((size_t) 1 << STREAM_POOL_MIN_SHIFT))
+		return -1;
+
+	if (((size_t) 1 << shift) > capacity)
+		shift--;
+
+	index = (int) (shift - STREAM_POOL_MIN_SHIFT);
+
+	return (index < STREAM_POOL_NUM_CLASSES) ? index : (STREAM_POOL_NUM_CLASSES - 1);
+}
+
+static struct _wStreamPoolCache* stream_pool_cache(wStreamPool* pool)
+{
+	UINT32 hash = ((UINT32) GetCurrentThreadId()) * 0x9E3779B1;
+
+	return &pool->caches[hash >> (32 - STREAM_POOL_CACHE_BITS)];
+}
+
+static UINT32 stream_pool_bucket(ULONG_PTR chunk, UINT32 shift)
+{
+	UINT64 hash = ((UINT64) chunk ^ ((UINT64) shift << 57)) * 0x9E3779B97F4A7C15ULL;
+
+	return (UINT32) (hash >> (64 - STREAM_POOL_BUCKET_BITS));
+}
+
+static BOOL stream_pool_index_add(struct _wStreamPoolIndex* index, wStream* s,
+		ULONG_PTR chunk, UINT32 shift)
+{
+	wStreamPoolSpan* span;
+	UINT32 bucket = stream_pool_bucket(chunk, shift);
+	LONG volatile* lock = &index->locks[bucket % STREAM_POOL_NUM_STRIPES];
+	wStreamPoolSpan** freeList = &index->free[bucket % STREAM_POOL_NUM_STRIPES];
+
+	stream_pool_spin_lock(lock);
+
+	span = *freeList;
+
+	if (span)
+		*freeList = span->next;
+	else
+		span = (wStreamPoolSpan*) malloc(sizeof(wStreamPoolSpan));
+
+	if (span)
+	{
+		span->chunk = chunk;
+		span->shift = shift;
+		span->s = s;
+		span->next = index->buckets[bucket];
+		index->buckets[bucket] = span;
+	}
+
+	stream_pool_spin_unlock(lock);
+
+	return (span) ? TRUE : FALSE;
+}
+
+static BOOL stream_pool_index_remove(struct _wStreamPoolIndex* index, wStream* s,
+		ULONG_PTR chunk, UINT32 shift)
+{
 	BOOL found = FALSE;
+	wStreamPoolSpan** link;
+	UINT32 bucket = stream_pool_bucket(chunk, shift);
+	LONG volatile* lock = &index->locks[bucket % STREAM_POOL_NUM_STRIPES];
+
+	stream_pool_spin_lock(lock);
 
-	for (index = 0; index < pool->uSize; index++)
+	for (link = &index->buckets[bucket]; *link; link = &(*link)->next)
 	{
-		if (pool->uArray[index] == s)
+		wStreamPoolSpan* span = *link;
+
+		if ((span->s == s) && (span->chunk == chunk) && (span->shift == shift))
 		{
+			*link = span->next;
+			span->next = index->free[bucket % STREAM_POOL_NUM_STRIPES];
+			index->free[bucket % STREAM_POOL_NUM_STRIPES] = span;
 			found = TRUE;
 			break;
 		}
 	}
 
-	if (found)
-		StreamPool_ShiftUsed(pool, index, -1);
+	stream_pool_spin_unlock(lock);
+
+	return found;
 }
 
-void StreamPool_ShiftAvailable(wStreamPool* pool, int index, int count)
+static void stream_pool_unregister(wStreamPool* pool, wStream* s, BYTE* buffer, size_t capacity)
 {
-	if (count > 0)
-	{
-		if (pool->aSize + count > pool->aCapacity)
-		{
-			int new_cap;
-			wStream **new_arr;
+	UINT32 shift = stream_pool_shift(capacity);
+	ULONG_PTR first = ((ULONG_PTR) buffer) >> shift;
+	ULONG_PTR last = ((ULONG_PTR) buffer + (capacity ? capacity - 1 : 0)) >> shift;
 
-			new_cap = pool->aCapacity * 2;
-			new_arr = (wStream**) realloc(pool->aArray, sizeof(wStream*) * new_cap);
-			if (!new_arr)
-				return;
-			pool->aCapacity = new_cap;
-			pool->aArray = new_arr;
-		}
+	if (!stream_pool_index_remove(pool->index, s, first, shift))
+		return;
 
-		MoveMemory(&pool->aArray[index + count], &pool->aArray[index], (pool->aSize - index) * sizeof(wStream*));
-		pool->aSize += count;
-	}
-	else if (count < 0)
-	{
-		if (pool->aSize - index + count > 0)
-		{
-			MoveMemory(&pool->aArray[index], &pool->aArray[index - count],
-					(pool->aSize - index + count) * sizeof(wStream*));
-		}
+	if (last != first)
+		stream_pool_index_remove(pool->index, s, last, shift);
 
-		pool->aSize += count;
+	InterlockedDecrement(&pool->index->shifts[shift]);
+}
+
+static BOOL stream_pool_register(wStreamPool* pool, wStream* s)
+{
+	BYTE* buffer = Stream_Buffer(s);
+	size_t capacity = Stream_Capacity(s);
+	UINT32 shift = stream_pool_shift(capacity);
+	ULONG_PTR first = ((ULONG_PTR) buffer) >> shift;
+	ULONG_PTR last = ((ULONG_PTR) buffer + (capacity ? capacity - 1 : 0)) >> shift;
+
+	if (!stream_pool_index_add(pool->index, s, first, shift))
+		return FALSE;
+
+	if ((last != first) && !stream_pool_index_add(pool->index, s, last, shift))
+	{
+		stream_pool_index_remove(pool->index, s, first, shift);
+		return FALSE;
 	}
+
+	InterlockedIncrement(&pool->index->shifts[shift]);
+
+	return TRUE;
 }
 
+BOOL StreamPool_UpdateBuffer(wStreamPool* pool, wStream* s, BYTE* oldBuffer, size_t oldCapacity)
+{
+	stream_pool_unregister(pool, s, oldBuffer, oldCapacity);
+
+	return stream_pool_register(pool, s);
+}
+
+/**
+ * Methods
+ */
+
 /**
  * Gets a stream from the pool.
  */
@@ -144,90 +281,152 @@ void StreamPool_ShiftAvailable(wStreamPool* pool, int index, int count)
 wStream* StreamPool_Take(wStreamPool* pool, size_t size)
 {
 	int index;
-	int foundIndex;
 	wStream* s = NULL;
-
-	if (pool->synchronized)
-		EnterCriticalSection(&pool->lock);
+	struct _wStreamPoolClass* sizeClass;
 
 	if (size == 0)
 		size = pool->defaultSize;
 
-	foundIndex = -1;
+	index = stream_pool_class_for_size(size);
 
-	for (index = 0; index < pool->aSize; index++)
+	if ((index >= 0) && (index < STREAM_POOL_CACHE_CLASSES))
 	{
-		s = pool->aArray[index];
+		struct _wStreamPoolCache* cache = stream_pool_cache(pool);
 
-		if (Stream_Capacity(s) >= size)
+		if (stream_pool_try_lock(&cache->lock))
 		{
-			foundIndex = index;
-			break;
+			if (cache->size[index] > 0)
+			{
+				s = cache->streams[index][--(cache->size[index])];
+				cache->hits++;
+			}
+
+			stream_pool_spin_unlock(&cache->lock);
 		}
 	}
 
-	if (foundIndex < 0)
+	if (!s)
 	{
-		s = Stream_New(NULL, size);
-		if (!s)
-			goto out_fail;
+		if (pool->synchronized)
+			EnterCriticalSection(&pool->lock);
+
+		if (index >= 0)
+		{
+			sizeClass = &pool->classes[index];
+
+			if (sizeClass->size > 0)
+				s = sizeClass->streams[--(sizeClass->size)];
+		}
+
+		if (s)
+			pool->hits++;
+		else
+			pool->misses++;
+
+		if (pool->synchronized)
+			LeaveCriticalSection(&pool->lock);
 	}
-	else
+
+	if (s)
 	{
+		InterlockedDecrement(&pool->aSize);
+		InterlockedExchangeAdd(&pool->retained, -((LONG) Stream_Capacity(s)));
 		Stream_SetPosition(s, 0);
-		StreamPool_ShiftAvailable(pool, foundIndex, -1);
 	}
+	else
+	{
+		s = Stream_New(NULL, (index >= 0) ? ((size_t) 1 << (index + STREAM_POOL_MIN_SHIFT)) : size);
 
-	if (s)
+		if (!s)
+			return NULL;
+	}
+
+	if (!stream_pool_register(pool, s))
 	{
-		s->pool = pool;
-		s->count = 1;
-		StreamPool_AddUsed(pool, s);
+		Stream_Free(s, TRUE);
+		return NULL;
 	}
 
-out_fail:
-	if (pool->synchronized)
-		LeaveCriticalSection(&pool->lock);
+	s->pool = pool;
+	s->count = 1;
+	InterlockedIncrement(&pool->uSize);
 
 	return s;
 }
 
 /**
  * Returns an object to the pool.
+ * The stream is freed if it does not fit a size class or if keeping
+ * it would exceed the retained memory limit.
  */
 
 void StreamPool_Return(wStreamPool* pool, wStream* s)
 {
-	if (pool->synchronized)
-		EnterCriticalSection(&pool->lock);
+	int index;
+	size_t capacity = Stream_Capacity(s);
+	struct _wStreamPoolClass* sizeClass;
+
+	stream_pool_unregister(pool, s, Stream_Buffer(s), capacity);
+	InterlockedDecrement(&pool->uSize);
 
-	if ((pool->aSize + 1) >= pool->aCapacity)
+	index = stream_pool_class_for_capacity(capacity);
+
+	if ((index < 0) || (((size_t) pool->retained + capacity) > pool->maxRetained))
 	{
-		int new_cap;
-		wStream **new_arr;
+		Stream_Free(s, TRUE);
+		return;
+	}
 
-		new_cap = pool->aCapacity * 2;
-		new_arr = (wStream**) realloc(pool->aArray, sizeof(wStream*) * new_cap);
-		if (!new_arr)
-			goto out_fail;
-		pool->aCapacity = new_cap;
-		pool->aArray = new_arr;
+	InterlockedExchangeAdd(&pool->retained, (LONG) capacity);
+	InterlockedIncrement(&pool->aSize);
+
+	if (index < STREAM_POOL_CACHE_CLASSES)
+	{
+		struct _wStreamPoolCache* cache = stream_pool_cache(pool);
+
+		if (stream_pool_try_lock(&cache->lock))
+		{
+			BOOL cached = FALSE;
+
+			if (cache->size[index] < STREAM_POOL_CACHE_DEPTH)
+			{
+				cache->streams[index][(cache->size[index])++] = s;
+				cached = TRUE;
+			}
+
+			stream_pool_spin_unlock(&cache->lock);
+
+			if (cached)
+				return;
+		}
 	}
-	else if ((pool->aSize + 1) * 3 < pool->aCapacity)
+
+	if (pool->synchronized)
+		EnterCriticalSection(&pool->lock);
+
+	sizeClass = &pool->classes[index];
+
+	if (sizeClass->size >= sizeClass->capacity)
 	{
 		int new_cap;
-		wStream **new_arr;
+		wStream** new_arr;
+
+		new_cap = (sizeClass->capacity > 0) ? sizeClass->capacity * 2 : 8;
+		new_arr = (wStream**) realloc(sizeClass->streams, sizeof(wStream*) * new_cap);
 
-		new_cap = pool->aCapacity / 2;
-		new_arr = (wStream**) realloc(pool->aArray, sizeof(wStream*) * new_cap);
 		if (!new_arr)
+		{
+			InterlockedExchangeAdd(&pool->retained, -((LONG) capacity));
+			InterlockedDecrement(&pool->aSize);
+			Stream_Free(s, TRUE);
 			goto out_fail;
-		pool->aCapacity = new_cap;
-		pool->aArray = new_arr;
+		}
+
+		sizeClass->capacity = new_cap;
+		sizeClass->streams = new_arr;
 	}
 
-	pool->aArray[(pool->aSize)++] = s;
-	StreamPool_RemoveUsed(pool, s);
+	sizeClass->streams[(sizeClass->size)++] = s;
 
 out_fail:
 	if (pool->synchronized)
@@ -259,11 +458,7 @@ void StreamPool_Unlock(wStreamPool* pool)
 void Stream_AddRef(wStream* s)
 {
 	if (s->pool)
-	{
-		StreamPool_Lock(s->pool);
-		s->count++;
-		StreamPool_Unlock(s->pool);
-	}
+		InterlockedIncrement((LONG volatile*) &(s->count));
 }
 
 /**
@@ -272,15 +467,9 @@ void Stream_AddRef(wStream* s)
 
 void Stream_Release(wStream* s)
 {
-	DWORD count;
-
 	if (s->pool)
 	{
-		StreamPool_Lock(s->pool);
-		count = --(s->count);
-		StreamPool_Unlock(s->pool);
-
-		if (count == 0)
+		if (InterlockedDecrement((LONG volatile*) &(s->count)) == 0)
 			StreamPool_Return(s->pool, s);
 	}
 }
@@ -291,26 +480,40 @@ void Stream_Release(wStream* s)
 
 wStream* StreamPool_Find(wStreamPool* pool, BYTE* ptr)
 {
-	int index;
+	UINT32 shift;
 	wStream* s = NULL;
-	BOOL found = FALSE;
-
-	EnterCriticalSection(&pool->lock);
+	struct _wStreamPoolIndex* index = pool->index;
 
-	for (index = 0; index < pool->uSize; index++)
+	for (shift = STREAM_POOL_MIN_SHIFT; (shift <= STREAM_POOL_MAX_SHIFT) && !s; shift++)
 	{
-		s = pool->uArray[index];
+		UINT32 bucket;
+		LONG volatile* lock;
+		wStreamPoolSpan* span;
+		ULONG_PTR chunk = ((ULONG_PTR) ptr) >> shift;
 
-		if ((ptr >= Stream_Buffer(s)) && (ptr < (Stream_Buffer(s) + Stream_Capacity(s))))
+		if (index->shifts[shift] < 1)
+			continue;
+
+		bucket = stream_pool_bucket(chunk, shift);
+		lock = &index->locks[bucket % STREAM_POOL_NUM_STRIPES];
+
+		stream_pool_spin_lock(lock);
+
+		for (span = index->buckets[bucket]; span; span = span->next)
 		{
-			found = TRUE;
-			break;
+			if ((span->chunk == chunk) && (span->shift == shift) &&
+					(ptr >= Stream_Buffer(span->s)) &&
+					(ptr < (Stream_Buffer(span->s) + Stream_Capacity(span->s))))
+			{
+				s = span->s;
+				break;
+			}
 		}
-	}
 
-	LeaveCriticalSection(&pool->lock);
+		stream_pool_spin_unlock(lock);
+	}
 
-	return (found) ? s : NULL;
+	return s;
 }
 
 /**
@@ -341,19 +544,93 @@ void StreamPool_Release(wStreamPool* pool, BYTE* ptr)
 		Stream_Release(s);
 }
 
+/**
+ * Sets the number of bytes the available streams may hold,
+ * streams returned beyond it are freed.
+ */
+
+void StreamPool_SetMaxRetained(wStreamPool* pool, size_t maxRetained)
+{
+	if (maxRetained > STREAM_POOL_LIMIT_MAX_RETAINED)
+		maxRetained = STREAM_POOL_LIMIT_MAX_RETAINED;
+
+	pool->maxRetained = maxRetained;
+}
+
+void StreamPool_GetStatistics(wStreamPool* pool, wStreamPoolStatistics* stats)
+{
+	int index;
+
+	ZeroMemory(stats, sizeof(wStreamPoolStatistics));
+
+	for (index = 0; index < STREAM_POOL_NUM_CACHES; index++)
+	{
+		struct _wStreamPoolCache* cache = &pool->caches[index];
+
+		stream_pool_spin_lock(&cache->lock);
+		stats->hits += cache->hits;
+		stream_pool_spin_unlock(&cache->lock);
+	}
+
+	if (pool->synchronized)
+		EnterCriticalSection(&pool->lock);
+
+	stats->hits += pool->hits;
+	stats->misses = pool->misses;
+
+	if (pool->synchronized)
+		LeaveCriticalSection(&pool->lock);
+
+	stats->retainedBytes = (size_t) pool->retained;
+	stats->available = pool->aSize;
+	stats->used = pool->uSize;
+}
+
 /**
  * Releases the streams currently cached in the pool.
  */
 
 void StreamPool_Clear(wStreamPool* pool)
 {
+	int index;
+	int depth;
+
+	for (index = 0; index < STREAM_POOL_NUM_CACHES; index++)
+	{
+		struct _wStreamPoolCache* cache = &pool->caches[index];
+
+		stream_pool_spin_lock(&cache->lock);
+
+		for (depth = 0; depth < STREAM_POOL_CACHE_CLASSES; depth++)
+		{
+			while (cache->size[depth] > 0)
+			{
+				wStream* s = cache->streams[depth][--(cache->size[depth])];
+
+				InterlockedExchangeAdd(&pool->retained, -((LONG) Stream_Capacity(s)));
+				InterlockedDecrement(&pool->aSize);
+				Stream_Free(s, TRUE);
+			}
+		}
+
+		stream_pool_spin_unlock(&cache->lock);
+	}
+
 	if (pool->synchronized)
 		EnterCriticalSection(&pool->lock);
 
-	while (pool->aSize > 0)
+	for (index = 0; index < STREAM_POOL_NUM_CLASSES; index++)
 	{
-		(pool->aSize)--;
-		Stream_Free(pool->aArray[pool->aSize], TRUE);
+		struct _wStreamPoolClass* sizeClass = &pool->classes[index];
+
+		while (sizeClass->size > 0)
+		{
+			wStream* s = sizeClass->streams[--(sizeClass->size)];
+
+			InterlockedExchangeAdd(&pool->retained, -((LONG) Stream_Capacity(s)));
+			InterlockedDecrement(&pool->aSize);
+			Stream_Free(s, TRUE);
+		}
 	}
 
 	if (pool->synchronized)
@@ -370,48 +647,82 @@ wStreamPool* StreamPool_New(BOOL synchronized, size_t defaultSize)
 
 	pool = (wStreamPool*) calloc(1, sizeof(wStreamPool));
 
-	if (pool)
-	{
-		pool->synchronized = synchronized;
-		pool->defaultSize = defaultSize;
+	if (!pool)
+		return NULL;
 
-		pool->aSize = 0;
-		pool->aCapacity = 32;
-		pool->aArray = (wStream**) calloc(pool->aCapacity, sizeof(wStream*));
+	pool->synchronized = synchronized;
+	pool->defaultSize = defaultSize;
+	pool->maxRetained = STREAM_POOL_DEFAULT_MAX_RETAINED;
 
-		if (!pool->aArray)
-		{
-			free(pool);
-			return NULL;
-		}
+	pool->classes = (struct _wStreamPoolClass*) calloc(STREAM_POOL_NUM_CLASSES,
+			sizeof(struct _wStreamPoolClass));
 
-		pool->uSize = 0;
-		pool->uCapacity = 32;
-		pool->uArray = (wStream**) calloc(pool->uCapacity, sizeof(wStream*));
+	if (!pool->classes)
+		goto fail_classes;
 
-		if (!pool->uArray)
-		{
-			free(pool->aArray);
-			free(pool);
-			return NULL;
-		}
+	pool->caches = (struct _wStreamPoolCache*) calloc(STREAM_POOL_NUM_CACHES,
+			sizeof(struct _wStreamPoolCache));
 
-		InitializeCriticalSectionAndSpinCount(&pool->lock, 4000);
-	}
+	if (!pool->caches)
+		goto fail_caches;
+
+	pool->index = (struct _wStreamPoolIndex*) calloc(1, sizeof(struct _wStreamPoolIndex));
+
+	if (!pool->index)
+		goto fail_index;
+
+	if (!InitializeCriticalSectionAndSpinCount(&pool->lock, 4000))
+		goto fail_lock;
 
 	return pool;
+
+fail_lock:
+	free(pool->index);
+fail_index:
+	free(pool->caches);
+fail_caches:
+	free(pool->classes);
+fail_classes:
+	free(pool);
+	return NULL;
 }
 
 void StreamPool_Free(wStreamPool* pool)
 {
+	int index;
+
 	if (pool)
 	{
 		StreamPool_Clear(pool);
 
 		DeleteCriticalSection(&pool->lock);
 
-		free(pool->aArray);
-		free(pool->uArray);
+		for (index = 0; index < STREAM_POOL_NUM_CLASSES; index++)
+			free(pool->classes[index].streams);
+
+		for (index = 0; index < STREAM_POOL_NUM_BUCKETS; index++)
+		{
+			while (pool->index->buckets[index])
+			{
+				wStreamPoolSpan* span = pool->index->buckets[index];
+				pool->index->buckets[index] = span->next;
+				free(span);
+			}
+		}
+
+		for (index = 0; index < STREAM_POOL_NUM_STRIPES; index++)
+		{
+			while (pool->index->free[index])
+			{
+				wStreamPoolSpan* span = pool->index->free[index];
+				pool->index->free[index] = span->next;
+				free(span);
+			}
+		}
+
+		free(pool->index);
+		free(pool->caches);
+		free(pool->classes);
 
 		free(pool);
 	}
@@ -0,0 +1,32 @@
+/**
+ * WinPR: Windows Portable Runtime
+ * Stream Pool
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef WINPR_COLLECTIONS_STREAM_POOL_H
+#define WINPR_COLLECTIONS_STREAM_POOL_H
+
+#include <winpr/winpr.h>
+#include <winpr/stream.h>
+
+/**
+ * Taken streams are indexed by buffer address so that StreamPool_Find
+ * does not walk them all, the index must follow a buffer reallocated by
+ * Stream_EnsureCapacity.
+ */
+
+BOOL StreamPool_UpdateBuffer(wStreamPool* pool, wStream* s, BYTE* oldBuffer, size_t oldCapacity);
+
+#endif /* WINPR_COLLECTIONS_STREAM_POOL_H */
@@ -480,13 +480,14 @@ void winpr_backtrace_symbols_fd(void* buffer, int fd)
 
 void winpr_log_backtrace(const char* tag, DWORD level, DWORD size)
 {
+	wLog* log = WLog_Get(tag);
 	size_t used, x;
 	char **msg;
 	void *stack = winpr_backtrace(20);
 
 	if (!stack)
 	{
-		WLog_ERR(tag, "winpr_backtrace failed!\n");
+		WLog_Print(log, WLOG_ERROR, "winpr_backtrace failed!\n");
 		winpr_backtrace_free(stack);
 		return;
 	}
@@ -495,7 +496,7 @@ void winpr_log_backtrace(const char* tag, DWORD level, DWORD size)
 	if (msg)
 	{
 		for (x=0; x<used; x++)
-			WLog_LVL(tag, level, "%lu: %s\n", (unsigned long)x, msg[x]);
+			WLog_Print(log, level, "%lu: %s\n", (unsigned long)x, msg[x]);
 	}
 	winpr_backtrace_free(stack);
 }
@@ -35,6 +35,7 @@
 
 void winpr_HexDump(const char* tag, UINT32 level, const BYTE* data, int length)
 {
+	wLog* log = WLog_Get(tag);
 	const BYTE* p = data;
 	int i, line, offset = 0;
 	size_t blen = 7 + WINPR_HEXDUMP_LINE_LENGTH * 5;
@@ -43,7 +44,7 @@ void winpr_HexDump(const char* tag, UINT32 level, const BYTE* data, int length)
 
 	if (!buffer)
 	{
-		WLog_ERR(tag, "malloc(%lu) failed with [%d] %s", (unsigned long)blen, errno, strerror(errno));
+		WLog_Print(log, WLOG_ERROR, "malloc(%lu) failed with [%d] %s", (unsigned long)blen, errno, strerror(errno));
 		return;
 	}
 
@@ -65,7 +66,7 @@ void winpr_HexDump(const char* tag, UINT32 level, const BYTE* data, int length)
 			pos += trio_snprintf(&buffer[pos], blen - pos, "%c",
 							(p[i] >= 0x20 && p[i] < 0x7F) ? p[i] : '.');
 
-		WLog_LVL(tag, level, "%s", buffer);
+		WLog_Print(log, level, "%s", buffer);
 		offset += line;
 		p += line;
 		pos = 0;
@@ -76,6 +77,7 @@ void winpr_HexDump(const char* tag, UINT32 level, const BYTE* data, int length)
 
 void winpr_CArrayDump(const char* tag, UINT32 level, const BYTE* data, int length, int width)
 {
+	wLog* log = WLog_Get(tag);
 	const BYTE* p = data;
 	int i, line, offset = 0;
 	const size_t llen = ((length > width) ? width : length) * 4 + 1;
@@ -84,7 +86,7 @@ void winpr_CArrayDump(const char* tag, UINT32 level, const BYTE* data, int lengt
 
 	if (!buffer)
 	{
-		WLog_ERR(tag, "malloc(%lu) failed with [%d] %s", (unsigned long)llen, errno, strerror(errno));
+		WLog_Print(log, WLOG_ERROR, "malloc(%lu) failed with [%d] %s", (unsigned long)llen, errno, strerror(errno));
 		return;
 	}
 
@@ -100,7 +102,7 @@ void winpr_CArrayDump(const char* tag, UINT32 level, const BYTE* data, int lengt
 		for (i = 0; i < line; i++)
 			pos += trio_snprintf(&buffer[pos], llen - pos, "\\x%02X", p[i]);
 
-		WLog_LVL(tag, level, "%s", buffer);
+		WLog_Print(log, level, "%s", buffer);
 		offset += line;
 		p += line;
 	}
@@ -25,6 +25,8 @@
 #include <winpr/crt.h>
 #include <winpr/stream.h>
 
+#include "collections/StreamPool.h"
+
 BOOL Stream_EnsureCapacity(wStream* s, size_t size)
 {
 	if (s->capacity < size)
@@ -32,8 +34,10 @@ BOOL Stream_EnsureCapacity(wStream* s, size_t size)
 		size_t position;
 		size_t old_capacity;
 		size_t new_capacity;
+		BYTE* old_buf;
 		BYTE* new_buf;
 
+		old_buf = s->buffer;
 		old_capacity = s->capacity;
 		new_capacity = old_capacity;
 
@@ -55,6 +59,9 @@ BOOL Stream_EnsureCapacity(wStream* s, size_t size)
 		ZeroMemory(&s->buffer[old_capacity], s->capacity - old_capacity);
 
 		Stream_SetPosition(s, position);
+
+		if (s->pool && !StreamPool_UpdateBuffer(s->pool, s, old_buf, old_capacity))
+			return FALSE;
 	}
 	return TRUE;
 }
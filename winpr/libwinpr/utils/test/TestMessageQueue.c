@@ -24,6 +24,83 @@ static void* message_queue_consumer_thread(void* arg)
 	return NULL;
 }
 
+static size_t message_queue_batch_sum = 0;
+
+static void* message_queue_batch_consumer_thread(void* arg)
+{
+	int index;
+	int count;
+	wMessage messages[4];
+	wMessageQueue* queue;
+
+	queue = (wMessageQueue*) arg;
+
+	while ((count = MessageQueue_GetBatch(queue, messages, 4)) >= 0)
+	{
+		for (index = 0; index < count; index++)
+		{
+			if (messages[index].id == WMQ_QUIT)
+				return NULL;
+
+			message_queue_batch_sum += (size_t) messages[index].wParam;
+		}
+	}
+
+	return NULL;
+}
+
+static int test_message_queue_lock_free(DWORD flags)
+{
+	size_t index;
+	HANDLE thread;
+	wMessage message;
+	wMessageQueue* queue;
+
+	message_queue_batch_sum = 0;
+
+	if (!(queue = MessageQueue_NewLockFree(NULL, 16, flags)))
+		return -1;
+
+	/* bounded: the 17th message does not fit */
+	for (index = 0; index < 16; index++)
+	{
+		if (!MessageQueue_Post(queue, NULL, 1, (void*) index, NULL))
+			return -1;
+	}
+
+	if (MessageQueue_Post(queue, NULL, 1, NULL, NULL) || (MessageQueue_Size(queue) != 16))
+		return -1;
+
+	if ((MessageQueue_Peek(queue, &message, FALSE) != 1) || (message.wParam != (void*) 0))
+		return -1;
+
+	MessageQueue_Clear(queue);
+
+	if (MessageQueue_Size(queue) != 0)
+		return -1;
+
+	if (!(thread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) message_queue_batch_consumer_thread,
+			(void*) queue, 0, NULL)))
+		return -1;
+
+	for (index = 1; index <= 1000; index++)
+	{
+		while (!MessageQueue_Post(queue, NULL, 1, (void*) index, NULL))
+			SwitchToThread();
+	}
+
+	while (!MessageQueue_PostQuit(queue, 0))
+		SwitchToThread();
+
+	if (WaitForSingleObject(thread, INFINITE) != WAIT_OBJECT_0)
+		return -1;
+
+	CloseHandle(thread);
+	MessageQueue_Free(queue);
+
+	return (message_queue_batch_sum == 1000 * 1001 / 2) ? 0 : -1;
+}
+
 int TestMessageQueue(int argc, char* argv[])
 {
 	HANDLE thread;
@@ -52,5 +129,17 @@ int TestMessageQueue(int argc, char* argv[])
 	MessageQueue_Free(queue);
 	CloseHandle(thread);
 
+	if (test_message_queue_lock_free(QUEUE_LOCK_FREE_SPSC) < 0)
+	{
+		printf("lock-free SPSC message queue failed\n");
+		return -1;
+	}
+
+	if (test_message_queue_lock_free(QUEUE_LOCK_FREE_MPMC) < 0)
+	{
+		printf("lock-free MPMC message queue failed\n");
+		return -1;
+	}
+
 	return 0;
 }
@@ -1,8 +1,215 @@
 
 #include <winpr/crt.h>
 #include <winpr/tchar.h>
+#include <winpr/synch.h>
+#include <winpr/thread.h>
+#include <winpr/sysinfo.h>
+#include <winpr/interlocked.h>
 #include <winpr/collections.h>
 
+#define BENCH_ITEMS		200000
+#define BENCH_MAX_THREADS	8
+
+static int test_queue_lock_free(DWORD flags)
+{
+	int index;
+	int count;
+	void* items[8];
+	wQueue* queue;
+
+	queue = Queue_NewLockFree(6, flags);
+	if (!queue)
+		return -1;
+
+	if (WaitForSingleObject(Queue_Event(queue), 0) != WAIT_TIMEOUT)
+		return -1;
+
+	/* capacity is rounded up to 8 */
+	for (index = 1; index <= 8; index++)
+	{
+		if (!Queue_Enqueue(queue, (void*) (size_t) index))
+			return -1;
+	}
+
+	if (Queue_Enqueue(queue, (void*) (size_t) 9))
+		return -1;
+
+	if ((Queue_Count(queue) != 8) || ((int) (size_t) Queue_Peek(queue) != 1))
+		return -1;
+
+	if (WaitForSingleObject(Queue_Event(queue), 0) != WAIT_OBJECT_0)
+		return -1;
+
+	if ((int) (size_t) Queue_Dequeue(queue) != 1)
+		return -1;
+
+	count = Queue_DequeueBatch(queue, items, 8);
+
+	if (count != 7)
+		return -1;
+
+	for (index = 0; index < count; index++)
+	{
+		if ((int) (size_t) items[index] != index + 2)
+			return -1;
+	}
+
+	if (WaitForSingleObject(Queue_Event(queue), 0) != WAIT_TIMEOUT)
+		return -1;
+
+	if (Queue_Dequeue(queue) || Queue_Peek(queue))
+		return -1;
+
+	/* wrap around several times */
+	for (index = 1; index <= 100; index++)
+	{
+		if (!Queue_Enqueue(queue, (void*) (size_t) index))
+			return -1;
+
+		if ((int) (size_t) Queue_Dequeue(queue) != index)
+			return -1;
+	}
+
+	Queue_Enqueue(queue, (void*) (size_t) 1);
+	Queue_Clear(queue);
+
+	if ((Queue_Count(queue) != 0) || (WaitForSingleObject(Queue_Event(queue), 0) != WAIT_TIMEOUT))
+		return -1;
+
+	Queue_Free(queue);
+	return 0;
+}
+
+struct _QUEUE_BENCH
+{
+	wQueue* queue;
+	LONG itemsPerProducer;
+	LONG remaining;
+	LONG volatile consumed;
+	LONG volatile sum;
+};
+typedef struct _QUEUE_BENCH QUEUE_BENCH;
+
+static DWORD WINAPI queue_bench_producer(LPVOID arg)
+{
+	LONG index;
+	QUEUE_BENCH* bench = (QUEUE_BENCH*) arg;
+
+	for (index = 1; index <= bench->itemsPerProducer; index++)
+	{
+		while (!Queue_Enqueue(bench->queue, (void*) (size_t) index))
+			SwitchToThread();
+	}
+
+	return 0;
+}
+
+static DWORD WINAPI queue_bench_consumer(LPVOID arg)
+{
+	int index;
+	int count;
+	LONG sum;
+	void* items[32];
+	QUEUE_BENCH* bench = (QUEUE_BENCH*) arg;
+
+	while (InterlockedCompareExchange(&bench->consumed, 0, 0) < bench->remaining)
+	{
+		if (WaitForSingleObject(Queue_Event(bench->queue), 10) != WAIT_OBJECT_0)
+			continue;
+
+		count = Queue_DequeueBatch(bench->queue, items, 32);
+
+		/* an element is being published by a preempted producer */
+		if (count < 1)
+			SwitchToThread();
+
+		sum = 0;
+
+		for (index = 0; index < count; index++)
+			sum += (LONG) (size_t) items[index];
+
+		InterlockedExchangeAdd(&bench->sum, sum);
+		InterlockedExchangeAdd(&bench->consumed, count);
+	}
+
+	return 0;
+}
+
+static int queue_bench_run(const char* name, wQueue* queue, int producers, int consumers)
+{
+	int index;
+	UINT64 start;
+	UINT64 elapsed;
+	LONG expected;
+	QUEUE_BENCH bench;
+	HANDLE threads[BENCH_MAX_THREADS * 2];
+	int numThreads = 0;
+
+	if (!queue)
+		return -1;
+
+	ZeroMemory(&bench, sizeof(bench));
+	bench.queue = queue;
+	bench.itemsPerProducer = BENCH_ITEMS / producers;
+	bench.remaining = bench.itemsPerProducer * producers;
+
+	start = GetTickCount64();
+
+	for (index = 0; index < consumers; index++)
+		threads[numThreads++] = CreateThread(NULL, 0, queue_bench_consumer, &bench, 0, NULL);
+
+	for (index = 0; index < producers; index++)
+		threads[numThreads++] = CreateThread(NULL, 0, queue_bench_producer, &bench, 0, NULL);
+
+	for (index = 0; index < numThreads; index++)
+	{
+		if (!threads[index])
+			return -1;
+
+		WaitForSingleObject(threads[index], INFINITE);
+		CloseHandle(threads[index]);
+	}
+
+	elapsed = GetTickCount64() - start;
+	expected = (LONG) (((INT64) bench.itemsPerProducer * (bench.itemsPerProducer + 1) / 2) *
+			producers);
+
+	printf("%-8s %d producer(s) %d consumer(s): %6lu ms\n", name,
+			producers, consumers, (unsigned long) elapsed);
+
+	Queue_Free(queue);
+
+	return ((bench.consumed == bench.remaining) && (bench.sum == expected)) ? 0 : -1;
+}
+
+/**
+ * Compares the locked queue with the lock-free variants,
+ * only run when --with-queue-bench is passed.
+ */
+
+static int test_queue_bench(void)
+{
+	int threads;
+
+	if (queue_bench_run("locked", Queue_New(TRUE, 1024, 2), 1, 1) < 0)
+		return -1;
+
+	if (queue_bench_run("spsc", Queue_NewLockFree(1024, QUEUE_LOCK_FREE_SPSC), 1, 1) < 0)
+		return -1;
+
+	for (threads = 1; threads <= BENCH_MAX_THREADS; threads *= 2)
+	{
+		if (queue_bench_run("locked", Queue_New(TRUE, 1024, 2), threads, threads) < 0)
+			return -1;
+
+		if (queue_bench_run("mpmc", Queue_NewLockFree(1024, QUEUE_LOCK_FREE_MPMC),
+				threads, threads) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
 int TestQueue(int argc, char* argv[])
 {
 	int item;
@@ -52,5 +259,23 @@ int TestQueue(int argc, char* argv[])
 	Queue_Clear(queue);
 	Queue_Free(queue);
 
+	if (test_queue_lock_free(QUEUE_LOCK_FREE_SPSC) < 0)
+	{
+		printf("lock-free SPSC queue failed\n");
+		return -1;
+	}
+
+	if (test_queue_lock_free(QUEUE_LOCK_FREE_MPMC) < 0)
+	{
+		printf("lock-free MPMC queue failed\n");
+		return -1;
+	}
+
+	for (index = 1; index < argc; index++)
+	{
+		if (strcmp(argv[index], "--with-queue-bench") == 0)
+			return test_queue_bench();
+	}
+
 	return 0;
 }
@@ -5,6 +5,77 @@
 
 #define BUFFER_SIZE 16384
 
+static int test_stream_pool_classes(void)
+{
+	wStream* s;
+	wStream* t;
+	BYTE* buffer;
+	wStreamPool* pool;
+	wStreamPoolStatistics stats;
+
+	if (!(pool = StreamPool_New(TRUE, BUFFER_SIZE)))
+		return -1;
+
+	/* requests are rounded up to their size class */
+	s = StreamPool_Take(pool, 100);
+
+	if (!s || (Stream_Capacity(s) != 256))
+		return -1;
+
+	Stream_Release(s);
+
+	/* a small request is not served from a larger class */
+	t = StreamPool_Take(pool, 1000);
+
+	if (!t || (t == s) || (Stream_Capacity(t) != 1024))
+		return -1;
+
+	/* but reuses a stream of its own class */
+	if (StreamPool_Take(pool, 200) != s)
+		return -1;
+
+	/* the index follows a buffer reallocated while the stream is taken */
+	if (!Stream_EnsureCapacity(s, 100000))
+		return -1;
+
+	buffer = Stream_Buffer(s);
+
+	if ((StreamPool_Find(pool, buffer) != s) || (StreamPool_Find(pool, buffer + 99999) != s) ||
+			(StreamPool_Find(pool, Stream_Buffer(t) + 1023) != t))
+		return -1;
+
+	StreamPool_Release(pool, buffer + 500);
+	Stream_Release(t);
+
+	if (StreamPool_Find(pool, buffer) || (pool->uSize != 0) || (pool->aSize != 2))
+		return -1;
+
+	StreamPool_GetStatistics(pool, &stats);
+
+	if ((stats.hits != 1) || (stats.misses != 2) || (stats.used != 0) || (stats.available != 2) ||
+			(stats.retainedBytes != 1024 + 131072))
+		return -1;
+
+	/* streams beyond the retained limit are freed */
+	StreamPool_Clear(pool);
+	StreamPool_SetMaxRetained(pool, 4096);
+
+	s = StreamPool_Take(pool, 4096);
+	t = StreamPool_Take(pool, 4096);
+
+	Stream_Release(s);
+	Stream_Release(t);
+
+	StreamPool_GetStatistics(pool, &stats);
+
+	if ((stats.available != 1) || (stats.retainedBytes != 4096))
+		return -1;
+
+	StreamPool_Free(pool);
+
+	return 0;
+}
+
 int TestStreamPool(int argc, char* argv[])
 {
 	wStream* s[5];
@@ -96,6 +167,12 @@ int TestStreamPool(int argc, char* argv[])
 
 	StreamPool_Free(pool);
 
+	if (test_stream_pool_classes() < 0)
+	{
+		printf("StreamPool size classes failed\n");
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -5,6 +5,74 @@
 #include <winpr/file.h>
 #include <winpr/wlog.h>
 
+#define TEST_CACHED_TAG "com.test.Cached"
+
+static BOOL test_wlog_registry(void)
+{
+	int index;
+	wLog* log;
+	char name[64];
+	char other[64];
+	wLogTagCache tag = { NULL, NULL };
+	wLogTagCache empty = { NULL, NULL };
+
+	WLog_Init();
+
+	/* one logger per name, whatever the number of loggers */
+	for (index = 0; index < 600; index++)
+	{
+		sprintf_s(name, sizeof(name), "com.test.Registry%d", index);
+
+		if (!(log = WLog_Get(name)) || (WLog_Get(name) != log))
+			return FALSE;
+	}
+
+	log = WLog_Get(TEST_CACHED_TAG);
+
+	if (!log || (WLog_GetCached(&tag, TEST_CACHED_TAG) != log) ||
+			(WLog_GetCached(&tag, TEST_CACHED_TAG) != log))
+		return FALSE;
+
+	if (WLog_GetCached(&tag, "com.test.Other") != WLog_Get("com.test.Other"))
+		return FALSE;
+
+	WLog_DBG(TEST_CACHED_TAG, "cached %s", "handle");
+
+	/* another pointer at the same call site is resolved by its name */
+	tag = empty;
+	sprintf_s(name, sizeof(name), "com.test.Buffer%d", 1);
+	sprintf_s(other, sizeof(other), "com.test.Buffer%d", 1);
+	log = WLog_GetCached(&tag, name);
+
+	if (!log || (log != WLog_Get("com.test.Buffer1")) || (WLog_GetCached(&tag, other) != log))
+		return FALSE;
+
+	sprintf_s(other, sizeof(other), "com.test.Buffer%d", 2);
+
+	if ((WLog_GetCached(&tag, other) != WLog_Get("com.test.Buffer2")) ||
+			(WLog_GetCached(&tag, name) != log))
+		return FALSE;
+
+	/* cached handles are looked up again after a re-initialization */
+	tag = empty;
+
+	if (WLog_GetCached(&tag, TEST_CACHED_TAG) != WLog_Get(TEST_CACHED_TAG))
+		return FALSE;
+
+	WLog_Uninit();
+	WLog_Init();
+
+	log = WLog_GetCached(&tag, TEST_CACHED_TAG);
+
+	if (!log || (log != WLog_Get(TEST_CACHED_TAG)))
+		return FALSE;
+
+	WLog_DBG(TEST_CACHED_TAG, "cached %s", "handle");
+
+	WLog_Uninit();
+	return TRUE;
+}
+
 int TestWLog(int argc, char* argv[])
 {
 	wLog* root;
@@ -58,6 +126,12 @@ int TestWLog(int argc, char* argv[])
 
 	WLog_Uninit();
 
+	if (!test_wlog_registry())
+	{
+		fprintf(stderr, "logger registry test failed\n");
+		return 1;
+	}
+
 	if ((wlog_file = GetCombinedPath(tmp_path, "test_w.log")))
 	{
 		DeleteFileA(wlog_file);
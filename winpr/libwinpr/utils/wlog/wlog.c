@@ -25,7 +25,9 @@
 #include <string.h>
 
 #include <winpr/crt.h>
+#include <winpr/synch.h>
 #include <winpr/print.h>
+#include <winpr/interlocked.h>
 #include <winpr/debug.h>
 #include <winpr/environment.h>
 
@@ -69,6 +71,20 @@ LPCSTR WLOG_LEVELS[7] =
 static DWORD g_FilterCount = 0;
 static wLogFilter* g_Filters = NULL;
 
+/**
+ * Loggers and the tags of the tag macros are found by name in two hash
+ * tables.
+ * Entries are only added under g_Lock and published last, lookups do not
+ * take the lock. Only WLog_Uninit removes loggers.
+ */
+
+#define WLOG_HASH_TABLE_SIZE	256
+
+static INIT_ONCE g_InitOnce = INIT_ONCE_STATIC_INIT;
+static CRITICAL_SECTION g_Lock;
+static wLog* volatile g_LogTable[WLOG_HASH_TABLE_SIZE];
+static wLogTag* volatile g_TagTable[WLOG_HASH_TABLE_SIZE];
+
 static LONG WLog_GetFilterLogLevel(wLog* log);
 static int WLog_ParseLogLevel(LPCSTR level);
 static BOOL WLog_ParseFilter(wLogFilter* filter, LPCSTR name);
@@ -703,69 +719,150 @@ void WLog_Free(wLog* log)
 	}
 }
 
-static wLog* g_RootLog = NULL;
+static wLog* volatile g_RootLog = NULL;
 
-wLog* WLog_GetRoot(void)
+static BOOL CALLBACK WLog_InitLock(PINIT_ONCE once, PVOID param, PVOID* context)
 {
-	char* env;
-	DWORD nSize;
-	DWORD logAppenderType;
+	InitializeCriticalSectionAndSpinCount(&g_Lock, 4000);
+	return TRUE;
+}
+
+/* FNV-1a */
+static UINT32 WLog_HashName(LPCSTR name)
+{
+	UINT32 hash = 2166136261U;
 
-	if (!g_RootLog)
+	while (*name)
 	{
-		if (!(g_RootLog = WLog_New("", NULL)))
-			return NULL;
+		hash ^= (BYTE) *name++;
+		hash *= 16777619U;
+	}
 
-		g_RootLog->IsRoot = TRUE;
-		WLog_ParseFilters();
-		logAppenderType = WLOG_APPENDER_CONSOLE;
-		nSize = GetEnvironmentVariableA("WLOG_APPENDER", NULL, 0);
+	return hash;
+}
 
-		if (nSize)
-		{
-			env = (LPSTR) malloc(nSize);
-			if (!env)
-				goto fail;
+/**
+ * The root logger is only published once it is fully set up. While it is
+ * being created, the creating thread (the only one holding g_Lock) gets
+ * it back from g_CreatingRoot, e.g. when an appender logs.
+ */
+
+static wLog* g_CreatingRoot = NULL;
+
+/**
+ * Loggers created by the creating thread while setting up the root were
+ * never visible to other threads, they are dropped together with it.
+ */
+
+static void WLog_FreeCreatingRoot(wLog* root)
+{
+	DWORD index;
+	wLog* child;
+	wLog** entry;
 
-			if (!GetEnvironmentVariableA("WLOG_APPENDER", env, nSize))
+	for (index = 0; index < root->ChildrenCount; index++)
+	{
+		child = root->Children[index];
+
+		for (entry = (wLog**) &g_LogTable[child->Hash % WLOG_HASH_TABLE_SIZE]; *entry; entry = &(*entry)->HashNext)
+		{
+			if (*entry == child)
 			{
-				fprintf(stderr, "WLOG_APPENDER environment variable modified in my back");
-				free(env);
-				goto fail;
+				*entry = child->HashNext;
+				break;
 			}
+		}
+
+		WLog_Free(child);
+	}
+
+	WLog_Free(root);
+}
+
+static wLog* WLog_CreateRoot(void)
+{
+	char* env;
+	DWORD nSize;
+	wLog* root;
+	DWORD logAppenderType;
+
+	if (g_RootLog)
+		return g_RootLog;
+
+	if (g_CreatingRoot)
+		return g_CreatingRoot;
+
+	if (!(root = WLog_New("", NULL)))
+		return NULL;
+
+	root->IsRoot = TRUE;
+	g_CreatingRoot = root;
+	WLog_ParseFilters();
+	logAppenderType = WLOG_APPENDER_CONSOLE;
+	nSize = GetEnvironmentVariableA("WLOG_APPENDER", NULL, 0);
+
+	if (nSize)
+	{
+		env = (LPSTR) malloc(nSize);
+		if (!env)
+			goto fail;
 
-			if (_stricmp(env, "CONSOLE") == 0)
-				logAppenderType = WLOG_APPENDER_CONSOLE;
-			else if (_stricmp(env, "FILE") == 0)
-				logAppenderType = WLOG_APPENDER_FILE;
-			else if (_stricmp(env, "BINARY") == 0)
-				logAppenderType = WLOG_APPENDER_BINARY;
+		if (!GetEnvironmentVariableA("WLOG_APPENDER", env, nSize))
+		{
+			fprintf(stderr, "WLOG_APPENDER environment variable modified in my back");
+			free(env);
+			goto fail;
+		}
+
+		if (_stricmp(env, "CONSOLE") == 0)
+			logAppenderType = WLOG_APPENDER_CONSOLE;
+		else if (_stricmp(env, "FILE") == 0)
+			logAppenderType = WLOG_APPENDER_FILE;
+		else if (_stricmp(env, "BINARY") == 0)
+			logAppenderType = WLOG_APPENDER_BINARY;
 #ifdef HAVE_SYSLOG_H
-			else if (_stricmp(env, "SYSLOG") == 0)
-				logAppenderType = WLOG_APPENDER_SYSLOG;
+		else if (_stricmp(env, "SYSLOG") == 0)
+			logAppenderType = WLOG_APPENDER_SYSLOG;
 #endif /* HAVE_SYSLOG_H */
 #ifdef HAVE_JOURNALD_H
-			else if (_stricmp(env, "JOURNALD") == 0)
-				logAppenderType = WLOG_APPENDER_JOURNALD;
+		else if (_stricmp(env, "JOURNALD") == 0)
+			logAppenderType = WLOG_APPENDER_JOURNALD;
 #endif
-			else if (_stricmp(env, "UDP") == 0)
-				logAppenderType = WLOG_APPENDER_UDP;
+		else if (_stricmp(env, "UDP") == 0)
+			logAppenderType = WLOG_APPENDER_UDP;
 
-			free(env);
-		}
-
-		if (!WLog_SetLogAppenderType(g_RootLog, logAppenderType))
-			goto fail;
+		free(env);
 	}
 
-	return g_RootLog;
+	if (!WLog_SetLogAppenderType(root, logAppenderType))
+		goto fail;
+
+	g_CreatingRoot = NULL;
+	InterlockedCompareExchangePointer((PVOID volatile*) &g_RootLog, root, NULL);
+	return root;
 
 fail:
-	free(g_RootLog);
-	g_RootLog = NULL;
+	g_CreatingRoot = NULL;
+	WLog_FreeCreatingRoot(root);
 	return NULL;
 }
 
+wLog* WLog_GetRoot(void)
+{
+	wLog* root = g_RootLog;
+
+	if (root)
+		return root;
+
+	InitOnceExecuteOnce(&g_InitOnce, WLog_InitLock, NULL, NULL);
+
+	EnterCriticalSection(&g_Lock);
+	root = WLog_CreateRoot();
+	LeaveCriticalSection(&g_Lock);
+
+	return root;
+}
+
 BOOL WLog_AddChild(wLog* parent, wLog* child)
 {
 	if (parent->ChildrenCount >= parent->ChildrenSize)
@@ -800,47 +897,135 @@ BOOL WLog_AddChild(wLog* parent, wLog* child)
 	return TRUE;
 }
 
+static wLog* WLog_LookupChild(LPCSTR name, UINT32 hash)
+{
+	wLog* log;
+
+	for (log = g_LogTable[hash % WLOG_HASH_TABLE_SIZE]; log; log = log->HashNext)
+	{
+		if ((log->Hash == hash) && (strcmp(log->Name, name) == 0))
+			return log;
+	}
+
+	return NULL;
+}
+
 wLog* WLog_FindChild(LPCSTR name)
 {
-	DWORD index;
+	if (!WLog_GetRoot())
+		return NULL;
+
+	return WLog_LookupChild(name, WLog_HashName(name));
+}
+
+wLog* WLog_Get(LPCSTR name)
+{
+	wLog* log;
 	wLog* root;
-	wLog* child = NULL;
-	BOOL found = FALSE;
-	root = WLog_GetRoot();
+	UINT32 hash;
 
-	if (!root)
+	if (!(root = WLog_GetRoot()))
 		return NULL;
 
-	for (index = 0; index < root->ChildrenCount; index++)
-	{
-		child = root->Children[index];
+	hash = WLog_HashName(name);
 
-		if (strcmp(child->Name, name) == 0)
+	if ((log = WLog_LookupChild(name, hash)))
+		return log;
+
+	EnterCriticalSection(&g_Lock);
+
+	/* another thread may have created it in the meantime */
+	if (!(log = WLog_LookupChild(name, hash)))
+	{
+		if ((log = WLog_New(name, root)))
 		{
-			found = TRUE;
-			break;
+			if (WLog_AddChild(root, log))
+			{
+				log->Hash = hash;
+				log->HashNext = g_LogTable[hash % WLOG_HASH_TABLE_SIZE];
+				InterlockedCompareExchangePointer((PVOID volatile*) &g_LogTable[hash % WLOG_HASH_TABLE_SIZE],
+						log, log->HashNext);
+			}
+			else
+			{
+				WLog_Free(log);
+				log = NULL;
+			}
 		}
 	}
 
-	return (found) ? child : NULL;
+	LeaveCriticalSection(&g_Lock);
+	return log;
 }
 
-wLog* WLog_Get(LPCSTR name)
+static wLogTag* WLog_LookupTag(LPCSTR name, UINT32 hash)
+{
+	wLogTag* tag;
+
+	for (tag = g_TagTable[hash % WLOG_HASH_TABLE_SIZE]; tag; tag = tag->Next)
+	{
+		if ((tag->Hash == hash) && (strcmp(tag->Name, name) == 0))
+			return tag;
+	}
+
+	return NULL;
+}
+
+/**
+ * Used by the tag macros: the cache of the call site is filled once, with
+ * the tag string it saw first. The same pointer is taken as the same tag,
+ * another pointer is compared by name. Tags are keyed by their string so
+ * that there is one per name, whatever buffer the name is passed in.
+ */
+
+wLog* WLog_GetCached(wLogTagCache* cache, LPCSTR name)
 {
 	wLog* log;
-	if (!(log = WLog_FindChild(name)))
-	{
-		wLog* root = WLog_GetRoot();
-		if (!root)
-			return NULL;
-		if (!(log = WLog_New(name, root)))
-			return NULL;
-		if (!WLog_AddChild(root, log))
+	UINT32 hash;
+	wLogTag* tag;
+
+	tag = (wLogTag*) InterlockedCompareExchangePointer((PVOID volatile*) &cache->Tag, NULL, NULL);
+
+	if (tag && ((cache->Key == name) || (strcmp(tag->Name, name) == 0)) && (log = tag->Log))
+		return log;
+
+	if (!WLog_GetRoot())
+		return NULL;
+
+	hash = WLog_HashName(name);
+
+	EnterCriticalSection(&g_Lock);
+
+	if (!(tag = WLog_LookupTag(name, hash)) && (tag = (wLogTag*) calloc(1, sizeof(wLogTag))))
+	{
+		if ((tag->Name = _strdup(name)))
+		{
+			tag->Hash = hash;
+			tag->Next = g_TagTable[hash % WLOG_HASH_TABLE_SIZE];
+			InterlockedCompareExchangePointer((PVOID volatile*) &g_TagTable[hash % WLOG_HASH_TABLE_SIZE],
+					tag, tag->Next);
+		}
+		else
 		{
-			WLog_Free(log);
-			return NULL;
+			free(tag);
+			tag = NULL;
 		}
 	}
+
+	log = WLog_Get(name);
+
+	if (tag)
+	{
+		tag->Log = log;
+
+		if (!cache->Tag)
+		{
+			cache->Key = name;
+			InterlockedCompareExchangePointer((PVOID volatile*) &cache->Tag, tag, NULL);
+		}
+	}
+
+	LeaveCriticalSection(&g_Lock);
 	return log;
 }
 
@@ -852,12 +1037,29 @@ BOOL WLog_Init()
 BOOL WLog_Uninit()
 {
 	DWORD index;
+	wLogTag* tag;
 	wLog* child = NULL;
 	wLog* root = g_RootLog;
 
 	if (!root)
 		return FALSE;
 
+	EnterCriticalSection(&g_Lock);
+
+	if (root != g_RootLog)
+	{
+		LeaveCriticalSection(&g_Lock);
+		return FALSE;
+	}
+
+	for (index = 0; index < WLOG_HASH_TABLE_SIZE; index++)
+	{
+		g_LogTable[index] = NULL;
+
+		for (tag = g_TagTable[index]; tag; tag = tag->Next)
+			tag->Log = NULL;
+	}
+
 	for (index = 0; index < root->ChildrenCount; index++)
 	{
 		child = root->Children[index];
@@ -866,5 +1068,7 @@ BOOL WLog_Uninit()
 
 	WLog_Free(root);
 	g_RootLog = NULL;
+
+	LeaveCriticalSection(&g_Lock);
 	return TRUE;
 }
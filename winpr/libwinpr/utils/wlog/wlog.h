@@ -75,6 +75,22 @@ struct _wLog
 	wLog** Children;
 	DWORD ChildrenCount;
 	DWORD ChildrenSize;
+
+	UINT32 Hash;
+	wLog* HashNext;
+};
+
+/**
+ * A tag name as seen by the tag macros, with its own copy of the name.
+ * Tags are never freed so the handles cached by the macros cannot dangle,
+ * the logger is reset by WLog_Uninit and looked up again on next use.
+ */
+struct _wLogTag
+{
+	LPSTR Name;
+	UINT32 Hash;
+	wLog* volatile Log;
+	wLogTag* Next;
 };
 
 